@@ -20,6 +20,7 @@
 
 #include <algorithm>                                           // std::set_union
 #include <array>
+#include <cmath>                                               // std::ceil
 #include <gflags/gflags.h>
 #include <melon/utility/containers/flat_map.h>
 #include <melon/utility/errno.h>
@@ -149,7 +150,8 @@ namespace melon::lb {
 
     ConsistentHashingLoadBalancer::ConsistentHashingLoadBalancer(
             ConsistentHashingLoadBalancerType type)
-            : _num_replicas(FLAGS_chash_num_replicas), _type(type) {
+            : _num_replicas(FLAGS_chash_num_replicas), _type(type)
+            , _load_factor(0), _total_inflight(0) {
         CHECK(GetReplicaPolicy(_type))
         << "Fail to find replica policy for consistency lb type: '" << _type << '\'';
     }
@@ -222,12 +224,40 @@ namespace melon::lb {
         return fg.size() - bg.size();
     }
 
+    size_t ConsistentHashingLoadBalancer::AddLoads(
+            LoadMap &bg, const LoadMap &fg, const std::vector<ServerId> &servers) {
+        for (size_t i = 0; i < servers.size(); ++i) {
+            const SocketId id = servers[i].id;
+            LoadMap::const_iterator it = fg.find(id);
+            if (it != fg.end()) {
+                // Created in the first call.
+                bg[id] = it->second;
+            } else {
+                bg[id] = std::make_shared<ServerLoad>();
+            }
+        }
+        return 1;
+    }
+
+    size_t ConsistentHashingLoadBalancer::RemoveLoads(
+            LoadMap &bg, const std::vector<ServerId> &servers) {
+        for (size_t i = 0; i < servers.size(); ++i) {
+            bg.erase(servers[i].id);
+        }
+        return 1;
+    }
+
     bool ConsistentHashingLoadBalancer::AddServer(const ServerId &server) {
         std::vector<Node> add_nodes;
         add_nodes.reserve(_num_replicas);
         if (!GetReplicaPolicy(_type)->Build(server, _num_replicas, &add_nodes)) {
             return false;
         }
+        if (bounded()) {
+            // Before the ring, so that selected servers always have loads.
+            _db_loads.ModifyWithForeground(
+                    AddLoads, std::vector<ServerId>(1, server));
+        }
         std::sort(add_nodes.begin(), add_nodes.end());
         bool executed = false;
         const size_t ret = _db_hash_ring.ModifyWithForeground(
@@ -242,12 +272,17 @@ namespace melon::lb {
         add_nodes.reserve(servers.size() * _num_replicas);
         std::vector<Node> replicas;
         replicas.reserve(_num_replicas);
+        std::vector<ServerId> added;
         for (size_t i = 0; i < servers.size(); ++i) {
             replicas.clear();
             if (GetReplicaPolicy(_type)->Build(servers[i], _num_replicas, &replicas)) {
                 add_nodes.insert(add_nodes.end(), replicas.begin(), replicas.end());
+                added.push_back(servers[i]);
             }
         }
+        if (bounded()) {
+            _db_loads.ModifyWithForeground(AddLoads, added);
+        }
         std::sort(add_nodes.begin(), add_nodes.end());
         bool executed = false;
         const size_t ret = _db_hash_ring.ModifyWithForeground(AddBatch, add_nodes, &executed);
@@ -263,6 +298,9 @@ namespace melon::lb {
         bool executed = false;
         const size_t ret = _db_hash_ring.ModifyWithForeground(Remove, server, &executed);
         CHECK(ret == 0 || ret == _num_replicas);
+        if (bounded()) {
+            _db_loads.Modify(RemoveLoads, std::vector<ServerId>(1, server));
+        }
         return ret != 0;
     }
 
@@ -271,6 +309,9 @@ namespace melon::lb {
         bool executed = false;
         const size_t ret = _db_hash_ring.ModifyWithForeground(RemoveBatch, servers, &executed);
         CHECK(ret % _num_replicas == 0);
+        if (bounded()) {
+            _db_loads.Modify(RemoveLoads, servers);
+        }
         const size_t n = ret / _num_replicas;
         LOG_IF(ERROR, n != servers.size())
         << "Fail to RemoveServersInBatch, expected " << servers.size()
@@ -309,16 +350,47 @@ namespace melon::lb {
         if (s->empty()) {
             return ENODATA;
         }
+        mutil::DoublyBufferedData<LoadMap>::ScopedPtr loads;
+        int64_t max_inflight = 0;
+        if (bounded()) {
+            if (_db_loads.Read(&loads) != 0) {
+                return ENOMEM;
+            }
+            // Count the request being selected as well, otherwise no server
+            // is selectable when nothing is in flight.
+            const size_t nserver = std::max(loads->size(), (size_t) 1);
+            max_inflight = (int64_t) std::ceil(
+                    _load_factor * (_total_inflight.load(mutil::memory_order_relaxed) + 1)
+                    / nserver);
+        }
         std::vector<Node>::const_iterator choice =
                 std::lower_bound(s->begin(), s->end(), (uint32_t) in.request_code);
         if (choice == s->end()) {
             choice = s->begin();
         }
         for (size_t i = 0; i < s->size(); ++i) {
-            if (((i + 1) == s->size() // always take last chance
-                 || !ExcludedServers::IsExcluded(in.excluded, choice->server_sock.id))
-                && Socket::Address(choice->server_sock.id, out->ptr) == 0
+            const SocketId id = choice->server_sock.id;
+            const bool last_chance = (i + 1) == s->size();
+            ServerLoad *load = nullptr;
+            if (bounded()) {
+                LoadMap::const_iterator it = loads->find(id);
+                if (it != loads->end()) {
+                    load = it->second.get();
+                }
+            }
+            if ((last_chance // always take last chance
+                 || (!ExcludedServers::IsExcluded(in.excluded, id)
+                     && (load == nullptr
+                         || load->inflight.load(mutil::memory_order_relaxed) < max_inflight)))
+                && Socket::Address(id, out->ptr) == 0
                 && (*out->ptr)->IsAvailable()) {
+                if (bounded()) {
+                    _total_inflight.fetch_add(1, mutil::memory_order_relaxed);
+                    if (load) {
+                        load->inflight.fetch_add(1, mutil::memory_order_relaxed);
+                    }
+                    out->need_feedback = true;
+                }
                 return 0;
             } else {
                 if (++choice == s->end()) {
@@ -329,6 +401,21 @@ namespace melon::lb {
         return EHOSTDOWN;
     }
 
+    void ConsistentHashingLoadBalancer::Feedback(const CallInfo &info) {
+        if (!bounded()) {
+            return;
+        }
+        _total_inflight.fetch_sub(1, mutil::memory_order_relaxed);
+        mutil::DoublyBufferedData<LoadMap>::ScopedPtr loads;
+        if (_db_loads.Read(&loads) != 0) {
+            return;
+        }
+        LoadMap::const_iterator it = loads->find(info.server_id);
+        if (it != loads->end()) {
+            it->second->inflight.fetch_sub(1, mutil::memory_order_relaxed);
+        }
+    }
+
     void ConsistentHashingLoadBalancer::Describe(
             std::ostream &os, const DescribeOptions &options) {
         if (!options.verbose) {
@@ -338,6 +425,9 @@ namespace melon::lb {
         os << "ConsistentHashingLoadBalancer {\n"
            << "  hash function: " << GetReplicaPolicy(_type)->name() << '\n'
            << "  replica per host: " << _num_replicas << '\n';
+        if (bounded()) {
+            os << "  load factor: " << _load_factor << '\n';
+        }
         std::map<mutil::EndPoint, double> load_map;
         GetLoads(&load_map);
         os << "  number of hosts: " << load_map.size() << '\n';
@@ -397,6 +487,16 @@ namespace melon::lb {
                 }
                 continue;
             }
+            if (sp.key() == "epsilon") {
+                double epsilon = 0;
+                if (!mutil::StringToDouble(sp.value().as_string(), &epsilon)
+                    || epsilon <= 0) {
+                    LOG(ERROR) << "epsilon must be positive, got " << sp.value();
+                    return false;
+                }
+                _load_factor = 1 + epsilon;
+                continue;
+            }
             LOG(ERROR) << "Failed to set this unknown parameters " << sp.key_and_value();
         }
         return true;
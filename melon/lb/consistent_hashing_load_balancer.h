@@ -23,7 +23,10 @@
 
 #include <stdint.h>                                     // uint32_t
 #include <functional>
+#include <memory>                                       // std::shared_ptr
+#include <unordered_map>                                // std::unordered_map
 #include <vector>                                       // std::vector
+#include <melon/utility/atomicops.h>
 #include <melon/utility/endpoint.h>                              // mutil::EndPoint
 #include <melon/utility/containers/doubly_buffered_data.h>
 #include <melon/rpc/load_balancer.h>
@@ -42,6 +45,12 @@ namespace melon::lb {
         CONS_HASH_LB_LAST = 3
     };
 
+    // Besides the plain ring, "Consistent Hashing with Bounded Loads" is
+    // enabled by parameter "epsilon", e.g. "c_murmurhash:epsilon=0.25": a
+    // server whose in-flight requests would exceed (1 + epsilon) times the
+    // average is skipped and the walk continues to the next node on the ring,
+    // so that hot keys spill over to neighbors instead of overloading one
+    // server, while most keys still stick to their servers.
     class ConsistentHashingLoadBalancer : public LoadBalancer {
     public:
         struct Node {
@@ -75,6 +84,8 @@ namespace melon::lb {
 
         int SelectServer(const SelectIn &in, SelectOut *out);
 
+        void Feedback(const CallInfo &info);
+
         void Describe(std::ostream &os, const DescribeOptions &options);
 
     private:
@@ -91,9 +102,28 @@ namespace melon::lb {
         static size_t Remove(std::vector<Node> &bg, const std::vector<Node> &fg,
                              const ServerId &server, bool *executed);
 
+        // In-flight requests of a server in bounded-load mode.
+        struct ServerLoad {
+            ServerLoad() : inflight(0) {}
+            mutil::atomic<int64_t> inflight;
+        };
+        // Shared by both instances of _db_loads.
+        typedef std::unordered_map<SocketId, std::shared_ptr<ServerLoad> > LoadMap;
+
+        bool bounded() const { return _load_factor > 0; }
+
+        static size_t AddLoads(LoadMap &bg, const LoadMap &fg,
+                               const std::vector<ServerId> &servers);
+
+        static size_t RemoveLoads(LoadMap &bg, const std::vector<ServerId> &servers);
+
         size_t _num_replicas;
         ConsistentHashingLoadBalancerType _type;
         mutil::DoublyBufferedData<std::vector<Node> > _db_hash_ring;
+        // 1 + epsilon, or 0 when loads are not bounded.
+        double _load_factor;
+        mutil::DoublyBufferedData<LoadMap> _db_loads;
+        mutil::atomic<int64_t> _total_inflight;
     };
 
 } // namespace melon::lb
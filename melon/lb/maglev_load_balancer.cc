@@ -0,0 +1,315 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#include <algorithm>                                   // std::set_union
+#include <gflags/gflags.h>
+#include <melon/utility/strings/string_number_conversions.h>
+#include <melon/rpc/socket.h>
+#include <melon/rpc/policy/hasher.h>
+#include <melon/lb/maglev_load_balancer.h>
+
+namespace melon::lb {
+
+    DEFINE_int32(maglev_table_size, 65537,
+                 "default number of slots of the lookup table in c_maglev, "
+                 "must be a prime");
+
+    static const uint32_t EMPTY_SLOT = (uint32_t) -1;
+    static const size_t DEFAULT_TABLE_SIZE = 65537;
+
+    static bool IsPrime(size_t n) {
+        if (n < 2) {
+            return false;
+        }
+        for (size_t i = 2; i * i <= n; ++i) {
+            if (n % i == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    MaglevLoadBalancer::MaglevLoadBalancer()
+            : _table_size(FLAGS_maglev_table_size) {
+        if (!IsPrime(_table_size)) {
+            LOG(ERROR) << "-maglev_table_size=" << FLAGS_maglev_table_size
+                       << " is not a prime, use " << DEFAULT_TABLE_SIZE;
+            _table_size = DEFAULT_TABLE_SIZE;
+        }
+    }
+
+    bool MaglevLoadBalancer::BuildBackend(const ServerId &server, Backend *b) const {
+        SocketUniquePtr ptr;
+        if (Socket::AddressFailedAsWell(server.id, &ptr) == -1) {
+            return false;
+        }
+        uint32_t weight = 1;
+        if (!server.tag.empty() &&
+            (!mutil::StringToUint(server.tag, &weight) || weight == 0)) {
+            LOG(ERROR) << "Invalid weight is set: " << server.tag;
+            return false;
+        }
+        const mutil::EndPointStr addr = endpoint2str(ptr->remote_side());
+        const size_t len = strlen(addr.c_str());
+        b->server_sock = server;
+        b->server_addr = ptr->remote_side();
+        b->weight = weight;
+        // Two independent hashes as in the paper.
+        b->offset_hash = melon::policy::MurmurHash32(addr.c_str(), len);
+        b->skip_hash = melon::policy::MD5Hash32(addr.c_str(), len);
+        return true;
+    }
+
+    void MaglevLoadBalancer::Populate(Table *t, size_t table_size) {
+        const size_t n = t->backends.size();
+        if (n == 0) {
+            t->lookup.clear();
+            return;
+        }
+        t->lookup.assign(table_size, EMPTY_SLOT);
+        uint64_t max_weight = 0;
+        for (size_t i = 0; i < n; ++i) {
+            max_weight = std::max(max_weight, (uint64_t) t->backends[i].weight);
+        }
+        // Next slot in the permutation of each backend, the permutation is
+        // offset, offset + skip, offset + 2 * skip ... (mod table_size),
+        // which covers all slots since table_size is a prime.
+        std::vector<uint64_t> pos(n);
+        std::vector<uint64_t> skip(n);
+        // A backend takes a slot in a round only when round * weight reaches
+        // target, a backend with the max weight takes one slot every round.
+        std::vector<uint64_t> target(n, 0);
+        for (size_t i = 0; i < n; ++i) {
+            pos[i] = t->backends[i].offset_hash % table_size;
+            skip[i] = t->backends[i].skip_hash % (table_size - 1) + 1;
+        }
+        size_t filled = 0;
+        for (uint64_t round = 1; filled < table_size; ++round) {
+            for (size_t i = 0; i < n && filled < table_size; ++i) {
+                if (round * t->backends[i].weight < target[i]) {
+                    continue;
+                }
+                target[i] += max_weight;
+                while (t->lookup[pos[i]] != EMPTY_SLOT) {
+                    pos[i] = (pos[i] + skip[i]) % table_size;
+                }
+                t->lookup[pos[i]] = i;
+                pos[i] = (pos[i] + skip[i]) % table_size;
+                ++filled;
+            }
+        }
+    }
+
+    size_t MaglevLoadBalancer::AddBatch(
+            Table &bg, const Table &fg,
+            const std::vector<Backend> &servers, Rebuilding *r) {
+        if (r->executed) {
+            // Populated already, copying is much cheaper.
+            const size_t old_size = bg.backends.size();
+            bg = fg;
+            return fg.backends.size() - old_size;
+        }
+        r->executed = true;
+        bg.backends.resize(fg.backends.size() + servers.size());
+        bg.backends.resize(std::set_union(fg.backends.begin(), fg.backends.end(),
+                                          servers.begin(), servers.end(),
+                                          bg.backends.begin())
+                           - bg.backends.begin());
+        const size_t n = bg.backends.size() - fg.backends.size();
+        if (n != 0) {
+            Populate(&bg, r->table_size);
+        }
+        return n;
+    }
+
+    size_t MaglevLoadBalancer::RemoveBatch(
+            Table &bg, const Table &fg,
+            const std::vector<ServerId> &servers, Rebuilding *r) {
+        if (r->executed) {
+            const size_t old_size = bg.backends.size();
+            bg = fg;
+            return old_size - fg.backends.size();
+        }
+        r->executed = true;
+        bg.backends.clear();
+        for (size_t i = 0; i < fg.backends.size(); ++i) {
+            if (!std::binary_search(servers.begin(), servers.end(),
+                                    fg.backends[i].server_sock)) {
+                bg.backends.push_back(fg.backends[i]);
+            }
+        }
+        const size_t n = fg.backends.size() - bg.backends.size();
+        if (n != 0) {
+            Populate(&bg, r->table_size);
+        }
+        return n;
+    }
+
+    bool MaglevLoadBalancer::AddServer(const ServerId &server) {
+        return AddServersInBatch(std::vector<ServerId>(1, server)) == 1;
+    }
+
+    size_t MaglevLoadBalancer::AddServersInBatch(
+            const std::vector<ServerId> &servers) {
+        std::vector<Backend> add_backends;
+        add_backends.reserve(servers.size());
+        for (size_t i = 0; i < servers.size(); ++i) {
+            Backend b;
+            if (BuildBackend(servers[i], &b)) {
+                add_backends.push_back(b);
+            }
+        }
+        std::sort(add_backends.begin(), add_backends.end());
+        add_backends.erase(
+                std::unique(add_backends.begin(), add_backends.end(),
+                            [](const Backend &lhs, const Backend &rhs) {
+                                return lhs.server_sock == rhs.server_sock;
+                            }),
+                add_backends.end());
+        Rebuilding r = { _table_size, false };
+        const size_t n = _db_table.ModifyWithForeground(AddBatch, add_backends, &r);
+        LOG_IF(ERROR, n != servers.size() && servers.size() > 1)
+        << "Fail to AddServersInBatch, expected " << servers.size()
+        << " actually " << n;
+        return n;
+    }
+
+    bool MaglevLoadBalancer::RemoveServer(const ServerId &server) {
+        return RemoveServersInBatch(std::vector<ServerId>(1, server)) == 1;
+    }
+
+    size_t MaglevLoadBalancer::RemoveServersInBatch(
+            const std::vector<ServerId> &servers) {
+        std::vector<ServerId> sorted_servers(servers);
+        std::sort(sorted_servers.begin(), sorted_servers.end());
+        Rebuilding r = { _table_size, false };
+        const size_t n = _db_table.ModifyWithForeground(RemoveBatch, sorted_servers, &r);
+        LOG_IF(ERROR, n != servers.size() && servers.size() > 1)
+        << "Fail to RemoveServersInBatch, expected " << servers.size()
+        << " actually " << n;
+        return n;
+    }
+
+    LoadBalancer *MaglevLoadBalancer::New(const mutil::StringPiece &params) const {
+        MaglevLoadBalancer *lb = new(std::nothrow) MaglevLoadBalancer;
+        if (lb && !lb->SetParameters(params)) {
+            delete lb;
+            lb = nullptr;
+        }
+        return lb;
+    }
+
+    void MaglevLoadBalancer::Destroy() {
+        delete this;
+    }
+
+    int MaglevLoadBalancer::SelectServer(const SelectIn &in, SelectOut *out) {
+        if (!in.has_request_code) {
+            LOG(ERROR) << "Controller.set_request_code() is required";
+            return EINVAL;
+        }
+        mutil::DoublyBufferedData<Table>::ScopedPtr s;
+        if (_db_table.Read(&s) != 0) {
+            return ENOMEM;
+        }
+        const size_t n = s->backends.size();
+        if (n == 0) {
+            return ENODATA;
+        }
+        const std::vector<uint32_t> &lookup = s->lookup;
+        size_t slot = in.request_code % lookup.size();
+        // Walk following slots which belong to other servers pseudo-randomly
+        // when the chosen one is unavailable. Servers appear in the walk
+        // many times, `tried' makes sure that each of them is tried once and
+        // is only allocated when the chosen one is unavailable.
+        uint32_t last = EMPTY_SLOT;
+        size_t ntried = 0;
+        std::vector<bool> tried;
+        for (size_t i = 0; i < lookup.size() && ntried < n; ++i) {
+            const uint32_t index = lookup[slot];
+            if (index != last && (tried.empty() || !tried[index])) {
+                last = index;
+                ++ntried;
+                const SocketId id = s->backends[index].server_sock.id;
+                if ((ntried == n // always take last chance
+                     || !ExcludedServers::IsExcluded(in.excluded, id))
+                    && Socket::Address(id, out->ptr) == 0
+                    && (*out->ptr)->IsAvailable()) {
+                    return 0;
+                }
+                if (tried.empty()) {
+                    tried.resize(n, false);
+                }
+                tried[index] = true;
+            }
+            if (++slot == lookup.size()) {
+                slot = 0;
+            }
+        }
+        return EHOSTDOWN;
+    }
+
+    void MaglevLoadBalancer::Describe(
+            std::ostream &os, const DescribeOptions &options) {
+        if (!options.verbose) {
+            os << "c_maglev";
+            return;
+        }
+        os << "MaglevLoadBalancer {\n"
+           << "  table size: " << _table_size << '\n';
+        mutil::DoublyBufferedData<Table>::ScopedPtr s;
+        if (_db_table.Read(&s) != 0) {
+            os << "  fail to read table\n}\n";
+            return;
+        }
+        std::vector<size_t> nslots(s->backends.size(), 0);
+        for (size_t i = 0; i < s->lookup.size(); ++i) {
+            ++nslots[s->lookup[i]];
+        }
+        os << "  number of hosts: " << s->backends.size() << '\n'
+           << "  slots of hosts: {\n";
+        for (size_t i = 0; i < s->backends.size(); ++i) {
+            os << "    " << s->backends[i].server_addr
+               << " weight=" << s->backends[i].weight
+               << ": " << nslots[i] << '\n';
+        }
+        os << "  }\n}\n";
+    }
+
+    bool MaglevLoadBalancer::SetParameters(const mutil::StringPiece &params) {
+        for (mutil::KeyValuePairsSplitter sp(params.begin(), params.end(), ' ', '=');
+             sp; ++sp) {
+            if (sp.value().empty()) {
+                LOG(ERROR) << "Empty value for " << sp.key() << " in lb parameter";
+                return false;
+            }
+            if (sp.key() == "table_size") {
+                if (!mutil::StringToSizeT(sp.value(), &_table_size)
+                    || !IsPrime(_table_size)) {
+                    LOG(ERROR) << "table_size must be a prime, got " << sp.value();
+                    return false;
+                }
+                continue;
+            }
+            LOG(ERROR) << "Failed to set this unknown parameters " << sp.key_and_value();
+        }
+        return true;
+    }
+
+} // namespace melon::lb
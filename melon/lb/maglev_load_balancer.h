@@ -0,0 +1,117 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#ifndef MELON_LB_POLICY_MAGLEV_LOAD_BALANCER_H_
+#define MELON_LB_POLICY_MAGLEV_LOAD_BALANCER_H_
+
+#include <stdint.h>                                     // uint32_t
+#include <vector>                                       // std::vector
+#include <melon/utility/endpoint.h>                     // mutil::EndPoint
+#include <melon/utility/containers/doubly_buffered_data.h>
+#include <melon/rpc/load_balancer.h>
+
+namespace melon::lb {
+
+    // Consistent hashing with the lookup table of Maglev (NSDI'16). Every
+    // server fills slots of a prime-sized table following its own permutation
+    // derived from its address, so that:
+    //  - SelectServer() is a single table lookup of request_code % table_size
+    //    instead of a binary search on a hash ring.
+    //  - Adding or removing a server only remaps slots owned by it and a few
+    //    others, and all clients with the same servers build the same table.
+    //  - Weights in tags of servers (as in "wrr") are honored: a server with
+    //    weight w owns about w/sum_of_weights of the slots.
+    // The table is rebuilt in the background instance of DoublyBufferedData
+    // when servers change, readers are never blocked by the rebuilding.
+    // The table size is set by -maglev_table_size or the "table_size"
+    // parameter of the lb, and should be a prime larger than 100 times the
+    // number of servers to keep the imbalance under 1%.
+    class MaglevLoadBalancer : public LoadBalancer {
+    public:
+        MaglevLoadBalancer();
+
+        bool AddServer(const ServerId &server);
+
+        bool RemoveServer(const ServerId &server);
+
+        size_t AddServersInBatch(const std::vector<ServerId> &servers);
+
+        size_t RemoveServersInBatch(const std::vector<ServerId> &servers);
+
+        LoadBalancer *New(const mutil::StringPiece &params) const;
+
+        void Destroy();
+
+        int SelectServer(const SelectIn &in, SelectOut *out);
+
+        void Describe(std::ostream &os, const DescribeOptions &options);
+
+        size_t table_size() const { return _table_size; }
+
+    private:
+        struct Backend {
+            ServerId server_sock;
+            mutil::EndPoint server_addr;
+            uint32_t weight;
+            // Hashes of server_addr, deciding offset and skip of the
+            // permutation. Computed once when the server is added.
+            uint32_t offset_hash;
+            uint32_t skip_hash;
+
+            // Sorted by address to make tables same among all clients.
+            bool operator<(const Backend &rhs) const {
+                if (server_addr != rhs.server_addr) {
+                    return server_addr < rhs.server_addr;
+                }
+                return server_sock < rhs.server_sock;
+            }
+        };
+
+        struct Table {
+            std::vector<Backend> backends;
+            // Index into `backends' of each slot.
+            std::vector<uint32_t> lookup;
+        };
+
+        // State of one Modify() on _db_table, the table is populated
+        // only in the first call and copied from foreground in the second.
+        struct Rebuilding {
+            size_t table_size;
+            bool executed;
+        };
+
+        bool SetParameters(const mutil::StringPiece &params);
+
+        bool BuildBackend(const ServerId &server, Backend *b) const;
+
+        static void Populate(Table *t, size_t table_size);
+
+        static size_t AddBatch(Table &bg, const Table &fg,
+                               const std::vector<Backend> &servers, Rebuilding *r);
+
+        static size_t RemoveBatch(Table &bg, const Table &fg,
+                                  const std::vector<ServerId> &servers, Rebuilding *r);
+
+        size_t _table_size;
+        mutil::DoublyBufferedData<Table> _db_table;
+    };
+
+} // namespace melon::lb
+
+#endif  // MELON_LB_POLICY_MAGLEV_LOAD_BALANCER_H_
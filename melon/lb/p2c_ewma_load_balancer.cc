@@ -0,0 +1,308 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#include <cmath>                                             // exp
+#include <limits>                                            // numeric_limits
+#include <gflags/gflags.h>
+#include <melon/utility/macros.h>
+#include <melon/utility/time.h>
+#include <melon/utility/fast_rand.h>
+#include <melon/rpc/socket.h>
+#include <melon/rpc/controller.h>
+#include <melon/lb/p2c_ewma_load_balancer.h>
+
+namespace melon::lb {
+
+    DEFINE_int64(p2c_ewma_decay_us, 10000000,
+                 "Time constant of the peak-EWMA latency in p2c_ewma, larger "
+                 "values make the latency decay slower");
+
+    // Cost of a server which has inflight requests but no latency yet, high
+    // enough to let fresh servers be probed with one request at a time.
+    static const int64_t UNKNOWN_LATENCY_PENALTY =
+            std::numeric_limits<int64_t>::max() >> 16;
+    // Times of sampling two servers before scanning all servers.
+    static const int MAX_SAMPLE_ROUNDS = 3;
+
+    static double DecayFactor(int64_t elapsed_us) {
+        if (elapsed_us <= 0) {
+            return 1.0;
+        }
+        return exp(-(double) elapsed_us / std::max(FLAGS_p2c_ewma_decay_us, (int64_t) 1));
+    }
+
+    int64_t P2CEwmaLoadBalancer::Stats::Cost() const {
+        const int64_t n = inflight.load(mutil::memory_order_relaxed);
+        const int64_t latency = ewma_latency_us.load(mutil::memory_order_relaxed);
+        if (latency == 0) {
+            return n <= 0 ? 0 : UNKNOWN_LATENCY_PENALTY + n;
+        }
+        // Decay towards zero as if zero latency was observed right now, so
+        // that servers not selected for long get chances again.
+        const int64_t elapsed_us = mutil::cpuwide_time_us() -
+                                   last_update_us.load(mutil::memory_order_relaxed);
+        const double decayed = latency * DecayFactor(elapsed_us);
+        return (int64_t) decayed * (std::max(n, (int64_t) 0) + 1);
+    }
+
+    void P2CEwmaLoadBalancer::Stats::Update(int64_t latency_us, int64_t now_us) {
+        const int64_t last_us = last_update_us.exchange(now_us, mutil::memory_order_relaxed);
+        const double w = (last_us == 0 ? 0.0 : DecayFactor(now_us - last_us));
+        int64_t old = ewma_latency_us.load(mutil::memory_order_relaxed);
+        int64_t updated = 0;
+        do {
+            if (latency_us > old) {
+                // Peak: jump to higher latencies immediately.
+                updated = latency_us;
+            } else {
+                updated = (int64_t) (old * w + latency_us * (1.0 - w));
+            }
+            updated = std::max(updated, (int64_t) 1);
+        } while (!ewma_latency_us.compare_exchange_weak(
+                old, updated, mutil::memory_order_relaxed));
+    }
+
+    bool P2CEwmaLoadBalancer::Add(Servers &bg, const Servers &fg, SocketId id) {
+        if (bg.server_map.find(id) != bg.server_map.end()) {
+            return false;
+        }
+        Server server;
+        server.id = id;
+        auto it = fg.server_map.find(id);
+        if (it != fg.server_map.end()) {
+            // Added to the other buffer already, share the stats.
+            server.stats = fg.server_list[it->second].stats;
+        } else {
+            server.stats = std::make_shared<Stats>();
+        }
+        bg.server_map[id] = bg.server_list.size();
+        bg.server_list.push_back(server);
+        return true;
+    }
+
+    bool P2CEwmaLoadBalancer::Remove(Servers &bg, SocketId id) {
+        auto it = bg.server_map.find(id);
+        if (it == bg.server_map.end()) {
+            return false;
+        }
+        const size_t index = it->second;
+        bg.server_map.erase(it);
+        if (index + 1 != bg.server_list.size()) {
+            bg.server_list[index] = bg.server_list.back();
+            bg.server_map[bg.server_list[index].id] = index;
+        }
+        bg.server_list.pop_back();
+        return true;
+    }
+
+    size_t P2CEwmaLoadBalancer::BatchAdd(
+            Servers &bg, const Servers &fg, const std::vector<ServerId> &servers) {
+        size_t count = 0;
+        for (size_t i = 0; i < servers.size(); ++i) {
+            count += !!Add(bg, fg, servers[i].id);
+        }
+        return count;
+    }
+
+    size_t P2CEwmaLoadBalancer::BatchRemove(
+            Servers &bg, const std::vector<ServerId> &servers) {
+        size_t count = 0;
+        for (size_t i = 0; i < servers.size(); ++i) {
+            count += !!Remove(bg, servers[i].id);
+        }
+        return count;
+    }
+
+    bool P2CEwmaLoadBalancer::AddServer(const ServerId &id) {
+        return _db_servers.ModifyWithForeground(Add, id.id);
+    }
+
+    bool P2CEwmaLoadBalancer::RemoveServer(const ServerId &id) {
+        return _db_servers.Modify(Remove, id.id);
+    }
+
+    size_t P2CEwmaLoadBalancer::AddServersInBatch(
+            const std::vector<ServerId> &servers) {
+        const size_t n = _db_servers.ModifyWithForeground(BatchAdd, servers);
+        LOG_IF(ERROR, n != servers.size())
+        << "Fail to AddServersInBatch, expected " << servers.size()
+        << " actually " << n;
+        return n;
+    }
+
+    size_t P2CEwmaLoadBalancer::RemoveServersInBatch(
+            const std::vector<ServerId> &servers) {
+        const size_t n = _db_servers.Modify(BatchRemove, servers);
+        LOG_IF(ERROR, n != servers.size())
+        << "Fail to RemoveServersInBatch, expected " << servers.size()
+        << " actually " << n;
+        return n;
+    }
+
+    bool P2CEwmaLoadBalancer::TryServer(const Servers &s, size_t index,
+                                        const SelectIn &in, SelectOut *out) {
+        const SocketId id = s.server_list[index].id;
+        return !ExcludedServers::IsExcluded(in.excluded, id)
+               && Socket::Address(id, out->ptr) == 0
+               && (*out->ptr)->IsAvailable();
+    }
+
+    int P2CEwmaLoadBalancer::SelectServer(const SelectIn &in, SelectOut *out) {
+        mutil::EpochBufferedData<Servers>::ScopedPtr s;
+        if (_db_servers.Read(&s) != 0) {
+            return ENOMEM;
+        }
+        const size_t n = s->server_list.size();
+        if (n == 0) {
+            return ENODATA;
+        }
+        if (_cluster_recover_policy && _cluster_recover_policy->StopRecoverIfNecessary()) {
+            std::vector<ServerId> server_list;
+            server_list.reserve(n);
+            for (size_t i = 0; i < n; ++i) {
+                server_list.push_back(ServerId(s->server_list[i].id));
+            }
+            if (_cluster_recover_policy->DoReject(server_list)) {
+                return EREJECT;
+            }
+        }
+        size_t chosen = n;
+        if (n == 1) {
+            if (TryServer(*s, 0, in, out)) {
+                chosen = 0;
+            }
+        } else {
+            for (int round = 0; round < MAX_SAMPLE_ROUNDS && chosen == n; ++round) {
+                size_t first = mutil::fast_rand_less_than(n);
+                size_t second = mutil::fast_rand_less_than(n - 1);
+                if (second >= first) {
+                    ++second;
+                }
+                if (s->server_list[second].stats->Cost() <
+                    s->server_list[first].stats->Cost()) {
+                    std::swap(first, second);
+                }
+                if (TryServer(*s, first, in, out)) {
+                    chosen = first;
+                } else if (TryServer(*s, second, in, out)) {
+                    chosen = second;
+                }
+            }
+        }
+        if (chosen == n) {
+            // Most sampled servers are unavailable, scan all of them.
+            const size_t offset = mutil::fast_rand_less_than(n);
+            for (size_t i = 0; i < n; ++i) {
+                const size_t index = (offset + i) % n;
+                if (TryServer(*s, index, in, out)) {
+                    chosen = index;
+                    break;
+                }
+            }
+        }
+        if (chosen == n) {
+            // Excluded servers are the last chance.
+            for (size_t i = 0; i < n; ++i) {
+                if (Socket::Address(s->server_list[i].id, out->ptr) == 0
+                    && (*out->ptr)->IsAvailable()) {
+                    chosen = i;
+                    break;
+                }
+            }
+        }
+        if (chosen == n) {
+            if (_cluster_recover_policy) {
+                _cluster_recover_policy->StartRecover();
+            }
+            return EHOSTDOWN;
+        }
+        s->server_list[chosen].stats->inflight.fetch_add(1, mutil::memory_order_relaxed);
+        out->need_feedback = true;
+        return 0;
+    }
+
+    void P2CEwmaLoadBalancer::Feedback(const CallInfo &info) {
+        mutil::EpochBufferedData<Servers>::ScopedPtr s;
+        if (_db_servers.Read(&s) != 0) {
+            return;
+        }
+        auto it = s->server_map.find(info.server_id);
+        if (it == s->server_map.end()) {
+            // The server was removed.
+            return;
+        }
+        Stats *stats = s->server_list[it->second].stats.get();
+        stats->inflight.fetch_sub(1, mutil::memory_order_relaxed);
+        int64_t latency_us = mutil::gettimeofday_us() - info.begin_time_us;
+        if (info.error_code != 0 && info.error_code != EBACKUPREQUEST &&
+            info.error_code != ECANCELED) {
+            // Servers failing fast must not look fast. Count errors as if the
+            // whole timeout was spent.
+            int64_t timeout_us = -1;
+            if (info.controller && info.controller->timeout_ms() > 0) {
+                timeout_us = info.controller->timeout_ms() * 1000L;
+            }
+            latency_us = std::max(latency_us * 2, timeout_us);
+        }
+        stats->Update(std::max(latency_us, (int64_t) 1), mutil::cpuwide_time_us());
+    }
+
+    P2CEwmaLoadBalancer *P2CEwmaLoadBalancer::New(
+            const mutil::StringPiece &params) const {
+        P2CEwmaLoadBalancer *lb = new(std::nothrow) P2CEwmaLoadBalancer;
+        if (lb && !lb->SetParameters(params)) {
+            delete lb;
+            lb = NULL;
+        }
+        return lb;
+    }
+
+    void P2CEwmaLoadBalancer::Destroy() {
+        delete this;
+    }
+
+    void P2CEwmaLoadBalancer::Describe(
+            std::ostream &os, const DescribeOptions &options) {
+        if (!options.verbose) {
+            os << "p2c_ewma";
+            return;
+        }
+        os << "P2CEwma{";
+        mutil::EpochBufferedData<Servers>::ScopedPtr s;
+        if (_db_servers.Read(&s) != 0) {
+            os << "fail to read _db_servers";
+        } else {
+            os << "n=" << s->server_list.size() << ':';
+            for (size_t i = 0; i < s->server_list.size(); ++i) {
+                const Server &server = s->server_list[i];
+                os << ' ' << server.id << "(latency="
+                   << server.stats->ewma_latency_us.load(mutil::memory_order_relaxed)
+                   << " inflight="
+                   << server.stats->inflight.load(mutil::memory_order_relaxed)
+                   << ')';
+            }
+        }
+        os << '}';
+    }
+
+    bool P2CEwmaLoadBalancer::SetParameters(const mutil::StringPiece &params) {
+        return GetRecoverPolicyByParams(params, &_cluster_recover_policy);
+    }
+
+} // namespace melon::lb
@@ -0,0 +1,91 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#ifndef MELON_LB_POLICY_P2C_EWMA_LOAD_BALANCER_H_
+#define MELON_LB_POLICY_P2C_EWMA_LOAD_BALANCER_H_
+
+#include <memory>                                      // std::shared_ptr
+#include <unordered_map>                               // std::unordered_map
+#include <vector>                                      // std::vector
+#include <melon/utility/atomicops.h>
+#include <melon/utility/containers/epoch_buffered_data.h>
+#include <melon/rpc/load_balancer.h>
+#include <melon/rpc/cluster_recover_policy.h>
+
+namespace melon::lb {
+
+// This LoadBalancer samples two servers randomly and selects the one with
+// lower cost, namely "power of two choices". Cost of a server is its
+// peak-EWMA latency multiplied by (inflight + 1): the EWMA jumps to a latency
+// higher than itself immediately and decays to lower latencies over time, so
+// that slow servers are avoided quickly and recovered gradually.
+// Unlike LocalityAwareLoadBalancer, selection is O(1) regardless of number of
+// servers and all per-server states are atomics updated without locks.
+// Servers are kept in EpochBufferedData so that selections are wait-free and
+// frequent naming updates don't wait for selecting threads.
+class P2CEwmaLoadBalancer : public LoadBalancer {
+public:
+    bool AddServer(const ServerId& id);
+    bool RemoveServer(const ServerId& id);
+    size_t AddServersInBatch(const std::vector<ServerId>& servers);
+    size_t RemoveServersInBatch(const std::vector<ServerId>& servers);
+    int SelectServer(const SelectIn& in, SelectOut* out);
+    void Feedback(const CallInfo& info);
+    P2CEwmaLoadBalancer* New(const mutil::StringPiece&) const;
+    void Destroy();
+    void Describe(std::ostream& os, const DescribeOptions&);
+
+private:
+    struct MELON_CACHELINE_ALIGNMENT Stats {
+        Stats() : inflight(0), ewma_latency_us(0), last_update_us(0) {}
+        // Lower is better.
+        int64_t Cost() const;
+        void Update(int64_t latency_us, int64_t now_us);
+
+        mutil::atomic<int64_t> inflight;
+        mutil::atomic<int64_t> ewma_latency_us;
+        mutil::atomic<int64_t> last_update_us;
+    };
+    struct Server {
+        SocketId id;
+        // Shared by both instances of _db_servers.
+        std::shared_ptr<Stats> stats;
+    };
+    struct Servers {
+        std::vector<Server> server_list;
+        std::unordered_map<SocketId, size_t> server_map;
+    };
+    bool SetParameters(const mutil::StringPiece& params);
+    static bool Add(Servers& bg, const Servers& fg, SocketId id);
+    static bool Remove(Servers& bg, SocketId id);
+    static size_t BatchAdd(Servers& bg, const Servers& fg,
+                           const std::vector<ServerId>& servers);
+    static size_t BatchRemove(Servers& bg, const std::vector<ServerId>& servers);
+    // Address the server at `index' if it's usable.
+    static bool TryServer(const Servers& s, size_t index, const SelectIn& in,
+                          SelectOut* out);
+
+    mutil::EpochBufferedData<Servers> _db_servers;
+    std::shared_ptr<ClusterRecoverPolicy> _cluster_recover_policy;
+};
+
+} // namespace melon::lb
+
+
+#endif  // MELON_LB_POLICY_P2C_EWMA_LOAD_BALANCER_H_
@@ -0,0 +1,240 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#include <unistd.h>                                    // getpid
+#include <algorithm>                                   // std::sort
+#include <iterator>                                    // std::back_inserter
+#include <random>                                      // std::mt19937_64
+#include <melon/utility/endpoint.h>
+#include <melon/utility/time.h>
+#include <melon/utility/third_party/murmurhash3/murmurhash3.h>
+#include <melon/rpc/socket.h>
+#include <melon/lb/subset_load_balancer.h>
+
+namespace melon::lb {
+
+    SubsetOptions::SubsetOptions()
+            : client_id(0), min_subset_size(16), max_subset_size(0), high_load(2.0),
+              low_load(0.5), resize_interval_ms(1000) {
+        std::string name = mutil::my_ip_cstr();
+        name.push_back(':');
+        name.append(std::to_string(getpid()));
+        uint64_t hash[2];
+        mutil::MurmurHash3_x64_128(name.data(), name.size(), 0, hash);
+        client_id = hash[0];
+    }
+
+    SubsetLoadBalancer::SubsetLoadBalancer(LoadBalancer *lb, const SubsetOptions &options)
+            : _lb(lb), _options(options),
+              _target_size(std::max(options.min_subset_size, (size_t) 1)),
+              _subset_size(0), _ninflight(0), _last_resize_ms(0) {}
+
+    SubsetLoadBalancer::~SubsetLoadBalancer() {
+        if (_lb) {
+            _lb->Destroy();
+            _lb = nullptr;
+        }
+    }
+
+    size_t SubsetLoadBalancer::EffectiveSize() const {
+        size_t size = std::max(_target_size, _options.min_subset_size);
+        if (_options.max_subset_size > 0) {
+            size = std::min(size, _options.max_subset_size);
+        }
+        return std::min(size, _servers.size());
+    }
+
+    void SubsetLoadBalancer::UpdateSubset(size_t size) {
+        std::vector<std::pair<std::string, ServerId> > ordered;
+        ordered.reserve(_servers.size());
+        for (std::map<ServerId, std::string>::const_iterator
+                     it = _servers.begin(); it != _servers.end(); ++it) {
+            ordered.push_back(std::make_pair(it->second, it->first));
+        }
+        std::sort(ordered.begin(), ordered.end());
+        size_t begin = 0;
+        size = std::min(size, ordered.size());
+        if (size != 0 && size < ordered.size()) {
+            const uint64_t subset_count = ordered.size() / size;
+            // Clients in the same round shuffle servers in the same way and
+            // take different subsets. Don't use std::shuffle whose results
+            // differ between implementations of the standard library.
+            std::mt19937_64 rng(_options.client_id / subset_count);
+            for (size_t i = ordered.size() - 1; i > 0; --i) {
+                std::swap(ordered[i], ordered[rng() % (i + 1)]);
+            }
+            begin = (_options.client_id % subset_count) * size;
+        }
+        std::vector<ServerId> subset;
+        subset.reserve(size);
+        for (size_t i = begin; i < begin + size; ++i) {
+            subset.push_back(ordered[i].second);
+        }
+        std::sort(subset.begin(), subset.end());
+        std::vector<ServerId> added;
+        std::set_difference(subset.begin(), subset.end(),
+                            _subset.begin(), _subset.end(),
+                            std::back_inserter(added));
+        std::vector<ServerId> removed;
+        std::set_difference(_subset.begin(), _subset.end(),
+                            subset.begin(), subset.end(),
+                            std::back_inserter(removed));
+        // Add before remove to not leave _lb empty in the middle.
+        if (!added.empty()) {
+            _lb->AddServersInBatch(added);
+        }
+        if (!removed.empty()) {
+            _lb->RemoveServersInBatch(removed);
+        }
+        _subset.swap(subset);
+        _subset_size.store(_subset.size(), mutil::memory_order_relaxed);
+    }
+
+    bool SubsetLoadBalancer::AddServer(const ServerId &server) {
+        return AddServersInBatch(std::vector<ServerId>(1, server)) == 1;
+    }
+
+    bool SubsetLoadBalancer::RemoveServer(const ServerId &server) {
+        return RemoveServersInBatch(std::vector<ServerId>(1, server)) == 1;
+    }
+
+    size_t SubsetLoadBalancer::AddServersInBatch(const std::vector<ServerId> &servers) {
+        std::vector<std::pair<ServerId, std::string> > keyed;
+        keyed.reserve(servers.size());
+        for (size_t i = 0; i < servers.size(); ++i) {
+            SocketUniquePtr ptr;
+            if (Socket::AddressFailedAsWell(servers[i].id, &ptr) == -1) {
+                continue;
+            }
+            // Order by the address rather than SocketId which differs
+            // between clients.
+            std::string key = endpoint2str(ptr->remote_side()).c_str();
+            if (!servers[i].tag.empty()) {
+                key.push_back('#');
+                key.append(servers[i].tag);
+            }
+            keyed.push_back(std::make_pair(servers[i], key));
+        }
+        std::unique_lock<mutil::Mutex> mu(_mutex);
+        size_t n = 0;
+        for (size_t i = 0; i < keyed.size(); ++i) {
+            n += _servers.insert(keyed[i]).second;
+        }
+        if (n != 0) {
+            UpdateSubset(EffectiveSize());
+        }
+        return n;
+    }
+
+    size_t SubsetLoadBalancer::RemoveServersInBatch(const std::vector<ServerId> &servers) {
+        std::unique_lock<mutil::Mutex> mu(_mutex);
+        size_t n = 0;
+        for (size_t i = 0; i < servers.size(); ++i) {
+            n += _servers.erase(servers[i]);
+        }
+        if (n != 0) {
+            UpdateSubset(EffectiveSize());
+        }
+        return n;
+    }
+
+    void SubsetLoadBalancer::MaybeResize(bool unavailable) {
+        const int64_t now_ms = mutil::cpuwide_time_ms();
+        int64_t last_ms = _last_resize_ms.load(mutil::memory_order_relaxed);
+        if (now_ms - last_ms < _options.resize_interval_ms) {
+            return;
+        }
+        const size_t size = subset_size();
+        const double load = (size == 0 ? 0 :
+                             (double) _ninflight.load(mutil::memory_order_relaxed) / size);
+        const bool grow = unavailable || load > _options.high_load;
+        const bool shrink = !grow && load < _options.low_load;
+        if (!grow && !shrink) {
+            return;
+        }
+        if (!_last_resize_ms.compare_exchange_strong(last_ms, now_ms)) {
+            // Another thread is resizing.
+            return;
+        }
+        std::unique_lock<mutil::Mutex> mu(_mutex);
+        if (grow) {
+            // Grow fast to catch up with bursts, shrink slowly.
+            _target_size = std::min(_target_size + std::max(_target_size / 4, (size_t) 1),
+                                    _servers.size());
+        } else if (_target_size > _options.min_subset_size && _target_size > 1) {
+            --_target_size;
+        }
+        const size_t new_size = EffectiveSize();
+        if (new_size != _subset.size()) {
+            UpdateSubset(new_size);
+        }
+    }
+
+    int SubsetLoadBalancer::SelectServer(const SelectIn &in, SelectOut *out) {
+        const int rc = _lb->SelectServer(in, out);
+        if (rc == 0) {
+            _ninflight.fetch_add(1, mutil::memory_order_relaxed);
+            out->need_feedback = true;
+        }
+        MaybeResize(rc != 0);
+        return rc;
+    }
+
+    void SubsetLoadBalancer::Feedback(const CallInfo &info) {
+        _ninflight.fetch_sub(1, mutil::memory_order_relaxed);
+        _lb->Feedback(info);
+    }
+
+    LoadBalancer *SubsetLoadBalancer::New(const mutil::StringPiece &params) const {
+        LoadBalancer *lb = _lb->New(params);
+        if (lb == nullptr) {
+            return nullptr;
+        }
+        SubsetLoadBalancer *subset_lb = new(std::nothrow) SubsetLoadBalancer(lb, _options);
+        if (subset_lb == nullptr) {
+            lb->Destroy();
+        }
+        return subset_lb;
+    }
+
+    void SubsetLoadBalancer::Destroy() {
+        delete this;
+    }
+
+    void SubsetLoadBalancer::Describe(std::ostream &os, const DescribeOptions &options) {
+        if (!options.verbose) {
+            os << "subset(";
+            _lb->Describe(os, options);
+            os << ')';
+            return;
+        }
+        os << "SubsetLoadBalancer {\n"
+           << "  client_id: " << _options.client_id << '\n'
+           << "  subset size: " << subset_size() << '\n'
+           << "  inflight: " << _ninflight.load(mutil::memory_order_relaxed) << '\n';
+        {
+            MELON_SCOPED_LOCK(_mutex);
+            os << "  number of servers: " << _servers.size() << '\n';
+        }
+        os << "  lb: ";
+        _lb->Describe(os, options);
+        os << "}\n";
+    }
+
+} // namespace melon::lb
@@ -0,0 +1,135 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#ifndef MELON_LB_POLICY_SUBSET_LOAD_BALANCER_H_
+#define MELON_LB_POLICY_SUBSET_LOAD_BALANCER_H_
+
+#include <stdint.h>                                    // uint64_t
+#include <map>                                         // std::map
+#include <string>
+#include <vector>                                      // std::vector
+#include <melon/utility/atomicops.h>
+#include <melon/utility/synchronization/lock.h>        // mutil::Mutex
+#include <melon/rpc/load_balancer.h>
+
+namespace melon::lb {
+
+    struct SubsetOptions {
+        // Constructed with default options.
+        SubsetOptions();
+
+        // Index of this client among clients of the same servers. A client
+        // always gets the same subset of the same servers. Subsets are
+        // balanced when the clients are numbered consecutively from 0.
+        // Default: hash of "<ip of this machine>:<pid>"
+        uint64_t client_id;
+
+        // The subset contains at least so many servers, or all servers when
+        // there're fewer.
+        // Default: 16
+        size_t min_subset_size;
+
+        // The subset contains at most so many servers, 0 means no limit.
+        // Default: 0
+        size_t max_subset_size;
+
+        // The subset grows when average in-flight requests per server in the
+        // subset is above `high_load' or no server in the subset is available,
+        // and shrinks by one server when it's below `low_load'.
+        // Default: 2.0 and 0.5
+        double high_load;
+        double low_load;
+
+        // Min interval between two resizings of the subset.
+        // Default: 1000 (milliseconds)
+        int64_t resize_interval_ms;
+    };
+
+    // Feed the wrapped LoadBalancer with a deterministic subset of servers
+    // from the naming service instead of all of them, so that each client only
+    // connects to and health-checks a small part of a large cluster.
+    // Servers are picked by deterministic subsetting: they are sorted by
+    // address, split into subset_count = #servers / subset size subsets, and
+    // shuffled before splitting with a seed of client_id / subset_count. The
+    // client takes the subset at client_id % subset_count, thus each group of
+    // subset_count consecutive clients uses every server once, and every
+    // server is chosen by the same number of clients give or take one.
+    // Adding/removing a server or resizing the subset reshuffles the servers
+    // and may change the subset entirely.
+    // The subset size adapts to load like "aperture" in finagle: it starts at
+    // min_subset_size and grows/shrinks with in-flight requests, checked at
+    // most once per resize_interval_ms in SelectServer().
+    class SubsetLoadBalancer : public LoadBalancer {
+    public:
+        // Take ownership of `lb'.
+        SubsetLoadBalancer(LoadBalancer *lb, const SubsetOptions &options);
+
+        bool AddServer(const ServerId &server);
+
+        bool RemoveServer(const ServerId &server);
+
+        size_t AddServersInBatch(const std::vector<ServerId> &servers);
+
+        size_t RemoveServersInBatch(const std::vector<ServerId> &servers);
+
+        int SelectServer(const SelectIn &in, SelectOut *out);
+
+        // Feedback of all calls is forwarded to the wrapped LoadBalancer.
+        void Feedback(const CallInfo &info);
+
+        LoadBalancer *New(const mutil::StringPiece &params) const;
+
+        void Destroy();
+
+        void Describe(std::ostream &os, const DescribeOptions &options);
+
+        // Number of servers fed to the wrapped LoadBalancer.
+        size_t subset_size() const {
+            return _subset_size.load(mutil::memory_order_relaxed);
+        }
+
+    private:
+        ~SubsetLoadBalancer();
+
+        size_t EffectiveSize() const;
+
+        // Feed _lb with a subset of `size' servers. Caller must hold _mutex.
+        void UpdateSubset(size_t size);
+
+        void MaybeResize(bool unavailable);
+
+        LoadBalancer *_lb;
+        SubsetOptions _options;
+
+        mutil::Mutex _mutex;
+        // All servers from the naming service and their addresses which are
+        // ordered in the same way by all clients.
+        std::map<ServerId, std::string> _servers;
+        // Sorted servers fed to _lb.
+        std::vector<ServerId> _subset;
+        size_t _target_size;
+
+        mutil::atomic<size_t> _subset_size;
+        mutil::atomic<int64_t> _ninflight;
+        mutil::atomic<int64_t> _last_resize_ms;
+    };
+
+} // namespace melon::lb
+
+#endif  // MELON_LB_POLICY_SUBSET_LOAD_BALANCER_H_
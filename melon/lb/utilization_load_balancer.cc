@@ -0,0 +1,287 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#include <gflags/gflags.h>
+#include <melon/utility/macros.h>
+#include <melon/utility/time.h>
+#include <melon/utility/fast_rand.h>
+#include <melon/rpc/socket.h>
+#include <melon/rpc/controller.h>
+#include <melon/rpc/server_load.h>
+#include <melon/lb/utilization_load_balancer.h>
+
+namespace melon::lb {
+
+    DEFINE_int32(utilization_lb_report_ttl_ms, 3000,
+                 "Utilization reported by a server is not trusted after so many "
+                 "milliseconds in utilization load balancer");
+
+    // Servers are never regarded as totally idle, otherwise inflight requests
+    // of idle servers make no difference.
+    static const int64_t MIN_UTILIZATION_PPM = 10000;
+    // Times of sampling two servers before scanning all servers.
+    static const int MAX_SAMPLE_ROUNDS = 3;
+
+    int64_t UtilizationLoadBalancer::Stats::Cost(
+            int64_t default_utilization_ppm, int64_t now_us) const {
+        const int64_t n = inflight.load(mutil::memory_order_relaxed);
+        int64_t utilization = default_utilization_ppm;
+        const int64_t report_us = report_time_us.load(mutil::memory_order_relaxed);
+        if (report_us != 0 &&
+            now_us - report_us <= FLAGS_utilization_lb_report_ttl_ms * 1000L) {
+            utilization = utilization_ppm.load(mutil::memory_order_relaxed);
+        }
+        return (utilization + MIN_UTILIZATION_PPM) * (std::max(n, (int64_t) 0) + 1);
+    }
+
+    bool UtilizationLoadBalancer::Add(Servers &bg, const Servers &fg, SocketId id) {
+        if (bg.server_map.find(id) != bg.server_map.end()) {
+            return false;
+        }
+        Server server;
+        server.id = id;
+        auto it = fg.server_map.find(id);
+        if (it != fg.server_map.end()) {
+            // Added to the other buffer already, share the stats.
+            server.stats = fg.server_list[it->second].stats;
+        } else {
+            server.stats = std::make_shared<Stats>();
+        }
+        bg.server_map[id] = bg.server_list.size();
+        bg.server_list.push_back(server);
+        return true;
+    }
+
+    bool UtilizationLoadBalancer::Remove(Servers &bg, SocketId id) {
+        auto it = bg.server_map.find(id);
+        if (it == bg.server_map.end()) {
+            return false;
+        }
+        const size_t index = it->second;
+        bg.server_map.erase(it);
+        if (index + 1 != bg.server_list.size()) {
+            bg.server_list[index] = bg.server_list.back();
+            bg.server_map[bg.server_list[index].id] = index;
+        }
+        bg.server_list.pop_back();
+        return true;
+    }
+
+    size_t UtilizationLoadBalancer::BatchAdd(
+            Servers &bg, const Servers &fg, const std::vector<ServerId> &servers) {
+        size_t count = 0;
+        for (size_t i = 0; i < servers.size(); ++i) {
+            count += !!Add(bg, fg, servers[i].id);
+        }
+        return count;
+    }
+
+    size_t UtilizationLoadBalancer::BatchRemove(
+            Servers &bg, const std::vector<ServerId> &servers) {
+        size_t count = 0;
+        for (size_t i = 0; i < servers.size(); ++i) {
+            count += !!Remove(bg, servers[i].id);
+        }
+        return count;
+    }
+
+    bool UtilizationLoadBalancer::AddServer(const ServerId &id) {
+        return _db_servers.ModifyWithForeground(Add, id.id);
+    }
+
+    bool UtilizationLoadBalancer::RemoveServer(const ServerId &id) {
+        return _db_servers.Modify(Remove, id.id);
+    }
+
+    size_t UtilizationLoadBalancer::AddServersInBatch(
+            const std::vector<ServerId> &servers) {
+        const size_t n = _db_servers.ModifyWithForeground(BatchAdd, servers);
+        LOG_IF(ERROR, n != servers.size())
+        << "Fail to AddServersInBatch, expected " << servers.size()
+        << " actually " << n;
+        return n;
+    }
+
+    size_t UtilizationLoadBalancer::RemoveServersInBatch(
+            const std::vector<ServerId> &servers) {
+        const size_t n = _db_servers.Modify(BatchRemove, servers);
+        LOG_IF(ERROR, n != servers.size())
+        << "Fail to RemoveServersInBatch, expected " << servers.size()
+        << " actually " << n;
+        return n;
+    }
+
+    bool UtilizationLoadBalancer::TryServer(const Servers &s, size_t index,
+                                            const SelectIn &in, SelectOut *out) {
+        const SocketId id = s.server_list[index].id;
+        return !ExcludedServers::IsExcluded(in.excluded, id)
+               && Socket::Address(id, out->ptr) == 0
+               && (*out->ptr)->IsAvailable();
+    }
+
+    int UtilizationLoadBalancer::SelectServer(const SelectIn &in, SelectOut *out) {
+        mutil::EpochBufferedData<Servers>::ScopedPtr s;
+        if (_db_servers.Read(&s) != 0) {
+            return ENOMEM;
+        }
+        const size_t n = s->server_list.size();
+        if (n == 0) {
+            return ENODATA;
+        }
+        if (_cluster_recover_policy && _cluster_recover_policy->StopRecoverIfNecessary()) {
+            std::vector<ServerId> server_list;
+            server_list.reserve(n);
+            for (size_t i = 0; i < n; ++i) {
+                server_list.push_back(ServerId(s->server_list[i].id));
+            }
+            if (_cluster_recover_policy->DoReject(server_list)) {
+                return EREJECT;
+            }
+        }
+        size_t chosen = n;
+        if (n == 1) {
+            if (TryServer(*s, 0, in, out)) {
+                chosen = 0;
+            }
+        } else {
+            const int64_t avg_utilization =
+                    _avg_utilization_ppm.load(mutil::memory_order_relaxed);
+            const int64_t now_us = mutil::cpuwide_time_us();
+            for (int round = 0; round < MAX_SAMPLE_ROUNDS && chosen == n; ++round) {
+                size_t first = mutil::fast_rand_less_than(n);
+                size_t second = mutil::fast_rand_less_than(n - 1);
+                if (second >= first) {
+                    ++second;
+                }
+                if (s->server_list[second].stats->Cost(avg_utilization, now_us) <
+                    s->server_list[first].stats->Cost(avg_utilization, now_us)) {
+                    std::swap(first, second);
+                }
+                if (TryServer(*s, first, in, out)) {
+                    chosen = first;
+                } else if (TryServer(*s, second, in, out)) {
+                    chosen = second;
+                }
+            }
+        }
+        if (chosen == n) {
+            // Most sampled servers are unavailable, scan all of them.
+            const size_t offset = mutil::fast_rand_less_than(n);
+            for (size_t i = 0; i < n; ++i) {
+                const size_t index = (offset + i) % n;
+                if (TryServer(*s, index, in, out)) {
+                    chosen = index;
+                    break;
+                }
+            }
+        }
+        if (chosen == n) {
+            // Excluded servers are the last chance.
+            for (size_t i = 0; i < n; ++i) {
+                if (Socket::Address(s->server_list[i].id, out->ptr) == 0
+                    && (*out->ptr)->IsAvailable()) {
+                    chosen = i;
+                    break;
+                }
+            }
+        }
+        if (chosen == n) {
+            if (_cluster_recover_policy) {
+                _cluster_recover_policy->StartRecover();
+            }
+            return EHOSTDOWN;
+        }
+        s->server_list[chosen].stats->inflight.fetch_add(1, mutil::memory_order_relaxed);
+        out->need_feedback = true;
+        return 0;
+    }
+
+    void UtilizationLoadBalancer::Feedback(const CallInfo &info) {
+        mutil::EpochBufferedData<Servers>::ScopedPtr s;
+        if (_db_servers.Read(&s) != 0) {
+            return;
+        }
+        auto it = s->server_map.find(info.server_id);
+        if (it == s->server_map.end()) {
+            // The server was removed.
+            return;
+        }
+        Stats *stats = s->server_list[it->second].stats.get();
+        stats->inflight.fetch_sub(1, mutil::memory_order_relaxed);
+        // Failed calls don't carry reports, the load in controller may
+        // belong to another call of the RPC.
+        if (info.error_code != 0 || info.controller == NULL ||
+            !info.controller->server_load().reported()) {
+            return;
+        }
+        const int64_t utilization =
+                (int64_t) (info.controller->server_load().utilization() * 1000000);
+        stats->utilization_ppm.store(utilization, mutil::memory_order_relaxed);
+        stats->report_time_us.store(mutil::cpuwide_time_us(), mutil::memory_order_relaxed);
+        // Racing updates lose some samples, which is fine for an average.
+        const int64_t avg = _avg_utilization_ppm.load(mutil::memory_order_relaxed);
+        _avg_utilization_ppm.store(avg == 0 ? utilization : avg + (utilization - avg) / 64,
+                                   mutil::memory_order_relaxed);
+    }
+
+    UtilizationLoadBalancer *UtilizationLoadBalancer::New(
+            const mutil::StringPiece &params) const {
+        UtilizationLoadBalancer *lb = new(std::nothrow) UtilizationLoadBalancer;
+        if (lb && !lb->SetParameters(params)) {
+            delete lb;
+            lb = NULL;
+        }
+        return lb;
+    }
+
+    void UtilizationLoadBalancer::Destroy() {
+        delete this;
+    }
+
+    void UtilizationLoadBalancer::Describe(
+            std::ostream &os, const DescribeOptions &options) {
+        if (!options.verbose) {
+            os << "utilization";
+            return;
+        }
+        os << "Utilization{";
+        mutil::EpochBufferedData<Servers>::ScopedPtr s;
+        if (_db_servers.Read(&s) != 0) {
+            os << "fail to read _db_servers";
+        } else {
+            os << "n=" << s->server_list.size() << " avg="
+               << _avg_utilization_ppm.load(mutil::memory_order_relaxed) / 10000.0
+               << "%:";
+            for (size_t i = 0; i < s->server_list.size(); ++i) {
+                const Server &server = s->server_list[i];
+                os << ' ' << server.id << "(utilization="
+                   << server.stats->utilization_ppm.load(mutil::memory_order_relaxed) / 10000.0
+                   << "% inflight="
+                   << server.stats->inflight.load(mutil::memory_order_relaxed)
+                   << ')';
+            }
+        }
+        os << '}';
+    }
+
+    bool UtilizationLoadBalancer::SetParameters(const mutil::StringPiece &params) {
+        return GetRecoverPolicyByParams(params, &_cluster_recover_policy);
+    }
+
+} // namespace melon::lb
@@ -0,0 +1,96 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#ifndef MELON_LB_POLICY_UTILIZATION_LOAD_BALANCER_H_
+#define MELON_LB_POLICY_UTILIZATION_LOAD_BALANCER_H_
+
+#include <memory>                                      // std::shared_ptr
+#include <unordered_map>                               // std::unordered_map
+#include <vector>                                      // std::vector
+#include <melon/utility/atomicops.h>
+#include <melon/utility/containers/epoch_buffered_data.h>
+#include <melon/rpc/load_balancer.h>
+#include <melon/rpc/cluster_recover_policy.h>
+
+namespace melon::lb {
+
+// This LoadBalancer samples two servers randomly and selects the one with
+// lower cost, where cost of a server is its utilization reported in
+// responses (read ServerOptions.report_load) multiplied by (inflight + 1).
+// Since utilization is measured by the servers themselves, a server with
+// more cores gets proportionally more requests, which latency-based
+// LoadBalancers can't do well. Inflight requests counted locally make up
+// for the delay of reports.
+// Servers whose reports are missing or older than
+// -utilization_lb_report_ttl_ms are assumed to be as busy as the average.
+// Servers are kept in EpochBufferedData like P2CEwmaLoadBalancer.
+class UtilizationLoadBalancer : public LoadBalancer {
+public:
+    UtilizationLoadBalancer() : _avg_utilization_ppm(0) {}
+    bool AddServer(const ServerId& id);
+    bool RemoveServer(const ServerId& id);
+    size_t AddServersInBatch(const std::vector<ServerId>& servers);
+    size_t RemoveServersInBatch(const std::vector<ServerId>& servers);
+    int SelectServer(const SelectIn& in, SelectOut* out);
+    void Feedback(const CallInfo& info);
+    UtilizationLoadBalancer* New(const mutil::StringPiece&) const;
+    void Destroy();
+    void Describe(std::ostream& os, const DescribeOptions&);
+
+private:
+    struct MELON_CACHELINE_ALIGNMENT Stats {
+        Stats() : inflight(0), utilization_ppm(0), report_time_us(0) {}
+        // Lower is better.
+        int64_t Cost(int64_t default_utilization_ppm, int64_t now_us) const;
+
+        mutil::atomic<int64_t> inflight;
+        // In parts per million.
+        mutil::atomic<int64_t> utilization_ppm;
+        // 0 means never reported.
+        mutil::atomic<int64_t> report_time_us;
+    };
+    struct Server {
+        SocketId id;
+        // Shared by both instances of _db_servers.
+        std::shared_ptr<Stats> stats;
+    };
+    struct Servers {
+        std::vector<Server> server_list;
+        std::unordered_map<SocketId, size_t> server_map;
+    };
+    bool SetParameters(const mutil::StringPiece& params);
+    static bool Add(Servers& bg, const Servers& fg, SocketId id);
+    static bool Remove(Servers& bg, SocketId id);
+    static size_t BatchAdd(Servers& bg, const Servers& fg,
+                           const std::vector<ServerId>& servers);
+    static size_t BatchRemove(Servers& bg, const std::vector<ServerId>& servers);
+    // Address the server at `index' if it's usable.
+    static bool TryServer(const Servers& s, size_t index, const SelectIn& in,
+                          SelectOut* out);
+
+    mutil::EpochBufferedData<Servers> _db_servers;
+    std::shared_ptr<ClusterRecoverPolicy> _cluster_recover_policy;
+    // Moving average of reported utilizations of all servers.
+    mutil::atomic<int64_t> _avg_utilization_ppm;
+};
+
+} // namespace melon::lb
+
+
+#endif  // MELON_LB_POLICY_UTILIZATION_LOAD_BALANCER_H_
@@ -0,0 +1,330 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#include <gflags/gflags.h>
+#include <melon/utility/fast_rand.h>
+#include <melon/utility/time.h>
+#include <melon/utility/strings/string_number_conversions.h>
+#include <melon/var/var.h>
+#include <melon/rpc/socket.h>
+#include <melon/lb/zone_aware_load_balancer.h>
+
+namespace melon::lb {
+
+    DEFINE_string(local_zone, "", "Zone of this process, used by zone_aware lb "
+                                  "without the `zone' parameter");
+
+    // Update the spill ratio at most once in so many microseconds.
+    static const int64_t SPILL_UPDATE_INTERVAL_US = 100000;
+
+    struct ZoneAwareVars {
+        melon::var::Adder<int64_t> nlocal;
+        melon::var::Adder<int64_t> ncross;
+        melon::var::Window<melon::var::Adder<int64_t> > nlocal_minute;
+        melon::var::Window<melon::var::Adder<int64_t> > ncross_minute;
+        melon::var::PassiveStatus<double> cross_percent;
+
+        ZoneAwareVars()
+                : nlocal_minute(&nlocal, 60), ncross_minute(&ncross, 60),
+                  cross_percent("zone_aware_lb_cross_zone_percent", GetCrossPercent, this) {}
+
+        static double GetCrossPercent(void *arg) {
+            ZoneAwareVars *vars = static_cast<ZoneAwareVars *>(arg);
+            const int64_t ncross = vars->ncross_minute.get_value();
+            const int64_t total = vars->nlocal_minute.get_value() + ncross;
+            return total > 0 ? ncross * 100.0 / total : 0;
+        }
+    };
+
+    static pthread_once_t g_vars_once = PTHREAD_ONCE_INIT;
+    static ZoneAwareVars *g_vars = nullptr;
+
+    static void InitZoneAwareVars() {
+        g_vars = new ZoneAwareVars;
+    }
+
+    static void UpdateLatency(mutil::atomic<int64_t> *ewma, int64_t latency_us) {
+        const int64_t old_value = ewma->load(mutil::memory_order_relaxed);
+        // Racing updates lose some samples, which is fine for an average.
+        ewma->store(old_value <= 0 ? latency_us : old_value + (latency_us - old_value) / 8,
+                    mutil::memory_order_relaxed);
+    }
+
+    ZoneAwareLoadBalancer::ZoneAwareLoadBalancer()
+            : _zone(FLAGS_local_zone), _lb_name("rr"), _latency_factor(2.0),
+              _probe_permille(1), _local_lb(nullptr), _remote_lb(nullptr),
+              _nremote(0), _spill_permille(0), _last_update_us(0),
+              _local_latency_us(0), _remote_latency_us(0) {
+        pthread_once(&g_vars_once, InitZoneAwareVars);
+    }
+
+    ZoneAwareLoadBalancer::~ZoneAwareLoadBalancer() {
+        if (_local_lb) {
+            _local_lb->Destroy();
+            _local_lb = nullptr;
+        }
+        if (_remote_lb) {
+            _remote_lb->Destroy();
+            _remote_lb = nullptr;
+        }
+    }
+
+    bool ZoneAwareLoadBalancer::ToInnerServer(const ServerId &server, ServerId *inner) const {
+        static const char ZONE_PREFIX[] = "zone=";
+        const size_t prefix_len = sizeof(ZONE_PREFIX) - 1;
+        bool local = false;
+        inner->id = server.id;
+        inner->tag.clear();
+        for (mutil::StringSplitter sp(server.tag.c_str(), ' '); sp; ++sp) {
+            mutil::StringPiece token(sp.field(), sp.length());
+            if (token.starts_with(ZONE_PREFIX)) {
+                local = (token.substr(prefix_len) == _zone);
+                continue;
+            }
+            if (!inner->tag.empty()) {
+                inner->tag.push_back(' ');
+            }
+            inner->tag.append(token.data(), token.size());
+        }
+        return local;
+    }
+
+    size_t ZoneAwareLoadBalancer::AddLocal(LocalServers &bg,
+                                           const std::vector<ServerId> &servers) {
+        for (size_t i = 0; i < servers.size(); ++i) {
+            bg.insert(servers[i].id);
+        }
+        return 1;
+    }
+
+    size_t ZoneAwareLoadBalancer::RemoveLocal(LocalServers &bg,
+                                              const std::vector<ServerId> &servers) {
+        for (size_t i = 0; i < servers.size(); ++i) {
+            bg.erase(servers[i].id);
+        }
+        return 1;
+    }
+
+    bool ZoneAwareLoadBalancer::AddServer(const ServerId &server) {
+        return AddServersInBatch(std::vector<ServerId>(1, server)) == 1;
+    }
+
+    bool ZoneAwareLoadBalancer::RemoveServer(const ServerId &server) {
+        return RemoveServersInBatch(std::vector<ServerId>(1, server)) == 1;
+    }
+
+    size_t ZoneAwareLoadBalancer::AddServersInBatch(const std::vector<ServerId> &servers) {
+        std::vector<ServerId> local;
+        std::vector<ServerId> remote;
+        for (size_t i = 0; i < servers.size(); ++i) {
+            ServerId inner;
+            if (ToInnerServer(servers[i], &inner)) {
+                local.push_back(inner);
+            } else {
+                remote.push_back(inner);
+            }
+        }
+        size_t n = 0;
+        if (!local.empty()) {
+            n += _local_lb->AddServersInBatch(local);
+            _db_local.Modify(AddLocal, local);
+        }
+        if (!remote.empty()) {
+            const size_t nremote = _remote_lb->AddServersInBatch(remote);
+            _nremote.fetch_add(nremote, mutil::memory_order_relaxed);
+            n += nremote;
+        }
+        // Reflect changes of local servers soon.
+        _last_update_us.store(0, mutil::memory_order_relaxed);
+        return n;
+    }
+
+    size_t ZoneAwareLoadBalancer::RemoveServersInBatch(const std::vector<ServerId> &servers) {
+        std::vector<ServerId> local;
+        std::vector<ServerId> remote;
+        for (size_t i = 0; i < servers.size(); ++i) {
+            ServerId inner;
+            if (ToInnerServer(servers[i], &inner)) {
+                local.push_back(inner);
+            } else {
+                remote.push_back(inner);
+            }
+        }
+        size_t n = 0;
+        if (!local.empty()) {
+            n += _local_lb->RemoveServersInBatch(local);
+            _db_local.Modify(RemoveLocal, local);
+        }
+        if (!remote.empty()) {
+            const size_t nremote = _remote_lb->RemoveServersInBatch(remote);
+            _nremote.fetch_sub(nremote, mutil::memory_order_relaxed);
+            n += nremote;
+        }
+        _last_update_us.store(0, mutil::memory_order_relaxed);
+        return n;
+    }
+
+    void ZoneAwareLoadBalancer::MaybeUpdateSpill() {
+        const int64_t now_us = mutil::cpuwide_time_us();
+        int64_t last_us = _last_update_us.load(mutil::memory_order_relaxed);
+        if (now_us - last_us < SPILL_UPDATE_INTERVAL_US ||
+            !_last_update_us.compare_exchange_strong(last_us, now_us)) {
+            return;
+        }
+        size_t nlocal = 0;
+        size_t nhealthy = 0;
+        {
+            mutil::DoublyBufferedData<LocalServers>::ScopedPtr s;
+            if (_db_local.Read(&s) != 0) {
+                return;
+            }
+            nlocal = s->size();
+            for (LocalServers::const_iterator it = s->begin(); it != s->end(); ++it) {
+                SocketUniquePtr ptr;
+                if (Socket::Address(*it, &ptr) == 0 && ptr->IsAvailable()) {
+                    ++nhealthy;
+                }
+            }
+        }
+        int spill = 0;
+        if (_nremote.load(mutil::memory_order_relaxed) > 0) {
+            spill = (nlocal == 0 ? 1000 : (int) ((nlocal - nhealthy) * 1000 / nlocal));
+            const int64_t local_latency = _local_latency_us.load(mutil::memory_order_relaxed);
+            const int64_t remote_latency = _remote_latency_us.load(mutil::memory_order_relaxed);
+            if (_latency_factor > 0 && local_latency > 0 && remote_latency > 0 &&
+                local_latency > _latency_factor * remote_latency) {
+                spill = std::max(spill, (int) (1000 - _latency_factor * remote_latency
+                                                      * 1000 / local_latency));
+            }
+            spill = std::max(spill, _probe_permille);
+        }
+        _spill_permille.store(spill, mutil::memory_order_relaxed);
+    }
+
+    int ZoneAwareLoadBalancer::SelectServer(const SelectIn &in, SelectOut *out) {
+        MaybeUpdateSpill();
+        const int spill = spill_permille();
+        bool cross = (spill > 0 && (int) mutil::fast_rand_less_than(1000) < spill);
+        int rc = (cross ? _remote_lb : _local_lb)->SelectServer(in, out);
+        if (rc != 0) {
+            cross = !cross;
+            rc = (cross ? _remote_lb : _local_lb)->SelectServer(in, out);
+            if (rc != 0) {
+                return rc;
+            }
+        }
+        if (cross) {
+            g_vars->ncross << 1;
+        } else {
+            g_vars->nlocal << 1;
+        }
+        out->need_feedback = true;
+        return 0;
+    }
+
+    void ZoneAwareLoadBalancer::Feedback(const CallInfo &info) {
+        bool local = false;
+        {
+            mutil::DoublyBufferedData<LocalServers>::ScopedPtr s;
+            if (_db_local.Read(&s) == 0) {
+                local = (s->count(info.server_id) != 0);
+            }
+        }
+        if (info.error_code == 0) {
+            const int64_t latency_us = mutil::gettimeofday_us() - info.begin_time_us;
+            UpdateLatency(local ? &_local_latency_us : &_remote_latency_us, latency_us);
+        }
+        (local ? _local_lb : _remote_lb)->Feedback(info);
+    }
+
+    LoadBalancer *ZoneAwareLoadBalancer::New(const mutil::StringPiece &params) const {
+        ZoneAwareLoadBalancer *lb = new(std::nothrow) ZoneAwareLoadBalancer;
+        if (lb && !lb->SetParameters(params)) {
+            delete lb;
+            lb = nullptr;
+        }
+        return lb;
+    }
+
+    void ZoneAwareLoadBalancer::Destroy() {
+        delete this;
+    }
+
+    void ZoneAwareLoadBalancer::Describe(std::ostream &os, const DescribeOptions &options) {
+        if (!options.verbose) {
+            os << "zone_aware";
+            return;
+        }
+        os << "ZoneAwareLoadBalancer {\n"
+           << "  zone: " << _zone << '\n'
+           << "  spill permille: " << spill_permille() << '\n'
+           << "  local latency: " << _local_latency_us.load(mutil::memory_order_relaxed) << "us\n"
+           << "  remote latency: " << _remote_latency_us.load(mutil::memory_order_relaxed) << "us\n"
+           << "  local lb: ";
+        if (_local_lb) {
+            _local_lb->Describe(os, options);
+        }
+        os << "\n  remote lb: ";
+        if (_remote_lb) {
+            _remote_lb->Describe(os, options);
+        }
+        os << "\n}\n";
+    }
+
+    bool ZoneAwareLoadBalancer::SetParameters(const mutil::StringPiece &params) {
+        for (mutil::KeyValuePairsSplitter sp(params.begin(), params.end(), ' ', '=');
+             sp; ++sp) {
+            if (sp.value().empty()) {
+                LOG(ERROR) << "Empty value for " << sp.key() << " in lb parameter";
+                return false;
+            }
+            if (sp.key() == "zone") {
+                _zone = sp.value().as_string();
+            } else if (sp.key() == "lb") {
+                _lb_name = sp.value().as_string();
+            } else if (sp.key() == "latency_factor") {
+                if (!mutil::StringToDouble(sp.value().as_string(), &_latency_factor)) {
+                    LOG(ERROR) << "Invalid latency_factor=" << sp.value();
+                    return false;
+                }
+            } else if (sp.key() == "probe_permille") {
+                if (!mutil::StringToInt(sp.value(), &_probe_permille)
+                    || _probe_permille < 0 || _probe_permille > 1000) {
+                    LOG(ERROR) << "Invalid probe_permille=" << sp.value();
+                    return false;
+                }
+            } else {
+                LOG(ERROR) << "Failed to set this unknown parameters " << sp.key_and_value();
+            }
+        }
+        if (_zone.empty()) {
+            LOG(WARNING) << "Neither zone parameter nor -local_zone is set, "
+                            "all servers are treated as in other zones";
+        }
+        const LoadBalancer *lb = LoadBalancerExtension()->Find(_lb_name.c_str());
+        if (lb == nullptr || lb == this || dynamic_cast<const ZoneAwareLoadBalancer *>(lb)) {
+            LOG(ERROR) << "Invalid lb=" << _lb_name;
+            return false;
+        }
+        _local_lb = lb->New("");
+        _remote_lb = lb->New("");
+        return _local_lb != nullptr && _remote_lb != nullptr;
+    }
+
+} // namespace melon::lb
@@ -0,0 +1,115 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#ifndef MELON_LB_POLICY_ZONE_AWARE_LOAD_BALANCER_H_
+#define MELON_LB_POLICY_ZONE_AWARE_LOAD_BALANCER_H_
+
+#include <string>
+#include <unordered_set>                               // std::unordered_set
+#include <vector>                                      // std::vector
+#include <melon/utility/atomicops.h>
+#include <melon/utility/containers/doubly_buffered_data.h>
+#include <melon/rpc/load_balancer.h>
+
+namespace melon::lb {
+
+    // Prefer servers in the same zone as this process and spill requests over
+    // to other zones when local servers are not enough. Zone of a server is
+    // the value of "zone=<name>" in its tag, e.g. "zone=us-east-1a 10" from
+    // a naming service means zone "us-east-1a" and tag "10" for the wrapped
+    // LoadBalancer, so that weights still work with "wrr" or "wr".
+    // Ratio of spilled requests is the max of:
+    //  - ratio of unhealthy servers in the local zone.
+    //  - 1 - latency_factor * remote_latency / local_latency, when latency of
+    //    the local zone is more than latency_factor times of other zones.
+    // Spilled requests are spread over servers in other zones by the wrapped
+    // LoadBalancer, which is proportional to their capacities.
+    // Parameters (separated by spaces):
+    //   zone=<name>          zone of this process, -local_zone by default
+    //   lb=<name>            the wrapped LoadBalancer, "rr" by default
+    //   latency_factor=<f>   see above, non-positive value disables it, 2 by
+    //                        default
+    //   probe_permille=<n>   send so many permille of requests to other zones
+    //                        to learn their latencies, 1 by default
+    // Example: "zone_aware:zone=us-east-1a lb=la"
+    // The global var "zone_aware_lb_cross_zone_percent" shows the percentage
+    // of cross-zone requests in last minute.
+    class ZoneAwareLoadBalancer : public LoadBalancer {
+    public:
+        ZoneAwareLoadBalancer();
+
+        ~ZoneAwareLoadBalancer();
+
+        bool AddServer(const ServerId &server);
+
+        bool RemoveServer(const ServerId &server);
+
+        size_t AddServersInBatch(const std::vector<ServerId> &servers);
+
+        size_t RemoveServersInBatch(const std::vector<ServerId> &servers);
+
+        int SelectServer(const SelectIn &in, SelectOut *out);
+
+        void Feedback(const CallInfo &info);
+
+        LoadBalancer *New(const mutil::StringPiece &params) const;
+
+        void Destroy();
+
+        void Describe(std::ostream &os, const DescribeOptions &options);
+
+        // Permille of requests to be sent to other zones.
+        int spill_permille() const {
+            return _spill_permille.load(mutil::memory_order_relaxed);
+        }
+
+    private:
+        typedef std::unordered_set<SocketId> LocalServers;
+
+        bool SetParameters(const mutil::StringPiece &params);
+
+        // Remove the zone from tag of `server'. Returns true if the server is
+        // in the local zone.
+        bool ToInnerServer(const ServerId &server, ServerId *inner) const;
+
+        static size_t AddLocal(LocalServers &bg, const std::vector<ServerId> &servers);
+
+        static size_t RemoveLocal(LocalServers &bg, const std::vector<ServerId> &servers);
+
+        void MaybeUpdateSpill();
+
+        std::string _zone;
+        std::string _lb_name;
+        double _latency_factor;
+        int _probe_permille;
+
+        LoadBalancer *_local_lb;
+        LoadBalancer *_remote_lb;
+        mutil::DoublyBufferedData<LocalServers> _db_local;
+        mutil::atomic<size_t> _nremote;
+
+        mutil::atomic<int> _spill_permille;
+        mutil::atomic<int64_t> _last_update_us;
+        mutil::atomic<int64_t> _local_latency_us;
+        mutil::atomic<int64_t> _remote_latency_us;
+    };
+
+} // namespace melon::lb
+
+#endif  // MELON_LB_POLICY_ZONE_AWARE_LOAD_BALANCER_H_
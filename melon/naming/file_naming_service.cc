@@ -24,7 +24,9 @@
 #include <set>                                          // std::set
 #include <melon/utility/files/file_watcher.h>                    // FileWatcher
 #include <melon/utility/files/scoped_file.h>                     // ScopedFILE
-#include <melon/fiber/fiber.h>                            // fiber_usleep
+#include <melon/utility/time.h>                           // microseconds_from_now
+#include <melon/fiber/butex.h>                            // butex_wait
+#include <melon/fiber/fiber.h>                            // fiber_stopped
 #include <melon/rpc/log.h>
 #include <melon/naming/file_naming_service.h>
 
@@ -84,6 +86,8 @@ namespace melon::naming {
             PLOG(ERROR) << "Fail to open `" << service_name << "'";
             return errno;
         }
+        std::unordered_map<std::string, ServerNode> parsed_lines;
+        parsed_lines.reserve(_parsed_lines.size());
         while ((nr = getline(&line, &line_len, fp.get())) != -1) {
             if (line[nr - 1] == '\n') { // remove ending newline
                 --nr;
@@ -94,28 +98,79 @@ namespace melon::naming {
                                        &addr, &tag)) {
                 continue;
             }
-            const_cast<char *>(addr.data())[addr.size()] = '\0'; // safe
-            mutil::EndPoint point;
-            if (str2endpoint(addr.data(), &point) != 0 &&
-                hostname2endpoint(addr.data(), &point) != 0) {
-                LOG(ERROR) << "Invalid address=`" << addr << '\'';
-                continue;
-            }
+            std::string key(line, nr);
             ServerNode node;
-            node.addr = point;
-            tag.CopyToString(&node.tag);
+            std::unordered_map<std::string, ServerNode>::const_iterator
+                    it = _parsed_lines.find(key);
+            if (it != _parsed_lines.end()) {
+                node = it->second;
+            } else {
+                const_cast<char *>(addr.data())[addr.size()] = '\0'; // safe
+                mutil::EndPoint point;
+                if (str2endpoint(addr.data(), &point) != 0 &&
+                    hostname2endpoint(addr.data(), &point) != 0) {
+                    LOG(ERROR) << "Invalid address=`" << addr << '\'';
+                    continue;
+                }
+                node.addr = point;
+                tag.CopyToString(&node.tag);
+            }
+            parsed_lines.emplace(std::move(key), node);
             if (presence.insert(node).second) {
                 servers->push_back(node);
             } else {
                 RPC_VLOG << "Duplicated server=" << node;
             }
         }
+        _parsed_lines.swap(parsed_lines);
         RPC_VLOG << "Got " << servers->size()
                  << (servers->size() > 1 ? " servers" : " server");
         free(line);
         return 0;
     }
 
+    static void WakeUpOnFileChange(void *arg) {
+        mutil::atomic<int> *changed = static_cast<mutil::atomic<int> *>(arg);
+        changed->fetch_add(1, mutil::memory_order_release);
+        fiber::butex_wake(changed);
+    }
+
+    // Wait until the file watched by `fw' is created or modified.
+    // Returns 0 on change, ESTOP when the fiber is stopped, -1 otherwise.
+    static int WaitForFileChange(mutil::FileWatcher *fw,
+                                 mutil::atomic<int> *changed,
+                                 int64_t poll_interval_us) {
+        for (;;) {
+            const int expected_val = changed->load(mutil::memory_order_acquire);
+            mutil::FileWatcher::Change change = fw->check_and_consume();
+            if (change > 0) {
+                return 0;
+            }
+            if (change < 0) {
+                LOG(ERROR) << "`" << fw->filepath() << "' was deleted";
+            }
+            const timespec abstime = mutil::microseconds_from_now(poll_interval_us);
+            if (fiber::butex_wait(changed, expected_val, &abstime) < 0 &&
+                errno != EWOULDBLOCK && errno != ETIMEDOUT && errno != EINTR) {
+                PLOG(ERROR) << "Fail to wait for changes of `"
+                            << fw->filepath() << "'";
+                return -1;
+            }
+            if (fiber_stopped(fiber_self())) {
+                return ESTOP;
+            }
+            if (changed->load(mutil::memory_order_acquire) != expected_val) {
+                // The file was written, reload it even if the mtime is
+                // unchanged due to the precision of file system.
+                change = fw->check_and_consume();
+                if (change >= 0) {
+                    return 0;
+                }
+                LOG(ERROR) << "`" << fw->filepath() << "' was deleted";
+            }
+        }
+    }
+
     int FileNamingService::RunNamingService(const char *service_name,
                                             NamingServiceActions *actions) {
         std::vector<ServerNode> servers;
@@ -124,32 +179,33 @@ namespace melon::naming {
             LOG(ERROR) << "Fail to init FileWatcher on `" << service_name << "'";
             return -1;
         }
+        mutil::atomic<int> *changed =
+                fiber::butex_create_checked<mutil::atomic<int> >();
+        if (changed == NULL) {
+            LOG(ERROR) << "Fail to create butex";
+            return -1;
+        }
+        changed->store(0, mutil::memory_order_relaxed);
+        // Reload on notifications of the file. Keep polling at a lower
+        // frequency in case that notifications are unavailable or lost.
+        const int64_t poll_interval_us =
+                (fw.watch(WakeUpOnFileChange, changed) == 0 ? 1000000L : 100000L);
+        int rc = 0;
         for (;;) {
-            const int rc = GetServers(service_name, &servers);
+            rc = GetServers(service_name, &servers);
             if (rc != 0) {
-                return rc;
+                break;
             }
             actions->ResetServers(servers);
-
-            for (;;) {
-                mutil::FileWatcher::Change change = fw.check_and_consume();
-                if (change > 0) {
-                    break;
-                }
-                if (change < 0) {
-                    LOG(ERROR) << "`" << service_name << "' was deleted";
-                }
-                if (fiber_usleep(100000L/*100ms*/) < 0) {
-                    if (errno == ESTOP) {
-                        return 0;
-                    }
-                    PLOG(ERROR) << "Fail to sleep";
-                    return -1;
-                }
+            rc = WaitForFileChange(&fw, changed, poll_interval_us);
+            if (rc != 0) {
+                break;
             }
         }
-        CHECK(false);
-        return -1;
+        // Callback is not running after unwatch().
+        fw.unwatch();
+        fiber::butex_destroy(changed);
+        return rc == ESTOP ? 0 : rc;
     }
 
     void FileNamingService::Describe(std::ostream &os,
@@ -20,6 +20,8 @@
 
 #pragma once
 
+#include <string>
+#include <unordered_map>
 #include <melon/naming/naming_service.h>
 
 
@@ -40,6 +42,12 @@ namespace melon::naming {
         NamingService *New() const override;
 
         void Destroy() override;
+
+    private:
+        // Lines parsed in last GetServers(), so that only changed lines of
+        // large files are parsed again. Notice that hostnames in unchanged
+        // lines are not resolved again.
+        std::unordered_map<std::string, ServerNode> _parsed_lines;
     };
 
 } // namespace melon::naming
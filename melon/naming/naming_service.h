@@ -38,10 +38,17 @@ namespace melon {
     public:
         virtual ~NamingServiceActions() {}
 
+        // Add `servers' to the current list, existing ones are ignored.
+        // Naming services receiving deltas from the registry should call
+        // this and RemoveServers() rather than ResetServers() with the full
+        // list, which costs O(N*logN) for N servers on every change.
         virtual void AddServers(const std::vector<ServerNode> &servers) = 0;
 
+        // Remove `servers' from the current list, missing ones are ignored.
         virtual void RemoveServers(const std::vector<ServerNode> &servers) = 0;
 
+        // Replace the current list with `servers'. Sorting is skipped if
+        // `servers' is already sorted.
         virtual void ResetServers(const std::vector<ServerNode> &servers) = 0;
     };
 
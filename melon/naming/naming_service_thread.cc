@@ -20,10 +20,16 @@
 
 
 #include <set>
+#include <inttypes.h>
 #include <pthread.h>
+#include <sys/stat.h>
 #include <gflags/gflags.h>
 #include <melon/fiber/butex.h>
+#include <melon/utility/file_util.h>
+#include <melon/utility/files/scoped_file.h>
 #include <melon/utility/scoped_lock.h>
+#include <melon/utility/string_printf.h>
+#include <melon/utility/third_party/murmurhash3/murmurhash3.h>
 #include <turbo/log/logging.h>
 #include <melon/rpc/log.h>
 #include <melon/rpc/socket_map.h>
@@ -32,6 +38,14 @@
 
 namespace melon {
 
+    DEFINE_string(naming_service_cache_dir, "",
+                  "If this flag is non-empty, servers of naming services are saved "
+                  "into files under this directory, and loaded to initialize "
+                  "channels before naming services return, so that a restarted "
+                  "process works even if the registry is unavailable");
+    DEFINE_int32(naming_service_cache_max_age_s, 86400,
+                 "Saved servers older than so many seconds are not loaded");
+
     struct NSKey {
         std::string protocol;
         std::string service_name;
@@ -65,7 +79,8 @@ namespace melon {
     static pthread_mutex_t g_nsthread_map_mutex = PTHREAD_MUTEX_INITIALIZER;
 
     NamingServiceThread::Actions::Actions(NamingServiceThread *owner)
-            : _owner(owner), _wait_id(INVALID_FIBER_ID), _has_wait_error(false), _wait_error(0) {
+            : _owner(owner), _wait_id(INVALID_FIBER_ID), _has_wait_error(false), _wait_error(0)
+            , _serving_cache(false), _cache_saved_s(0) {
         CHECK_EQ(0, fiber_session_create(&_wait_id, NULL, NULL));
     }
 
@@ -79,32 +94,76 @@ namespace melon {
         EndWait(0);
     }
 
+    void NamingServiceThread::Actions::SortAndDedup(
+            const std::vector<ServerNode> &servers, std::vector<ServerNode> *out) {
+        out->assign(servers.begin(), servers.end());
+        // Lists from many naming services are already sorted.
+        if (!std::is_sorted(out->begin(), out->end())) {
+            std::sort(out->begin(), out->end());
+        }
+        const size_t dedup_size = std::unique(out->begin(), out->end())
+                                  - out->begin();
+        if (dedup_size != out->size()) {
+            LOG(WARNING) << "Removed " << out->size() - dedup_size
+                         << " duplicated servers";
+            out->resize(dedup_size);
+        }
+    }
+
     void NamingServiceThread::Actions::AddServers(
-            const std::vector<ServerNode> &) {
-        // FIXME(gejun)
-        RELEASE_ASSERT_VERBOSE(false, "Not implemented");
+            const std::vector<ServerNode> &servers) {
+        _serving_cache = false;
+        SortAndDedup(servers, &_servers);
+        // Notice that _last_servers is always sorted.
+        _added.resize(_servers.size());
+        std::vector<ServerNode>::iterator _added_end =
+                std::set_difference(_servers.begin(), _servers.end(),
+                                    _last_servers.begin(), _last_servers.end(),
+                                    _added.begin());
+        _added.resize(_added_end - _added.begin());
+        _removed.clear();
+        _servers.resize(_last_servers.size() + _added.size());
+        std::merge(_last_servers.begin(), _last_servers.end(),
+                   _added.begin(), _added.end(), _servers.begin());
+        ApplyChanges();
     }
 
     void NamingServiceThread::Actions::RemoveServers(
-            const std::vector<ServerNode> &) {
-        // FIXME(gejun)
-        RELEASE_ASSERT_VERBOSE(false, "Not implemented");
+            const std::vector<ServerNode> &servers) {
+        _serving_cache = false;
+        SortAndDedup(servers, &_servers);
+        _removed.resize(_servers.size());
+        std::vector<ServerNode>::iterator _removed_end =
+                std::set_intersection(_servers.begin(), _servers.end(),
+                                      _last_servers.begin(), _last_servers.end(),
+                                      _removed.begin());
+        _removed.resize(_removed_end - _removed.begin());
+        _added.clear();
+        _servers.resize(_last_servers.size());
+        std::vector<ServerNode>::iterator _servers_end =
+                std::set_difference(_last_servers.begin(), _last_servers.end(),
+                                    _removed.begin(), _removed.end(),
+                                    _servers.begin());
+        _servers.resize(_servers_end - _servers.begin());
+        ApplyChanges();
     }
 
     void NamingServiceThread::Actions::ResetServers(
             const std::vector<ServerNode> &servers) {
-        _servers.assign(servers.begin(), servers.end());
+        if (servers.empty() && _serving_cache) {
+            // Naming services reset with empty list on errors to wake up
+            // callers, keep the cached servers until the registry is back.
+            LOG(WARNING) << mutil::class_name_str(*_owner->_ns) << "(\""
+                         << _owner->_service_name << "\") is empty, keep using "
+                         << _last_servers.size() << " cached servers";
+            EndWait(0);
+            return;
+        }
+        _serving_cache = false;
+        SortAndDedup(servers, &_servers);
 
         // Diff servers with _last_servers by comparing sorted vectors.
         // Notice that _last_servers is always sorted.
-        std::sort(_servers.begin(), _servers.end());
-        const size_t dedup_size = std::unique(_servers.begin(), _servers.end())
-                                  - _servers.begin();
-        if (dedup_size != _servers.size()) {
-            LOG(WARNING) << "Removed " << _servers.size() - dedup_size
-                         << " duplicated servers";
-            _servers.resize(dedup_size);
-        }
         _added.resize(_servers.size());
         std::vector<ServerNode>::iterator _added_end =
                 std::set_difference(_servers.begin(), _servers.end(),
@@ -118,7 +177,30 @@ namespace melon {
                                     _servers.begin(), _servers.end(),
                                     _removed.begin());
         _removed.resize(_removed_end - _removed.begin());
+        ApplyChanges();
+    }
+
+    void NamingServiceThread::Actions::ResetServersFromCache(
+            const std::vector<ServerNode> &servers) {
+        CHECK(_last_servers.empty());
+        // Don't save the cache back, which refreshes its age.
+        _serving_cache = true;
+        SortAndDedup(servers, &_servers);
+        _added = _servers;
+        _removed.clear();
+        ApplyChanges();
+    }
 
+    void NamingServiceThread::Actions::ApplyChanges() {
+        if (_added.empty() && _removed.empty()) {
+            // Periodically polled naming services return the same list
+            // mostly, skip copying sockets and notifying watchers.
+            if (!_last_servers.empty()) {
+                MaybeSaveCache(false);
+            }
+            EndWait(_last_servers.empty() ? ENODATA : 0);
+            return;
+        }
         _added_sockets.clear();
         for (size_t i = 0; i < _added.size(); ++i) {
             ServerNodeWithId tagged_id;
@@ -205,7 +287,24 @@ namespace melon {
             LOG(INFO) << info.str();
         }
 
-        EndWait(servers.empty() ? ENODATA : 0);
+        MaybeSaveCache(true);
+        EndWait(_last_servers.empty() ? ENODATA : 0);
+    }
+
+    void NamingServiceThread::Actions::MaybeSaveCache(bool changed) {
+        if (_serving_cache || _owner->_cache_path.empty()) {
+            return;
+        }
+        // Unchanged lists still refresh the age of the cache: once when the
+        // registry confirms the list for the first time, then every half of
+        // -naming_service_cache_max_age_s, otherwise a stable service would
+        // not be loaded after a restart.
+        const int64_t now = time(NULL);
+        if (changed || _cache_saved_s == 0 ||
+            now - _cache_saved_s >= FLAGS_naming_service_cache_max_age_s / 2) {
+            _owner->SaveCachedServers(_last_servers);
+            _cache_saved_s = now;
+        }
     }
 
     void NamingServiceThread::Actions::EndWait(int error_code) {
@@ -267,6 +366,125 @@ namespace melon {
         }
     }
 
+    // Map `url' to a file under -naming_service_cache_dir. Characters other
+    // than [A-Za-z0-9._-] are escaped as %XX, overlong names are truncated
+    // and suffixed with hash of `url' to be shorter than NAME_MAX. Channels
+    // with different signatures have different files.
+    static std::string GetCacheFilePath(const std::string &url,
+                                        const ChannelSignature &sig) {
+        std::string name;
+        name.reserve(url.size());
+        for (size_t i = 0; i < url.size(); ++i) {
+            const char c = url[i];
+            if (isalnum(c) || c == '.' || c == '_' || c == '-') {
+                name.push_back(c);
+            } else {
+                char buf[4];
+                snprintf(buf, sizeof(buf), "%%%02X", (unsigned char)c);
+                name.append(buf);
+            }
+        }
+        const size_t MAX_NAME_LEN = 200;
+        if (name.size() > MAX_NAME_LEN) {
+            uint32_t h = 0;
+            mutil::MurmurHash3_x86_32(url.data(), url.size(), 0, &h);
+            char buf[16];
+            snprintf(buf, sizeof(buf), "_%08" PRIx32, h);
+            name.resize(MAX_NAME_LEN - 9);
+            name.append(buf);
+        }
+        if (sig != ChannelSignature()) {
+            // '@' is escaped above, so the suffix can't be mistaken.
+            char buf[40];
+            snprintf(buf, sizeof(buf), "@%016" PRIx64 "%016" PRIx64,
+                     sig.data[0], sig.data[1]);
+            name.append(buf);
+        }
+        return FLAGS_naming_service_cache_dir + '/' + name;
+    }
+
+    void NamingServiceThread::LoadCachedServers() {
+        struct stat st;
+        if (stat(_cache_path.c_str(), &st) != 0) {
+            return;
+        }
+        if (time(NULL) - st.st_mtime > FLAGS_naming_service_cache_max_age_s) {
+            LOG(WARNING) << "Ignore stale cache `" << _cache_path << '\'';
+            return;
+        }
+        mutil::ScopedFILE fp(fopen(_cache_path.c_str(), "r"));
+        if (!fp) {
+            PLOG(WARNING) << "Fail to open `" << _cache_path << '\'';
+            return;
+        }
+        // Each line is "address[ tag]", see SaveCachedServers()
+        std::vector<ServerNode> servers;
+        char *line = NULL;
+        size_t line_len = 0;
+        ssize_t nr = 0;
+        while ((nr = getline(&line, &line_len, fp.get())) != -1) {
+            if (nr > 0 && line[nr - 1] == '\n') {
+                line[--nr] = '\0';
+            }
+            if (nr == 0 || line[0] == '#') {
+                continue;
+            }
+            char *tag = strchr(line, ' ');
+            if (tag != NULL) {
+                *tag++ = '\0';
+            }
+            ServerNode node;
+            if (str2endpoint(line, &node.addr) != 0) {
+                LOG(ERROR) << "Invalid address=`" << line << "' in "
+                           << _cache_path;
+                continue;
+            }
+            if (tag != NULL) {
+                node.tag = tag;
+            }
+            servers.push_back(node);
+        }
+        free(line);
+        if (!servers.empty()) {
+            LOG(INFO) << "Loaded " << servers.size() << " servers of `" << *this
+                      << "' from " << _cache_path;
+            _actions.ResetServersFromCache(servers);
+        }
+    }
+
+    void NamingServiceThread::SaveCachedServers(
+            const std::vector<ServerNode> &servers) {
+        std::string content;
+        for (size_t i = 0; i < servers.size(); ++i) {
+            content.append(endpoint2str(servers[i].addr).c_str());
+            if (!servers[i].tag.empty()) {
+                content.push_back(' ');
+                content.append(servers[i].tag);
+            }
+            content.push_back('\n');
+        }
+        // Write into a temporary file and rename it so that readers never
+        // see a partial list, even if this process crashes in the middle.
+        const mutil::FilePath dir(FLAGS_naming_service_cache_dir);
+        const std::string tmp_path = mutil::string_printf(
+                "%s.%d.tmp", _cache_path.c_str(), (int)getpid());
+        if (!mutil::CreateDirectory(dir)) {
+            PLOG(WARNING) << "Fail to create " << dir.value();
+            return;
+        }
+        if (mutil::WriteFile(mutil::FilePath(tmp_path), content.data(),
+                             content.size()) != (int)content.size()) {
+            PLOG(WARNING) << "Fail to write " << tmp_path;
+            unlink(tmp_path.c_str());
+            return;
+        }
+        if (rename(tmp_path.c_str(), _cache_path.c_str()) != 0) {
+            PLOG(WARNING) << "Fail to rename " << tmp_path << " to "
+                          << _cache_path;
+            unlink(tmp_path.c_str());
+        }
+    }
+
     void *NamingServiceThread::RunThis(void *arg) {
         static_cast<NamingServiceThread *>(arg)->Run();
         return NULL;
@@ -287,6 +505,13 @@ namespace melon {
             _options = *opt_in;
         }
         _last_sockets.clear();
+        // Naming services returning quickly are static, no need to cache.
+        if (!FLAGS_naming_service_cache_dir.empty() &&
+            !_ns->RunNamingServiceReturnsQuickly()) {
+            _cache_path = GetCacheFilePath(protocol + "://" + service_name,
+                                           _options.channel_signature);
+            LoadCachedServers();
+        }
         if (_ns->RunNamingServiceReturnsQuickly()) {
             RunThis(this);
         } else {
@@ -82,7 +82,24 @@ namespace melon {
 
             void EndWait(int error_code);
 
+            // Initialize servers with the list saved by a previous process.
+            // Until the naming service returns a non-empty list, empty lists
+            // from it are ignored so that the cached servers are kept.
+            void ResetServersFromCache(const std::vector<ServerNode> &servers);
+
         private:
+            // Sort and dedup `servers' into `out'.
+            static void SortAndDedup(const std::vector<ServerNode> &servers,
+                                     std::vector<ServerNode> *out);
+
+            // Apply _added/_removed to sockets and watchers, then replace
+            // _last_servers with _servers. All of them must be sorted.
+            void ApplyChanges();
+
+            // Save _last_servers to the cache of the owner if `changed' or
+            // the cache is due for refreshing.
+            void MaybeSaveCache(bool changed);
+
             NamingServiceThread *_owner;
             fiber_session_t _wait_id;
             mutil::atomic<bool> _has_wait_error;
@@ -94,6 +111,9 @@ namespace melon {
             std::vector<ServerNodeWithId> _sockets;
             std::vector<ServerNodeWithId> _added_sockets;
             std::vector<ServerNodeWithId> _removed_sockets;
+            bool _serving_cache;
+            // Seconds since epoch when the cache was saved, 0 for never.
+            int64_t _cache_saved_s;
         };
 
     public:
@@ -123,6 +143,13 @@ namespace melon {
 
         static void *RunThis(void *);
 
+        // Load servers saved by a previous process into _actions.
+        void LoadCachedServers();
+
+        // Save `servers' to _cache_path, called after servers changed or
+        // to refresh the age of the cache.
+        void SaveCachedServers(const std::vector<ServerNode> &servers);
+
         static void ServerNodeWithId2ServerId(
                 const std::vector<ServerNodeWithId> &src,
                 std::vector<ServerId> *dst, const NamingServiceFilter *filter);
@@ -132,6 +159,8 @@ namespace melon {
         NamingService *_ns;
         std::string _protocol;
         std::string _service_name;
+        // Empty when -naming_service_cache_dir is not set.
+        std::string _cache_path;
         GetNamingServiceThreadOptions _options;
         std::vector<ServerNodeWithId> _last_sockets;
         Actions _actions;
@@ -34,6 +34,10 @@ namespace melon::raft {
         _peers.reserve(conf.size());
         for (Configuration::const_iterator
                      iter = conf.begin(); iter != conf.end(); ++iter) {
+            // Learners don't count toward the quorum.
+            if (iter->is_learner()) {
+                continue;
+            }
             _peers.push_back(*iter);
         }
         _quorum = _peers.size() / 2 + 1;
@@ -43,6 +47,9 @@ namespace melon::raft {
         _old_peers.reserve(old_conf->size());
         for (Configuration::const_iterator
                      iter = old_conf->begin(); iter != old_conf->end(); ++iter) {
+            if (iter->is_learner()) {
+                continue;
+            }
             _old_peers.push_back(*iter);
         }
         _old_quorum = _old_peers.size() / 2 + 1;
@@ -148,6 +148,26 @@ namespace melon::raft {
             return mutil::Status::OK();
         }
 
+        mutil::Status add_learner(const GroupId &group_id, const Configuration &conf,
+                                  const PeerId &peer_id, const CliOptions &options) {
+            PeerId learner = peer_id;
+            learner.role = LEARNER;
+            return add_peer(group_id, conf, learner, options);
+        }
+
+        mutil::Status remove_learner(const GroupId &group_id, const Configuration &conf,
+                                     const PeerId &peer_id, const CliOptions &options) {
+            return remove_peer(group_id, conf, peer_id, options);
+        }
+
+        mutil::Status promote_learner(const GroupId &group_id, const Configuration &conf,
+                                      const PeerId &peer_id, const CliOptions &options) {
+            // Adding an existing peer with another role changes its role.
+            PeerId voter = peer_id;
+            voter.role = REPLICA;
+            return add_peer(group_id, conf, voter, options);
+        }
+
         mutil::Status reset_peer(const GroupId &group_id, const PeerId &peer_id,
                                  const Configuration &new_conf,
                                  const CliOptions &options) {
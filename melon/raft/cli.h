@@ -41,6 +41,24 @@ namespace melon::raft {
         mutil::Status remove_peer(const GroupId &group_id, const Configuration &conf,
                                   const PeerId &peer_id, const CliOptions &options);
 
+        // Add a learner, which is replicated by the leader and serves follower
+        // reads but doesn't vote, into the replicating group which consists
+        // of |conf|.
+        // Returns OK on success, error information otherwise.
+        mutil::Status add_learner(const GroupId &group_id, const Configuration &conf,
+                                  const PeerId &peer_id, const CliOptions &options);
+
+        // Remove a learner from the replicating group which consists of |conf|.
+        // Returns OK on success, error information otherwise.
+        mutil::Status remove_learner(const GroupId &group_id, const Configuration &conf,
+                                     const PeerId &peer_id, const CliOptions &options);
+
+        // Turn a learner of the replicating group which consists of |conf| into
+        // a voter once it catches up with the leader.
+        // Returns OK on success, error information otherwise.
+        mutil::Status promote_learner(const GroupId &group_id, const Configuration &conf,
+                                      const PeerId &peer_id, const CliOptions &options);
+
     // Gracefully change the peers of the replication group.
         mutil::Status change_peers(const GroupId &group_id, const Configuration &conf,
                                    const Configuration &new_peers,
@@ -41,9 +41,12 @@ namespace melon::raft {
         bool already_exists = false;
         for (size_t i = 0; i < old_peers.size(); ++i) {
             response->add_old_peers(old_peers[i].to_string());
-            response->add_new_peers(old_peers[i].to_string());
             if (old_peers[i] == request->peer_id()) {
+                // The role of the peer may have been changed.
                 already_exists = true;
+                response->add_new_peers(request->peer_id());
+            } else {
+                response->add_new_peers(old_peers[i].to_string());
             }
         }
         if (!already_exists) {
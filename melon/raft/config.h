@@ -46,6 +46,51 @@ namespace melon::raft {
     // Default: false
     DECLARE_bool(raft_sync_segments);
 
+    // Compress data of log entries appended to segments with this
+    // melon::CompressType, only snappy(1) and gzip(2) are supported.
+    // UNSAFE until every node is upgraded: older versions ignore the
+    // compression in segment headers and read compressed entries as data,
+    // so the binary can't be downgraded once segments are compressed.
+    // Default: 0 (no compression)
+    DECLARE_int32(raft_log_compress_type);
+
+    // Data of log entries shorter than this value are not compressed
+    // Default: 256
+    DECLARE_int32(raft_log_compress_min_bytes);
+
+    // Preallocate segment files with fallocate and write them with O_DIRECT
+    // in whole blocks, so that fdatasync doesn't flush metadata of growing
+    // files and log writes don't pollute page cache. Each write ends with a
+    // padding record up to the next block, segments containing them can't be
+    // loaded by older versions.
+    // Default: false
+    DECLARE_bool(raft_segment_direct_io);
+
+    // Max number of files of removed segments kept for reuse when
+    // raft_segment_direct_io is enabled
+    // Default: 2
+    DECLARE_int32(raft_segment_recycle_num);
+
+    // Max bytes of log entries cached in memory by all the raft nodes of this
+    // process, logs already on disk of the least recently accessed nodes are
+    // evicted beyond it
+    // Default: 0 (no limit)
+    DECLARE_int64(raft_log_cache_max_bytes);
+
+    // Max size of one segment file of the shared wal
+    // Default: 64M
+    DECLARE_int32(raft_shared_wal_segment_size);
+
+    // Groups pinning the oldest segment are rewritten when the shared wal
+    // has more segments than this value
+    // Default: 8
+    DECLARE_int32(raft_shared_wal_max_segments);
+
+    // Max bytes of alive logs rewritten to remove the oldest segment of the
+    // shared wal
+    // Default: 4M
+    DECLARE_int32(raft_shared_wal_max_rewrite_bytes);
+
     // Max leader io batch
     // Default: 256
     DECLARE_int32(raft_leader_batch);
@@ -83,6 +128,22 @@ namespace melon::raft {
     // Default: false
     DECLARE_bool(raft_enable_witness_to_leader);
 
+    // send heartbeats of all the groups between two endpoints in one RPC
+    // Default: false
+    DECLARE_bool(raft_enable_coalesced_heartbeat);
+
+    // window in milliseconds to coalesce heartbeats
+    // Default: 10
+    DECLARE_int32(raft_coalesced_heartbeat_window_ms);
+
+    // stop heartbeating idle groups, requires coalesced heartbeat
+    // Default: false
+    DECLARE_bool(raft_quiesce_idle_groups);
+
+    // number of idle heartbeats before a group is quiesced
+    // Default: 3
+    DECLARE_int32(raft_quiesce_idle_heartbeats);
+
     // max number of tasks that can be written into db in a single batch
     // Default: 128
     DECLARE_int32(raft_meta_write_batch);
@@ -98,6 +159,16 @@ namespace melon::raft {
     // enable throttle when install snapshot, for both leader and follower
     // Default: true
     DECLARE_bool(raft_enable_throttle_when_install_snapshot);
+
+    // Split files added to snapshots into chunks of this many bytes and
+    // record their content hashes so that followers only copy the chunks
+    // they don't have, 0 to disable
+    // Default: 0
+    DECLARE_int32(raft_snapshot_chunk_size);
+
+    // Max number of chunks of a snapshot file copied at the same time
+    // Default: 4
+    DECLARE_int32(raft_snapshot_max_concurrent_chunk_copies);
     
     // The max number of entries in AppendEntriesRequest
     // Default: 1024
@@ -111,6 +182,18 @@ namespace melon::raft {
     // Default: 512K (1024 * 512)
     DECLARE_int32(raft_max_body_size);
 
+    // Compress data of entries in AppendEntriesRequest as a whole with this
+    // melon::CompressType, only snappy(1) and gzip(2) are supported. Entries
+    // are only compressed for followers whose last AppendEntriesResponse set
+    // accept_compress, so followers of older versions get raw entries.
+    // Default: 0 (no compression)
+    DECLARE_int32(raft_replication_compress_type);
+
+    // Data of entries in AppendEntriesRequest shorter than this value are
+    // not compressed
+    // Default: 4096
+    DECLARE_int32(raft_replication_compress_min_bytes);
+
     // Interval of retry to append entries or install snapshot
     // Default: 1000
     DECLARE_int32(raft_retry_replicate_interval_ms);
@@ -145,10 +228,16 @@ namespace melon::raft {
     DECLARE_bool(raft_create_parent_directories);
 
     // raft sync policy when raft_sync set to true, 0 mean sync immediately, 1
-    // mean sync by write bytes
+    // mean sync by write bytes, 2 mean adaptive group commit
     // Default: 0
     DECLARE_int32(raft_sync_policy);
 
+    // Target latency of syncing appended logs when raft_sync_policy is 2.
+    // Appends are held for at most the part of this value not spent on
+    // syncing, so that more entries are synced by one fsync under load.
+    // Default: 2000
+    DECLARE_int32(raft_sync_target_latency_us);
+
     // sync log meta, snapshot meta and raft meta
     // Default: false
     DECLARE_bool(raft_sync_meta);
@@ -37,6 +37,9 @@ namespace melon::raft {
     enum Role {
         REPLICA = 0,
         WITNESS = 1,
+        // Receives the replicated log but neither votes nor counts toward
+        // any quorum, used as a read replica.
+        LEARNER = 2,
     };
 
 // Represent a participant in a replicating group.
@@ -76,6 +79,10 @@ namespace melon::raft {
             return role == WITNESS;
         }
 
+        bool is_learner() const {
+            return role == LEARNER;
+        }
+
         int parse(const std::string &str) {
             reset();
             char ip_str[64];
@@ -85,7 +92,7 @@ namespace melon::raft {
                 return -1;
             }
             role = (Role) value;
-            if (role > WITNESS) {
+            if (role > LEARNER) {
                 reset();
                 return -1;
             }
@@ -220,6 +227,25 @@ namespace melon::raft {
             }
         }
 
+        // Clear the container and put the peers which are not learners in.
+        void list_voters(std::vector<PeerId> *peers) const {
+            peers->clear();
+            for (const_iterator it = _peers.begin(); it != _peers.end(); ++it) {
+                if (!it->is_learner()) {
+                    peers->push_back(*it);
+                }
+            }
+        }
+
+        // Number of the peers which are not learners.
+        size_t voter_count() const {
+            size_t n = 0;
+            for (const_iterator it = _peers.begin(); it != _peers.end(); ++it) {
+                n += !it->is_learner();
+            }
+            return n;
+        }
+
         void append_peers(std::set<PeerId> *peers) {
             peers->insert(_peers.begin(), _peers.end());
         }
@@ -241,6 +267,18 @@ namespace melon::raft {
             return _peers.find(peer_id) != _peers.end();
         }
 
+        // True if the peer exists as a learner.
+        bool is_learner(const PeerId &peer_id) const {
+            const_iterator it = _peers.find(peer_id);
+            return it != _peers.end() && it->is_learner();
+        }
+
+        // True if the peer exists and is not a learner.
+        bool is_voter(const PeerId &peer_id) const {
+            const_iterator it = _peers.find(peer_id);
+            return it != _peers.end() && !it->is_learner();
+        }
+
         // True if ALL peers exist.
         bool contains(const std::vector<PeerId> &peers) const {
             for (size_t i = 0; i < peers.size(); i++) {
@@ -251,11 +289,12 @@ namespace melon::raft {
             return true;
         }
 
-        // True if peers are same.
+        // True if peers and their roles are same.
         bool equals(const std::vector<PeerId> &peers) const {
             std::set<PeerId> peer_set;
             for (size_t i = 0; i < peers.size(); i++) {
-                if (_peers.find(peers[i]) == _peers.end()) {
+                const_iterator it = _peers.find(peers[i]);
+                if (it == _peers.end() || it->role != peers[i].role) {
                     return false;
                 }
                 peer_set.insert(peers[i]);
@@ -270,7 +309,8 @@ namespace melon::raft {
             // The cost of the following routine is O(nlogn), which is not the best
             // approach.
             for (const_iterator iter = begin(); iter != end(); ++iter) {
-                if (!rhs.contains(*iter)) {
+                const_iterator it = rhs._peers.find(*iter);
+                if (it == rhs._peers.end() || it->role != iter->role) {
                     return false;
                 }
             }
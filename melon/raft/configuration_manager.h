@@ -50,6 +50,9 @@ namespace melon::raft {
         }
 
         bool contains(const PeerId &peer) const { return conf.contains(peer) || old_conf.contains(peer); }
+
+        // True if the peer votes in either configuration.
+        bool is_voter(const PeerId &peer) const { return conf.is_voter(peer) || old_conf.is_voter(peer); }
     };
 
 // Manager the history of configuration changing
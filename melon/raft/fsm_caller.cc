@@ -41,7 +41,8 @@ namespace melon::raft {
 
     FSMCaller::FSMCaller()
             : _log_manager(nullptr), _fsm(nullptr), _closure_queue(nullptr), _last_applied_index(0), _last_applied_term(0),
-              _after_shutdown(nullptr), _node(nullptr), _cur_task(IDLE), _applying_index(0), _queue_started(false) {
+              _after_shutdown(nullptr), _node(nullptr), _cur_task(IDLE), _applying_index(0), _queue_started(false),
+              _usercode_in_pthread(false), _apply_concurrency(1) {
     }
 
     FSMCaller::~FSMCaller() {
@@ -116,6 +117,10 @@ namespace melon::raft {
                         caller->_cur_task = ERROR;
                         caller->do_on_error((OnErrorClousre *) iter->done);
                         break;
+                    case WAIT_APPLIED:
+                        caller->do_wait_applied(*(iter->applied_waiter));
+                        delete iter->applied_waiter;
+                        break;
                     case IDLE:
                         CHECK(false) << "Can't reach here";
                         break;
@@ -156,6 +161,8 @@ namespace melon::raft {
         _closure_queue = options.closure_queue;
         _after_shutdown = options.after_shutdown;
         _node = options.node;
+        _usercode_in_pthread = options.usercode_in_pthread;
+        _apply_concurrency = std::max(options.apply_concurrency, 1);
         _last_applied_index.store(options.bootstrap_id.index,
                                   mutil::memory_order_relaxed);
         _last_applied_term = options.bootstrap_id.term;
@@ -186,6 +193,7 @@ namespace melon::raft {
     }
 
     void FSMCaller::do_shutdown() {
+        clear_applied_waiters(EPERM, "FSMCaller is shut down");
         if (_node) {
             _node->Release();
             _node = nullptr;
@@ -248,6 +256,7 @@ namespace melon::raft {
             return;
         }
         _error = e;
+        clear_applied_waiters(EINVAL, "FSMCaller is in bad status");
         if (_fsm) {
             _fsm->on_error(_error);
         }
@@ -274,44 +283,234 @@ namespace melon::raft {
 
         IteratorImpl iter_impl(_fsm, _log_manager, &closure, first_closure_index,
                                last_applied_index, committed_index, &_applying_index);
-        for (; iter_impl.is_good();) {
-            if (iter_impl.entry()->type != ENTRY_TYPE_DATA) {
-                if (iter_impl.entry()->type == ENTRY_TYPE_CONFIGURATION) {
-                    if (iter_impl.entry()->old_peers == nullptr) {
-                        // Joint stage is not supposed to be noticeable by end users.
-                        _fsm->on_configuration_committed(
-                                Configuration(*iter_impl.entry()->peers),
-                                iter_impl.entry()->id.index);
+        int64_t last_index = 0;
+        if (_apply_concurrency > 1) {
+            last_index = apply_partitioned(&iter_impl);
+        } else {
+            for (; iter_impl.is_good();) {
+                if (iter_impl.entry()->type != ENTRY_TYPE_DATA) {
+                    if (iter_impl.entry()->type == ENTRY_TYPE_CONFIGURATION) {
+                        if (iter_impl.entry()->old_peers == nullptr) {
+                            // Joint stage is not supposed to be noticeable by end users.
+                            _fsm->on_configuration_committed(
+                                    Configuration(*iter_impl.entry()->peers),
+                                    iter_impl.entry()->id.index);
+                        }
                     }
+                    // For other entries, we have nothing to do besides flush the
+                    // pending tasks and run this closure to notify the caller that the
+                    // entries before this one were successfully committed and applied.
+                    if (iter_impl.done()) {
+                        iter_impl.done()->Run();
+                    }
+                    iter_impl.next();
+                    continue;
                 }
-                // For other entries, we have nothing to do besides flush the
-                // pending tasks and run this closure to notify the caller that the
-                // entries before this one were successfully committed and applied.
-                if (iter_impl.done()) {
-                    iter_impl.done()->Run();
+                Iterator iter(&iter_impl);
+                _fsm->on_apply(iter);
+                LOG_IF(ERROR, iter.valid())
+                << "Node " << _node->node_id()
+                << " Iterator is still valid, did you return before iterator "
+                   " reached the end?";
+                // Try move to next in case that we pass the same log twice.
+                iter.next();
+            }
+            if (iter_impl.has_error()) {
+                set_error(iter_impl.error());
+                iter_impl.run_the_rest_closure_with_error();
+            }
+            last_index = iter_impl.index() - 1;
+        }
+        const int64_t last_term = _log_manager->get_term(last_index);
+        LogId last_applied_id(last_index, last_term);
+        _last_applied_index.store(committed_index, mutil::memory_order_release);
+        _last_applied_term = last_term;
+        _log_manager->set_applied_id(last_applied_id);
+        notify_applied_waiters();
+    }
+
+    int64_t FSMCaller::apply_partitioned(IteratorImpl *iter_impl) {
+        std::vector<ApplyLane> lanes(_apply_concurrency);
+        for (size_t i = 0; i < lanes.size(); ++i) {
+            lanes[i].caller = this;
+        }
+        size_t npending = 0;
+        ApplyLane *failed = NULL;
+        while (iter_impl->is_good()) {
+            LogEntry *entry = iter_impl->entry();
+            uint64_t key = 0;
+            if (entry->type == ENTRY_TYPE_DATA && _fsm->get_apply_key(entry->data, &key)) {
+                // Tasks with the same key go to the same lane and are applied
+                // in order
+                ApplyLane &lane = lanes[key % lanes.size()];
+                entry->AddRef();
+                lane.entries.push_back(entry);
+                lane.dones.push_back(iter_impl->done());
+                ++npending;
+                iter_impl->next();
+                continue;
+            }
+            // Everything before a barrier must be applied before it
+            if (npending != 0) {
+                npending = 0;
+                if (!run_apply_lanes(&lanes, &failed)) {
+                    break;
+                }
+            }
+            if (entry->type == ENTRY_TYPE_DATA) {
+                // Task conflicting with all the others, apply it alone
+                std::vector<ApplyLane> barrier(1);
+                barrier[0].caller = this;
+                entry->AddRef();
+                barrier[0].entries.push_back(entry);
+                barrier[0].dones.push_back(iter_impl->done());
+                iter_impl->next();
+                if (!run_apply_lanes(&barrier, &failed)) {
+                    // |failed| points into |barrier|, take the error out
+                    lanes[0].error = failed->error;
+                    lanes[0].failed_index = failed->failed_index;
+                    failed = &lanes[0];
+                    break;
                 }
-                iter_impl.next();
                 continue;
             }
+            if (entry->type == ENTRY_TYPE_CONFIGURATION && entry->old_peers == nullptr) {
+                _fsm->on_configuration_committed(Configuration(*entry->peers),
+                                                 entry->id.index);
+            }
+            if (iter_impl->done()) {
+                iter_impl->done()->Run();
+            }
+            iter_impl->next();
+        }
+        if (npending != 0 && failed == NULL) {
+            run_apply_lanes(&lanes, &failed);
+        }
+        if (failed != NULL) {
+            set_error(failed->error);
+            iter_impl->run_the_rest_closure_with_error();
+            return failed->failed_index - 1;
+        }
+        if (iter_impl->has_error()) {
+            set_error(iter_impl->error());
+            iter_impl->run_the_rest_closure_with_error();
+        }
+        return iter_impl->index() - 1;
+    }
+
+    bool FSMCaller::run_apply_lanes(std::vector<ApplyLane> *lanes, ApplyLane **failed) {
+        std::vector<fiber_t> tids;
+        ApplyLane *inplace = NULL;
+        for (size_t i = 0; i < lanes->size(); ++i) {
+            ApplyLane *lane = &(*lanes)[i];
+            if (lane->entries.empty()) {
+                continue;
+            }
+            if (inplace == NULL) {
+                // Apply one of the lanes in this fiber
+                inplace = lane;
+                continue;
+            }
+            fiber_t tid;
+            const fiber_attr_t attr = _usercode_in_pthread ? FIBER_ATTR_PTHREAD
+                                                          : FIBER_ATTR_NORMAL;
+            if (fiber_start_background(&tid, &attr, run_apply_lane, lane) != 0) {
+                PLOG(ERROR) << "Fail to start fiber";
+                run_apply_lane(lane);
+                continue;
+            }
+            tids.push_back(tid);
+        }
+        if (inplace != NULL) {
+            run_apply_lane(inplace);
+        }
+        for (size_t i = 0; i < tids.size(); ++i) {
+            fiber_join(tids[i], NULL);
+        }
+        *failed = NULL;
+        for (size_t i = 0; i < lanes->size(); ++i) {
+            ApplyLane *lane = &(*lanes)[i];
+            for (size_t j = 0; j < lane->entries.size(); ++j) {
+                lane->entries[j]->Release();
+            }
+            lane->entries.clear();
+            lane->dones.clear();
+            if (lane->error.type() != ERROR_TYPE_NONE &&
+                (*failed == NULL || lane->failed_index < (*failed)->failed_index)) {
+                *failed = lane;
+            }
+        }
+        return *failed == NULL;
+    }
+
+    void *FSMCaller::run_apply_lane(void *arg) {
+        ApplyLane *lane = (ApplyLane *) arg;
+        StateMachine *fsm = lane->caller->_fsm;
+        IteratorImpl iter_impl(fsm, lane);
+        while (iter_impl.is_good()) {
             Iterator iter(&iter_impl);
-            _fsm->on_apply(iter);
+            fsm->on_apply(iter);
             LOG_IF(ERROR, iter.valid())
-            << "Node " << _node->node_id()
+            << "Node " << lane->caller->_node->node_id()
             << " Iterator is still valid, did you return before iterator "
                " reached the end?";
-            // Try move to next in case that we pass the same log twice.
             iter.next();
         }
         if (iter_impl.has_error()) {
-            set_error(iter_impl.error());
+            lane->error = iter_impl.error();
+            lane->failed_index = iter_impl.index();
             iter_impl.run_the_rest_closure_with_error();
         }
-        const int64_t last_index = iter_impl.index() - 1;
-        const int64_t last_term = _log_manager->get_term(last_index);
-        LogId last_applied_id(last_index, last_term);
-        _last_applied_index.store(committed_index, mutil::memory_order_release);
-        _last_applied_term = last_term;
-        _log_manager->set_applied_id(last_applied_id);
+        return NULL;
+    }
+
+    int FSMCaller::wait_applied(int64_t index, Closure *done) {
+        if (_last_applied_index.load(mutil::memory_order_acquire) >= index) {
+            run_closure_in_fiber(done);
+            return 0;
+        }
+        AppliedWaiter *waiter = new AppliedWaiter;
+        waiter->index = index;
+        waiter->done = done;
+        ApplyTask t;
+        t.type = WAIT_APPLIED;
+        t.applied_waiter = waiter;
+        if (fiber::execution_queue_execute(_queue_id, t) != 0) {
+            delete waiter;
+            done->status().set_error(EPERM, "FSMCaller is shut down");
+            run_closure_in_fiber(done);
+            return -1;
+        }
+        return 0;
+    }
+
+    void FSMCaller::do_wait_applied(const AppliedWaiter &waiter) {
+        if (!_error.status().ok()) {
+            waiter.done->status().set_error(EINVAL, "FSMCaller is in bad status");
+            run_closure_in_fiber(waiter.done);
+            return;
+        }
+        _applied_waiters.insert(std::make_pair(waiter.index, waiter.done));
+        notify_applied_waiters();
+    }
+
+    void FSMCaller::notify_applied_waiters() {
+        const int64_t last_applied_index =
+                _last_applied_index.load(mutil::memory_order_relaxed);
+        while (!_applied_waiters.empty() &&
+               _applied_waiters.begin()->first <= last_applied_index) {
+            run_closure_in_fiber(_applied_waiters.begin()->second);
+            _applied_waiters.erase(_applied_waiters.begin());
+        }
+    }
+
+    void FSMCaller::clear_applied_waiters(int error_code, const char *reason) {
+        for (std::multimap<int64_t, Closure *>::iterator
+                     it = _applied_waiters.begin(); it != _applied_waiters.end(); ++it) {
+            it->second->status().set_error(error_code, "%s", reason);
+            run_closure_in_fiber(it->second);
+        }
+        _applied_waiters.clear();
     }
 
     int FSMCaller::on_snapshot_save(SaveSnapshotClosure *done) {
@@ -421,6 +620,7 @@ namespace melon::raft {
         _last_applied_index.store(meta.last_included_index(),
                                   mutil::memory_order_release);
         _last_applied_term = meta.last_included_term();
+        notify_applied_waiters();
         done->Run();
     }
 
@@ -528,6 +728,9 @@ namespace melon::raft {
             case STOP_FOLLOWING:
                 os << "Notifying stop following";
                 break;
+            case WAIT_APPLIED:
+                os << "Waiting for applied index";
+                break;
         }
         os << newline;
     }
@@ -556,9 +759,33 @@ namespace melon::raft {
                                mutil::atomic<int64_t> *applying_index)
             : _sm(sm), _lm(lm), _closure(closure), _first_closure_index(first_closure_index),
               _cur_index(last_applied_index), _committed_index(committed_index), _cur_entry(nullptr),
-              _applying_index(applying_index) { next(); }
+              _applying_index(applying_index), _lane(nullptr), _lane_pos(0) { next(); }
+
+    IteratorImpl::IteratorImpl(StateMachine *sm, ApplyLane *lane)
+            : _sm(sm), _lm(nullptr), _closure(nullptr), _first_closure_index(0),
+              _cur_index(0), _committed_index(0), _cur_entry(nullptr),
+              _applying_index(nullptr), _lane(lane), _lane_pos(0) {
+        if (!_lane->entries.empty()) {
+            _cur_entry = _lane->entries[0];
+            _cur_index = _cur_entry->id.index;
+        }
+    }
 
     void IteratorImpl::next() {
+        if (_lane) {
+            // Entries are owned by the lane
+            if (_lane_pos < _lane->entries.size()) {
+                ++_lane_pos;
+                ++_cur_index;
+            }
+            if (_lane_pos < _lane->entries.size()) {
+                _cur_entry = _lane->entries[_lane_pos];
+                _cur_index = _cur_entry->id.index;
+            } else {
+                _cur_entry = nullptr;
+            }
+            return;
+        }
         if (_cur_entry) {
             _cur_entry->Release();
             _cur_entry = nullptr;
@@ -580,6 +807,9 @@ namespace melon::raft {
     }
 
     Closure *IteratorImpl::done() const {
+        if (_lane) {
+            return _lane_pos < _lane->dones.size() ? _lane->dones[_lane_pos] : nullptr;
+        }
         if (_cur_index < _first_closure_index) {
             return nullptr;
         }
@@ -592,6 +822,21 @@ namespace melon::raft {
             CHECK(false) << "Invalid ntail=" << ntail;
             return;
         }
+        if (_lane) {
+            // Only tasks of this lane can be rolled back
+            const size_t n = std::min(ntail - (_cur_entry ? 1 : 0), _lane_pos);
+            _lane_pos -= n;
+            _cur_entry = nullptr;
+            if (_lane_pos < _lane->entries.size()) {
+                _cur_index = _lane->entries[_lane_pos]->id.index;
+            }
+            _error.set_type(ERROR_TYPE_STATE_MACHINE);
+            _error.status().set_error(ESTATEMACHINE,
+                                      "StateMachine meet critical error when applying one "
+                                      " or more tasks since index=%" PRId64 ", %s", _cur_index,
+                                      (st ? st->error_cstr() : "none"));
+            return;
+        }
         if (_cur_entry == nullptr || _cur_entry->type != ENTRY_TYPE_DATA) {
             _cur_index -= ntail;
         } else {
@@ -609,6 +854,16 @@ namespace melon::raft {
     }
 
     void IteratorImpl::run_the_rest_closure_with_error() {
+        if (_lane) {
+            for (size_t i = _lane_pos; i < _lane->dones.size(); ++i) {
+                Closure *done = _lane->dones[i];
+                if (done) {
+                    done->status() = _error.status();
+                    run_closure_in_fiber(done);
+                }
+            }
+            return;
+        }
         for (int64_t i = std::max(_cur_index, _first_closure_index);
              i <= _committed_index; ++i) {
             Closure *done = (*_closure)[i - _first_closure_index];
@@ -19,6 +19,7 @@
 
 #pragma once
 
+#include <map>
 #include <melon/utility/macros.h>                        // MELON_CACHELINE_ALIGNMENT
 #include <melon/fiber/fiber.h>
 #include <melon/fiber/execution_queue.h>
@@ -44,6 +45,21 @@ namespace melon::raft {
 
     class LeaderChangeContext;
 
+    class FSMCaller;
+
+    // Data tasks applied by one fiber in partitioned apply, see
+    // NodeOptions::apply_concurrency
+    struct ApplyLane {
+        ApplyLane() : caller(NULL), failed_index(0) {}
+
+        FSMCaller *caller;
+        std::vector<LogEntry *> entries;
+        std::vector<Closure *> dones;
+        // Set if the state machine failed at |failed_index|
+        Error error;
+        int64_t failed_index;
+    };
+
 // Backing implementation of Iterator
     class IteratorImpl {
         DISALLOW_COPY_AND_ASSIGN(IteratorImpl);
@@ -54,7 +70,12 @@ namespace melon::raft {
 
         LogEntry *entry() const { return _cur_entry; }
 
-        bool is_good() const { return _cur_index <= _committed_index && !has_error(); }
+        bool is_good() const {
+            if (_lane) {
+                return _lane_pos < _lane->entries.size() && !has_error();
+            }
+            return _cur_index <= _committed_index && !has_error();
+        }
 
         Closure *done() const;
 
@@ -76,6 +97,9 @@ namespace melon::raft {
                      int64_t committed_index,
                      mutil::atomic<int64_t> *applying_index);
 
+        // Iterate the tasks of |lane|
+        IteratorImpl(StateMachine *sm, ApplyLane *lane);
+
         ~IteratorImpl() {}
 
         friend class FSMCaller;
@@ -89,12 +113,14 @@ namespace melon::raft {
         LogEntry *_cur_entry;
         mutil::atomic<int64_t> *_applying_index;
         Error _error;
+        ApplyLane *_lane;
+        size_t _lane_pos;
     };
 
     struct FSMCallerOptions {
         FSMCallerOptions()
                 : log_manager(NULL), fsm(NULL), after_shutdown(NULL), closure_queue(NULL), node(NULL),
-                  usercode_in_pthread(false), bootstrap_id() {}
+                  usercode_in_pthread(false), apply_concurrency(1), bootstrap_id() {}
 
         LogManager *log_manager;
         StateMachine *fsm;
@@ -102,6 +128,7 @@ namespace melon::raft {
         ClosureQueue *closure_queue;
         NodeImpl *node;
         bool usercode_in_pthread;
+        int apply_concurrency;
         LogId bootstrap_id;
     };
 
@@ -143,6 +170,11 @@ namespace melon::raft {
 
         BRAFT_MOCK int on_error(const Error &e);
 
+        // Run |done| in a new fiber once the state machine has applied the log
+        // at |index|, or with an error if the state machine stops or goes wrong
+        // before that.
+        int wait_applied(int64_t index, Closure *done);
+
         int64_t last_applied_index() const {
             return _last_applied_index.load(mutil::memory_order_relaxed);
         }
@@ -167,6 +199,7 @@ namespace melon::raft {
             START_FOLLOWING,
             STOP_FOLLOWING,
             ERROR,
+            WAIT_APPLIED,
         };
 
         struct LeaderStartContext {
@@ -177,6 +210,11 @@ namespace melon::raft {
             int64_t lease_epoch;
         };
 
+        struct AppliedWaiter {
+            int64_t index;
+            Closure *done;
+        };
+
         struct ApplyTask {
             TaskType type;
             union {
@@ -192,6 +230,9 @@ namespace melon::raft {
                 // For on_start_following and on_stop_following
                 LeaderChangeContext *leader_change_context;
 
+                // For wait_applied
+                AppliedWaiter *applied_waiter;
+
                 // For other operation
                 Closure *done;
             };
@@ -220,10 +261,29 @@ namespace melon::raft {
 
         void do_stop_following(const LeaderChangeContext &stop_following_context);
 
+        void do_wait_applied(const AppliedWaiter &waiter);
+
+        // Run waiters whose index has been applied.
+        void notify_applied_waiters();
+
+        // Fail all waiters with |error_code|.
+        void clear_applied_waiters(int error_code, const char *reason);
+
         void set_error(const Error &e);
 
         bool pass_by_status(Closure *done);
 
+        // Apply tasks of |iter_impl| concurrently by their keys, returns the
+        // index of the last applied task.
+        int64_t apply_partitioned(IteratorImpl *iter_impl);
+
+        // Run the non-empty lanes concurrently and wait until all of them
+        // finish. Returns false if any of them failed, with |failed| set to
+        // the one failed at the smallest index.
+        bool run_apply_lanes(std::vector<ApplyLane> *lanes, ApplyLane **failed);
+
+        static void *run_apply_lane(void *arg);
+
         fiber::ExecutionQueueId<ApplyTask> _queue_id;
         LogManager *_log_manager;
         StateMachine *_fsm;
@@ -236,6 +296,10 @@ namespace melon::raft {
         mutil::atomic<int64_t> _applying_index;
         Error _error;
         bool _queue_started;
+        bool _usercode_in_pthread;
+        int _apply_concurrency;
+        // Only accessed inside _queue_id.
+        std::multimap<int64_t, Closure *> _applied_waiters;
     };
 
 };
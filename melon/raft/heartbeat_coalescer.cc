@@ -0,0 +1,234 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#include <algorithm>
+#include <gflags/gflags.h>
+#include <melon/utility/time.h>
+#include <melon/fiber/fiber.h>
+#include <melon/fiber/unstable.h>
+#include <melon/rpc/controller.h>
+#include <melon/rpc/reloadable_flags.h>
+#include <melon/raft/heartbeat_coalescer.h>
+#include <melon/raft/util.h>
+#include <melon/raft/config.h>
+
+namespace melon::raft {
+
+    DEFINE_bool(raft_enable_coalesced_heartbeat, false,
+                "Send heartbeats of all the groups between two endpoints in "
+                "one RPC, all peers must support the coalesced_heartbeat RPC");
+    MELON_VALIDATE_GFLAG(raft_enable_coalesced_heartbeat, ::melon::PassValidate);
+
+    DEFINE_int32(raft_coalesced_heartbeat_window_ms, 10,
+                 "Heartbeats queued within so many milliseconds are sent in "
+                 "one coalesced RPC");
+    MELON_VALIDATE_GFLAG(raft_coalesced_heartbeat_window_ms,
+                        ::melon::NonNegativeInteger);
+
+    DEFINE_bool(raft_quiesce_idle_groups, false,
+                "Stop heartbeating idle groups whose followers are up to date, "
+                "only works with raft_enable_coalesced_heartbeat");
+    MELON_VALIDATE_GFLAG(raft_quiesce_idle_groups, ::melon::PassValidate);
+
+    DEFINE_int32(raft_quiesce_idle_heartbeats, 3,
+                 "A group is quiesced after so many heartbeats without "
+                 "anything to replicate");
+    MELON_VALIDATE_GFLAG(raft_quiesce_idle_heartbeats, ::melon::PositiveInteger);
+
+    static melon::var::Adder<int64_t> g_coalesced_heartbeat_rpc(
+            "raft_coalesced_heartbeat_rpc_count");
+    static melon::var::Adder<int64_t> g_coalesced_heartbeat(
+            "raft_coalesced_heartbeat_count");
+
+    // The coalesced RPC in flight, which dispatches the responses to the
+    // heartbeats it carries.
+    class HeartbeatCoalescer::CoalescedCall : public google::protobuf::Closure {
+    public:
+        // Called with link->mutex held
+        CoalescedCall(Link *link, std::vector<PendingHeartbeat> *heartbeats,
+                      std::map<GroupKey, QuiescedGroup> *quiesced)
+                : _link(link), _send_time_ms(mutil::monotonic_time_ms()) {
+            _heartbeats.swap(*heartbeats);
+            request.set_server_addr(mutil::endpoint2str(link->from).c_str());
+            for (size_t i = 0; i < _heartbeats.size(); ++i) {
+                *request.add_heartbeats() = *_heartbeats[i].request;
+            }
+            for (std::map<GroupKey, QuiescedGroup>::const_iterator
+                         iter = quiesced->begin(); iter != quiesced->end(); ++iter) {
+                _groups.push_back(iter->first);
+                *request.add_quiesced_groups() = iter->second;
+            }
+            quiesced->clear();
+        }
+
+        void Run() {
+            if (!cntl.Failed()) {
+                if (response.responses_size() != (int) _heartbeats.size()) {
+                    cntl.SetFailed(melon::ERESPONSE, "Unmatched number of "
+                                   "heartbeat responses, %d != %d",
+                                   response.responses_size(),
+                                   (int) _heartbeats.size());
+                } else {
+                    MELON_SCOPED_LOCK(_link->mutex);
+                    for (size_t i = 0; i < _groups.size() &&
+                                       i < (size_t) response.quiesced_acks_size(); ++i) {
+                        if (!response.quiesced_acks(i)) {
+                            continue;
+                        }
+                        // Concurrent calls of the same link may finish out
+                        // of order
+                        int64_t &ack_ms = _link->ack_ms[_groups[i]];
+                        ack_ms = std::max(ack_ms, _send_time_ms);
+                    }
+                }
+            }
+            for (size_t i = 0; i < _heartbeats.size(); ++i) {
+                PendingHeartbeat &hb = _heartbeats[i];
+                if (cntl.Failed()) {
+                    hb.cntl->SetFailed(cntl.ErrorCode(), "%s",
+                                       cntl.ErrorText().c_str());
+                } else if (i < (size_t) response.error_codes_size() &&
+                           response.error_codes(i) != 0) {
+                    hb.cntl->SetFailed(response.error_codes(i),
+                                       "Fail to handle coalesced heartbeat");
+                } else {
+                    hb.response->Swap(response.mutable_responses(i));
+                }
+                hb.done->Run();
+            }
+            delete this;
+        }
+
+        melon::Controller cntl;
+        CoalescedHeartbeatRequest request;
+        CoalescedHeartbeatResponse response;
+
+    private:
+        Link *_link;
+        std::vector<PendingHeartbeat> _heartbeats;
+        std::vector<GroupKey> _groups;
+        int64_t _send_time_ms;
+    };
+
+    HeartbeatCoalescer::Link *HeartbeatCoalescer::get_link(
+            const mutil::EndPoint &from, const mutil::EndPoint &to) {
+        MELON_SCOPED_LOCK(_mutex);
+        Link *&link = _links[std::make_pair(from, to)];
+        if (link == NULL) {
+            link = new Link;
+            link->from = from;
+            link->to = to;
+            melon::ChannelOptions options;
+            options.connection_type = melon::CONNECTION_TYPE_SINGLE;
+            options.max_retry = 0;
+            options.connect_timeout_ms = FLAGS_raft_rpc_channel_connect_timeout_ms;
+            options.timeout_ms = -1;
+            if (link->channel.Init(to, &options) != 0) {
+                // RPCs fail with EINVAL through a channel failed to init
+                LOG(ERROR) << "Fail to init channel to " << to;
+            }
+        }
+        return link;
+    }
+
+    void HeartbeatCoalescer::send(const mutil::EndPoint &from,
+                                  const mutil::EndPoint &to,
+                                  melon::Controller *cntl,
+                                  const AppendEntriesRequest *request,
+                                  AppendEntriesResponse *response,
+                                  google::protobuf::Closure *done) {
+        Link *link = get_link(from, to);
+        PendingHeartbeat hb = {cntl, request, response, done};
+        MELON_SCOPED_LOCK(link->mutex);
+        link->pending.push_back(hb);
+        schedule_flush(link, cntl->timeout_ms());
+    }
+
+    int64_t HeartbeatCoalescer::keepalive(const mutil::EndPoint &from,
+                                          const mutil::EndPoint &to,
+                                          const QuiescedGroup &group,
+                                          int64_t timeout_ms) {
+        Link *link = get_link(from, to);
+        const GroupKey key(group.group_id(), group.peer_id());
+        MELON_SCOPED_LOCK(link->mutex);
+        link->quiesced[key] = group;
+        schedule_flush(link, timeout_ms);
+        std::map<GroupKey, int64_t>::const_iterator
+                iter = link->ack_ms.find(key);
+        return iter != link->ack_ms.end() ? iter->second : 0;
+    }
+
+    void HeartbeatCoalescer::forget(const mutil::EndPoint &from,
+                                    const mutil::EndPoint &to,
+                                    const QuiescedGroup &group) {
+        Link *link = get_link(from, to);
+        const GroupKey key(group.group_id(), group.peer_id());
+        MELON_SCOPED_LOCK(link->mutex);
+        link->quiesced.erase(key);
+        link->ack_ms.erase(key);
+    }
+
+    void HeartbeatCoalescer::schedule_flush(Link *link, int64_t timeout_ms) {
+        if (timeout_ms > 0 &&
+            (link->timeout_ms <= 0 || timeout_ms < link->timeout_ms)) {
+            link->timeout_ms = timeout_ms;
+        }
+        if (link->flush_scheduled) {
+            return;
+        }
+        link->flush_scheduled = true;
+        fiber_timer_t timer;
+        if (fiber_timer_add(&timer,
+                            mutil::milliseconds_from_now(
+                                    FLAGS_raft_coalesced_heartbeat_window_ms),
+                            on_flush_timer, link) != 0) {
+            on_flush_timer(link);
+        }
+    }
+
+    void HeartbeatCoalescer::on_flush_timer(void *arg) {
+        // Don't send RPC in the TimerThread
+        fiber_t tid;
+        if (fiber_start_background(&tid, NULL, flush, arg) != 0) {
+            PLOG(ERROR) << "Fail to start fiber";
+            flush(arg);
+        }
+    }
+
+    void *HeartbeatCoalescer::flush(void *arg) {
+        Link *link = (Link *) arg;
+        std::unique_lock<raft_mutex_t> lck(link->mutex);
+        CoalescedCall *call = new CoalescedCall(link, &link->pending,
+                                                &link->quiesced);
+        const int64_t timeout_ms = link->timeout_ms;
+        link->timeout_ms = -1;
+        link->flush_scheduled = false;
+        lck.unlock();
+
+        if (timeout_ms > 0) {
+            call->cntl.set_timeout_ms(timeout_ms);
+        }
+        g_coalesced_heartbeat_rpc << 1;
+        g_coalesced_heartbeat << call->request.heartbeats_size();
+        RaftService_Stub stub(&link->channel);
+        stub.coalesced_heartbeat(&call->cntl, &call->request, &call->response, call);
+        return NULL;
+    }
+
+}  //  namespace melon::raft
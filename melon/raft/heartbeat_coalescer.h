@@ -0,0 +1,125 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <melon/utility/endpoint.h>
+#include <melon/utility/atomicops.h>
+#include <melon/utility/memory/singleton.h>
+#include <melon/rpc/channel.h>
+#include <melon/raft/macros.h>
+#include <melon/proto/raft/raft.pb.h>
+
+namespace melon::raft {
+
+    // Coalesces heartbeats of all the raft groups sent from one endpoint to
+    // another into a single coalesced_heartbeat RPC per
+    // raft_coalesced_heartbeat_window_ms, so that the number of heartbeat RPCs
+    // scales with the number of host pairs rather than the number of groups.
+    //
+    // Leaders of quiesced groups don't send heartbeats but list the groups in
+    // the coalesced RPC every heartbeat interval, which renews the leases of
+    // the quiesced followers. A leader that stops is no longer listed, so its
+    // followers elect a new one even if its host keeps sending coalesced RPCs.
+    class HeartbeatCoalescer {
+    public:
+        static HeartbeatCoalescer *GetInstance() {
+            return Singleton<HeartbeatCoalescer>::get();
+        }
+
+        // Queue the heartbeat from |from| to |to|. |done| is called when the
+        // coalesced RPC finishes, with |cntl| failed or |response| filled, just
+        // like calling RaftService_Stub::append_entries with these arguments.
+        // The timeout of the coalesced RPC is the minimum of all the queued
+        // heartbeats.
+        void send(const mutil::EndPoint &from, const mutil::EndPoint &to,
+                  melon::Controller *cntl, const AppendEntriesRequest *request,
+                  AppendEntriesResponse *response,
+                  google::protobuf::Closure *done);
+
+        // List |group| in the coalesced RPC sent from |from| to |to| in the
+        // current window, which is called by quiesced replicators every
+        // heartbeat interval.
+        // Returns the monotonic time in milliseconds when the latest coalesced
+        // RPC acknowledged by the follower of |group| was sent, 0 if none.
+        int64_t keepalive(const mutil::EndPoint &from, const mutil::EndPoint &to,
+                          const QuiescedGroup &group, int64_t timeout_ms);
+
+        // Forget the acknowledgements of |group|, called when the replicator
+        // of |group| stops.
+        void forget(const mutil::EndPoint &from, const mutil::EndPoint &to,
+                    const QuiescedGroup &group);
+
+    private:
+        friend struct DefaultSingletonTraits<HeartbeatCoalescer>;
+
+        struct PendingHeartbeat {
+            melon::Controller *cntl;
+            const AppendEntriesRequest *request;
+            AppendEntriesResponse *response;
+            google::protobuf::Closure *done;
+        };
+
+        // (group_id, peer_id) of a quiesced group
+        typedef std::pair<std::string, std::string> GroupKey;
+
+        // All the heartbeats from one endpoint to another. Links are never
+        // destroyed as there are only as many of them as host pairs.
+        struct Link {
+            Link() : flush_scheduled(false), timeout_ms(-1) {}
+
+            raft_mutex_t mutex;
+            mutil::EndPoint from;
+            mutil::EndPoint to;
+            melon::Channel channel;
+            std::vector<PendingHeartbeat> pending;
+            std::map<GroupKey, QuiescedGroup> quiesced;
+            bool flush_scheduled;
+            int64_t timeout_ms;
+            // Send time of the latest coalesced RPC acknowledged by the
+            // follower of each quiesced group
+            std::map<GroupKey, int64_t> ack_ms;
+        };
+
+        class CoalescedCall;
+
+        HeartbeatCoalescer() {}
+
+        ~HeartbeatCoalescer() {}
+
+        DISALLOW_COPY_AND_ASSIGN(HeartbeatCoalescer);
+
+        Link *get_link(const mutil::EndPoint &from, const mutil::EndPoint &to);
+
+        // Schedule a flush of |link| at the end of the current window unless
+        // one is scheduled already. Called with link->mutex held.
+        void schedule_flush(Link *link, int64_t timeout_ms);
+
+        static void on_flush_timer(void *arg);
+
+        static void *flush(void *arg);
+
+        raft_mutex_t _mutex;
+        std::map<std::pair<mutil::EndPoint, mutil::EndPoint>, Link *> _links;
+    };
+
+}  //  namespace melon::raft
@@ -26,6 +26,8 @@
 #include <melon/utility/time.h>
 #include <melon/utility/raw_pack.h>                          // mutil::RawPacker
 #include <melon/utility/fd_utility.h>                        // mutil::make_close_on_exec
+#include <melon/utility/memory/aligned_memory.h>             // mutil::AlignedAlloc
+#include <melon/utility/build_config.h>                      // OS_LINUX
 #include <melon/rpc/reloadable_flags.h>             //
 
 #include <melon/proto/raft/local_storage.pb.h>
@@ -34,6 +36,7 @@
 #include <melon/raft/util.h>
 #include <melon/raft/fsync.h>
 #include <melon/raft/config.h>
+#include <algorithm>
 #include <cinttypes>
 
 //#define BRAFT_SEGMENT_OPEN_PATTERN "log_inprogress_%020ld"
@@ -41,6 +44,7 @@
 #define BRAFT_SEGMENT_OPEN_PATTERN "log_inprogress_%020" PRId64
 #define BRAFT_SEGMENT_CLOSED_PATTERN "log_%020" PRId64 "_%020" PRId64
 #define BRAFT_SEGMENT_META_FILE  "log_meta"
+#define BRAFT_SEGMENT_RECYCLED_PATTERN "log_recycled_%020" PRId64
 
 namespace melon::raft {
 
@@ -54,6 +58,30 @@ namespace melon::raft {
     DEFINE_bool(raft_sync_segments, false, "call fsync when a segment is closed");
     MELON_VALIDATE_GFLAG(raft_sync_segments, ::melon::PassValidate);
 
+    static bool validate_log_compress_type(const char *, int32_t value) {
+        return is_log_compress_type_supported(value);
+    }
+
+    DEFINE_int32(raft_log_compress_type, 0,
+                 "Compress data of log entries appended to segments with this "
+                 "melon::CompressType, 0 means no compression. UNSAFE until every "
+                 "node is upgraded, older versions read compressed entries as "
+                 "raw data");
+    MELON_VALIDATE_GFLAG(raft_log_compress_type, validate_log_compress_type);
+
+    DEFINE_int32(raft_log_compress_min_bytes, 256,
+                 "Data of log entries shorter than this value are not compressed");
+    MELON_VALIDATE_GFLAG(raft_log_compress_min_bytes, ::melon::NonNegativeInteger);
+
+    DEFINE_bool(raft_segment_direct_io, false,
+                "Preallocate segment files and write them with O_DIRECT");
+    MELON_VALIDATE_GFLAG(raft_segment_direct_io, ::melon::PassValidate);
+
+    DEFINE_int32(raft_segment_recycle_num, 2,
+                 "Max number of files of removed segments kept for reuse "
+                 "when raft_segment_direct_io is enabled");
+    MELON_VALIDATE_GFLAG(raft_segment_recycle_num, ::melon::NonNegativeInteger);
+
     static melon::var::LatencyRecorder g_open_segment_latency("raft_open_segment");
     static melon::var::LatencyRecorder g_segment_append_entry_latency("raft_segment_append_entry");
     static melon::var::LatencyRecorder g_sync_segment_latency("raft_sync_segment");
@@ -71,17 +99,16 @@ namespace melon::raft {
         CHECKSUM_CRC32 = 1,
     };
 
-    enum RaftSyncPolicy {
-        RAFT_SYNC_IMMEDIATELY = 0,
-        RAFT_SYNC_BY_BYTES = 1,
-    };
-
 
     // Format of Header, all fields are in network order
     // | -------------------- term (64bits) -------------------------  |
-    // | entry-type (8bits) | checksum_type (8bits) | reserved(16bits) |
+    // | entry-type (8bits) | checksum_type (8bits) |
+    // | compress_type (8bits) | reserved (8bits)                      |
     // | ------------------ data len (32bits) -----------------------  |
     // | data_checksum (32bits) | header checksum (32bits)             |
+    // compress_type was reserved and zero in old segments, which means the
+    // data is not compressed. data len and data_checksum are of the data
+    // stored in the segment, i.e. compressed data if compress_type is set.
 
     const static size_t ENTRY_HEADER_SIZE = 24;
 
@@ -89,6 +116,7 @@ namespace melon::raft {
         int64_t term;
         int type;
         int checksum_type;
+        int compress_type;
         uint32_t data_len;
         uint32_t data_checksum;
     };
@@ -96,11 +124,38 @@ namespace melon::raft {
     std::ostream &operator<<(std::ostream &os, const Segment::EntryHeader &h) {
         os << "{term=" << h.term << ", type=" << h.type << ", data_len="
            << h.data_len << ", checksum_type=" << h.checksum_type
+           << ", compress_type=" << h.compress_type
            << ", data_checksum=" << h.data_checksum << '}';
         return os;
     }
 
+    // Writes of segments with direct io are aligned to this size.
+    const static size_t SEGMENT_BLOCK_SIZE = 4096;
+
     int Segment::create() {
+        return create(std::string());
+    }
+
+    // Zero the whole content of |fd|, keeping its blocks allocated if the
+    // file system supports it.
+    static int zero_file(int fd) {
+#if defined(OS_LINUX)
+        struct stat st_buf;
+        if (fstat(fd, &st_buf) != 0) {
+            return -1;
+        }
+        if (st_buf.st_size == 0 ||
+            ::fallocate(fd, FALLOC_FL_ZERO_RANGE, 0, st_buf.st_size) == 0 ||
+            ::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                        0, st_buf.st_size) == 0) {
+            return 0;
+        }
+#endif
+        // Blocks are allocated again by _init_direct_io
+        return ::ftruncate(fd, 0);
+    }
+
+    int Segment::create(const std::string &recycled_path) {
         if (!_is_open) {
             CHECK(false) << "Create on a closed segment at first_index="
                          << _first_index << " in " << _path;
@@ -109,13 +164,48 @@ namespace melon::raft {
 
         std::string path(_path);
         mutil::string_appendf(&path, "/" BRAFT_SEGMENT_OPEN_PATTERN, _first_index);
-        _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        const bool direct_io = FLAGS_raft_segment_direct_io;
+        if (direct_io && !recycled_path.empty()) {
+            // The recycled file is full of old entries. Zeroing only the first
+            // header is not enough: after a crash in the middle of a flush,
+            // the zeros following the new entries may be lost and old entries
+            // behind them would be loaded. Zero the whole file before it
+            // becomes an open segment.
+            _fd = ::open(recycled_path.c_str(), O_RDWR);
+            if (_fd < 0
+                || zero_file(_fd) != 0
+                || raft_fsync(_fd) != 0
+                || ::rename(recycled_path.c_str(), path.c_str()) != 0) {
+                PLOG(WARNING) << "Fail to reuse `" << recycled_path << "' as `"
+                              << path << '\'';
+                if (_fd >= 0) {
+                    ::close(_fd);
+                    _fd = -1;
+                }
+                ::unlink(recycled_path.c_str());
+            } else {
+                LOG(INFO) << "Reused `" << recycled_path << "' as `" << path << '\'';
+            }
+        } else if (!recycled_path.empty()) {
+            ::unlink(recycled_path.c_str());
+        }
+        if (_fd < 0) {
+            _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        }
         if (_fd >= 0) {
             mutil::make_close_on_exec(_fd);
         }
         LOG_IF(INFO, _fd >= 0) << "Created new segment `" << path
                                << "' with fd=" << _fd;
-        return _fd >= 0 ? 0 : -1;
+        if (_fd < 0) {
+            return -1;
+        }
+        if (direct_io && _init_direct_io(path, 0) != 0) {
+            ::close(_fd);
+            _fd = -1;
+            return -1;
+        }
+        return 0;
     }
 
     inline bool verify_checksum(int checksum_type,
@@ -170,6 +260,131 @@ namespace melon::raft {
         }
     }
 
+    // Pack the header of a padding record which covers `len' bytes from
+    // the end of the last entry to the next block.
+    static void pack_padding_header(char *header_buf, int checksum_type, size_t len) {
+        const uint32_t data_len = len - ENTRY_HEADER_SIZE;
+        const char zero_block[SEGMENT_BLOCK_SIZE] = {0};
+        const uint32_t meta_field = (ENTRY_TYPE_UNKNOWN << 24) | (checksum_type << 16);
+        RawPacker packer(header_buf);
+        packer.pack64(0)
+                .pack32(meta_field)
+                .pack32(data_len)
+                .pack32(get_checksum(checksum_type, zero_block, data_len));
+        packer.pack32(get_checksum(
+                checksum_type, header_buf, ENTRY_HEADER_SIZE - 4));
+    }
+
+    // Size of the padding record following an entry which ends at `offset',
+    // 0 if it ends at a block boundary.
+    static size_t padding_size(int64_t offset) {
+        if ((offset & (SEGMENT_BLOCK_SIZE - 1)) == 0) {
+            return 0;
+        }
+        const int64_t next = (offset + ENTRY_HEADER_SIZE + SEGMENT_BLOCK_SIZE - 1)
+                             & ~(int64_t) (SEGMENT_BLOCK_SIZE - 1);
+        return next - offset;
+    }
+
+    int Segment::_init_direct_io(const std::string &path, int64_t end_offset) {
+        if (!_direct_io) {
+#if defined(OS_LINUX)
+            // Allocate blocks and file size ahead so that fdatasync doesn't
+            // have to flush metadata of the growing file.
+            if (::fallocate(_fd, 0, 0, FLAGS_raft_max_segment_size) != 0) {
+                PLOG(WARNING) << "Fail to preallocate " << path;
+            }
+            _direct_fd = ::open(path.c_str(), O_WRONLY | O_DIRECT);
+            if (_direct_fd >= 0) {
+                mutil::make_close_on_exec(_direct_fd);
+            } else {
+                // e.g. tmpfs, write aligned blocks through page cache then
+                PLOG(WARNING) << "Fail to open " << path << " with O_DIRECT";
+            }
+#endif
+            _wbuf_cap = 16 * SEGMENT_BLOCK_SIZE;
+            _wbuf = (char *) mutil::AlignedAlloc(_wbuf_cap, SEGMENT_BLOCK_SIZE);
+            _direct_io = true;
+        }
+        // Pad the last block through the regular fd which only writes the
+        // padding record instead of the whole block
+        const size_t pad = padding_size(end_offset);
+        if (pad > 0) {
+            char pad_buf[SEGMENT_BLOCK_SIZE + ENTRY_HEADER_SIZE] = {0};
+            pack_padding_header(pad_buf, _checksum_type, pad);
+            if (::pwrite(_fd, pad_buf, pad, end_offset) != (ssize_t) pad) {
+                PLOG(ERROR) << "Fail to pad the last block of " << path;
+                return -1;
+            }
+        }
+        _wbuf_offset = end_offset + pad;
+        _wbuf_len = 0;
+        return 0;
+    }
+
+    void Segment::_release_direct_io() {
+        if (_direct_fd >= 0) {
+            ::close(_direct_fd);
+            _direct_fd = -1;
+        }
+        if (_wbuf) {
+            mutil::AlignedFree(_wbuf);
+            _wbuf = NULL;
+        }
+        _wbuf_cap = 0;
+        _wbuf_len = 0;
+        _direct_io = false;
+    }
+
+    void Segment::_stage(const mutil::IOBuf &header, const mutil::IOBuf &data) {
+        const size_t to_write = header.length() + data.length();
+        // Leave room for the padding record following the last entry
+        const size_t need = _wbuf_len + to_write + ENTRY_HEADER_SIZE + SEGMENT_BLOCK_SIZE;
+        if (need > _wbuf_cap) {
+            size_t new_cap = std::max(_wbuf_cap * 2, need);
+            new_cap = (new_cap + SEGMENT_BLOCK_SIZE - 1) & ~(SEGMENT_BLOCK_SIZE - 1);
+            char *new_buf = (char *) mutil::AlignedAlloc(new_cap, SEGMENT_BLOCK_SIZE);
+            memcpy(new_buf, _wbuf, _wbuf_len);
+            mutil::AlignedFree(_wbuf);
+            _wbuf = new_buf;
+            _wbuf_cap = new_cap;
+        }
+        _wbuf_len += header.copy_to(_wbuf + _wbuf_len);
+        _wbuf_len += data.copy_to(_wbuf + _wbuf_len);
+    }
+
+    int Segment::flush() {
+        if (!_direct_io || _wbuf_len == 0) {
+            return 0;
+        }
+        // Blocks written before may have been synced, never write them again.
+        // Fill the rest of the last block with a padding record so that the
+        // next flush starts at a new block, see load()
+        const size_t pad = padding_size(_wbuf_len);
+        if (pad > 0) {
+            memset(_wbuf + _wbuf_len, 0, pad);
+            pack_padding_header(_wbuf + _wbuf_len, _checksum_type, pad);
+        }
+        const size_t len = _wbuf_len + pad;
+        const int fd = _direct_fd >= 0 ? _direct_fd : _fd;
+        size_t written = 0;
+        while (written < len) {
+            const ssize_t n = ::pwrite(fd, _wbuf + written, len - written,
+                                       _wbuf_offset + written);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                PLOG(ERROR) << "Fail to write to fd=" << fd << ", path: " << _path;
+                return -1;
+            }
+            written += n;
+        }
+        _wbuf_offset += len;
+        _wbuf_len = 0;
+        return 0;
+    }
+
     int Segment::_load_entry(off_t offset, EntryHeader *head, mutil::IOBuf *data,
                              size_t size_hint) const {
         mutil::IOPortal buf;
@@ -180,6 +395,10 @@ namespace melon::raft {
         }
         char header_buf[ENTRY_HEADER_SIZE];
         const char *p = (const char *) buf.fetch(header_buf, ENTRY_HEADER_SIZE);
+        if (is_zero(p, ENTRY_HEADER_SIZE)) {
+            // End of entries in a preallocated file
+            return 1;
+        }
         int64_t term = 0;
         uint32_t meta_field;
         uint32_t data_len = 0;
@@ -194,6 +413,7 @@ namespace melon::raft {
         tmp.term = term;
         tmp.type = meta_field >> 24;
         tmp.checksum_type = (meta_field << 8) >> 24;
+        tmp.compress_type = (meta_field << 16) >> 24;
         tmp.data_len = data_len;
         tmp.data_checksum = data_checksum;
         if (!verify_checksum(tmp.checksum_type,
@@ -225,6 +445,17 @@ namespace melon::raft {
                 // TODO: abort()?
                 return -1;
             }
+            if (tmp.compress_type != 0) {
+                mutil::IOBuf raw;
+                if (decompress_log_data(tmp.compress_type, buf, &raw) != 0) {
+                    LOG(ERROR) << "Fail to decompress data at offset="
+                               << offset + ENTRY_HEADER_SIZE
+                               << " header=" << tmp
+                               << " path: " << _path;
+                    return -1;
+                }
+                buf.swap(raw);
+            }
             data->swap(buf);
         }
         return 0;
@@ -286,11 +517,14 @@ namespace melon::raft {
         int64_t file_size = st_buf.st_size;
         int64_t entry_off = 0;
         int64_t actual_last_index = _first_index - 1;
-        for (int64_t i = _first_index; entry_off < file_size; i++) {
+        // Whether entries are followed by zeros of a preallocated file
+        bool zero_padded = false;
+        for (int64_t i = _first_index; entry_off < file_size;) {
             EntryHeader header;
             const int rc = _load_entry(entry_off, &header, NULL, ENTRY_HEADER_SIZE);
             if (rc > 0) {
                 // The last log was not completely written, which should be truncated
+                zero_padded = (entry_off + (int64_t) ENTRY_HEADER_SIZE <= file_size);
                 break;
             }
             if (rc < 0) {
@@ -304,6 +538,12 @@ namespace melon::raft {
                 // truncated
                 break;
             }
+            if (header.term == 0 && header.type == ENTRY_TYPE_UNKNOWN) {
+                // Padding record written with direct io, the next entry
+                // starts from the next block
+                entry_off += skip_len;
+                continue;
+            }
             if (header.type == ENTRY_TYPE_CONFIGURATION) {
                 mutil::IOBuf data;
                 // Header will be parsed again but it's fine as configuration
@@ -327,6 +567,7 @@ namespace melon::raft {
             }
             _offset_and_term.push_back(std::make_pair(entry_off, header.term));
             ++actual_last_index;
+            ++i;
             entry_off += skip_len;
         }
 
@@ -350,11 +591,36 @@ namespace melon::raft {
             return ret;
         }
 
+        if (_is_open && zero_padded) {
+            // The file size of a preallocated segment doesn't tell whether the
+            // last entries were completely written, verify their data and drop
+            // entries from the first broken one.
+            for (size_t j = 0; j < _offset_and_term.size(); ++j) {
+                const int64_t off = _offset_and_term[j].first;
+                const int64_t end = (j + 1 < _offset_and_term.size())
+                                    ? _offset_and_term[j + 1].first : entry_off;
+                mutil::IOBuf data;
+                if (_load_entry(off, NULL, &data, end - off) != 0) {
+                    LOG(WARNING) << "Found uncompleted entry, path: " << _path
+                                 << " index: " << _first_index + (int64_t) j
+                                 << " offset: " << off;
+                    _offset_and_term.resize(j);
+                    actual_last_index = _first_index + (int64_t) j - 1;
+                    configuration_manager->truncate_suffix(actual_last_index);
+                    entry_off = off;
+                    zero_padded = false;
+                    break;
+                }
+            }
+        }
+
         if (_is_open) {
             _last_index = actual_last_index;
         }
 
-        // truncate last uncompleted entry
+        // truncate last uncompleted entry. Zeros of a preallocated file are
+        // dropped as well, or blocks of an interrupted flush behind them might
+        // be loaded after the padding of a later flush
         if (entry_off != file_size) {
             LOG(INFO) << "truncate last uncompleted write entry, path: " << _path
                       << " first_index: " << _first_index << " old_size: " << file_size << " new_size: " << entry_off;
@@ -365,6 +631,9 @@ namespace melon::raft {
         ::lseek(_fd, entry_off, SEEK_SET);
 
         _bytes = entry_off;
+        if (ret == 0 && _is_open && FLAGS_raft_segment_direct_io) {
+            ret = _init_direct_io(path, entry_off);
+        }
         return ret;
     }
 
@@ -401,9 +670,24 @@ namespace melon::raft {
                            << ", path: " << _path;
                 return -1;
         }
+        int compress_type = FLAGS_raft_log_compress_type;
+        if (compress_type != 0 && entry->type == ENTRY_TYPE_DATA
+            && data.length() >= (size_t) FLAGS_raft_log_compress_min_bytes) {
+            mutil::IOBuf compressed;
+            // Keep the raw data if it's not compressible
+            if (compress_log_data(compress_type, data, &compressed) == 0
+                && compressed.length() < data.length()) {
+                data.swap(compressed);
+            } else {
+                compress_type = 0;
+            }
+        } else {
+            compress_type = 0;
+        }
         CHECK_LE(data.length(), 1ul << 56ul);
         char header_buf[ENTRY_HEADER_SIZE];
-        const uint32_t meta_field = (entry->type << 24) | (_checksum_type << 16);
+        const uint32_t meta_field = (entry->type << 24) | (_checksum_type << 16)
+                                    | (compress_type << 8);
         RawPacker packer(header_buf);
         packer.pack64(entry->id.term)
                 .pack32(meta_field)
@@ -417,6 +701,13 @@ namespace melon::raft {
         mutil::IOBuf *pieces[2] = {&header, &data};
         size_t start = 0;
         ssize_t written = 0;
+        int64_t offset = _bytes;
+        if (_direct_io) {
+            // Written by flush(), which starts from a new block
+            offset = _wbuf_offset + _wbuf_len;
+            _stage(header, data);
+            written = to_write;
+        }
         while (written < (ssize_t) to_write) {
             const ssize_t n = mutil::IOBuf::cut_multiple_into_file_descriptor(
                     _fd, pieces + start, ARRAY_SIZE(pieces) - start);
@@ -429,9 +720,9 @@ namespace melon::raft {
             for (; start < ARRAY_SIZE(pieces) && pieces[start]->empty(); ++start) {}
         }
         MELON_SCOPED_LOCK(_mutex);
-        _offset_and_term.push_back(std::make_pair(_bytes, entry->id.term));
+        _offset_and_term.push_back(std::make_pair(offset, entry->id.term));
         _last_index.fetch_add(1, mutil::memory_order_relaxed);
-        _bytes += to_write;
+        _bytes = offset + to_write;
         _unsynced_bytes += to_write;
 
         return 0;
@@ -441,6 +732,9 @@ namespace melon::raft {
         if (_last_index < _first_index) {
             return 0;
         }
+        if (flush() != 0) {
+            return -1;
+        }
         //CHECK(_is_open);
         if (will_sync) {
             if (!FLAGS_raft_sync) {
@@ -538,13 +832,14 @@ namespace melon::raft {
                   << " raft_sync_segments: " << FLAGS_raft_sync_segments
                   << " will_sync: " << will_sync
                   << " path: " << new_path;
-        int ret = 0;
-        if (_last_index > _first_index) {
+        int ret = flush();
+        if (ret == 0 && _last_index > _first_index) {
             if (FLAGS_raft_sync_segments && will_sync) {
                 ret = raft_fsync(_fd);
             }
         }
         if (ret == 0) {
+            _release_direct_io();
             _is_open = false;
             const int rc = ::rename(old_path.c_str(), new_path.c_str());
             LOG_IF(INFO, rc == 0) << "Renamed `" << old_path
@@ -611,7 +906,28 @@ namespace melon::raft {
         return ret;
     }
 
+    int Segment::recycle(const std::string &recycled_path) {
+        std::string path(_path);
+        if (_is_open) {
+            mutil::string_appendf(&path, "/" BRAFT_SEGMENT_OPEN_PATTERN,
+                                  _first_index);
+        } else {
+            mutil::string_appendf(&path, "/" BRAFT_SEGMENT_CLOSED_PATTERN,
+                                  _first_index, _last_index.load());
+        }
+        const int ret = ::rename(path.c_str(), recycled_path.c_str());
+        if (ret != 0) {
+            PLOG(ERROR) << "Fail to rename " << path << " to " << recycled_path;
+            return ret;
+        }
+        LOG(INFO) << "Recycled segment `" << path << "' to `" << recycled_path << '\'';
+        return 0;
+    }
+
     int Segment::truncate(const int64_t last_index_kept) {
+        if (flush() != 0) {
+            return -1;
+        }
         int64_t truncate_size = 0;
         int64_t first_truncate_in_offset = 0;
         std::unique_lock<raft_mutex_t> lck(_mutex);
@@ -665,6 +981,13 @@ namespace melon::raft {
         _offset_and_term.resize(first_truncate_in_offset);
         _last_index.store(last_index_kept, mutil::memory_order_relaxed);
         _bytes = truncate_size;
+        lck.unlock();
+
+        if (_direct_io || FLAGS_raft_segment_direct_io) {
+            std::string path(_path);
+            mutil::string_appendf(&path, "/" BRAFT_SEGMENT_OPEN_PATTERN, _first_index);
+            ret = _init_direct_io(path, truncate_size);
+        }
         return ret;
     }
 
@@ -763,6 +1086,9 @@ namespace melon::raft {
             last_segment = segment;
         }
         now = mutil::cpuwide_time_us();
+        if (last_segment->flush() != 0) {
+            return 0;
+        }
         last_segment->sync(_enable_sync);
         if (FLAGS_raft_trace_append_entry_latency && metric) {
             delta_time_us = mutil::cpuwide_time_us() - now;
@@ -856,12 +1182,48 @@ namespace melon::raft {
         std::vector<scoped_refptr<Segment> > popped;
         pop_segments(first_index_kept, &popped);
         for (size_t i = 0; i < popped.size(); ++i) {
-            popped[i]->unlink();
+            if (!recycle_segment(popped[i])) {
+                popped[i]->unlink();
+            }
             popped[i] = NULL;
         }
         return 0;
     }
 
+    bool SegmentLogStorage::recycle_segment(const scoped_refptr<Segment> &segment) {
+        // The file is overwritten once reused, which must not happen while
+        // readers still hold the segment.
+        if (!FLAGS_raft_segment_direct_io || !segment->HasOneRef()) {
+            return false;
+        }
+        std::string recycled_path(_path);
+        mutil::string_appendf(&recycled_path, "/" BRAFT_SEGMENT_RECYCLED_PATTERN,
+                              segment->first_index());
+        {
+            MELON_SCOPED_LOCK(_mutex);
+            if (_recycled_files.size() >= (size_t) FLAGS_raft_segment_recycle_num
+                || std::find(_recycled_files.begin(), _recycled_files.end(),
+                             recycled_path) != _recycled_files.end()) {
+                return false;
+            }
+        }
+        if (segment->recycle(recycled_path) != 0) {
+            return false;
+        }
+        MELON_SCOPED_LOCK(_mutex);
+        _recycled_files.push_back(recycled_path);
+        return true;
+    }
+
+    std::string SegmentLogStorage::pop_recycled_file() {
+        std::string path;
+        if (!_recycled_files.empty()) {
+            path.swap(_recycled_files.back());
+            _recycled_files.pop_back();
+        }
+        return path;
+    }
+
     void SegmentLogStorage::pop_segments_from_back(
             const int64_t last_index_kept,
             std::vector<scoped_refptr<Segment> > *popped,
@@ -991,6 +1353,20 @@ namespace melon::raft {
 
         // restore segment meta
         while (dir_reader.Next()) {
+            int64_t recycled_index = 0;
+            if (sscanf(dir_reader.name(), BRAFT_SEGMENT_RECYCLED_PATTERN,
+                       &recycled_index) == 1) {
+                std::string recycled_path(_path);
+                recycled_path.append("/");
+                recycled_path.append(dir_reader.name());
+                if (FLAGS_raft_segment_direct_io &&
+                    _recycled_files.size() < (size_t) FLAGS_raft_segment_recycle_num) {
+                    _recycled_files.push_back(recycled_path);
+                } else {
+                    ::unlink(recycled_path.c_str());
+                }
+                continue;
+            }
             // unlink unneed segments and unfinished unlinked segments
             if ((is_empty && 0 == strncmp(dir_reader.name(), "log_", strlen("log_"))) ||
                 (0 == strncmp(dir_reader.name() + (strlen(dir_reader.name()) - strlen(".tmp")),
@@ -1180,7 +1556,7 @@ namespace melon::raft {
             MELON_SCOPED_LOCK(_mutex);
             if (!_open_segment) {
                 _open_segment = new Segment(_path, last_log_index() + 1, _checksum_type);
-                if (_open_segment->create() != 0) {
+                if (_open_segment->create(pop_recycled_file()) != 0) {
                     _open_segment = NULL;
                     return NULL;
                 }
@@ -1195,7 +1571,7 @@ namespace melon::raft {
                 if (prev_open_segment->close(_enable_sync) == 0) {
                     MELON_SCOPED_LOCK(_mutex);
                     _open_segment = new Segment(_path, last_log_index() + 1, _checksum_type);
-                    if (_open_segment->create() == 0) {
+                    if (_open_segment->create(pop_recycled_file()) == 0) {
                         // success
                         break;
                     }
@@ -39,20 +39,27 @@ namespace melon::raft {
                 : _path(path), _bytes(0), _unsynced_bytes(0),
                   _fd(-1), _is_open(true),
                   _first_index(first_index), _last_index(first_index - 1),
-                  _checksum_type(checksum_type) {}
+                  _checksum_type(checksum_type), _direct_io(false), _direct_fd(-1),
+                  _wbuf(NULL), _wbuf_cap(0), _wbuf_len(0), _wbuf_offset(0) {}
 
         Segment(const std::string &path, const int64_t first_index, const int64_t last_index,
                 int checksum_type)
                 : _path(path), _bytes(0), _unsynced_bytes(0),
                   _fd(-1), _is_open(false),
                   _first_index(first_index), _last_index(last_index),
-                  _checksum_type(checksum_type) {}
+                  _checksum_type(checksum_type), _direct_io(false), _direct_fd(-1),
+                  _wbuf(NULL), _wbuf_cap(0), _wbuf_len(0), _wbuf_offset(0) {}
 
         struct EntryHeader;
 
         // create open segment
         int create();
 
+        // create open segment by reusing the file of a removed segment at
+        // `recycled_path', which is only used when direct io is enabled.
+        // A new file is created if `recycled_path' is empty or can't be reused.
+        int create(const std::string &recycled_path);
+
         // load open or closed segment
         // open fd, load index, truncate uncompleted entry
         int load(ConfigurationManager *configuration_manager);
@@ -72,9 +79,17 @@ namespace melon::raft {
         // sync open segment
         int sync(bool will_sync);
 
+        // write entries staged by append() to the file, only entries of
+        // segments written with direct io are staged
+        int flush();
+
         // unlink segment
         int unlink();
 
+        // rename the file of this removed segment to `recycled_path' so that
+        // it can be reused by a later segment
+        int recycle(const std::string &recycled_path);
+
         // truncate segment to last_index_kept
         int truncate(const int64_t last_index_kept);
 
@@ -104,6 +119,7 @@ namespace melon::raft {
                 ::close(_fd);
                 _fd = -1;
             }
+            _release_direct_io();
         }
 
         struct LogMeta {
@@ -119,6 +135,15 @@ namespace melon::raft {
 
         int _truncate_meta_and_get_last(int64_t last);
 
+        // Preallocate the file, open it with O_DIRECT and pad the partial
+        // block before `end_offset' so that appending starts from the next
+        // block.
+        int _init_direct_io(const std::string &path, int64_t end_offset);
+
+        void _release_direct_io();
+
+        void _stage(const mutil::IOBuf &header, const mutil::IOBuf &data);
+
         std::string _path;
         int64_t _bytes;
         int64_t _unsynced_bytes;
@@ -129,6 +154,18 @@ namespace melon::raft {
         mutil::atomic<int64_t> _last_index;
         int _checksum_type;
         std::vector<std::pair<int64_t/*offset*/, int64_t/*term*/> > _offset_and_term;
+
+        // With direct io, appended entries are staged in the block aligned
+        // _wbuf which starts at the block aligned _wbuf_offset of the file,
+        // and written by flush() in whole blocks. The rest of the last block
+        // is filled with a padding record and never written again, so a torn
+        // write can't damage entries which were synced before.
+        bool _direct_io;
+        int _direct_fd;
+        char *_wbuf;
+        size_t _wbuf_cap;
+        size_t _wbuf_len;
+        int64_t _wbuf_offset;
     };
 
 // LogStorage use segmented append-only file, all data in disk, all index in memory.
@@ -138,6 +175,8 @@ namespace melon::raft {
 //      log_meta: record start_log
 //      log_000001-0001000: closed segment
 //      log_inprogress_0001001: open segment
+//      log_recycled_0000001: file of a removed segment kept for reuse, only
+//                            with raft_segment_direct_io
     class SegmentLogStorage : public LogStorage {
     public:
         typedef std::map<int64_t, scoped_refptr<Segment> > SegmentMap;
@@ -207,6 +246,14 @@ namespace melon::raft {
 
         int get_segment(int64_t log_index, scoped_refptr<Segment> *ptr);
 
+        // Keep the file of the removed `segment' for reuse instead of unlinking
+        // it. Returns true if the file is kept.
+        bool recycle_segment(const scoped_refptr<Segment> &segment);
+
+        // Returns the path of a recycled file or an empty string, must be
+        // called with _mutex held.
+        std::string pop_recycled_file();
+
         void pop_segments(
                 int64_t first_index_kept,
                 std::vector<scoped_refptr<Segment> > *poped);
@@ -223,6 +270,7 @@ namespace melon::raft {
         raft_mutex_t _mutex;
         SegmentMap _segments;
         scoped_refptr<Segment> _open_segment;
+        std::vector<std::string> _recycled_files;
         int _checksum_type;
         bool _enable_sync;
     };
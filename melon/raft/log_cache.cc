@@ -0,0 +1,101 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#include <melon/raft/log_cache.h>
+
+#include <algorithm>
+#include <vector>
+#include <gflags/gflags.h>
+#include <melon/utility/scoped_lock.h>
+#include <melon/rpc/reloadable_flags.h>         // MELON_VALIDATE_GFLAG
+#include <melon/raft/log_manager.h>
+
+namespace melon::raft {
+
+    DEFINE_int64(raft_log_cache_max_bytes, 0,
+                 "Max bytes of log entries cached in memory by all the raft nodes "
+                 "of this process, 0 means no limit");
+    MELON_VALIDATE_GFLAG(raft_log_cache_max_bytes, ::melon::NonNegativeInteger);
+
+    // Hit ratio is calculated in this many seconds
+    static const time_t LOG_CACHE_HIT_RATIO_WINDOW_S = 10;
+
+    LogCache::LogCache()
+            : _cached_bytes(0),
+              _nhit("raft_log_cache_hit_count"),
+              _nmiss("raft_log_cache_miss_count"),
+              _nhit_window(&_nhit, LOG_CACHE_HIT_RATIO_WINDOW_S),
+              _nmiss_window(&_nmiss, LOG_CACHE_HIT_RATIO_WINDOW_S),
+              _nevicted_bytes("raft_log_cache_evicted_bytes"),
+              _cached_bytes_var("raft_log_cache_bytes", get_cached_bytes, this),
+              _hit_ratio_var("raft_log_cache_hit_ratio", get_hit_ratio, this) {}
+
+    LogCache::~LogCache() {}
+
+    int64_t LogCache::get_cached_bytes(void *arg) {
+        return static_cast<LogCache *>(arg)->cached_bytes();
+    }
+
+    double LogCache::get_hit_ratio(void *arg) {
+        LogCache *c = static_cast<LogCache *>(arg);
+        const int64_t nhit = c->_nhit_window.get_value();
+        const int64_t ntotal = nhit + c->_nmiss_window.get_value();
+        return ntotal > 0 ? (double) nhit / ntotal : 0;
+    }
+
+    void LogCache::add(LogManager *manager) {
+        MELON_SCOPED_LOCK(_mutex);
+        _managers.insert(manager);
+    }
+
+    void LogCache::remove(LogManager *manager) {
+        MELON_SCOPED_LOCK(_mutex);
+        _managers.erase(manager);
+    }
+
+    void LogCache::evict_if_needed() {
+        const int64_t max_bytes = FLAGS_raft_log_cache_max_bytes;
+        if (max_bytes <= 0 || cached_bytes() <= max_bytes) {
+            return;
+        }
+        std::unique_lock<mutil::Mutex> lck(_mutex, std::try_to_lock);
+        if (!lck.owns_lock()) {
+            // Another thread is evicting
+            return;
+        }
+        // Evict a bit more than needed so that not every flush of logs
+        // triggers an eviction.
+        const int64_t target_bytes = max_bytes - max_bytes / 16;
+        std::vector<std::pair<int64_t, LogManager *> > lru;
+        lru.reserve(_managers.size());
+        for (std::set<LogManager *>::iterator
+                     it = _managers.begin(); it != _managers.end(); ++it) {
+            lru.push_back(std::make_pair((*it)->last_access_us(), *it));
+        }
+        std::sort(lru.begin(), lru.end());
+        for (size_t i = 0; i < lru.size(); ++i) {
+            const int64_t to_evict = cached_bytes() - target_bytes;
+            if (to_evict <= 0) {
+                break;
+            }
+            _nevicted_bytes << lru[i].second->evict_memory_logs(to_evict);
+        }
+    }
+
+}  //  namespace melon::raft
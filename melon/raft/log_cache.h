@@ -0,0 +1,95 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#pragma once
+
+#include <set>
+#include <melon/utility/atomicops.h>
+#include <melon/utility/memory/singleton.h>
+#include <melon/utility/synchronization/lock.h>
+#include <melon/var/var.h>
+
+namespace melon::raft {
+
+    class LogManager;
+
+    // Accounts the memory of log entries cached by all the LogManagers of this
+    // process against one budget, raft_log_cache_max_bytes.
+    //
+    // When the budget is exceeded, entries which are already on disk are
+    // evicted from the least recently accessed groups first. Within a group
+    // entries are evicted from the oldest one, as entries of a group are
+    // appended and read in the order of index. Evicted entries are read from
+    // LogStorage again by lagging replicators and the state machine.
+    // Entries not on disk yet are never evicted, so the budget can be exceeded
+    // temporarily by a burst of appends.
+    class LogCache {
+    public:
+        static LogCache *GetInstance() {
+            return Singleton<LogCache>::get();
+        }
+
+        void add(LogManager *manager);
+
+        // Must be called before |manager| is destroyed.
+        void remove(LogManager *manager);
+
+        // Called by LogManagers when their cached bytes change by |delta|.
+        void update(int64_t delta) {
+            _cached_bytes.fetch_add(delta, mutil::memory_order_relaxed);
+        }
+
+        void on_hit() { _nhit << 1; }
+
+        void on_miss() { _nmiss << 1; }
+
+        // Evict entries if the budget is exceeded. Must not be called with
+        // the mutex of any LogManager held.
+        void evict_if_needed();
+
+        int64_t cached_bytes() const {
+            return _cached_bytes.load(mutil::memory_order_relaxed);
+        }
+
+    private:
+        friend struct DefaultSingletonTraits<LogCache>;
+
+        LogCache();
+
+        ~LogCache();
+
+        static int64_t get_cached_bytes(void *arg);
+
+        static double get_hit_ratio(void *arg);
+
+        // Protects _managers, held during eviction
+        mutil::Mutex _mutex;
+        std::set<LogManager *> _managers;
+        mutil::atomic<int64_t> _cached_bytes;
+
+        melon::var::Adder<int64_t> _nhit;
+        melon::var::Adder<int64_t> _nmiss;
+        melon::var::Window<melon::var::Adder<int64_t> > _nhit_window;
+        melon::var::Window<melon::var::Adder<int64_t> > _nmiss_window;
+        melon::var::Adder<int64_t> _nevicted_bytes;
+        melon::var::PassiveStatus<int64_t> _cached_bytes_var;
+        melon::var::PassiveStatus<double> _hit_ratio_var;
+    };
+
+}  //  namespace melon::raft
@@ -27,6 +27,8 @@
 #include <melon/rpc/reloadable_flags.h>         // MELON_VALIDATE_GFLAG
 #include <melon/raft/storage.h>                       // LogStorage
 #include <melon/raft/fsm_caller.h>                    // FSMCaller
+#include <melon/raft/config.h>                        // FLAGS_raft_sync
+#include <melon/raft/log_cache.h>                     // LogCache
 #include <cinttypes>
 
 namespace melon::raft {
@@ -54,6 +56,26 @@ namespace melon::raft {
     static melon::var::CounterRecorder g_storage_flush_batch_counter(
             "raft_storage_flush_batch_counter");
 
+    static melon::var::IntRecorder g_storage_entries_per_sync(
+            "raft_storage_entries_per_sync");
+    static melon::var::LatencyRecorder g_storage_sync_latency(
+            "raft_storage_sync_latency");
+    static melon::var::LatencyRecorder g_group_commit_hold_latency(
+            "raft_storage_group_commit_hold");
+
+    // Minimal hold time of adaptive group commit, holding shorter than this
+    // is not worth a context switch
+    static const int64_t GROUP_COMMIT_MIN_HOLD_US = 50;
+
+    static bool adaptive_sync_enabled() {
+        return FLAGS_raft_sync && FLAGS_raft_sync_policy == RAFT_SYNC_ADAPTIVE;
+    }
+
+    // Memory charged to LogCache for an entry in _logs_in_memory
+    inline int64_t memory_log_charge(const LogEntry *entry) {
+        return sizeof(LogEntry) + entry->data.length();
+    }
+
 
     void LogManager::StableClosure::update_metric(IOMetric *m) {
         metric.open_segment_time_us = m->open_segment_time_us;
@@ -66,7 +88,9 @@ namespace melon::raft {
 
     LogManager::LogManager()
             : _log_storage(NULL), _config_manager(NULL), _stopped(false), _has_error(false), _next_wait_id(0),
-              _first_log_index(0), _last_log_index(0) {
+              _cached_bytes(0), _last_access_us(0),
+              _first_log_index(0), _last_log_index(0), _group_commit_scheduled(false),
+              _group_commit_hold_us(0), _sync_latency_us(0), _sync_latency_dev_us(0) {
         CHECK_EQ(0, start_disk_thread());
     }
 
@@ -92,15 +116,19 @@ namespace melon::raft {
         // after snapshot load finish.
         _disk_id.term = _log_storage->get_term(_last_log_index);
         _fsm_caller = options.fsm_caller;
+        LogCache::GetInstance()->add(this);
         return 0;
     }
 
     LogManager::~LogManager() {
+        LogCache::GetInstance()->remove(this);
         stop_disk_thread();
         for (size_t i = 0; i < _logs_in_memory.size(); ++i) {
             _logs_in_memory[i]->Release();
         }
         _logs_in_memory.clear();
+        LogCache::GetInstance()->update(-_cached_bytes);
+        _cached_bytes = 0;
     }
 
     int LogManager::start_disk_thread() {
@@ -124,15 +152,18 @@ namespace melon::raft {
             nentries = 0;
             {
                 MELON_SCOPED_LOCK(_mutex);
+                int64_t nbytes = 0;
                 while (!_logs_in_memory.empty()
                        && nentries < ARRAY_SIZE(entries_to_clear)) {
                     LogEntry *entry = _logs_in_memory.front();
                     if (entry->id > id) {
                         break;
                     }
+                    nbytes += memory_log_charge(entry);
                     entries_to_clear[nentries++] = entry;
                     _logs_in_memory.pop_front();
                 }
+                unsafe_update_cached_bytes(-nbytes);
             }  // out of _mutex
             for (size_t i = 0; i < nentries; ++i) {
                 entries_to_clear[i]->Release();
@@ -140,6 +171,36 @@ namespace melon::raft {
         } while (nentries == ARRAY_SIZE(entries_to_clear));
     }
 
+    int64_t LogManager::evict_memory_logs(int64_t max_bytes) {
+        std::vector<LogEntry *> entries_to_evict;
+        int64_t nbytes = 0;
+        {
+            MELON_SCOPED_LOCK(_mutex);
+            while (!_logs_in_memory.empty() && nbytes < max_bytes) {
+                LogEntry *entry = _logs_in_memory.front();
+                // Entries not on disk can't be read from _log_storage
+                if (entry->id > _disk_id) {
+                    break;
+                }
+                nbytes += memory_log_charge(entry);
+                entries_to_evict.push_back(entry);
+                _logs_in_memory.pop_front();
+            }
+            unsafe_update_cached_bytes(-nbytes);
+        }  // out of _mutex
+        for (size_t i = 0; i < entries_to_evict.size(); ++i) {
+            entries_to_evict[i]->Release();
+        }
+        return nbytes;
+    }
+
+    void LogManager::unsafe_update_cached_bytes(int64_t delta) {
+        if (delta != 0) {
+            _cached_bytes += delta;
+            LogCache::GetInstance()->update(delta);
+        }
+    }
+
     int64_t LogManager::first_log_index() {
         MELON_SCOPED_LOCK(_mutex);
         return _first_log_index;
@@ -265,15 +326,18 @@ namespace melon::raft {
         // container in O(1) time, one solution is a segmented double-linked list
         // along with a bounded queue as the indexer, of which the payoff is that
         // _logs_in_memory has to be bounded.
+        int64_t nbytes = 0;
         while (!_logs_in_memory.empty()) {
             LogEntry *entry = _logs_in_memory.front();
             if (entry->id.index < first_index_kept) {
+                nbytes += memory_log_charge(entry);
                 saved_logs_in_memory.push_back(entry);
                 _logs_in_memory.pop_front();
             } else {
                 break;
             }
         }
+        unsafe_update_cached_bytes(-nbytes);
         CHECK_GE(first_index_kept, _first_log_index);
         _first_log_index = first_index_kept;
         if (first_index_kept > _last_log_index) {
@@ -295,6 +359,7 @@ namespace melon::raft {
         CHECK(lck.owns_lock());
         std::deque<LogEntry *> saved_logs_in_memory;
         saved_logs_in_memory.swap(_logs_in_memory);
+        unsafe_update_cached_bytes(-_cached_bytes);
         _first_log_index = next_log_index;
         _last_log_index = next_log_index - 1;
         _config_manager->truncate_prefix(_first_log_index);
@@ -317,15 +382,18 @@ namespace melon::raft {
             return;
         }
 
+        int64_t nbytes = 0;
         while (!_logs_in_memory.empty()) {
             LogEntry *entry = _logs_in_memory.back();
             if (entry->id.index > last_index_kept) {
+                nbytes += memory_log_charge(entry);
                 entry->Release();
                 _logs_in_memory.pop_back();
             } else {
                 break;
             }
         }
+        unsafe_update_cached_bytes(-nbytes);
         _last_log_index = last_index_kept;
         const int64_t last_term_kept = unsafe_get_term(last_index_kept);
         CHECK(last_index_kept == 0 || last_term_kept != 0)
@@ -431,9 +499,11 @@ namespace melon::raft {
             return;
         }
 
+        int64_t nbytes = 0;
         for (size_t i = 0; i < entries->size(); ++i) {
             // Add ref for disk_thread
             (*entries)[i]->AddRef();
+            nbytes += memory_log_charge((*entries)[i]);
             if ((*entries)[i]->type == ENTRY_TYPE_CONFIGURATION) {
                 ConfigurationEntry conf_entry(*((*entries)[i]));
                 _config_manager->add(conf_entry);
@@ -443,6 +513,8 @@ namespace melon::raft {
         if (!entries->empty()) {
             done->_first_log_index = entries->front()->id.index;
             _logs_in_memory.insert(_logs_in_memory.end(), entries->begin(), entries->end());
+            unsafe_update_cached_bytes(nbytes);
+            _last_access_us.store(mutil::cpuwide_time_us(), mutil::memory_order_relaxed);
         }
 
         done->_entries.swap(*entries);
@@ -475,6 +547,10 @@ namespace melon::raft {
                 *last_id = (*to_append)[nappent - 1]->id;
             }
             g_storage_append_entries_latency << timer.u_elapsed();
+            if (FLAGS_raft_sync && FLAGS_raft_sync_policy != RAFT_SYNC_BY_BYTES) {
+                g_storage_entries_per_sync << to_append->size();
+            }
+            update_sync_latency(timer.u_elapsed());
             if (written_size) {
                 g_nomralized_append_entries_latency << timer.u_elapsed() * 1024 / written_size;
             }
@@ -503,6 +579,7 @@ namespace melon::raft {
                 IOMetric metric;
                 _lm->append_to_storage(&_to_append, _last_id, &metric);
                 g_storage_flush_batch_counter << _size;
+                g_storage_sync_latency << mutil::cpuwide_time_us() - _storage[0]->metric.start_time_us;
                 for (size_t i = 0; i < _size; ++i) {
                     _storage[i]->_entries.clear();
                     if (_lm->_has_error.load(mutil::memory_order_relaxed)) {
@@ -518,6 +595,16 @@ namespace melon::raft {
             _buffer_size = 0;
         }
 
+        // Move the pending appends to |held| without flushing them
+        void hold(std::vector<LogManager::StableClosure *> *held) {
+            held->insert(held->end(), _storage, _storage + _size);
+            _to_append.clear();
+            _size = 0;
+            _buffer_size = 0;
+        }
+
+        size_t size() const { return _size; }
+
         void append(LogManager::StableClosure *done) {
             if (_size == _cap ||
                 _buffer_size >= (size_t) FLAGS_raft_max_append_buffer_size) {
@@ -541,18 +628,33 @@ namespace melon::raft {
         LogManager *_lm;
     };
 
+    // Marks the end of holding appends for adaptive group commit
+    class GroupCommitClosure : public LogManager::StableClosure {
+    public:
+        void Run() { delete this; }
+    };
+
     int LogManager::disk_thread(void *meta,
                                 fiber::TaskIterator<StableClosure *> &iter) {
-        if (iter.is_queue_stopped()) {
-            return 0;
-        }
-
         LogManager *log_manager = static_cast<LogManager *>(meta);
         // FIXME(chenzhangyi01): it's buggy
         LogId last_id = log_manager->_disk_id;
         StableClosure *storage[256];
         AppendBatcher ab(storage, ARRAY_SIZE(storage), &last_id, log_manager);
+        // Appends held by the previous run go first
+        const size_t nheld = log_manager->_held_appends.size();
+        for (size_t i = 0; i < nheld; ++i) {
+            ab.append(log_manager->_held_appends[i]);
+        }
+        log_manager->_held_appends.clear();
+
+        if (iter.is_queue_stopped()) {
+            ab.flush();
+            log_manager->set_disk_id(last_id);
+            return 0;
+        }
 
+        size_t nappend = 0;
         for (; iter; ++iter) {
             // ^^^ Must iterate to the end to release to corresponding
             //     even if some error has occurred
@@ -561,6 +663,7 @@ namespace melon::raft {
                                                  done->metric.start_time_us;
             if (!done->_entries.empty()) {
                 ab.append(done);
+                ++nappend;
             } else {
                 ab.flush();
                 int ret = 0;
@@ -606,6 +709,12 @@ namespace melon::raft {
                         ret = log_manager->_log_storage->reset(rc->next_log_index());
                         break;
                     }
+                    if (dynamic_cast<GroupCommitClosure *>(done)) {
+                        // Appends before this closure came while holding
+                        log_manager->_group_commit_scheduled = false;
+                        log_manager->adjust_group_commit_hold(nappend > 0);
+                        break;
+                    }
                 } while (0);
 
                 if (ret != 0) {
@@ -615,11 +724,68 @@ namespace melon::raft {
             }
         }
         CHECK(!iter) << "Must iterate to the end";
+        const int64_t hold_us = log_manager->group_commit_hold_us();
+        if (hold_us == 0 && ab.size() > 1 && adaptive_sync_enabled()) {
+            // Appends are batched even without holding, try holding next time
+            log_manager->adjust_group_commit_hold(true);
+        }
+        if (ab.size() > 0 && hold_us > 0 && !log_manager->_group_commit_scheduled) {
+            // Wait for more appends to sync them together. Appends coming in
+            // meanwhile are queued before the GroupCommitClosure, which flushes
+            // all of them. Closures are not run until the logs are synced.
+            fiber_usleep(hold_us);
+            g_group_commit_hold_latency << hold_us;
+            GroupCommitClosure *gcc = new GroupCommitClosure;
+            if (fiber::execution_queue_execute(log_manager->_disk_queue, gcc) == 0) {
+                log_manager->_group_commit_scheduled = true;
+                ab.hold(&log_manager->_held_appends);
+            } else {
+                delete gcc;
+            }
+        } else if (ab.size() > 0 && log_manager->_group_commit_scheduled) {
+            ab.hold(&log_manager->_held_appends);
+        }
         ab.flush();
         log_manager->set_disk_id(last_id);
         return 0;
     }
 
+    int64_t LogManager::group_commit_hold_us() {
+        if (!adaptive_sync_enabled() || _has_error.load(mutil::memory_order_relaxed)) {
+            _group_commit_hold_us = 0;
+            return 0;
+        }
+        return _group_commit_hold_us;
+    }
+
+    void LogManager::adjust_group_commit_hold(bool gained) {
+        if (gained) {
+            _group_commit_hold_us = std::max(_group_commit_hold_us * 2,
+                                             GROUP_COMMIT_MIN_HOLD_US);
+        } else {
+            _group_commit_hold_us /= 2;
+        }
+        // Leave room for syncing in the target latency, the tail of syncing
+        // is estimated like the retransmission timeout of TCP.
+        const int64_t budget = FLAGS_raft_sync_target_latency_us
+                               - _sync_latency_us - 4 * _sync_latency_dev_us;
+        _group_commit_hold_us = std::min(_group_commit_hold_us, budget);
+        if (_group_commit_hold_us < GROUP_COMMIT_MIN_HOLD_US) {
+            _group_commit_hold_us = 0;
+        }
+    }
+
+    void LogManager::update_sync_latency(int64_t latency_us) {
+        if (_sync_latency_us == 0) {
+            _sync_latency_us = latency_us;
+            _sync_latency_dev_us = latency_us / 2;
+            return;
+        }
+        const int64_t err = latency_us - _sync_latency_us;
+        _sync_latency_us += err / 8;
+        _sync_latency_dev_us += (std::abs(err) - _sync_latency_dev_us) / 4;
+    }
+
     void LogManager::set_snapshot(const SnapshotMeta *meta) {
         BRAFT_VLOG << "Set snapshot last_included_index="
                    << meta->last_included_index()
@@ -768,9 +934,13 @@ namespace melon::raft {
         LogEntry *entry = get_entry_from_memory(index);
         if (entry) {
             entry->AddRef();
+            lck.unlock();
+            _last_access_us.store(mutil::cpuwide_time_us(), mutil::memory_order_relaxed);
+            LogCache::GetInstance()->on_hit();
             return entry;
         }
         lck.unlock();
+        LogCache::GetInstance()->on_miss();
         g_read_entry_from_storage << 1;
         entry = _log_storage->get_entry(index);
         if (!entry) {
@@ -807,7 +977,9 @@ namespace melon::raft {
         _disk_id = disk_id;
         LogId clear_id = std::min(_disk_id, _applied_id);
         lck.unlock();
-        return clear_memory_logs(clear_id);
+        clear_memory_logs(clear_id);
+        // Logs on disk become evictable
+        LogCache::GetInstance()->evict_if_needed();
     }
 
     void LogManager::set_applied_id(const LogId &applied_id) {
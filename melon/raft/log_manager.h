@@ -161,6 +161,7 @@ namespace melon::raft {
 
     private:
         friend class AppendBatcher;
+        friend class LogCache;
 
         struct WaitMeta {
             int (*on_new_log)(void *arg, int error_code);
@@ -174,6 +175,17 @@ namespace melon::raft {
         static int disk_thread(void *meta,
                                fiber::TaskIterator<StableClosure *> &iter);
 
+        // Adaptive group commit, called in the disk thread.
+        // Returns how long the pending appends should be held to be synced
+        // with the following ones.
+        int64_t group_commit_hold_us();
+
+        // Grow the hold time if more appends were collected by holding,
+        // shrink it otherwise.
+        void adjust_group_commit_hold(bool gained);
+
+        void update_sync_latency(int64_t latency_us);
+
         // delete logs from storage's head, [1, first_index_kept) will be discarded
         // Returns:
         //  success return 0, failed return -1
@@ -199,6 +211,19 @@ namespace melon::raft {
         // Clear the logs in memory whose id <= the given |id|
         void clear_memory_logs(const LogId &id);
 
+        // Evict at least |max_bytes| of the oldest logs in memory which are
+        // already on disk, called by LogCache.
+        // Returns the number of bytes evicted.
+        int64_t evict_memory_logs(int64_t max_bytes);
+
+        // Account |delta| bytes of logs added to or removed from
+        // _logs_in_memory, must be called with _mutex held.
+        void unsafe_update_cached_bytes(int64_t delta);
+
+        int64_t last_access_us() const {
+            return _last_access_us.load(mutil::memory_order_relaxed);
+        }
+
         int64_t unsafe_get_term(const int64_t index);
 
         // Start a independent thread to append log to LogStorage
@@ -228,6 +253,11 @@ namespace melon::raft {
         LogId _applied_id;
         // TODO(chenzhangyi01): replace deque with a thread-safe data structure
         std::deque<LogEntry * /*FIXME*/> _logs_in_memory;
+        // Bytes of entries in _logs_in_memory, accounted in LogCache
+        int64_t _cached_bytes;
+        // When _logs_in_memory was appended or read last time, for LogCache
+        // to evict from the least recently accessed group
+        mutil::atomic<int64_t> _last_access_us;
         int64_t _first_log_index;
         int64_t _last_log_index;
         // the last snapshot's log_id
@@ -240,6 +270,15 @@ namespace melon::raft {
         LogId _virtual_first_log_id;
 
         fiber::ExecutionQueueId<StableClosure *> _disk_queue;
+
+        // Following fields are only touched in the disk thread
+        // Appends held by adaptive group commit until the next flush
+        std::vector<StableClosure *> _held_appends;
+        bool _group_commit_scheduled;
+        int64_t _group_commit_hold_us;
+        // Smoothed latency and deviation of appending to the storage
+        int64_t _sync_latency_us;
+        int64_t _sync_latency_dev_us;
     };
 
 }  //  namespace melon::raft
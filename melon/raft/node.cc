@@ -146,7 +146,8 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
               _log_storage(nullptr), _meta_storage(nullptr), _closure_queue(nullptr), _config_manager(nullptr), _log_manager(nullptr),
               _fsm_caller(nullptr), _ballot_box(nullptr), _snapshot_executor(nullptr), _stop_transfer_arg(nullptr),
               _vote_triggered(false), _waking_candidate(0), _append_entries_cache(nullptr),
-              _append_entries_cache_version(0), _node_readonly(false), _majority_nodes_readonly(false) {
+              _append_entries_cache_version(0), _read_index_queue_started(false),
+              _node_readonly(false), _majority_nodes_readonly(false), _quiesced(false) {
         mutil::string_printf(&_v_group_id, "%s_%d", _group_id.c_str(), _server_id.idx);
         AddRef();
         g_num_nodes << 1;
@@ -157,7 +158,8 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
               _log_storage(nullptr), _meta_storage(nullptr), _closure_queue(nullptr), _config_manager(nullptr), _log_manager(nullptr),
               _fsm_caller(nullptr), _ballot_box(nullptr), _snapshot_executor(nullptr), _stop_transfer_arg(nullptr),
               _vote_triggered(false), _waking_candidate(0), _append_entries_cache(nullptr),
-              _append_entries_cache_version(0), _node_readonly(false), _majority_nodes_readonly(false) {
+              _append_entries_cache_version(0), _read_index_queue_started(false),
+              _node_readonly(false), _majority_nodes_readonly(false), _quiesced(false) {
         mutil::string_printf(&_v_group_id, "%s_%d", _group_id.c_str(), _server_id.idx);
         AddRef();
         g_num_nodes << 1;
@@ -170,6 +172,10 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
             _apply_queue.reset();
             fiber::execution_queue_join(_apply_queue_id);
         }
+        if (_read_index_queue_started) {
+            fiber::execution_queue_stop(_read_index_queue_id);
+            fiber::execution_queue_join(_read_index_queue_id);
+        }
 
         if (_config_manager) {
             delete _config_manager;
@@ -337,6 +343,7 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
         // fsm caller init, node AddRef in init
         FSMCallerOptions fsm_caller_options;
         fsm_caller_options.usercode_in_pthread = _options.usercode_in_pthread;
+        fsm_caller_options.apply_concurrency = _options.apply_concurrency;
         this->AddRef();
         fsm_caller_options.after_shutdown =
                 melon::NewCallback<NodeImpl *>(after_shutdown, this);
@@ -509,6 +516,14 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
             return -1;
         }
 
+        if (fiber::execution_queue_start(&_read_index_queue_id, nullptr,
+                                           execute_read_index_tasks, this) != 0) {
+            LOG(ERROR) << "node " << _group_id << ":" << _server_id
+                       << " fail to start read_index execution_queue";
+            return -1;
+        }
+        _read_index_queue_started = true;
+
         // Create _fsm_caller first as log_manager needs it to report error
         _fsm_caller = new FSMCaller();
 
@@ -678,6 +693,336 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
         }
     }
 
+    // A batch of read_index() calls sharing one read index.
+    class ReadIndexBatch : public Closure {
+    public:
+        ReadIndexBatch(NodeImpl *node, std::vector<ReadIndexTask> *tasks)
+                : _node(node), _term(0), _index(0) {
+            _node->AddRef();
+            _tasks.swap(*tasks);
+        }
+
+        ~ReadIndexBatch() {
+            _node->Release();
+        }
+
+        void set_read_index(int64_t term, int64_t index) {
+            _term = term;
+            _index = index;
+        }
+
+        // Called when the leadership at _index is confirmed or not. Forwarded
+        // calls are answered right now, local calls wait until the state
+        // machine applies to _index.
+        void on_confirmed(const mutil::Status &st) {
+            bool has_local_task = false;
+            for (size_t i = 0; i < _tasks.size(); ++i) {
+                if (_tasks[i].response == NULL) {
+                    has_local_task = true;
+                    continue;
+                }
+                if (st.ok()) {
+                    _tasks[i].response->set_term(_term);
+                    _tasks[i].response->set_index(_index);
+                } else {
+                    _tasks[i].done->status() = st;
+                }
+                run_closure_in_fiber(_tasks[i].done);
+            }
+            if (!has_local_task) {
+                delete this;
+                return;
+            }
+            if (!st.ok()) {
+                status() = st;
+                return Run();
+            }
+            // Run() is called by FSMCaller
+            _node->_fsm_caller->wait_applied(_index, this);
+        }
+
+        void Run() {
+            for (size_t i = 0; i < _tasks.size(); ++i) {
+                if (_tasks[i].response == NULL) {
+                    if (!status().ok()) {
+                        _tasks[i].done->status() = status();
+                    }
+                    run_closure_in_fiber(_tasks[i].done);
+                }
+            }
+            delete this;
+        }
+
+    private:
+        NodeImpl *_node;
+        std::vector<ReadIndexTask> _tasks;
+        int64_t _term;
+        int64_t _index;
+    };
+
+    // Collects responses of heartbeats sent to confirm the leadership.
+    struct ReadIndexBallotCtx {
+        raft_mutex_t mutex;
+        Ballot ballot;
+        int npending;
+        bool finished;
+        NodeImpl *node;
+        int64_t term;
+        ReadIndexBatch *batch;
+
+        void on_response(const PeerId &peer, bool granted) {
+            std::unique_lock<raft_mutex_t> lck(mutex);
+            bool confirmed = false;
+            if (granted && !finished) {
+                ballot.grant(peer);
+                if (ballot.granted()) {
+                    finished = true;
+                    confirmed = true;
+                }
+            }
+            const bool last = (--npending == 0);
+            bool failed = false;
+            if (last && !finished) {
+                finished = true;
+                failed = true;
+            }
+            lck.unlock();
+            if (confirmed) {
+                batch->on_confirmed(mutil::Status::OK());
+            } else if (failed) {
+                batch->on_confirmed(mutil::Status(
+                        EPERM, "Fail to confirm leadership from a quorum"));
+            }
+            if (last) {
+                node->Release();
+                delete this;
+            }
+        }
+    };
+
+    class ReadIndexHeartbeatDone : public HeartbeatClosure {
+    public:
+        ReadIndexHeartbeatDone(ReadIndexBallotCtx *ctx, const PeerId &peer)
+                : _ctx(ctx), _peer(peer) {}
+
+        const PeerId &peer() const { return _peer; }
+
+        void Run() {
+            bool granted = false;
+            if (cntl.Failed()) {
+                BRAFT_VLOG << "node " << _ctx->node->node_id()
+                           << " fail to send heartbeat for ReadIndex to " << _peer
+                           << ": " << cntl.ErrorText();
+            } else if (response.term() > _ctx->term) {
+                mutil::Status status;
+                status.set_error(EHIGHERTERMRESPONSE, "Leader receives higher term "
+                                 "heartbeat_response from peer:%s",
+                                 _peer.to_string().c_str());
+                _ctx->node->increase_term_to(response.term(), status);
+            } else {
+                // Followers acknowledge the leader of the term even if the
+                // log doesn't match.
+                granted = (response.term() == _ctx->term);
+            }
+            _ctx->on_response(_peer, granted);
+            delete this;
+        }
+
+    private:
+        ReadIndexBallotCtx *_ctx;
+        PeerId _peer;
+    };
+
+    class ReadIndexForwardDone : public google::protobuf::Closure {
+    public:
+        ReadIndexForwardDone(ReadIndexBatch *batch, const PeerId &leader)
+                : _batch(batch), _leader(leader) {}
+
+        void Run() {
+            if (cntl.Failed()) {
+                _batch->on_confirmed(mutil::Status(
+                        EHOSTDOWN, "Fail to forward ReadIndex to leader %s: %s",
+                        _leader.to_string().c_str(), cntl.ErrorText().c_str()));
+            } else if (!response.success()) {
+                _batch->on_confirmed(mutil::Status(
+                        EPERM, "Leader %s fails to confirm ReadIndex",
+                        _leader.to_string().c_str()));
+            } else {
+                _batch->set_read_index(response.term(), response.index());
+                _batch->on_confirmed(mutil::Status::OK());
+            }
+            delete this;
+        }
+
+        melon::Controller cntl;
+        ReadIndexRequest request;
+        ReadIndexResponse response;
+
+    private:
+        ReadIndexBatch *_batch;
+        PeerId _leader;
+    };
+
+    // Answer a ReadIndex forwarded by a follower.
+    class ReadIndexRpcDone : public Closure {
+    public:
+        ReadIndexRpcDone(ReadIndexResponse *response,
+                         google::protobuf::Closure *done)
+                : _response(response), _done(done) {}
+
+        void Run() {
+            _response->set_success(status().ok());
+            if (!_response->has_term()) {
+                _response->set_term(0);
+            }
+            _done->Run();
+            delete this;
+        }
+
+    private:
+        ReadIndexResponse *_response;
+        google::protobuf::Closure *_done;
+    };
+
+    void NodeImpl::read_index(Closure *done) {
+        ReadIndexTask task;
+        task.done = done;
+        task.response = NULL;
+        if (fiber::execution_queue_execute(_read_index_queue_id, task) != 0) {
+            done->status().set_error(EPERM, "Node is down");
+            return run_closure_in_fiber(done);
+        }
+    }
+
+    void NodeImpl::handle_read_index_request(melon::Controller *controller,
+                                             const ReadIndexRequest *request,
+                                             ReadIndexResponse *response,
+                                             google::protobuf::Closure *done) {
+        (void) controller;
+        (void) request;
+        ReadIndexTask task;
+        task.done = new ReadIndexRpcDone(response, done);
+        task.response = response;
+        if (fiber::execution_queue_execute(_read_index_queue_id, task) != 0) {
+            task.done->status().set_error(EPERM, "Node is down");
+            task.done->Run();
+        }
+    }
+
+    DEFINE_int32(raft_read_index_batch, 1024, "Max number of read_index() calls "
+                                               "confirmed in a single batch");
+    MELON_VALIDATE_GFLAG(raft_read_index_batch, ::melon::PositiveInteger);
+
+    int NodeImpl::execute_read_index_tasks(
+            void *meta, fiber::TaskIterator<ReadIndexTask> &iter) {
+        NodeImpl *m = (NodeImpl *) meta;
+        std::vector<ReadIndexTask> tasks;
+        if (iter.is_queue_stopped()) {
+            for (; iter; ++iter) {
+                iter->done->status().set_error(EPERM, "Node is down");
+                run_closure_in_fiber(iter->done);
+            }
+            return 0;
+        }
+        const size_t batch_size = FLAGS_raft_read_index_batch;
+        tasks.reserve(std::min(batch_size, (size_t) 64));
+        for (; iter; ++iter) {
+            if (tasks.size() == batch_size) {
+                m->read_index(&tasks);
+                tasks.clear();
+            }
+            tasks.push_back(*iter);
+        }
+        if (!tasks.empty()) {
+            m->read_index(&tasks);
+        }
+        return 0;
+    }
+
+    void NodeImpl::read_index(std::vector<ReadIndexTask> *tasks) {
+        bool has_forwarded_task = false;
+        for (size_t i = 0; i < tasks->size(); ++i) {
+            if ((*tasks)[i].response != NULL) {
+                has_forwarded_task = true;
+                break;
+            }
+        }
+        ReadIndexBatch *batch = new ReadIndexBatch(this, tasks);
+        std::unique_lock<raft_mutex_t> lck(_mutex);
+        if (_state == STATE_LEADER) {
+            const int64_t read_index = _ballot_box->last_committed_index();
+            // The commit index of a new leader is not up to date until an
+            // entry of its own term is committed.
+            if (_log_manager->get_term(read_index) != _current_term) {
+                lck.unlock();
+                return batch->on_confirmed(mutil::Status(
+                        EAGAIN, "Leader has not committed any log in its term"));
+            }
+            batch->set_read_index(_current_term, read_index);
+            std::set<PeerId> peers;
+            _conf.list_peers(&peers);
+            ReadIndexBallotCtx *ctx = new ReadIndexBallotCtx;
+            ctx->ballot.init(_conf.conf, _conf.stable() ? NULL : &_conf.old_conf);
+            ctx->npending = 1;
+            ctx->finished = false;
+            ctx->node = this;
+            ctx->term = _current_term;
+            ctx->batch = batch;
+            AddRef();
+            std::vector<ReadIndexHeartbeatDone *> dones;
+            for (std::set<PeerId>::const_iterator
+                         iter = peers.begin(); iter != peers.end(); ++iter) {
+                if (*iter == _server_id || !_conf.is_voter(*iter)) {
+                    continue;
+                }
+                ++ctx->npending;
+                dones.push_back(new ReadIndexHeartbeatDone(ctx, *iter));
+            }
+            // All heartbeats are accounted for in npending before any of them
+            // is sent, so that ctx is not released by an early response.
+            std::vector<PeerId> failed_peers;
+            for (size_t i = 0; i < dones.size(); ++i) {
+                const PeerId peer = dones[i]->peer();
+                if (_replicator_group.send_heartbeat(peer, dones[i]) != 0) {
+                    delete dones[i];
+                    failed_peers.push_back(peer);
+                }
+            }
+            lck.unlock();
+            for (size_t i = 0; i < failed_peers.size(); ++i) {
+                ctx->on_response(failed_peers[i], false);
+            }
+            return ctx->on_response(_server_id, true);
+        }
+        if (_state == STATE_FOLLOWER && !_leader_id.is_empty() &&
+            !has_forwarded_task) {
+            ReadIndexForwardDone *done = new ReadIndexForwardDone(batch, _leader_id);
+            done->request.set_group_id(_group_id);
+            done->request.set_server_id(_server_id.to_string());
+            done->request.set_peer_id(_leader_id.to_string());
+            done->cntl.set_timeout_ms(_options.election_timeout_ms);
+            const PeerId leader_id = _leader_id;
+            lck.unlock();
+            melon::ChannelOptions options;
+            options.connection_type = melon::CONNECTION_TYPE_SINGLE;
+            options.max_retry = 0;
+            options.connect_timeout_ms = FLAGS_raft_rpc_channel_connect_timeout_ms;
+            melon::Channel channel;
+            if (channel.Init(leader_id.addr, &options) != 0) {
+                LOG(WARNING) << "node " << _group_id << ":" << _server_id
+                             << " channel init failed, addr " << leader_id.addr;
+                done->cntl.SetFailed(EINVAL, "Fail to init channel to leader");
+                return done->Run();
+            }
+            RaftService_Stub stub(&channel);
+            return stub.read_index(&done->cntl, &done->request, &done->response, done);
+        }
+        lck.unlock();
+        // Don't forward a forwarded request again, the sender would retry with
+        // the new leader by itself.
+        batch->on_confirmed(mutil::Status(EPERM, "Not leader"));
+    }
+
     void NodeImpl::on_configuration_change_done(int64_t term) {
         MELON_SCOPED_LOCK(_mutex);
         if (_state > STATE_TRANSFERRING || term != _current_term) {
@@ -764,7 +1109,7 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
 
     void NodeImpl::check_dead_nodes(const Configuration &conf, int64_t now_ms) {
         std::vector<PeerId> peers;
-        conf.list_peers(&peers);
+        conf.list_voters(&peers);
         size_t alive_count = 0;
         Configuration dead_nodes;  // for easily print
         for (size_t i = 0; i < peers.size(); i++) {
@@ -852,6 +1197,17 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
             return;
         }
 
+        if (new_conf.voter_count() == 0) {
+            LOG(WARNING) << "[" << node_id()
+                         << "] Refusing configuration " << new_conf
+                         << " which has no voter";
+            if (done) {
+                done->status().set_error(EINVAL, "No voter in the new configuration");
+                run_closure_in_fiber(done);
+            }
+            return;
+        }
+
         // Return immediately when the new peers equals to current configuration
         if (_conf.conf.equals(new_conf)) {
             run_closure_in_fiber(done);
@@ -873,6 +1229,9 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
     void NodeImpl::add_peer(const PeerId &peer, Closure *done) {
         MELON_SCOPED_LOCK(_mutex);
         Configuration new_conf = _conf.conf;
+        // Adding an existing peer with another role changes its role, e.g.
+        // promotes a learner to a voter.
+        new_conf.remove_peer(peer);
         new_conf.add_peer(peer);
         return unsafe_register_conf_change(_conf.conf, new_conf, done);
     }
@@ -1001,6 +1360,11 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
                 if (_fsm_caller) {
                     _fsm_caller->shutdown();
                 }
+
+                // Pending read_index() calls fail with "Node is down".
+                if (_read_index_queue_started) {
+                    fiber::execution_queue_stop(_read_index_queue_id);
+                }
             }
 
             if (_state != STATE_SHUTDOWN) {
@@ -1022,6 +1386,9 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
     }
 
     void NodeImpl::join() {
+        if (_read_index_queue_started) {
+            fiber::execution_queue_join(_read_index_queue_id);
+        }
         if (_fsm_caller) {
             _fsm_caller->join();
         }
@@ -1208,6 +1575,12 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
                          << " which doesn't belong to " << _conf.conf;
             return EINVAL;
         }
+        if (!_conf.is_voter(peer_id)) {
+            LOG(WARNING) << "node " << _group_id << ":" << _server_id
+                         << " refused to transfer leadership to peer " << peer_id
+                         << " which is a learner of " << _conf.conf;
+            return EINVAL;
+        }
         const int64_t last_log_index = _log_manager->last_log_index();
         const int rc = _replicator_group.transfer_leadership_to(peer_id, last_log_index);
         if (rc != 0) {
@@ -1607,6 +1980,11 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
                          << " can't do pre_vote as it is not in " << _conf.conf;
             return;
         }
+        if (!_conf.is_voter(_server_id)) {
+            BRAFT_VLOG << "node " << _group_id << ':' << _server_id
+                       << " doesn't do pre_vote as it is a learner of " << _conf.conf;
+            return;
+        }
 
         int64_t old_term = _current_term;
         // get last_log_id outof node mutex
@@ -1626,7 +2004,7 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
 
         for (std::set<PeerId>::const_iterator
                      iter = peers.begin(); iter != peers.end(); ++iter) {
-            if (*iter == _server_id) {
+            if (*iter == _server_id || !_conf.is_voter(*iter)) {
                 continue;
             }
             melon::ChannelOptions options;
@@ -1666,6 +2044,11 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
                          << " can't do elect_self as it is not in " << _conf.conf;
             return;
         }
+        if (!_conf.is_voter(_server_id)) {
+            LOG(WARNING) << "node " << _group_id << ':' << _server_id
+                         << " can't do elect_self as it is a learner of " << _conf.conf;
+            return;
+        }
         // cancel follower election timer
         if (_state == STATE_FOLLOWER) {
             BRAFT_VLOG << "node " << _group_id << ":" << _server_id
@@ -1732,7 +2115,7 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
                                          const DisruptedLeader &disrupted_leader) {
         for (std::set<PeerId>::const_iterator
                      iter = peers.begin(); iter != peers.end(); ++iter) {
-            if (*iter == _server_id) {
+            if (*iter == _server_id || !_conf.is_voter(*iter)) {
                 continue;
             }
             melon::ChannelOptions options;
@@ -1863,6 +2246,7 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
                 _fsm_caller->on_stop_following(stop_following_context);
             }
             _leader_id.reset();
+            _quiesced = false;
         } else {
             if (_leader_id.is_empty()) {
                 _pre_vote_ctx.reset(this);
@@ -2092,6 +2476,18 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
         _log_manager->check_and_set_configuration(&_conf);
     }
 
+    bool NodeImpl::handle_quiesced_heartbeat(const PeerId &server_id,
+                                             int64_t term) {
+        MELON_SCOPED_LOCK(_mutex);
+        if (_state != STATE_FOLLOWER || !_quiesced || term != _current_term
+            || server_id != _leader_id) {
+            return false;
+        }
+        // The leader listed this group, it's still alive
+        _follower_lease.renew(_leader_id);
+        return true;
+    }
+
     int NodeImpl::handle_pre_vote_request(const RequestVoteRequest *request,
                                           RequestVoteResponse *response) {
         std::unique_lock<raft_mutex_t> lck(_mutex);
@@ -2375,6 +2771,22 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
         std::vector<LogEntry *> entries;
         entries.reserve(request->entries_size());
         melon::ClosureGuard done_guard(done);
+        response->set_accept_compress(true);
+        // Decompress out of _mutex which blocks other requests to this node.
+        // Requests from the cache were decompressed when they were received.
+        if (request->compress_type() != 0 && !from_append_entries_cache) {
+            mutil::IOBuf data_buf;
+            if (decompress_log_data(request->compress_type(),
+                                    cntl->request_attachment(), &data_buf) != 0) {
+                LOG(WARNING) << "node " << _group_id << ":" << _server_id
+                             << " fail to decompress entries from " << request->server_id()
+                             << " with compress_type=" << request->compress_type();
+                cntl->SetFailed(EINVAL, "Fail to decompress entries with compress_type=%d",
+                                request->compress_type());
+                return;
+            }
+            cntl->request_attachment().swap(data_buf);
+        }
         std::unique_lock<raft_mutex_t> lck(_mutex);
 
         // pre set term, to avoid get term in lock
@@ -2438,6 +2850,7 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
             // Requests from cache already updated timestamp
             _follower_lease.renew(_leader_id);
         }
+        _quiesced = false;
 
         if (request->entries_size() > 0 &&
             (_snapshot_executor
@@ -2499,6 +2912,7 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
             response->set_term(_current_term);
             response->set_last_log_index(_log_manager->last_log_index());
             response->set_readonly(_node_readonly);
+            _quiesced = request->quiesce();
             lck.unlock();
             // see the comments at FollowerStableClosure::run()
             _ballot_box->set_last_committed_index(
@@ -2507,7 +2921,7 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
             return;
         }
 
-        // Parse request
+        // Parse request, the attachment was decompressed before locking.
         mutil::IOBuf data_buf;
         data_buf.swap(cntl->request_attachment());
         int64_t index = prev_log_index;
@@ -3196,6 +3610,18 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
         Configuration removing;
         new_conf.diffs(old_conf, &adding, &removing);
         _nchanges = adding.size() + removing.size();
+        // A peer changing its role alters the voters just like adding or
+        // removing it. A promoted learner has to catch up as well.
+        for (Configuration::const_iterator
+                     iter = new_conf.begin(); iter != new_conf.end(); ++iter) {
+            if (old_conf.contains(*iter) &&
+                old_conf.is_learner(*iter) != iter->is_learner()) {
+                ++_nchanges;
+                if (!iter->is_learner()) {
+                    adding.add_peer(*iter);
+                }
+            }
+        }
 
         std::stringstream ss;
         ss << "node " << _node->_group_id << ":" << _node->_server_id
@@ -3291,13 +3717,18 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
                 return _node->unsafe_apply_configuration(
                         Configuration(_new_peers), nullptr, false);
             case STAGE_STABLE: {
-                bool should_step_down =
-                        _new_peers.find(_node->_server_id) == _new_peers.end();
+                std::set<PeerId>::const_iterator self =
+                        _new_peers.find(_node->_server_id);
+                const bool removed = self == _new_peers.end();
+                // Step down as well when this node became a learner.
+                const bool should_step_down = removed || self->is_learner();
                 mutil::Status st = mutil::Status::OK();
                 reset(&st);
                 if (should_step_down) {
                     _node->step_down(_node->_current_term, true,
-                                     mutil::Status(ELEADERREMOVED, "This node was removed"));
+                                     mutil::Status(ELEADERREMOVED, "This node %s",
+                                                   removed ? "was removed"
+                                                           : "became a learner"));
                 }
                 return;
             }
@@ -3385,7 +3816,7 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
 
     void NodeImpl::check_majority_nodes_readonly(const Configuration &conf) {
         std::vector<PeerId> peers;
-        conf.list_peers(&peers);
+        conf.list_voters(&peers);
         size_t readonly_nodes = 0;
         for (size_t i = 0; i < peers.size(); i++) {
             if (peers[i] == _server_id) {
@@ -3606,7 +4037,7 @@ melon::var::Adder<int64_t> g_num_nodes("raft_node_count");
 
     int64_t NodeImpl::last_leader_active_timestamp(const Configuration &conf) {
         std::vector<PeerId> peers;
-        conf.list_peers(&peers);
+        conf.list_voters(&peers);
         std::vector<int64_t> last_rpc_send_timestamps;
         LastActiveTimestampCompare compare;
         for (size_t i = 0; i < peers.size(); i++) {
@@ -50,6 +50,14 @@ namespace melon::raft {
 
     class NodeImpl;
 
+    // A read_index() call queued in NodeImpl. |response| is not NULL when the
+    // call is forwarded by a follower, which is answered with the read index
+    // once the leadership is confirmed, without waiting for the state machine.
+    struct ReadIndexTask {
+        Closure *done;
+        ReadIndexResponse *response;
+    };
+
     class NodeTimer : public RepeatedTimerTask {
     public:
         NodeTimer() : _node(NULL) {}
@@ -110,6 +118,8 @@ namespace melon::raft {
 
         friend class VoteBallotCtx;
 
+        friend class ReadIndexBatch;
+
     public:
         NodeImpl(const GroupId &group_id, const PeerId &peer_id);
 
@@ -153,6 +163,9 @@ namespace melon::raft {
         //
         void apply(const Task &task);
 
+        // Linearizable read, see Node::read_index
+        void read_index(Closure *done);
+
         mutil::Status list_peers(std::vector<PeerId> *peers);
 
         // @Node configuration change
@@ -192,6 +205,10 @@ namespace melon::raft {
                                            google::protobuf::Closure *done,
                                            bool from_append_entries_cache = false);
 
+        // handle the quiesced group listed in a coalesced heartbeat from the
+        // leader |server_id|, returns false if not quiesced following it
+        bool handle_quiesced_heartbeat(const PeerId &server_id, int64_t term);
+
         // handle received InstallSnapshot
         void handle_install_snapshot_request(melon::Controller *controller,
                                              const InstallSnapshotRequest *request,
@@ -203,6 +220,12 @@ namespace melon::raft {
                                         TimeoutNowResponse *response,
                                         google::protobuf::Closure *done);
 
+        // handle ReadIndex forwarded by followers
+        void handle_read_index_request(melon::Controller *controller,
+                                       const ReadIndexRequest *request,
+                                       ReadIndexResponse *response,
+                                       google::protobuf::Closure *done);
+
         // timer func
         void handle_election_timeout();
 
@@ -358,6 +381,13 @@ namespace melon::raft {
 
         void apply(LogEntryAndClosure tasks[], size_t size);
 
+        static int execute_read_index_tasks(
+                void *meta, fiber::TaskIterator<ReadIndexTask> &iter);
+
+        // Confirm leadership for a batch of read_index() calls with a single
+        // round of heartbeats, or forward them to the leader.
+        void read_index(std::vector<ReadIndexTask> *tasks);
+
         void check_dead_nodes(const Configuration &conf, int64_t now_ms);
 
         void check_witness(const Configuration &conf);
@@ -630,11 +660,17 @@ namespace melon::raft {
         fiber::ExecutionQueue<LogEntryAndClosure>::scoped_ptr_t _apply_queue;
         AppendEntriesCache *_append_entries_cache;
         int64_t _append_entries_cache_version;
+        fiber::ExecutionQueueId<ReadIndexTask> _read_index_queue_id;
+        bool _read_index_queue_started;
 
         // for readonly mode
         bool _node_readonly;
         bool _majority_nodes_readonly;
 
+        // The leader has stopped heartbeating this idle group, see
+        // raft_quiesce_idle_groups
+        bool _quiesced;
+
         LeaderLease _leader_lease;
         FollowerLease _follower_lease;
     };
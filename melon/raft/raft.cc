@@ -28,6 +28,7 @@
 #include <melon/raft/node_manager.h>
 #include <melon/raft/log.h>
 #include <melon/raft/memory_log.h>
+#include <melon/raft/shared_log.h>
 #include <melon/raft/raft_meta.h>
 #include <melon/raft/snapshot.h>
 #include <melon/raft/fsm_caller.h>            // IteratorImpl
@@ -51,6 +52,7 @@ namespace melon::raft {
     struct GlobalExtension {
         SegmentLogStorage local_log;
         MemoryLogStorage memory_log;
+        SharedLogStorage shared_log;
 
         // manage only one raft instance
         FileBasedSingleMetaStorage single_meta;
@@ -67,6 +69,7 @@ namespace melon::raft {
 
         log_storage_extension()->RegisterOrDie("local", &s_ext.local_log);
         log_storage_extension()->RegisterOrDie("memory", &s_ext.memory_log);
+        log_storage_extension()->RegisterOrDie("shared", &s_ext.shared_log);
 
         // uri = local://{single_path}
         // |single_path| usually ends with `/meta'
@@ -185,6 +188,10 @@ namespace melon::raft {
         _impl->apply(task);
     }
 
+    void Node::read_index(Closure *done) {
+        _impl->read_index(done);
+    }
+
     mutil::Status Node::list_peers(std::vector<PeerId> *peers) {
         return _impl->list_peers(peers);
     }
@@ -277,6 +284,10 @@ namespace melon::raft {
 
     void StateMachine::on_shutdown() {}
 
+    bool StateMachine::get_apply_key(const mutil::IOBuf &, uint64_t *) {
+        return false;
+    }
+
     void StateMachine::on_snapshot_save(SnapshotWriter *writer, Closure *done) {
         (void) writer;
         CHECK(done);
@@ -226,6 +226,22 @@ namespace melon::raft {
         // and report a error whose type is ERROR_TYPE_STATE_MACHINE.
         virtual void on_apply(::melon::raft::Iterator &iter) = 0;
 
+        // Partitioned apply, only used when NodeOptions::apply_concurrency > 1.
+        //
+        // Returns true and sets |key| if the task whose data is |data| only
+        // conflicts with the tasks with the same key. Tasks with the same key
+        // are applied in the order of their indexes, while tasks with different
+        // keys may be applied concurrently: on_apply is called by multiple fibers
+        // at the same time, each of them iterating tasks of a subset of the keys.
+        // Returns false if the task conflicts with all the others, it's applied
+        // alone after all the tasks before it.
+        //
+        // If set_error_and_rollback is called by a concurrent on_apply, only the
+        // tasks iterated by that call are rolled back while tasks of other keys
+        // after them may have been applied.
+        // Default: return false.
+        virtual bool get_apply_key(const mutil::IOBuf &data, uint64_t *key);
+
         // Invoked once when the raft node was shut down.
         // Default do nothing
         virtual void on_shutdown();
@@ -623,6 +639,13 @@ namespace melon::raft {
         // Default: false
         bool witness = false;
 
+        // Max number of fibers applying committed tasks concurrently. If greater
+        // than 1, tasks are partitioned by StateMachine::get_apply_key, tasks
+        // with different keys are applied concurrently and the applied index
+        // advances after all of them are applied.
+        // Default: 1
+        int apply_concurrency = 1;
+
         // Construct a default instance
         NodeOptions();
 
@@ -692,6 +715,21 @@ namespace melon::raft {
         //
         void apply(const Task &task);
 
+        // [Thread-safe and wait-free]
+        // Linearizable read without writing the log (ReadIndex in the raft
+        // paper). |done| is called once the leadership at the time of the
+        // call is confirmed by a quorum and the state machine has applied all
+        // logs committed before the call, so that a read performed in |done|
+        // observes every write acknowledged before read_index is called.
+        // Concurrent calls share one round of heartbeats. Followers forward
+        // the call to the leader and wait for their own state machine to
+        // catch up with the index returned by the leader.
+        //
+        // |done| fails with EPERM if the node is neither the leader nor aware
+        // of one, and with EAGAIN if the leader hasn't committed any log in
+        // its term yet; in both cases the caller may retry later.
+        void read_index(Closure *done);
+
         // list peers of this raft group, only leader retruns ok
         // [NOTE] when list_peers concurrency with add_peer/remove_peer, maybe return peers is staled.
         // because add_peer/remove_peer immediately modify configuration in memory
@@ -699,6 +737,10 @@ namespace melon::raft {
 
         // Add a new peer to the raft group. done->Run() would be invoked after this
         // operation finishes, describing the detailed result.
+        // A peer whose role is LEARNER is replicated but neither votes nor
+        // counts toward any quorum, it serves follower reads through
+        // read_index(). Adding an existing peer with another role changes its
+        // role, e.g. promotes a learner once it catches up.
         void add_peer(const PeerId &peer, Closure *done);
 
         // Remove the peer from the raft group. done->Run() would be invoked after
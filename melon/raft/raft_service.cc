@@ -168,4 +168,152 @@ namespace melon::raft {
         node->handle_timeout_now_request(cntl, request, response, done);
     }
 
+    void RaftServiceImpl::read_index(::google::protobuf::RpcController *controller,
+                                     const ::melon::raft::ReadIndexRequest *request,
+                                     ::melon::raft::ReadIndexResponse *response,
+                                     ::google::protobuf::Closure *done) {
+        melon::Controller *cntl =
+                static_cast<melon::Controller *>(controller);
+
+        PeerId peer_id;
+        if (0 != peer_id.parse(request->peer_id())) {
+            cntl->SetFailed(EINVAL, "peer_id invalid");
+            done->Run();
+            return;
+        }
+
+        scoped_refptr<NodeImpl> node_ptr =
+                global_node_manager->get(request->group_id(), peer_id);
+        NodeImpl *node = node_ptr.get();
+        if (!node) {
+            cntl->SetFailed(ENOENT, "peer_id not exist");
+            done->Run();
+            return;
+        }
+
+        node->handle_read_index_request(cntl, request, response, done);
+    }
+
+    // Collects the results of heartbeats in a coalesced RPC, which is
+    // responded after all of them are handled.
+    class CoalescedHeartbeatCtx {
+    public:
+        class HeartbeatDone : public google::protobuf::Closure {
+        public:
+            void Run() { ctx->on_heartbeat_done(index); }
+
+            CoalescedHeartbeatCtx *ctx;
+            int index;
+        };
+
+        CoalescedHeartbeatCtx(int n, CoalescedHeartbeatResponse *response,
+                              google::protobuf::Closure *done)
+                : _npending(n + 1), _response(response), _done(done)
+                , _cntls(new melon::Controller[n]), _dones(new HeartbeatDone[n]) {
+            for (int i = 0; i < n; ++i) {
+                _dones[i].ctx = this;
+                _dones[i].index = i;
+                AppendEntriesResponse *res = response->add_responses();
+                res->set_term(0);
+                res->set_success(false);
+                response->add_error_codes(0);
+            }
+        }
+
+        ~CoalescedHeartbeatCtx() {
+            delete[] _cntls;
+            delete[] _dones;
+        }
+
+        melon::Controller *cntl(int i) { return &_cntls[i]; }
+
+        google::protobuf::Closure *done(int i) { return &_dones[i]; }
+
+        void on_heartbeat_done(int i) {
+            if (_cntls[i].Failed()) {
+                _response->set_error_codes(i, _cntls[i].ErrorCode());
+            }
+            release();
+        }
+
+        // Called after all the heartbeats are dispatched.
+        void release() {
+            if (_npending.fetch_sub(1, mutil::memory_order_acq_rel) == 1) {
+                _done->Run();
+                delete this;
+            }
+        }
+
+    private:
+        mutil::atomic<int> _npending;
+        CoalescedHeartbeatResponse *_response;
+        google::protobuf::Closure *_done;
+        melon::Controller *_cntls;
+        HeartbeatDone *_dones;
+    };
+
+    void RaftServiceImpl::coalesced_heartbeat(
+            ::google::protobuf::RpcController *controller,
+            const ::melon::raft::CoalescedHeartbeatRequest *request,
+            ::melon::raft::CoalescedHeartbeatResponse *response,
+            ::google::protobuf::Closure *done) {
+        melon::ClosureGuard done_guard(done);
+        melon::Controller *cntl =
+                static_cast<melon::Controller *>(controller);
+
+        mutil::EndPoint server_addr;
+        if (0 != mutil::str2endpoint(request->server_addr().c_str(), &server_addr)) {
+            cntl->SetFailed(EINVAL, "server_addr invalid");
+            return;
+        }
+        for (int i = 0; i < request->quiesced_groups_size(); ++i) {
+            const QuiescedGroup &group = request->quiesced_groups(i);
+            PeerId peer_id;
+            PeerId server_id;
+            bool ack = false;
+            if (0 == peer_id.parse(group.peer_id()) &&
+                0 == server_id.parse(group.server_id())) {
+                scoped_refptr<NodeImpl> node_ptr =
+                        global_node_manager->get(group.group_id(), peer_id);
+                if (node_ptr) {
+                    ack = node_ptr->handle_quiesced_heartbeat(server_id,
+                                                              group.term());
+                }
+            }
+            response->add_quiesced_acks(ack);
+        }
+        if (request->heartbeats_size() == 0) {
+            return;
+        }
+
+        CoalescedHeartbeatCtx *ctx = new CoalescedHeartbeatCtx(
+                request->heartbeats_size(), response, done_guard.release());
+        for (int i = 0; i < request->heartbeats_size(); ++i) {
+            const AppendEntriesRequest &hb = request->heartbeats(i);
+            PeerId peer_id;
+            if (hb.entries_size() != 0) {
+                ctx->cntl(i)->SetFailed(EINVAL, "Not a heartbeat");
+                ctx->done(i)->Run();
+                continue;
+            }
+            if (0 != peer_id.parse(hb.peer_id())) {
+                ctx->cntl(i)->SetFailed(EINVAL, "peer_id invalid");
+                ctx->done(i)->Run();
+                continue;
+            }
+            scoped_refptr<NodeImpl> node_ptr =
+                    global_node_manager->get(hb.group_id(), peer_id);
+            NodeImpl *node = node_ptr.get();
+            if (!node) {
+                ctx->cntl(i)->SetFailed(ENOENT, "peer_id not exist");
+                ctx->done(i)->Run();
+                continue;
+            }
+            node->handle_append_entries_request(ctx->cntl(i), &hb,
+                                                response->mutable_responses(i),
+                                                ctx->done(i));
+        }
+        ctx->release();
+    }
+
 }
@@ -55,6 +55,16 @@ namespace melon::raft {
                          ::melon::raft::TimeoutNowResponse *response,
                          ::google::protobuf::Closure *done);
 
+        void read_index(::google::protobuf::RpcController *controller,
+                        const ::melon::raft::ReadIndexRequest *request,
+                        ::melon::raft::ReadIndexResponse *response,
+                        ::google::protobuf::Closure *done);
+
+        void coalesced_heartbeat(::google::protobuf::RpcController *controller,
+                                 const ::melon::raft::CoalescedHeartbeatRequest *request,
+                                 ::melon::raft::CoalescedHeartbeatResponse *response,
+                                 ::google::protobuf::Closure *done);
+
     private:
         mutil::EndPoint _addr;
     };
@@ -156,6 +156,41 @@ namespace melon::raft {
         return session;
     }
 
+    scoped_refptr<RemoteFileCopier::Session>
+    RemoteFileCopier::start_to_copy_range_to_file(
+            const std::string &source,
+            const std::string &dest_path,
+            int64_t offset, int64_t count,
+            const CopyOptions *options) {
+        mutil::File::Error e;
+        FileAdaptor *file = _fs->open(dest_path, O_WRONLY | O_CREAT | O_CLOEXEC, NULL, &e);
+
+        if (!file) {
+            LOG(ERROR) << "Fail to open " << dest_path
+                       << ", " << mutil::File::ErrorToString(e);
+            return NULL;
+        }
+
+        scoped_refptr<Session> session(new Session());
+        session->_dest_path = dest_path;
+        session->_file = file;
+        session->_end_offset = offset + count;
+        session->_request.set_filename(source);
+        session->_request.set_reader_id(_reader_id);
+        // The first RPC starts at offset + count of this fake previous one
+        session->_request.set_offset(offset);
+        session->_request.set_count(0);
+        session->_channel = &_channel;
+        if (options) {
+            session->_options = *options;
+        }
+        if (_throttle) {
+            session->_throttle = _throttle;
+        }
+        session->send_next_rpc();
+        return session;
+    }
+
     scoped_refptr<RemoteFileCopier::Session>
     RemoteFileCopier::start_to_copy_to_iobuf(
             const std::string &source,
@@ -176,7 +211,7 @@ namespace melon::raft {
     }
 
     RemoteFileCopier::Session::Session()
-            : _channel(NULL), _file(NULL), _retry_times(0), _finished(false), _buf(NULL), _timer(), _throttle(NULL),
+            : _channel(NULL), _end_offset(-1), _file(NULL), _retry_times(0), _finished(false), _buf(NULL), _timer(), _throttle(NULL),
               _throttle_token_acquire_time_us(1) {
         _done.owner = this;
     }
@@ -194,8 +229,11 @@ namespace melon::raft {
         _response.Clear();
         // Not clear request as we need some fields of the previous RPC
         off_t offset = _request.offset() + _request.count();
-        const size_t max_count =
+        size_t max_count =
                 (!_buf) ? FLAGS_raft_max_byte_count_per_rpc : UINT_MAX;
+        if (_end_offset >= 0) {
+            max_count = std::min(max_count, size_t(_end_offset - offset));
+        }
         _cntl.set_timeout_ms(_options.timeout_ms);
         _request.set_offset(offset);
         // Read partly when throttled
@@ -316,7 +354,8 @@ namespace melon::raft {
                 _buf->append(seg_data);
             }
         }
-        if (_response.eof()) {
+        if (_response.eof() || (_end_offset >= 0 &&
+                                _request.offset() + _request.count() >= _end_offset)) {
             on_finished();
             return;
         }
@@ -91,6 +91,8 @@ namespace melon::raft {
             mutil::Status _st;
             melon::Channel *_channel;
             std::string _dest_path;
+            // Stop at this offset instead of the end of the file if it's not -1
+            int64_t _end_offset;
             FileAdaptor *_file;
             int _retry_times;
             bool _finished;
@@ -126,6 +128,14 @@ namespace melon::raft {
                 const std::string &dest_path,
                 const CopyOptions *options);
 
+        // Copy [offset, offset + count) of `source' from remote to the same
+        // range of dest_path, other parts of dest_path are left untouched.
+        scoped_refptr<Session> start_to_copy_range_to_file(
+                const std::string &source,
+                const std::string &dest_path,
+                int64_t offset, int64_t count,
+                const CopyOptions *options);
+
         scoped_refptr<Session> start_to_copy_to_iobuf(
                 const std::string &source,
                 mutil::IOBuf *dest_buf,
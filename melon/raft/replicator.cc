@@ -28,6 +28,7 @@
 #include <melon/raft/ballot_box.h>                    // BallotBox
 #include <melon/raft/log_entry.h>                     // LogEntry
 #include <melon/raft/snapshot_throttle.h>             // SnapshotThrottle
+#include <melon/raft/heartbeat_coalescer.h>           // HeartbeatCoalescer
 #include <melon/raft/config.h>
 
 namespace melon::raft {
@@ -50,11 +51,33 @@ namespace melon::raft {
     MELON_VALIDATE_GFLAG(raft_retry_replicate_interval_ms,
                         melon::PositiveInteger);
 
+    static bool validate_replication_compress_type(const char *, int32_t value) {
+        return is_log_compress_type_supported(value);
+    }
+
+    DEFINE_int32(raft_replication_compress_type, 0,
+                 "Compress data of entries in AppendEntriesRequest with this "
+                 "melon::CompressType, 0 means no compression. Only entries "
+                 "sent to followers which reported that they can decompress "
+                 "are compressed");
+    MELON_VALIDATE_GFLAG(raft_replication_compress_type,
+                        validate_replication_compress_type);
+
+    DEFINE_int32(raft_replication_compress_min_bytes, 4096,
+                 "Data of entries in AppendEntriesRequest shorter than this "
+                 "value are not compressed");
+    MELON_VALIDATE_GFLAG(raft_replication_compress_min_bytes,
+                        ::melon::NonNegativeInteger);
+
     static melon::var::LatencyRecorder g_send_entries_latency("raft_send_entries");
     static melon::var::LatencyRecorder g_normalized_send_entries_latency(
             "raft_send_entries_normalized");
     static melon::var::CounterRecorder g_send_entries_batch_counter(
             "raft_send_entries_batch_counter");
+    static melon::var::Adder<int64_t> g_send_entries_raw_bytes(
+            "raft_send_entries_raw_bytes");
+    static melon::var::Adder<int64_t> g_send_entries_compressed_bytes(
+            "raft_send_entries_compressed_bytes");
 
     ReplicatorOptions::ReplicatorOptions()
             : dynamic_heartbeat_timeout_ms(NULL), log_manager(NULL), ballot_box(NULL), node(NULL), term(0),
@@ -64,7 +87,8 @@ namespace melon::raft {
     Replicator::Replicator()
             : _next_index(0), _flying_append_entries_size(0), _consecutive_error_times(0), _has_succeeded(false),
               _timeout_now_index(0), _heartbeat_counter(0), _append_entries_counter(0), _install_snapshot_counter(0),
-              _readonly_index(0), _wait_id(0), _is_waiter_canceled(false), _reader(NULL), _catchup_closure(NULL) {
+              _readonly_index(0), _wait_id(0), _is_waiter_canceled(false), _reader(NULL), _catchup_closure(NULL),
+              _idle_heartbeats(0), _quiesced(false), _quiesced_ms(0), _peer_accepts_compress(false) {
         _install_snapshot_in_fly.value = 0;
         _heartbeat_in_fly.value = 0;
         _timeout_now_in_fly.value = 0;
@@ -287,11 +311,13 @@ namespace melon::raft {
             << " fail to issue RPC to " << r->_options.peer_id
             << " _consecutive_error_times=" << r->_consecutive_error_times
             << ", " << cntl->ErrorText();
+            r->_peer_accepts_compress = false;
             r->_start_heartbeat_timer(start_time_us);
             CHECK_EQ(0, fiber_session_unlock(dummy_id)) << "Fail to unlock " << dummy_id;
             return;
         }
         r->_consecutive_error_times = 0;
+        r->_peer_accepts_compress = response->accept_compress();
         if (response->term() > r->_options.term) {
             ss << " fail, greater term " << response->term()
                << " expect term " << r->_options.term;
@@ -318,6 +344,14 @@ namespace melon::raft {
         BRAFT_VLOG << ss.str() << " readonly " << readonly;
         r->_update_last_rpc_send_timestamp(rpc_send_time);
         r->_start_heartbeat_timer(start_time_us);
+        // Nothing was sent since the quiesce heartbeat, otherwise
+        // _idle_heartbeats would have been reset.
+        if (request->quiesce() && response->success() &&
+            r->_idle_heartbeats >= FLAGS_raft_quiesce_idle_heartbeats &&
+            !r->_quiesced) {
+            r->_quiesced = true;
+            r->_quiesced_ms = mutil::monotonic_time_ms();
+        }
         NodeImpl *node_impl = NULL;
         // Check if readonly config changed
         if ((readonly && r->_readonly_index == 0) ||
@@ -392,10 +426,12 @@ namespace melon::raft {
             // so we need to block the follower for a while instead of looping until
             // it comes back or be removed
             // dummy_id is unlock in block
+            r->_peer_accepts_compress = false;
             r->_reset_next_index();
             return r->_block(start_time_us, cntl->ErrorCode());
         }
         r->_consecutive_error_times = 0;
+        r->_peer_accepts_compress = response->accept_compress();
         if (!response->success()) {
             if (response->term() > r->_options.term) {
                 BRAFT_VLOG << " fail, greater term " << response->term()
@@ -532,9 +568,22 @@ namespace melon::raft {
         request->set_prev_log_index(prev_log_index);
         request->set_prev_log_term(prev_log_term);
         request->set_committed_index(_options.ballot_box->last_committed_index());
+        if (!is_heartbeat) {
+            _idle_heartbeats = 0;
+            _quiesced = false;
+        }
         return 0;
     }
 
+    bool Replicator::_is_idle() {
+        const int64_t last_log_index = _options.log_manager->last_log_index();
+        return _st.st == IDLE && _append_entries_in_fly.empty()
+               && _next_index == last_log_index + 1
+               && _options.ballot_box->last_committed_index() == last_log_index
+               && _timeout_now_index == 0 && _catchup_closure == NULL
+               && _readonly_index == 0;
+    }
+
     void Replicator::_send_empty_entries(bool is_heartbeat) {
         std::unique_ptr<melon::Controller> cntl(new melon::Controller);
         std::unique_ptr<AppendEntriesRequest> request(new AppendEntriesRequest);
@@ -546,10 +595,17 @@ namespace melon::raft {
             return _install_snapshot();
         }
         if (is_heartbeat) {
-            _heartbeat_in_fly = cntl->call_id();
             _heartbeat_counter++;
             // set RPC timeout for heartbeat, how long should timeout be is waiting to be optimized.
             cntl->set_timeout_ms(*_options.election_timeout_ms / 2);
+            if (FLAGS_raft_quiesce_idle_groups && FLAGS_raft_enable_coalesced_heartbeat
+                && _is_idle()) {
+                if (++_idle_heartbeats >= FLAGS_raft_quiesce_idle_heartbeats) {
+                    request->set_quiesce(true);
+                }
+            } else {
+                _idle_heartbeats = 0;
+            }
         } else {
             _st.st = APPENDING_ENTRIES;
             _st.first_log_index = _next_index;
@@ -571,6 +627,18 @@ namespace melon::raft {
                 _id.value, cntl.get(), request.get(), response.get(),
                 mutil::monotonic_time_ms());
 
+        if (is_heartbeat && FLAGS_raft_enable_coalesced_heartbeat) {
+            // Not cancelable, the response is dropped by _on_heartbeat_returned
+            // once the replicator is stopped.
+            HeartbeatCoalescer::GetInstance()->send(
+                    _options.server_id.addr, _options.peer_id.addr,
+                    cntl.release(), request.release(), response.release(), done);
+            CHECK_EQ(0, fiber_session_unlock(_id)) << "Fail to unlock " << _id;
+            return;
+        }
+        if (is_heartbeat) {
+            _heartbeat_in_fly = cntl->call_id();
+        }
         RaftService_Stub stub(&_sending_channel);
         stub.append_entries(cntl.release(), request.release(),
                             response.release(), done);
@@ -619,6 +687,34 @@ namespace melon::raft {
         return 0;
     }
 
+    void Replicator::_compress_entries(AppendEntriesRequest *request,
+                                       mutil::IOBuf *data) {
+        const int compress_type = FLAGS_raft_replication_compress_type;
+        // Followers of older versions ignore compress_type and would take
+        // compressed data as entries.
+        if (compress_type == 0 || !_peer_accepts_compress
+            || data->length() < (size_t) FLAGS_raft_replication_compress_min_bytes) {
+            return;
+        }
+        // Data of all entries are compressed as a whole, which is much more
+        // effective than compressing small entries one by one.
+        mutil::IOBuf compressed;
+        if (compress_log_data(compress_type, *data, &compressed) != 0) {
+            LOG(WARNING) << "node " << _options.group_id << ":" << _options.server_id
+                         << " fail to compress entries sent to " << _options.peer_id
+                         << " with compress_type=" << compress_type;
+            return;
+        }
+        g_send_entries_raw_bytes << data->length();
+        if (compressed.length() >= data->length()) {
+            g_send_entries_compressed_bytes << data->length();
+            return;
+        }
+        g_send_entries_compressed_bytes << compressed.length();
+        data->swap(compressed);
+        request->set_compress_type(compress_type);
+    }
+
     void Replicator::_send_entries() {
         if (_flying_append_entries_size >= FLAGS_raft_max_entries_size ||
             _append_entries_in_fly.size() >= (size_t) FLAGS_raft_max_parallel_append_entries_rpc_num ||
@@ -667,6 +763,7 @@ namespace melon::raft {
             }
             return _wait_more_entries();
         }
+        _compress_entries(request.get(), &cntl->request_attachment());
 
         _append_entries_in_fly.push_back(FlyingAppendEntriesRpc(_next_index,
                                                                 request->entries_size(), cntl->call_id()));
@@ -966,6 +1063,32 @@ namespace melon::raft {
             // This replicator is stopped
             return NULL;
         }
+        if (r->_quiesced) {
+            // The follower doesn't expect heartbeats of this group, it's alive
+            // as long as it acknowledges the group in coalesced heartbeats.
+            QuiescedGroup group;
+            r->_fill_quiesced_group(&group);
+            const int64_t last_ack_ms = std::max(r->_quiesced_ms,
+                    HeartbeatCoalescer::GetInstance()->keepalive(
+                            r->_options.server_id.addr, r->_options.peer_id.addr,
+                            group, *r->_options.election_timeout_ms / 2));
+            if (mutil::monotonic_time_ms() - last_ack_ms <=
+                *r->_options.election_timeout_ms / 2) {
+                r->_update_last_rpc_send_timestamp(last_ack_ms);
+                r->_start_heartbeat_timer(mutil::gettimeofday_us());
+                CHECK_EQ(0, fiber_session_unlock(id)) << "Fail to unlock " << id;
+                return NULL;
+            }
+            // The follower is unreachable or not quiesced any more, e.g. it
+            // has restarted, go back to heartbeats.
+            LOG(WARNING) << "Group " << r->_options.group_id
+                         << " quiesced follower " << r->_options.peer_id
+                         << " stopped acknowledging, resume heartbeats";
+            HeartbeatCoalescer::GetInstance()->forget(
+                    r->_options.server_id.addr, r->_options.peer_id.addr, group);
+            r->_quiesced = false;
+            r->_idle_heartbeats = 0;
+        }
         // id is unlock in _send_empty_entries;
         r->_send_empty_entries(true);
         return NULL;
@@ -974,6 +1097,13 @@ namespace melon::raft {
     int Replicator::_on_error(fiber_session_t id, void *arg, int error_code) {
         Replicator *r = (Replicator *) arg;
         if (error_code == ESTOP) {
+            if (r->_quiesced) {
+                QuiescedGroup group;
+                r->_fill_quiesced_group(&group);
+                HeartbeatCoalescer::GetInstance()->forget(
+                        r->_options.server_id.addr, r->_options.peer_id.addr, group);
+                r->_wake_up_follower();
+            }
             melon::StartCancel(r->_install_snapshot_in_fly);
             melon::StartCancel(r->_heartbeat_in_fly);
             melon::StartCancel(r->_timeout_now_in_fly);
@@ -1006,6 +1136,30 @@ namespace melon::raft {
         }
     }
 
+    class WakeUpHeartbeatClosure : public HeartbeatClosure {
+    public:
+        void Run() { delete this; }
+    };
+
+    void Replicator::_fill_quiesced_group(QuiescedGroup *group) {
+        group->set_group_id(_options.group_id);
+        group->set_server_id(_options.server_id.to_string());
+        group->set_peer_id(_options.peer_id.to_string());
+        group->set_term(_options.term);
+    }
+
+    void Replicator::_wake_up_follower() {
+        // Best effort, if the heartbeat is lost, the follower elects a new
+        // leader once its lease expires as this group is no longer listed in
+        // coalesced heartbeats.
+        WakeUpHeartbeatClosure *done = new WakeUpHeartbeatClosure;
+        CHECK_EQ(0, _fill_common_fields(&done->request, _next_index - 1, true));
+        done->cntl.set_timeout_ms(*_options.election_timeout_ms / 2);
+        HeartbeatCoalescer::GetInstance()->send(
+                _options.server_id.addr, _options.peer_id.addr,
+                &done->cntl, &done->request, &done->response, done);
+    }
+
     void Replicator::_on_catch_up_timedout(void *arg) {
         fiber_session_t id = {(uint64_t) arg};
         Replicator *r = NULL;
@@ -1029,6 +1183,26 @@ namespace melon::raft {
         return r->_transfer_leadership(log_index);
     }
 
+    int Replicator::send_heartbeat(ReplicatorId id, HeartbeatClosure *done) {
+        Replicator *r = NULL;
+        fiber_session_t dummy_id = {id};
+        const int rc = fiber_session_lock(dummy_id, (void **) &r);
+        if (rc != 0) {
+            return rc;
+        }
+        // Heartbeats never fail to fill, see _fill_common_fields
+        CHECK_EQ(0, r->_fill_common_fields(&done->request, r->_next_index - 1, true));
+        done->cntl.set_timeout_ms(*r->_options.election_timeout_ms / 2);
+        if (r->_quiesced) {
+            // Keep the follower quiesced
+            done->request.set_quiesce(true);
+        }
+        RaftService_Stub stub(&r->_sending_channel);
+        stub.append_entries(&done->cntl, &done->request, &done->response, done);
+        CHECK_EQ(0, fiber_session_unlock(dummy_id)) << "Fail to unlock " << dummy_id;
+        return 0;
+    }
+
     int Replicator::stop_transfer_leadership(ReplicatorId id) {
         Replicator *r = NULL;
         fiber_session_t dummy = {id};
@@ -1470,6 +1644,14 @@ namespace melon::raft {
         return Replicator::transfer_leadership(rid, log_index);
     }
 
+    int ReplicatorGroup::send_heartbeat(const PeerId &peer, HeartbeatClosure *done) {
+        std::map<PeerId, ReplicatorIdAndStatus>::const_iterator iter = _rmap.find(peer);
+        if (iter == _rmap.end()) {
+            return EINVAL;
+        }
+        return Replicator::send_heartbeat(iter->second.id, done);
+    }
+
     int ReplicatorGroup::stop_transfer_leadership(const PeerId &peer) {
         std::map<PeerId, ReplicatorIdAndStatus>::const_iterator iter = _rmap.find(peer);
         if (iter == _rmap.end()) {
@@ -1507,7 +1689,7 @@ namespace melon::raft {
         int64_t max_index = 0;
         for (std::map<PeerId, ReplicatorIdAndStatus>::const_iterator
                      iter = _rmap.begin(); iter != _rmap.end(); ++iter) {
-            if (!conf.contains(iter->first)) {
+            if (!conf.is_voter(iter->first)) {
                 continue;
             }
             const int64_t next_index = Replicator::get_next_index(iter->second.id);
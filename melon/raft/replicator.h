@@ -84,6 +84,15 @@ namespace melon::raft {
         void _run();
     };
 
+    // Closure of the heartbeat sent by Replicator::send_heartbeat(), Run() is
+    // called with |cntl| and |response| filled when the RPC finishes.
+    class HeartbeatClosure : public google::protobuf::Closure {
+    public:
+        melon::Controller cntl;
+        AppendEntriesRequest request;
+        AppendEntriesResponse response;
+    };
+
     class MELON_CACHELINE_ALIGNMENT Replicator {
     public:
         // Called by the leader, otherwise the behavior is undefined
@@ -114,6 +123,13 @@ namespace melon::raft {
         // finishes no matter it succes or fails.
         static int send_timeout_now_and_stop(ReplicatorId id, int timeout_ms);
 
+        // Send a heartbeat to the follower right now besides the periodical
+        // ones, which is used to confirm leadership for ReadIndex. Responses
+        // are not processed by the replicator.
+        // Returns 0 on success and |done| is called when the RPC finishes,
+        // the error code otherwise and |done| is not called.
+        static int send_heartbeat(ReplicatorId id, HeartbeatClosure *done);
+
         // Get the next index of this Replica if we know the correct value is
         // Return the correct value on success, 0 otherwise.
         static int64_t get_next_index(ReplicatorId id);
@@ -159,6 +175,10 @@ namespace melon::raft {
 
         int _prepare_entry(int offset, EntryMeta *em, mutil::IOBuf *data);
 
+        // Compress `data' of all entries in `request' in place if it's
+        // worth it.
+        void _compress_entries(AppendEntriesRequest *request, mutil::IOBuf *data);
+
         void _wait_more_entries();
 
         void _send_empty_entries(bool is_heartbeat);
@@ -255,6 +275,16 @@ namespace melon::raft {
 
         void _close_reader();
 
+        // Nothing to replicate and the follower has known that all the logs
+        // are committed, in which case heartbeats can be stopped.
+        bool _is_idle();
+
+        // Tell the quiesced follower that heartbeats are going to stop.
+        void _wake_up_follower();
+
+        // Identify this group in coalesced heartbeats while quiesced.
+        void _fill_quiesced_group(QuiescedGroup *group);
+
         int64_t _last_rpc_send_timestamp() {
             return _options.replicator_status->last_rpc_send_timestamp.load(mutil::memory_order_relaxed);
         }
@@ -298,6 +328,17 @@ namespace melon::raft {
         fiber_timer_t _heartbeat_timer;
         SnapshotReader *_reader;
         CatchupClosure *_catchup_closure;
+        // Number of consecutive heartbeats sent while idle
+        int _idle_heartbeats;
+        // The follower has acknowledged a quiesce heartbeat, no heartbeat is
+        // sent until something is replicated again.
+        bool _quiesced;
+        // Monotonic time in milliseconds when the follower was quiesced
+        int64_t _quiesced_ms;
+        // The last response from the follower says that it can decompress
+        // entries. Reset when RPC fails since the follower may be restarted
+        // with another version.
+        bool _peer_accepts_compress;
     };
 
     struct ReplicatorGroupOptions {
@@ -369,6 +410,9 @@ namespace melon::raft {
         // Transfer leadership to the given |peer|
         int transfer_leadership_to(const PeerId &peer, int64_t log_index);
 
+        // Send a heartbeat to the given |peer|, see Replicator::send_heartbeat
+        int send_heartbeat(const PeerId &peer, HeartbeatClosure *done);
+
         // Stop transferring leadership to the given |peer|
         int stop_transfer_leadership(const PeerId &peer);
 
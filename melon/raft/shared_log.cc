@@ -0,0 +1,1165 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#include <melon/raft/shared_log.h>
+
+#include <fcntl.h>
+#include <algorithm>
+#include <set>
+#include <gflags/gflags.h>
+#include <melon/utility/files/dir_reader_posix.h>            // mutil::DirReaderPosix
+#include <melon/utility/file_util.h>                         // mutil::CreateDirectory
+#include <melon/utility/string_printf.h>                     // mutil::string_appendf
+#include <melon/utility/time.h>
+#include <melon/utility/raw_pack.h>                          // mutil::RawPacker
+#include <melon/utility/fd_utility.h>                        // mutil::make_close_on_exec
+#include <melon/fiber/fiber.h>
+#include <melon/rpc/reloadable_flags.h>
+
+#include <melon/raft/fsync.h>
+#include <melon/raft/config.h>
+#include <cinttypes>
+
+#define BRAFT_SHARED_WAL_SEGMENT_PATTERN "wal_%020" PRId64
+
+namespace melon::raft {
+
+    using ::mutil::RawPacker;
+    using ::mutil::RawUnpacker;
+
+    DEFINE_int32(raft_shared_wal_segment_size, 64 * 1024 * 1024 /*64M*/,
+                 "Max size of one segment file of the shared wal");
+    MELON_VALIDATE_GFLAG(raft_shared_wal_segment_size, melon::PositiveInteger);
+
+    DEFINE_int32(raft_shared_wal_max_segments, 8,
+                 "Groups pinning the oldest segment are rewritten when the shared "
+                 "wal has more segments than this value");
+    MELON_VALIDATE_GFLAG(raft_shared_wal_max_segments, melon::PositiveInteger);
+
+    DEFINE_int32(raft_shared_wal_max_rewrite_bytes, 4 * 1024 * 1024 /*4M*/,
+                 "Max bytes of alive logs rewritten to remove the oldest segment "
+                 "of the shared wal");
+    MELON_VALIDATE_GFLAG(raft_shared_wal_max_rewrite_bytes, melon::NonNegativeInteger);
+
+    static melon::var::LatencyRecorder g_shared_wal_write_latency("raft_shared_wal_write");
+    static melon::var::Adder<int64_t> g_shared_wal_batch_size("raft_shared_wal_batch_size");
+
+    enum RecordType {
+        RECORD_ENTRY = 1,
+        RECORD_TRUNCATE_PREFIX = 2,
+        RECORD_TRUNCATE_SUFFIX = 3,
+        RECORD_RESET = 4,
+        RECORD_DROP = 5,
+        // Copy of an entry moved from an old segment, replaces the location
+        // of the entry only if it's still alive. The original entry is gone
+        // once the old segment is removed, so replay inserts the copy if the
+        // index is missing.
+        RECORD_COPY = 6,
+    };
+
+    // Format of Record, all fields are in network order
+    // | record type: 8bits | entry type: 8bits | reserved: 16bits               |
+    // | ------------------------------- key len: 32bits ------------------------ |
+    // | ---------------------------- index: 64bits ---------------------------- |
+    // | ---------------------------- term: 64bits ----------------------------- |
+    // | ------------------------------- data len: 32bits ----------------------- |
+    // | --------------------- checksum of key and data: 32bits ----------------- |
+    // | ------------------------- header checksum: 32bits --------------------- |
+    // | ------------------------------- key ----------------------------------- |
+    // | ------------------------------- data ---------------------------------- |
+    static const size_t RECORD_HEADER_SIZE = 36;
+
+    struct RecordHeader {
+        int type;
+        int entry_type;
+        uint32_t key_len;
+        int64_t index;
+        int64_t term;
+        uint32_t data_len;
+        uint32_t data_checksum;
+    };
+
+    // Load the record at |offset| of |fd|.
+    // Returns 0 on success, 1 if the record is incomplete, -1 if it's corrupted.
+    static int load_record(int fd, int64_t offset, RecordHeader *head,
+                           std::string *key, mutil::IOBuf *data) {
+        mutil::IOPortal buf;
+        ssize_t n = file_pread(&buf, fd, offset, RECORD_HEADER_SIZE);
+        if (n != (ssize_t) RECORD_HEADER_SIZE) {
+            return n < 0 ? -1 : 1;
+        }
+        char header_buf[RECORD_HEADER_SIZE];
+        const char *p = (const char *) buf.fetch(header_buf, RECORD_HEADER_SIZE);
+        uint32_t meta_field = 0;
+        uint32_t header_checksum = 0;
+        RecordHeader tmp;
+        RawUnpacker(p).unpack32(meta_field)
+                .unpack32(tmp.key_len)
+                .unpack64((uint64_t &) tmp.index)
+                .unpack64((uint64_t &) tmp.term)
+                .unpack32(tmp.data_len)
+                .unpack32(tmp.data_checksum)
+                .unpack32(header_checksum);
+        if (crc32(p, RECORD_HEADER_SIZE - 4) != header_checksum) {
+            LOG(ERROR) << "Found corrupted record header at offset=" << offset;
+            return -1;
+        }
+        tmp.type = meta_field >> 24;
+        tmp.entry_type = (meta_field << 8) >> 24;
+        buf.clear();
+        const size_t to_read = tmp.key_len + tmp.data_len;
+        n = file_pread(&buf, fd, offset + RECORD_HEADER_SIZE, to_read);
+        if (n != (ssize_t) to_read) {
+            return n < 0 ? -1 : 1;
+        }
+        if (crc32(buf) != tmp.data_checksum) {
+            LOG(ERROR) << "Found corrupted record data at offset=" << offset;
+            return -1;
+        }
+        if (key != NULL) {
+            key->resize(tmp.key_len);
+            buf.cutn(&(*key)[0], tmp.key_len);
+        } else {
+            buf.pop_front(tmp.key_len);
+        }
+        if (data != NULL) {
+            data->swap(buf);
+        }
+        *head = tmp;
+        return 0;
+    }
+
+    struct SharedWal::Location {
+        int64_t seq;
+        int64_t offset;
+        int64_t term;
+        int32_t length;
+        int32_t type;
+    };
+
+    struct SharedWal::Record {
+        GroupState *g;
+        int type;
+        int entry_type;
+        int64_t index;
+        int64_t term;
+        // offset in the batch before it's written, offset in the segment after
+        int64_t offset;
+        int32_t length;
+
+        Location location(int64_t seq) const {
+            Location loc = {seq, offset, term, length, entry_type};
+            return loc;
+        }
+    };
+
+    struct SharedWal::WriteBatch {
+        WriteBatch() : seq(0), rc(0), done(false) {}
+
+        mutil::IOBuf buf;
+        std::vector<Record> records;
+        int64_t seq;
+        int rc;
+        bool done;
+    };
+
+    struct SharedWal::Segment : public mutil::RefCountedThreadSafe<Segment> {
+        Segment() : seq(0), fd(-1), bytes(0) {}
+
+        ~Segment() {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+
+        int64_t seq;
+        int fd;
+        // Only touched by the writer
+        int64_t bytes;
+        std::string path;
+        // Groups having records in this segment, each holds a reference.
+        // Protected by SharedWal::_mutex.
+        std::set<GroupState *> groups;
+    };
+
+    // In-memory index of a group. Entries of [first_index, last_index] are
+    // located by |locations|.
+    struct SharedWal::GroupState {
+        explicit GroupState(const std::string &k)
+                : key(k), first_index(1), last_index(0), attached(false),
+                  dropped(false), nref(0) {}
+
+        // Following methods are called with |mutex| held.
+        void append(int64_t index, const Location &loc, bool replaying) {
+            if (replaying && first_index <= last_index && index > last_index + 1) {
+                // Entries are appended without gaps, the missing ones were in
+                // removed segments and are filled by their copies.
+                locations.insert(locations.end(), index - last_index - 1, hole());
+                last_index = index - 1;
+            } else if (index < first_index || index > last_index + 1) {
+                clear(index);
+            } else if (index <= last_index) {
+                truncate_suffix(index - 1);
+            }
+            locations.push_back(loc);
+            add_bytes(loc.seq, loc.length);
+            last_index = index;
+        }
+
+        void copy(int64_t index, const Location &loc, bool replaying) {
+            if (index < first_index || index > last_index) {
+                if (!replaying) {
+                    return;
+                }
+                // Copies are written for alive entries only, the entries
+                // missing here were in removed segments. Copies of different
+                // gc rounds may arrive out of order, leave holes between them
+                // and the known entries, which are filled by other copies.
+                if (first_index > last_index) {
+                    clear(index);
+                    locations.push_back(hole());
+                    last_index = index;
+                } else if (index < first_index) {
+                    locations.insert(locations.begin(), first_index - index, hole());
+                    first_index = index;
+                } else {
+                    locations.insert(locations.end(), index - last_index, hole());
+                    last_index = index;
+                }
+            }
+            Location &old = locations[index - first_index];
+            if (!is_hole(old) && old.term != loc.term) {
+                return;
+            }
+            add_bytes(old.seq, -old.length);
+            add_bytes(loc.seq, loc.length);
+            old = loc;
+        }
+
+        // Placeholder of an entry whose copy hasn't been replayed
+        static Location hole() {
+            const Location loc = {0, 0, 0, 0, 0};
+            return loc;
+        }
+
+        static bool is_hole(const Location &loc) {
+            return loc.length == 0;
+        }
+
+        bool has_hole() const {
+            for (size_t i = 0; i < locations.size(); ++i) {
+                if (is_hole(locations[i])) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void truncate_prefix(int64_t first_index_kept, bool replaying) {
+            // The checkpoint written by gc is the only record left of an empty
+            // group once the removed segments are gone.
+            if (first_index_kept > last_index ||
+                (replaying && first_index > last_index)) {
+                clear(first_index_kept);
+                return;
+            }
+            while (first_index < first_index_kept) {
+                add_bytes(locations.front().seq, -locations.front().length);
+                locations.pop_front();
+                ++first_index;
+            }
+        }
+
+        void truncate_suffix(int64_t last_index_kept) {
+            while (last_index > last_index_kept && !locations.empty()) {
+                add_bytes(locations.back().seq, -locations.back().length);
+                locations.pop_back();
+                --last_index;
+            }
+        }
+
+        void clear(int64_t next_log_index) {
+            locations.clear();
+            seq_bytes.clear();
+            first_index = next_log_index;
+            last_index = next_log_index - 1;
+        }
+
+        void add_bytes(int64_t seq, int64_t n) {
+            int64_t &bytes = seq_bytes[seq];
+            bytes += n;
+            if (bytes == 0) {
+                seq_bytes.erase(seq);
+            }
+        }
+
+        void apply(const Record &r, int64_t seq, bool replaying) {
+            switch (r.type) {
+                case RECORD_ENTRY:
+                    append(r.index, r.location(seq), replaying);
+                    break;
+                case RECORD_COPY:
+                    copy(r.index, r.location(seq), replaying);
+                    break;
+                case RECORD_TRUNCATE_PREFIX:
+                    truncate_prefix(r.index, replaying);
+                    break;
+                case RECORD_TRUNCATE_SUFFIX:
+                    truncate_suffix(r.index);
+                    break;
+                case RECORD_RESET:
+                    clear(r.index);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        const std::string key;
+        raft_mutex_t mutex;
+        int64_t first_index;
+        int64_t last_index;
+        std::deque<Location> locations;
+        // bytes of alive records in each segment
+        std::map<int64_t, int64_t> seq_bytes;
+        // Serializes writes of the owner with rewrites and checkpoints of gc
+        fiber::Mutex write_mutex;
+        bool attached;
+        // Protected by SharedWal::_mutex
+        bool dropped;
+        int nref;
+    };
+
+    static pthread_mutex_t s_wal_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+    static std::map<std::string, SharedWal *> *s_wal_map = NULL;
+
+    SharedWal *SharedWal::open(const std::string &path) {
+        SharedWal *wal = NULL;
+        bool need_gc = false;
+        {
+            MELON_SCOPED_LOCK(s_wal_map_mutex);
+            if (s_wal_map == NULL) {
+                s_wal_map = new std::map<std::string, SharedWal *>;
+            }
+            std::map<std::string, SharedWal *>::iterator it = s_wal_map->find(path);
+            if (it != s_wal_map->end()) {
+                ++it->second->_nref;
+                return it->second;
+            }
+            wal = new SharedWal(path);
+            if (wal->init() != 0) {
+                delete wal;
+                return NULL;
+            }
+            wal->_nref = 1;
+            (*s_wal_map)[path] = wal;
+            need_gc = wal->_segments.size() > 1;
+        }
+        if (need_gc) {
+            wal->start_gc();
+        }
+        return wal;
+    }
+
+    void SharedWal::release() {
+        {
+            MELON_SCOPED_LOCK(s_wal_map_mutex);
+            if (--_nref > 0) {
+                return;
+            }
+            s_wal_map->erase(_path);
+        }
+        delete this;
+    }
+
+    SharedWal::SharedWal(const std::string &path)
+            : _path(path), _nref(0), _writing(false), _gc_running(false),
+              _nsync(0), _nwrite(0), _bytes(0), _nrecord(0) {}
+
+    SharedWal::~SharedWal() {
+        _current = NULL;
+        for (std::map<int64_t, scoped_refptr<Segment> >::iterator
+                     it = _segments.begin(); it != _segments.end(); ++it) {
+            for (std::set<GroupState *>::iterator
+                         git = it->second->groups.begin(); git != it->second->groups.end(); ++git) {
+                if (--(*git)->nref == 0) {
+                    delete *git;
+                }
+            }
+        }
+        _segments.clear();
+        for (std::map<std::string, GroupState *>::iterator
+                     it = _groups.begin(); it != _groups.end(); ++it) {
+            if (--it->second->nref == 0) {
+                delete it->second;
+            }
+        }
+        _groups.clear();
+    }
+
+    SharedWal::Stats SharedWal::stats() {
+        Stats s;
+        s.nsync = _nsync.load(mutil::memory_order_relaxed);
+        s.nwrite = _nwrite.load(mutil::memory_order_relaxed);
+        s.bytes = _bytes.load(mutil::memory_order_relaxed);
+        s.nrecord = _nrecord.load(mutil::memory_order_relaxed);
+        MELON_SCOPED_LOCK(_mutex);
+        s.nsegment = _segments.size();
+        return s;
+    }
+
+    int SharedWal::init() {
+        mutil::FilePath dir_path(_path);
+        mutil::File::Error e;
+        if (!mutil::CreateDirectoryAndGetError(
+                dir_path, &e, FLAGS_raft_create_parent_directories)) {
+            LOG(ERROR) << "Fail to create " << dir_path.value() << " : " << e;
+            return -1;
+        }
+        std::set<int64_t> seqs;
+        mutil::DirReaderPosix dir_reader(_path.c_str());
+        if (!dir_reader.IsValid()) {
+            LOG(WARNING) << "directory reader failed, maybe NOEXIST or PERMISSION."
+                         << " path: " << _path;
+            return -1;
+        }
+        while (dir_reader.Next()) {
+            int64_t seq = 0;
+            int match = sscanf(dir_reader.name(), BRAFT_SHARED_WAL_SEGMENT_PATTERN, &seq);
+            if (match == 1) {
+                seqs.insert(seq);
+            }
+        }
+        for (std::set<int64_t>::iterator it = seqs.begin(); it != seqs.end(); ++it) {
+            scoped_refptr<Segment> seg = open_segment(*it, false);
+            if (seg == NULL) {
+                return -1;
+            }
+            _segments[*it] = seg;
+            if (replay(seg.get(), *it == *seqs.rbegin()) != 0) {
+                return -1;
+            }
+        }
+        for (std::map<std::string, GroupState *>::iterator
+                     it = _groups.begin(); it != _groups.end(); ++it) {
+            if (it->second->has_hole()) {
+                LOG(ERROR) << "Missing logs of group " << it->first
+                           << " in shared wal, path: " << _path;
+                return -1;
+            }
+        }
+        if (_segments.empty()) {
+            scoped_refptr<Segment> seg = open_segment(1, true);
+            if (seg == NULL) {
+                return -1;
+            }
+            _segments[1] = seg;
+        }
+        _current = _segments.rbegin()->second;
+        LOG(INFO) << "Opened shared wal, path: " << _path << " segments: "
+                  << _segments.size() << " groups: " << _groups.size();
+        return 0;
+    }
+
+    scoped_refptr<SharedWal::Segment> SharedWal::open_segment(int64_t seq, bool create) {
+        scoped_refptr<Segment> seg = new Segment;
+        seg->seq = seq;
+        seg->path = _path;
+        mutil::string_appendf(&seg->path, "/" BRAFT_SHARED_WAL_SEGMENT_PATTERN, seq);
+        seg->fd = ::open(seg->path.c_str(), O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0644);
+        if (seg->fd < 0) {
+            LOG(ERROR) << "Fail to open " << seg->path << ", " << berror();
+            return NULL;
+        }
+        mutil::make_close_on_exec(seg->fd);
+        struct stat st_buf;
+        if (fstat(seg->fd, &st_buf) != 0) {
+            LOG(ERROR) << "Fail to get the stat of " << seg->path << ", " << berror();
+            return NULL;
+        }
+        seg->bytes = st_buf.st_size;
+        return seg;
+    }
+
+    int SharedWal::replay(Segment *seg, bool is_last) {
+        int64_t offset = 0;
+        while (offset < seg->bytes) {
+            RecordHeader head;
+            std::string key;
+            const int rc = load_record(seg->fd, offset, &head, &key, NULL);
+            if (rc < 0 || (rc > 0 && !is_last)) {
+                LOG(ERROR) << "Fail to load record at offset=" << offset
+                           << " path: " << seg->path;
+                return -1;
+            }
+            if (rc > 0) {
+                break;
+            }
+            Record r;
+            r.type = head.type;
+            r.entry_type = head.entry_type;
+            r.index = head.index;
+            r.term = head.term;
+            r.offset = offset;
+            r.length = RECORD_HEADER_SIZE + head.key_len + head.data_len;
+            GroupState *g = ref_group(key, true);
+            add_to_segment(seg, g);
+            if (r.type == RECORD_DROP) {
+                drop_group(g);
+            } else {
+                MELON_SCOPED_LOCK(g->mutex);
+                g->apply(r, seg->seq, true);
+            }
+            unref_group(g);
+            offset += r.length;
+        }
+        if (offset != seg->bytes) {
+            LOG(INFO) << "truncate last uncompleted record, path: " << seg->path
+                      << " old_size: " << seg->bytes << " new_size: " << offset;
+            if (ftruncate(seg->fd, offset) != 0) {
+                LOG(ERROR) << "Fail to truncate " << seg->path << ", " << berror();
+                return -1;
+            }
+            seg->bytes = offset;
+        }
+        return 0;
+    }
+
+    SharedWal::GroupState *SharedWal::ref_group(const std::string &key, bool create) {
+        MELON_SCOPED_LOCK(_mutex);
+        std::map<std::string, GroupState *>::iterator it = _groups.find(key);
+        GroupState *g = NULL;
+        if (it != _groups.end()) {
+            g = it->second;
+        } else if (create) {
+            g = new GroupState(key);
+            g->nref = 1;
+            _groups[key] = g;
+        } else {
+            return NULL;
+        }
+        ++g->nref;
+        return g;
+    }
+
+    void SharedWal::unref_group(GroupState *g) {
+        MELON_SCOPED_LOCK(_mutex);
+        if (--g->nref == 0) {
+            delete g;
+        }
+    }
+
+    void SharedWal::drop_group(GroupState *g) {
+        MELON_SCOPED_LOCK(_mutex);
+        if (g->dropped) {
+            return;
+        }
+        g->dropped = true;
+        std::map<std::string, GroupState *>::iterator it = _groups.find(g->key);
+        if (it != _groups.end() && it->second == g) {
+            _groups.erase(it);
+            // The caller holds another reference
+            --g->nref;
+        }
+    }
+
+    void SharedWal::add_to_segment(Segment *seg, GroupState *g) {
+        // Caller holds |_mutex| or is replaying
+        if (seg->groups.insert(g).second) {
+            ++g->nref;
+        }
+    }
+
+    void SharedWal::add_record(WriteBatch *batch, GroupState *g, int type,
+                               int entry_type, int64_t index, int64_t term,
+                               const mutil::IOBuf &data) {
+        CHECK_LE(data.length(), 1ul << 31ul);
+        mutil::IOBuf payload;
+        payload.append(g->key);
+        payload.append(data);
+        char header_buf[RECORD_HEADER_SIZE];
+        const uint32_t meta_field = (type << 24) | (entry_type << 16);
+        RawPacker packer(header_buf);
+        packer.pack32(meta_field)
+                .pack32(g->key.size())
+                .pack64(index)
+                .pack64(term)
+                .pack32(data.length())
+                .pack32(crc32(payload));
+        packer.pack32(crc32(header_buf, RECORD_HEADER_SIZE - 4));
+        Record r;
+        r.g = g;
+        r.type = type;
+        r.entry_type = entry_type;
+        r.index = index;
+        r.term = term;
+        r.offset = batch->buf.length();
+        r.length = RECORD_HEADER_SIZE + payload.length();
+        batch->buf.append(header_buf, RECORD_HEADER_SIZE);
+        batch->buf.append(payload);
+        batch->records.push_back(r);
+    }
+
+    int SharedWal::submit(WriteBatch *batch) {
+        bool rolled = false;
+        {
+            std::unique_lock<fiber::Mutex> lck(_write_mutex);
+            _pending.push_back(batch);
+            while (!batch->done) {
+                if (_writing) {
+                    _write_cond.wait(lck);
+                    continue;
+                }
+                // Become the writer and write all the pending batches, including
+                // the ones submitted while the previous writer was writing.
+                _writing = true;
+                std::vector<WriteBatch *> batches;
+                batches.swap(_pending);
+                lck.unlock();
+                rolled = write_batches(batches);
+                lck.lock();
+                for (size_t i = 0; i < batches.size(); ++i) {
+                    batches[i]->done = true;
+                }
+                _writing = false;
+                _write_cond.notify_all();
+            }
+        }
+        if (rolled) {
+            start_gc();
+        }
+        return batch->rc;
+    }
+
+    bool SharedWal::write_batches(const std::vector<WriteBatch *> &batches) {
+        const int64_t start_time_us = mutil::cpuwide_time_us();
+        mutil::IOBuf buf;
+        size_t nrecord = 0;
+        for (size_t i = 0; i < batches.size(); ++i) {
+            buf.append(batches[i]->buf);
+            nrecord += batches[i]->records.size();
+        }
+        bool rolled = false;
+        int rc = 0;
+        if (_current->bytes > 0 &&
+            _current->bytes + buf.length() > (size_t) FLAGS_raft_shared_wal_segment_size) {
+            scoped_refptr<Segment> seg = open_segment(_current->seq + 1, true);
+            if (seg != NULL) {
+                MELON_SCOPED_LOCK(_mutex);
+                _segments[seg->seq] = seg;
+                _current = seg;
+                rolled = true;
+            } else {
+                rc = -1;
+            }
+        }
+        const int64_t offset = _current->bytes;
+        if (rc == 0) {
+            const ssize_t n = file_pwrite(buf, _current->fd, offset);
+            if (n != (ssize_t) buf.length()) {
+                LOG(ERROR) << "Fail to write to " << _current->path << ", " << berror();
+                if (ftruncate(_current->fd, offset) != 0) {
+                    PLOG(ERROR) << "Fail to truncate " << _current->path;
+                }
+                rc = -1;
+            } else if (FLAGS_raft_sync) {
+                if (raft_fsync(_current->fd) != 0) {
+                    LOG(ERROR) << "Fail to sync " << _current->path << ", " << berror();
+                    rc = -1;
+                }
+                _nsync.fetch_add(1, mutil::memory_order_relaxed);
+            }
+        }
+        if (rc == 0) {
+            _current->bytes = offset + buf.length();
+            int64_t base = offset;
+            MELON_SCOPED_LOCK(_mutex);
+            for (size_t i = 0; i < batches.size(); ++i) {
+                WriteBatch *batch = batches[i];
+                batch->seq = _current->seq;
+                for (size_t j = 0; j < batch->records.size(); ++j) {
+                    batch->records[j].offset += base;
+                    add_to_segment(_current.get(), batch->records[j].g);
+                }
+                base += batch->buf.length();
+            }
+            _nwrite.fetch_add(1, mutil::memory_order_relaxed);
+            _bytes.fetch_add(buf.length(), mutil::memory_order_relaxed);
+            _nrecord.fetch_add(nrecord, mutil::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < batches.size(); ++i) {
+            batches[i]->rc = rc;
+        }
+        g_shared_wal_write_latency << mutil::cpuwide_time_us() - start_time_us;
+        g_shared_wal_batch_size << batches.size();
+        return rolled;
+    }
+
+    int SharedWal::read_record(const Location &loc, mutil::IOBuf *data) {
+        scoped_refptr<Segment> seg;
+        {
+            MELON_SCOPED_LOCK(_mutex);
+            std::map<int64_t, scoped_refptr<Segment> >::iterator it = _segments.find(loc.seq);
+            if (it == _segments.end()) {
+                return -1;
+            }
+            seg = it->second;
+        }
+        RecordHeader head;
+        if (load_record(seg->fd, loc.offset, &head, NULL, data) != 0) {
+            LOG(ERROR) << "Fail to read record at offset=" << loc.offset
+                       << " path: " << seg->path;
+            return -1;
+        }
+        CHECK_EQ(loc.term, head.term);
+        return 0;
+    }
+
+    void SharedWal::start_gc() {
+        if (_gc_running.exchange(true, mutil::memory_order_acquire)) {
+            return;
+        }
+        {
+            MELON_SCOPED_LOCK(s_wal_map_mutex);
+            ++_nref;
+        }
+        fiber_t tid;
+        if (fiber_start_background(&tid, NULL, run_gc, this) != 0) {
+            LOG(ERROR) << "Fail to start gc of shared wal, path: " << _path;
+            run_gc(this);
+        }
+    }
+
+    void *SharedWal::run_gc(void *arg) {
+        SharedWal *wal = (SharedWal *) arg;
+        wal->gc();
+        wal->_gc_running.store(false, mutil::memory_order_release);
+        wal->release();
+        return NULL;
+    }
+
+    void SharedWal::gc() {
+        while (gc_front_segment()) {}
+    }
+
+    bool SharedWal::gc_front_segment() {
+        scoped_refptr<Segment> front;
+        std::vector<GroupState *> groups;
+        size_t nsegment = 0;
+        {
+            MELON_SCOPED_LOCK(_mutex);
+            // Never touch the segment being appended
+            if (_segments.size() < 2) {
+                return false;
+            }
+            front = _segments.begin()->second;
+            nsegment = _segments.size();
+            for (std::set<GroupState *>::iterator
+                         it = front->groups.begin(); it != front->groups.end(); ++it) {
+                if (!(*it)->dropped) {
+                    groups.push_back(*it);
+                }
+            }
+        }
+        // Groups are referenced by |front| until it's removed. Writes of
+        // their owners are blocked while the segment is examined, so that
+        // the checkpoints and copies can't interleave with them.
+        std::sort(groups.begin(), groups.end());
+        for (size_t i = 0; i < groups.size(); ++i) {
+            groups[i]->write_mutex.lock();
+        }
+        WriteBatch batch;
+        int64_t pinned_bytes = 0;
+        bool pinned = false;
+        for (size_t i = 0; i < groups.size() && !pinned; ++i) {
+            GroupState *g = groups[i];
+            std::vector<std::pair<int64_t, Location> > alive;
+            {
+                MELON_SCOPED_LOCK(g->mutex);
+                std::map<int64_t, int64_t>::iterator it = g->seq_bytes.find(front->seq);
+                if (it != g->seq_bytes.end()) {
+                    pinned_bytes += it->second;
+                    for (size_t j = 0; j < g->locations.size(); ++j) {
+                        if (g->locations[j].seq == front->seq) {
+                            alive.push_back(std::make_pair(g->first_index + j,
+                                                           g->locations[j]));
+                        }
+                    }
+                }
+            }
+            if (!alive.empty() &&
+                (nsegment <= (size_t) FLAGS_raft_shared_wal_max_segments ||
+                 pinned_bytes > FLAGS_raft_shared_wal_max_rewrite_bytes)) {
+                pinned = true;
+                break;
+            }
+            // Move the alive logs to the newest segment
+            for (size_t j = 0; j < alive.size(); ++j) {
+                mutil::IOBuf data;
+                if (read_record(alive[j].second, &data) != 0) {
+                    pinned = true;
+                    break;
+                }
+                add_record(&batch, g, RECORD_COPY, alive[j].second.type,
+                           alive[j].first, alive[j].second.term, data);
+            }
+            // Checkpoint the first index as the truncations in |front| are
+            // going to be removed
+            int64_t first_index = 0;
+            {
+                MELON_SCOPED_LOCK(g->mutex);
+                first_index = g->first_index;
+            }
+            add_record(&batch, g, RECORD_TRUNCATE_PREFIX, 0, first_index, 0, mutil::IOBuf());
+        }
+        int rc = 0;
+        if (!pinned && !batch.records.empty()) {
+            rc = submit(&batch);
+            if (rc == 0) {
+                for (size_t i = 0; i < batch.records.size(); ++i) {
+                    const Record &r = batch.records[i];
+                    if (r.type == RECORD_COPY) {
+                        MELON_SCOPED_LOCK(r.g->mutex);
+                        r.g->apply(r, batch.seq, false);
+                    }
+                }
+            }
+        }
+        for (size_t i = 0; i < groups.size(); ++i) {
+            groups[i]->write_mutex.unlock();
+        }
+        if (pinned || rc != 0) {
+            return false;
+        }
+        {
+            MELON_SCOPED_LOCK(_mutex);
+            _segments.erase(front->seq);
+            for (std::set<GroupState *>::iterator
+                         it = front->groups.begin(); it != front->groups.end(); ++it) {
+                if (--(*it)->nref == 0) {
+                    delete *it;
+                }
+            }
+            front->groups.clear();
+        }
+        if (::unlink(front->path.c_str()) != 0) {
+            PLOG(WARNING) << "Fail to unlink " << front->path;
+        }
+        LOG(INFO) << "Removed segment of shared wal, path: " << front->path
+                  << " copied_bytes: " << pinned_bytes;
+        return true;
+    }
+
+    // SharedLogStorage
+
+    SharedLogStorage::~SharedLogStorage() {
+        if (_group != NULL) {
+            {
+                MELON_SCOPED_LOCK(_group->mutex);
+                _group->attached = false;
+            }
+            _wal->unref_group(_group);
+            _group = NULL;
+        }
+        if (_wal != NULL) {
+            _wal->release();
+            _wal = NULL;
+        }
+    }
+
+    int SharedLogStorage::parse_uri(const std::string &uri, std::string *path,
+                                    std::string *key) {
+        // ${path}?group=${key}
+        const size_t pos = uri.rfind("?group=");
+        if (pos == std::string::npos || pos == 0 || pos + 7 == uri.size()) {
+            LOG(ERROR) << "Invalid shared log storage uri=`" << uri << '\'';
+            return -1;
+        }
+        path->assign(uri, 0, pos);
+        key->assign(uri, pos + 7, std::string::npos);
+        return 0;
+    }
+
+    int SharedLogStorage::init(ConfigurationManager *configuration_manager) {
+        if (_wal != NULL) {
+            LOG(WARNING) << "SharedLogStorage init() already succeed, key: " << _key;
+            return 0;
+        }
+        if (_path.empty() || _key.empty()) {
+            LOG(ERROR) << "Invalid SharedLogStorage, path: " << _path << " key: " << _key;
+            return -1;
+        }
+        _wal = SharedWal::open(_path);
+        if (_wal == NULL) {
+            return -1;
+        }
+        _group = _wal->ref_group(_key, true);
+        std::vector<std::pair<int64_t, SharedWal::Location> > confs;
+        bool attached = false;
+        {
+            MELON_SCOPED_LOCK(_group->mutex);
+            attached = _group->attached;
+            _group->attached = true;
+            for (size_t i = 0; !attached && i < _group->locations.size(); ++i) {
+                if (_group->locations[i].type == ENTRY_TYPE_CONFIGURATION) {
+                    confs.push_back(std::make_pair(_group->first_index + i,
+                                                   _group->locations[i]));
+                }
+            }
+        }
+        if (attached) {
+            LOG(ERROR) << "Group " << _key << " of " << _path
+                       << " is used by another log storage";
+            _wal->unref_group(_group);
+            _group = NULL;
+            return -1;
+        }
+        for (size_t i = 0; i < confs.size(); ++i) {
+            mutil::IOBuf data;
+            if (_wal->read_record(confs[i].second, &data) != 0) {
+                return -1;
+            }
+            scoped_refptr<LogEntry> entry = new LogEntry();
+            entry->id.index = confs[i].first;
+            entry->id.term = confs[i].second.term;
+            mutil::Status status = parse_configuration_meta(data, entry);
+            if (!status.ok()) {
+                LOG(ERROR) << "fail to parse configuration meta, key: " << _key
+                           << " index: " << confs[i].first;
+                return -1;
+            }
+            ConfigurationEntry conf_entry(*entry);
+            configuration_manager->add(conf_entry);
+        }
+        return 0;
+    }
+
+    int64_t SharedLogStorage::first_log_index() {
+        MELON_SCOPED_LOCK(_group->mutex);
+        return _group->first_index;
+    }
+
+    int64_t SharedLogStorage::last_log_index() {
+        MELON_SCOPED_LOCK(_group->mutex);
+        return _group->last_index;
+    }
+
+    LogEntry *SharedLogStorage::get_entry(const int64_t index) {
+        mutil::IOBuf data;
+        SharedWal::Location loc;
+        // The entry may be moved by gc between looking up and reading
+        for (int i = 0; i < 2; ++i) {
+            {
+                MELON_SCOPED_LOCK(_group->mutex);
+                if (index < _group->first_index || index > _group->last_index) {
+                    return NULL;
+                }
+                loc = _group->locations[index - _group->first_index];
+            }
+            if (_wal->read_record(loc, &data) == 0) {
+                break;
+            }
+            if (i == 1) {
+                return NULL;
+            }
+        }
+        LogEntry *entry = new LogEntry();
+        entry->AddRef();
+        entry->id = LogId(index, loc.term);
+        entry->type = (EntryType) loc.type;
+        switch (loc.type) {
+            case ENTRY_TYPE_DATA:
+                entry->data.swap(data);
+                break;
+            case ENTRY_TYPE_NO_OP:
+                CHECK(data.empty()) << "Data of NO_OP must be empty";
+                break;
+            case ENTRY_TYPE_CONFIGURATION: {
+                mutil::Status status = parse_configuration_meta(data, entry);
+                if (!status.ok()) {
+                    LOG(WARNING) << "Fail to parse ConfigurationPBMeta, key: " << _key;
+                    entry->Release();
+                    return NULL;
+                }
+            }
+                break;
+            default:
+                CHECK(false) << "Unknown entry type, key: " << _key;
+                break;
+        }
+        return entry;
+    }
+
+    int64_t SharedLogStorage::get_term(const int64_t index) {
+        MELON_SCOPED_LOCK(_group->mutex);
+        if (index < _group->first_index || index > _group->last_index) {
+            return 0;
+        }
+        return _group->locations[index - _group->first_index].term;
+    }
+
+    int SharedLogStorage::append_entry(const LogEntry *entry) {
+        std::vector<LogEntry *> entries(1, const_cast<LogEntry *>(entry));
+        return append_entries(entries, NULL) == 1 ? 0 : -1;
+    }
+
+    int SharedLogStorage::append_entries(const std::vector<LogEntry *> &entries, IOMetric *metric) {
+        if (entries.empty()) {
+            return 0;
+        }
+        std::unique_lock<fiber::Mutex> lck(_group->write_mutex);
+        if (last_log_index() + 1 != entries.front()->id.index) {
+            LOG(FATAL) << "There's gap between appending entries and last_log_index"
+                       << " key: " << _key;
+            return -1;
+        }
+        int64_t now = mutil::cpuwide_time_us();
+        SharedWal::WriteBatch batch;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const LogEntry *entry = entries[i];
+            mutil::IOBuf data;
+            switch (entry->type) {
+                case ENTRY_TYPE_DATA:
+                    data.append(entry->data);
+                    break;
+                case ENTRY_TYPE_NO_OP:
+                    break;
+                case ENTRY_TYPE_CONFIGURATION: {
+                    mutil::Status status = serialize_configuration_meta(entry, data);
+                    if (!status.ok()) {
+                        LOG(ERROR) << "Fail to serialize ConfigurationPBMeta, key: " << _key;
+                        return -1;
+                    }
+                }
+                    break;
+                default:
+                    LOG(FATAL) << "unknow entry type: " << entry->type << ", key: " << _key;
+                    return -1;
+            }
+            SharedWal::add_record(&batch, _group, RECORD_ENTRY, entry->type,
+                                  entry->id.index, entry->id.term, data);
+        }
+        if (FLAGS_raft_trace_append_entry_latency && metric) {
+            const int64_t t = mutil::cpuwide_time_us();
+            metric->append_entry_time_us += t - now;
+            now = t;
+        }
+        if (_wal->submit(&batch) != 0) {
+            return -1;
+        }
+        if (FLAGS_raft_trace_append_entry_latency && metric) {
+            metric->sync_segment_time_us += mutil::cpuwide_time_us() - now;
+        }
+        MELON_SCOPED_LOCK(_group->mutex);
+        for (size_t i = 0; i < batch.records.size(); ++i) {
+            _group->apply(batch.records[i], batch.seq, false);
+        }
+        return entries.size();
+    }
+
+    int SharedLogStorage::write_control(int type, int64_t index) {
+        // Caller holds _group->write_mutex
+        SharedWal::WriteBatch batch;
+        SharedWal::add_record(&batch, _group, type, 0, index, 0, mutil::IOBuf());
+        if (_wal->submit(&batch) != 0) {
+            return -1;
+        }
+        MELON_SCOPED_LOCK(_group->mutex);
+        _group->apply(batch.records[0], batch.seq, false);
+        return 0;
+    }
+
+    int SharedLogStorage::truncate_prefix(const int64_t first_index_kept) {
+        std::unique_lock<fiber::Mutex> lck(_group->write_mutex);
+        if (first_index_kept <= first_log_index()) {
+            return 0;
+        }
+        return write_control(RECORD_TRUNCATE_PREFIX, first_index_kept);
+    }
+
+    int SharedLogStorage::truncate_suffix(const int64_t last_index_kept) {
+        std::unique_lock<fiber::Mutex> lck(_group->write_mutex);
+        if (last_index_kept >= last_log_index()) {
+            return 0;
+        }
+        return write_control(RECORD_TRUNCATE_SUFFIX, last_index_kept);
+    }
+
+    int SharedLogStorage::reset(const int64_t next_log_index) {
+        if (next_log_index <= 0) {
+            LOG(ERROR) << "Invalid next_log_index=" << next_log_index
+                       << " key: " << _key;
+            return EINVAL;
+        }
+        std::unique_lock<fiber::Mutex> lck(_group->write_mutex);
+        return write_control(RECORD_RESET, next_log_index);
+    }
+
+    LogStorage *SharedLogStorage::new_instance(const std::string &uri) const {
+        std::string path;
+        std::string key;
+        if (parse_uri(uri, &path, &key) != 0) {
+            return NULL;
+        }
+        return new SharedLogStorage(path, key);
+    }
+
+    mutil::Status SharedLogStorage::gc_instance(const std::string &uri) const {
+        mutil::Status status;
+        std::string path;
+        std::string key;
+        if (parse_uri(uri, &path, &key) != 0) {
+            status.set_error(EINVAL, "Invalid uri %s", uri.c_str());
+            return status;
+        }
+        SharedWal *wal = SharedWal::open(path);
+        if (wal == NULL) {
+            status.set_error(EIO, "Fail to open shared wal %s", path.c_str());
+            return status;
+        }
+        SharedWal::GroupState *g = wal->ref_group(key, false);
+        if (g != NULL) {
+            std::unique_lock<fiber::Mutex> lck(g->write_mutex);
+            bool attached = false;
+            {
+                MELON_SCOPED_LOCK(g->mutex);
+                attached = g->attached;
+            }
+            if (attached) {
+                status.set_error(EBUSY, "Group %s is in use", key.c_str());
+            } else {
+                SharedWal::WriteBatch batch;
+                SharedWal::add_record(&batch, g, RECORD_DROP, 0, 0, 0, mutil::IOBuf());
+                if (wal->submit(&batch) != 0) {
+                    status.set_error(EIO, "Fail to drop group %s", key.c_str());
+                } else {
+                    wal->drop_group(g);
+                }
+            }
+            lck.unlock();
+            wal->unref_group(g);
+        }
+        wal->release();
+        if (status.ok()) {
+            LOG(INFO) << "Succeed to gc log storage from uri " << uri;
+        }
+        return status;
+    }
+
+}  //  namespace melon::raft
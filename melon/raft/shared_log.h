@@ -0,0 +1,215 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#pragma once
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <melon/utility/atomicops.h>
+#include <melon/utility/iobuf.h>
+#include <melon/utility/memory/ref_counted.h>
+#include <melon/fiber/mutex.h>
+#include <melon/fiber/condition_variable.h>
+#include <melon/raft/log_entry.h>
+#include <melon/raft/storage.h>
+#include <melon/raft/util.h>
+
+namespace melon::raft {
+
+    // Append-only write-ahead log shared by many raft groups. Appends of all
+    // the groups are turned into sequential writes of one file, and appends
+    // issued concurrently are written and synced together (group commit), so
+    // that the number of fsync does not grow with the number of groups.
+    //
+    // SharedWal layout:
+    //      wal_00000000000000000001: full segment
+    //      wal_00000000000000000002: segment being appended
+    //
+    // Every record carries the key of its group and either a log entry or a
+    // truncation of the group. Locations of log entries are indexed in memory
+    // per group, all of them are rebuilt by replaying the segments in order on
+    // opening. Segments are removed from the front once all the entries in
+    // them are discarded by their groups; groups pinning old segments with
+    // only a few logs are rewritten to the newest segment.
+    class SharedWal {
+    public:
+        struct Stats {
+            int64_t nsync;
+            int64_t nwrite;
+            int64_t bytes;
+            int64_t nrecord;
+            int64_t nsegment;
+        };
+
+        // Open the WAL in |path| which is shared by all the callers with the
+        // same |path|, segments are replayed by the first caller.
+        // Returns NULL on failure.
+        static SharedWal *open(const std::string &path);
+
+        // Release the reference acquired by open().
+        void release();
+
+        Stats stats();
+
+    private:
+        friend class SharedLogStorage;
+
+        struct Segment;
+        struct GroupState;
+        struct WriteBatch;
+        struct Location;
+        struct Record;
+
+        explicit SharedWal(const std::string &path);
+
+        ~SharedWal();
+
+        DISALLOW_COPY_AND_ASSIGN(SharedWal);
+
+        int init();
+
+        // Rebuild the index of groups from records in |seg|. A torn record
+        // at the end of the last segment is truncated.
+        int replay(Segment *seg, bool is_last);
+
+        // Get the state of group |key| with a reference, NULL if it doesn't
+        // exist and |create| is false.
+        GroupState *ref_group(const std::string &key, bool create);
+
+        void unref_group(GroupState *g);
+
+        void drop_group(GroupState *g);
+
+        // Encode a record of group |g| into |batch|.
+        static void add_record(WriteBatch *batch, GroupState *g, int type,
+                               int entry_type, int64_t index, int64_t term,
+                               const mutil::IOBuf &data);
+
+        // Append |batch| to the WAL, return after it's written and synced.
+        // Batches submitted concurrently are written with one write and one
+        // fsync.
+        int submit(WriteBatch *batch);
+
+        // Returns true if a new segment was opened.
+        bool write_batches(const std::vector<WriteBatch *> &batches);
+
+        void add_to_segment(Segment *seg, GroupState *g);
+
+        scoped_refptr<Segment> open_segment(int64_t seq, bool create);
+
+        int read_record(const Location &loc, mutil::IOBuf *data);
+
+        void start_gc();
+
+        static void *run_gc(void *arg);
+
+        void gc();
+
+        // Remove the front segment if none of the logs in it is alive.
+        // Returns false if it's pinned or on error.
+        bool gc_front_segment();
+
+        std::string _path;
+        int _nref;
+
+        // protects _segments, _groups and the bookkeeping of segments
+        raft_mutex_t _mutex;
+        std::map<int64_t, scoped_refptr<Segment> > _segments;
+        std::map<std::string, GroupState *> _groups;
+
+        // group commit
+        fiber::Mutex _write_mutex;
+        fiber::ConditionVariable _write_cond;
+        std::vector<WriteBatch *> _pending;
+        bool _writing;
+        // Only touched by the writer
+        scoped_refptr<Segment> _current;
+
+        mutil::atomic<bool> _gc_running;
+
+        mutil::atomic<int64_t> _nsync;
+        mutil::atomic<int64_t> _nwrite;
+        mutil::atomic<int64_t> _bytes;
+        mutil::atomic<int64_t> _nrecord;
+    };
+
+    // LogStorage of a raft group whose logs are in a SharedWal.
+    //
+    // uri = shared://{wal_path}?group={key}
+    // |key| must be unique among the groups sharing |wal_path|, e.g. the
+    // group id followed by the index of the peer.
+    class SharedLogStorage : public LogStorage {
+    public:
+        SharedLogStorage(const std::string &path, const std::string &key)
+                : _path(path), _key(key), _wal(NULL), _group(NULL) {}
+
+        SharedLogStorage() : _wal(NULL), _group(NULL) {}
+
+        virtual ~SharedLogStorage();
+
+        // init logstorage, check consistency and integrity
+        virtual int init(ConfigurationManager *configuration_manager);
+
+        // first log index in log
+        virtual int64_t first_log_index();
+
+        // last log index in log
+        virtual int64_t last_log_index();
+
+        // get logentry by index
+        virtual LogEntry *get_entry(const int64_t index);
+
+        // get logentry's term by index
+        virtual int64_t get_term(const int64_t index);
+
+        // append entry to log
+        virtual int append_entry(const LogEntry *entry);
+
+        // append entries to log and update IOMetric, return success append number
+        virtual int append_entries(const std::vector<LogEntry *> &entries, IOMetric *metric);
+
+        // delete logs from storage's head, [1, first_index_kept) will be discarded
+        virtual int truncate_prefix(const int64_t first_index_kept);
+
+        // delete uncommitted logs from storage's tail, (last_index_kept, infinity) will be discarded
+        virtual int truncate_suffix(const int64_t last_index_kept);
+
+        virtual int reset(const int64_t next_log_index);
+
+        virtual LogStorage *new_instance(const std::string &uri) const;
+
+        virtual mutil::Status gc_instance(const std::string &uri) const;
+
+        SharedWal *wal() const { return _wal; }
+
+    private:
+        static int parse_uri(const std::string &uri, std::string *path,
+                             std::string *key);
+
+        int write_control(int type, int64_t index);
+
+        std::string _path;
+        std::string _key;
+        SharedWal *_wal;
+        SharedWal::GroupState *_group;
+    };
+
+}  //  namespace melon::raft
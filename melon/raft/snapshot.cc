@@ -20,6 +20,7 @@
 
 #include <melon/utility/time.h>
 #include <melon/utility/string_printf.h>                     // mutil::string_appendf
+#include <melon/utility/third_party/murmurhash3/murmurhash3.h>
 #include <melon/rpc/uri.h>
 #include <melon/raft/util.h>
 #include <melon/raft/protobuf_file.h>
@@ -28,7 +29,9 @@
 #include <melon/raft/snapshot.h>
 #include <melon/raft/node.h>
 #include <melon/raft/file_service.h>
+#include <melon/raft/config.h>
 #include <cinttypes>
+#include <deque>
 
 //#define MELON_RAFT_SNAPSHOT_PATTERN "snapshot_%020ld"
 #define MELON_RAFT_SNAPSHOT_PATTERN "snapshot_%020" PRId64
@@ -36,8 +39,68 @@
 
 namespace melon::raft {
 
+    DEFINE_int32(raft_snapshot_chunk_size, 0,
+                 "Split files added to snapshots into chunks of this many bytes and "
+                 "record their content hashes so that followers only copy the chunks "
+                 "they don't have, 0 to disable");
+    MELON_VALIDATE_GFLAG(raft_snapshot_chunk_size, ::melon::NonNegativeInteger);
+    DEFINE_int32(raft_snapshot_max_concurrent_chunk_copies, 4,
+                 "Max number of chunks of a snapshot file copied at the same time");
+    MELON_VALIDATE_GFLAG(raft_snapshot_max_concurrent_chunk_copies, ::melon::PositiveInteger);
+
     const char *LocalSnapshotStorage::_s_temp_path = "temp";
 
+    static std::string chunk_hash(const mutil::IOBuf &data) {
+        mutil::MurmurHash3_x64_128_Context ctx;
+        mutil::MurmurHash3_x64_128_Init(&ctx, 0);
+        for (size_t i = 0; i < data.backing_block_num(); ++i) {
+            const mutil::StringPiece block = data.backing_block(i);
+            mutil::MurmurHash3_x64_128_Update(&ctx, block.data(), block.size());
+        }
+        char hash[16];
+        mutil::MurmurHash3_x64_128_Final(hash, &ctx);
+        return std::string(hash, sizeof(hash));
+    }
+
+    int compute_file_chunks(FileSystemAdaptor *fs, const std::string &path,
+                            size_t chunk_size, LocalFileMeta *file_meta) {
+        mutil::File::Error e;
+        FileAdaptor *file = fs->open(path, O_RDONLY | O_CLOEXEC, NULL, &e);
+        if (!file) {
+            LOG(WARNING) << "Fail to open " << path
+                         << ", " << mutil::File::ErrorToString(e);
+            return -1;
+        }
+        file_meta->clear_chunks();
+        int ret = 0;
+        off_t offset = 0;
+        while (true) {
+            mutil::IOPortal buf;
+            const ssize_t nread = file->read(&buf, offset, chunk_size);
+            if (nread < 0) {
+                LOG(WARNING) << "Fail to read " << path << " at offset=" << offset;
+                ret = -1;
+                break;
+            }
+            if (nread == 0) {
+                break;
+            }
+            FileChunk *chunk = file_meta->add_chunks();
+            chunk->set_length(nread);
+            chunk->set_hash(chunk_hash(buf));
+            offset += nread;
+            if ((size_t) nread < chunk_size) {
+                break;
+            }
+        }
+        file->close();
+        delete file;
+        if (ret != 0) {
+            file_meta->clear_chunks();
+        }
+        return ret;
+    }
+
     LocalSnapshotMetaTable::LocalSnapshotMetaTable() {}
 
     LocalSnapshotMetaTable::~LocalSnapshotMetaTable() {}
@@ -236,6 +299,7 @@ namespace melon::raft {
     }
 
     int LocalSnapshotWriter::remove_file(const std::string &filename) {
+        _streams.erase(filename);
         return _meta_table.remove_file(filename);
     }
 
@@ -248,9 +312,30 @@ namespace melon::raft {
             meta.CopyFrom(*file_meta);
         }
         // TODO: Check file_meta
+        if (FLAGS_raft_snapshot_chunk_size > 0 && meta.chunks_size() == 0 &&
+            meta.source() == FILE_SOURCE_LOCAL &&
+            _meta_table.get_file_meta(filename, NULL) != 0) {
+            // Followers copy the whole file if this fails
+            compute_file_chunks(_fs.get(), _path + "/" + filename,
+                                FLAGS_raft_snapshot_chunk_size, &meta);
+        }
         return _meta_table.add_file(filename, meta);
     }
 
+    int LocalSnapshotWriter::add_stream(const std::string &filename,
+                                        SnapshotStreamSource *source) {
+        if (source == NULL) {
+            return -1;
+        }
+        LocalFileMeta meta;
+        meta.set_source(FILE_SOURCE_STREAM);
+        if (_meta_table.add_file(filename, meta) != 0) {
+            return -1;
+        }
+        _streams[filename] = source;
+        return 0;
+    }
+
     void LocalSnapshotWriter::list_files(std::vector<std::string> *files) {
         return _meta_table.list_files(files);
     }
@@ -343,10 +428,26 @@ namespace melon::raft {
                            SnapshotThrottle *snapshot_throttle)
                 : LocalDirReader(fs, path), _snapshot_throttle(snapshot_throttle) {}
 
+        ~SnapshotFileReader() {
+            for (std::map<std::string, FileAdaptor *>::iterator
+                         it = _chunked_files.begin(); it != _chunked_files.end(); ++it) {
+                it->second->close();
+                delete it->second;
+            }
+            for (std::map<std::string, StreamState *>::iterator
+                         it = _stream_states.begin(); it != _stream_states.end(); ++it) {
+                delete it->second;
+            }
+        }
+
         void set_meta_table(const LocalSnapshotMetaTable &meta_table) {
             _meta_table = meta_table;
         }
 
+        void set_streams(const SnapshotStreamMap &streams) {
+            _streams = streams;
+        }
+
         int read_file(mutil::IOBuf *out,
                       const std::string &filename,
                       off_t offset,
@@ -382,7 +483,7 @@ namespace melon::raft {
                     }
                 }
                 if (ret == 0) {
-                    ret = LocalDirReader::read_file_with_meta(
+                    ret = read_file_by_source(
                             out, filename, &file_meta, offset, new_max_count, read_count, is_eof);
                     used_count = out->size();
                 }
@@ -392,13 +493,137 @@ namespace melon::raft {
                 }
                 return ret;
             }
-            return LocalDirReader::read_file_with_meta(
+            return read_file_by_source(
                     out, filename, &file_meta, offset, new_max_count, read_count, is_eof);
         }
 
     private:
+        // The part of a stream produced but not yet acknowledged by the
+        // follower, kept for retries.
+        struct StreamState {
+            std::unique_ptr<SnapshotStream> stream;
+            off_t offset = 0;
+            mutil::IOBuf pending;
+            bool eof = false;
+        };
+
+        int read_file_by_source(mutil::IOBuf *out,
+                                const std::string &filename,
+                                LocalFileMeta *file_meta,
+                                off_t offset,
+                                size_t max_count,
+                                size_t *read_count,
+                                bool *is_eof) const {
+            if (file_meta->source() == FILE_SOURCE_STREAM) {
+                return read_stream(out, filename, offset, max_count, read_count, is_eof);
+            }
+            if (file_meta->chunks_size() > 0) {
+                return read_chunked_file(out, filename, *file_meta, offset,
+                                         max_count, read_count, is_eof);
+            }
+            return LocalDirReader::read_file_with_meta(
+                    out, filename, file_meta, offset, max_count, read_count, is_eof);
+        }
+
+        // Chunks are copied concurrently and out of order, which the
+        // sequential reading of LocalDirReader doesn't allow.
+        int read_chunked_file(mutil::IOBuf *out,
+                              const std::string &filename,
+                              const LocalFileMeta &file_meta,
+                              off_t offset,
+                              size_t max_count,
+                              size_t *read_count,
+                              bool *is_eof) const {
+            FileAdaptor *file = NULL;
+            {
+                MELON_SCOPED_LOCK(_files_mutex);
+                std::map<std::string, FileAdaptor *>::const_iterator
+                        it = _chunked_files.find(filename);
+                if (it != _chunked_files.end()) {
+                    file = it->second;
+                } else {
+                    LocalFileMeta meta = file_meta;
+                    mutil::File::Error e;
+                    file = file_system()->open(path() + "/" + filename,
+                                               O_RDONLY | O_CLOEXEC, &meta, &e);
+                    if (!file) {
+                        return file_error_to_os_error(e);
+                    }
+                    _chunked_files[filename] = file;
+                }
+            }
+            int64_t file_size = 0;
+            for (int i = 0; i < file_meta.chunks_size(); ++i) {
+                file_size += file_meta.chunks(i).length();
+            }
+            mutil::IOPortal buf;
+            const ssize_t nread = file->read(&buf, offset, max_count);
+            if (nread < 0) {
+                return EIO;
+            }
+            *read_count = nread;
+            *is_eof = offset + nread >= file_size;
+            out->swap(buf);
+            return 0;
+        }
+
+        int read_stream(mutil::IOBuf *out,
+                        const std::string &filename,
+                        off_t offset,
+                        size_t max_count,
+                        size_t *read_count,
+                        bool *is_eof) const {
+            MELON_SCOPED_LOCK(_files_mutex);
+            StreamState *&st = _stream_states[filename];
+            if (st == NULL) {
+                SnapshotStreamMap::const_iterator it = _streams.find(filename);
+                if (it == _streams.end()) {
+                    LOG(WARNING) << "No stream source of " << filename
+                                 << " in " << path() << ", maybe restarted";
+                    _stream_states.erase(filename);
+                    return ENOENT;
+                }
+                SnapshotStream *stream = it->second->open();
+                if (stream == NULL) {
+                    _stream_states.erase(filename);
+                    return EIO;
+                }
+                st = new StreamState;
+                st->stream.reset(stream);
+            }
+            // The follower moves forward once it has written the data, reading
+            // the same offset again is a retry.
+            if (offset < st->offset || offset > st->offset + (off_t) st->pending.size()) {
+                LOG(WARNING) << "Out of order read of stream " << filename
+                             << " offset=" << offset << " expected=" << st->offset;
+                return EINVAL;
+            }
+            st->pending.pop_front(offset - st->offset);
+            st->offset = offset;
+            while (st->pending.size() < max_count && !st->eof) {
+                const size_t saved_size = st->pending.size();
+                const int rc = st->stream->read(
+                        &st->pending, max_count - st->pending.size(), &st->eof);
+                if (rc != 0) {
+                    return rc;
+                }
+                if (st->pending.size() == saved_size) {
+                    break;
+                }
+            }
+            out->clear();
+            st->pending.append_to(out, max_count);
+            *read_count = out->size();
+            *is_eof = st->eof && out->size() == st->pending.size();
+            return 0;
+        }
+
         LocalSnapshotMetaTable _meta_table;
         scoped_refptr<SnapshotThrottle> _snapshot_throttle;
+        SnapshotStreamMap _streams;
+        mutable raft_mutex_t _files_mutex;
+        mutable std::map<std::string, FileAdaptor *> _chunked_files;
+        mutable std::map<std::string, StreamState *> _stream_states;
     };
 
     std::string LocalSnapshotReader::generate_uri_for_copy() {
@@ -411,6 +636,7 @@ namespace melon::raft {
             scoped_refptr<SnapshotFileReader> reader(
                     new SnapshotFileReader(_fs.get(), _path, _snapshot_throttle.get()));
             reader->set_meta_table(_meta_table);
+            reader->set_streams(_streams);
             if (!reader->open()) {
                 LOG(ERROR) << "Open snapshot=" << _path << " failed";
                 return std::string();
@@ -525,6 +751,7 @@ namespace melon::raft {
 
             if (it->second == 0) {
                 _ref_map.erase(it);
+                _streams.erase(index);
                 lck.unlock();
                 std::string old_path(_path);
                 mutil::string_appendf(&old_path, "/" MELON_RAFT_SNAPSHOT_PATTERN, index);
@@ -651,6 +878,9 @@ namespace melon::raft {
                 MELON_SCOPED_LOCK(_mutex);
                 CHECK_EQ(old_index, _last_snapshot_index);
                 _last_snapshot_index = new_index;
+                if (!writer->_streams.empty()) {
+                    _streams[new_index].swap(writer->_streams);
+                }
             }
             // unref old_index, ref new_index
             unref(old_index);
@@ -668,6 +898,12 @@ namespace melon::raft {
         if (_last_snapshot_index != 0) {
             const int64_t last_snapshot_index = _last_snapshot_index;
             ++_ref_map[last_snapshot_index];
+            SnapshotStreamMap streams;
+            std::map<int64_t, SnapshotStreamMap>::const_iterator
+                    it = _streams.find(last_snapshot_index);
+            if (it != _streams.end()) {
+                streams = it->second;
+            }
             lck.unlock();
             std::string snapshot_path(_path);
             mutil::string_appendf(&snapshot_path, "/" MELON_RAFT_SNAPSHOT_PATTERN, last_snapshot_index);
@@ -679,6 +915,7 @@ namespace melon::raft {
                 delete reader;
                 return NULL;
             }
+            reader->_streams.swap(streams);
             return reader;
         } else {
             errno = ENODATA;
@@ -735,7 +972,8 @@ namespace melon::raft {
 
     LocalSnapshotCopier::LocalSnapshotCopier(bool copy_file) :
             _tid(INVALID_FIBER), _cancelled(false), _filter_before_copy_remote(false), _copy_file(copy_file),
-            _fs(NULL), _throttle(NULL), _writer(NULL), _storage(NULL), _reader(NULL), _cur_session(NULL) {}
+            _fs(NULL), _throttle(NULL), _writer(NULL), _storage(NULL), _reader(NULL),
+            _chunk_index_built(false), _last_snapshot(NULL) {}
 
     LocalSnapshotCopier::~LocalSnapshotCopier() {
         CHECK(!_writer);
@@ -766,6 +1004,10 @@ namespace melon::raft {
                 copy_file(files[i]);
             }
         } while (0);
+        if (_last_snapshot) {
+            _storage->close(_last_snapshot);
+            _last_snapshot = NULL;
+        }
         if (!ok() && _writer && _writer->ok()) {
             LOG(WARNING) << "Fail to copy, error_code " << error_code()
                          << " error_msg " << error_cstr()
@@ -795,11 +1037,11 @@ namespace melon::raft {
         scoped_refptr<RemoteFileCopier::Session> session
                 = _copier.start_to_copy_to_iobuf(MELON_RAFT_SNAPSHOT_META_FILE,
                                                  &meta_buf, NULL);
-        _cur_session = session.get();
+        _cur_sessions.insert(session.get());
         lck.unlock();
         session->join();
         lck.lock();
-        _cur_session = NULL;
+        _cur_sessions.erase(session.get());
         lck.unlock();
         if (!session->status().ok()) {
             LOG(WARNING) << "Fail to copy meta file : " << session->status();
@@ -962,6 +1204,27 @@ namespace melon::raft {
         }
         LocalFileMeta meta;
         _remote_snapshot.get_file_meta(filename, &meta);
+        if (meta.chunks_size() > 0) {
+            copy_file_chunks(filename, file_path, meta);
+        } else {
+            copy_whole_file(filename, file_path);
+        }
+        if (!ok()) {
+            return;
+        }
+        if (_writer->add_file(filename, &meta) != 0) {
+            set_error(EIO, "Fail to add file to writer");
+            return;
+        }
+        if (_writer->sync() != 0) {
+            set_error(EIO, "Fail to sync writer");
+            return;
+        }
+        add_to_chunk_index(file_path, meta);
+    }
+
+    void LocalSnapshotCopier::copy_whole_file(const std::string &filename,
+                                              const std::string &file_path) {
         std::unique_lock<raft_mutex_t> lck(_mutex);
         if (_cancelled) {
             set_error(ECANCELED, "%s", berror(ECANCELED));
@@ -975,24 +1238,168 @@ namespace melon::raft {
             set_error(-1, "Fail to copy %s", filename.c_str());
             return;
         }
-        _cur_session = session.get();
+        _cur_sessions.insert(session.get());
         lck.unlock();
         session->join();
         lck.lock();
-        _cur_session = NULL;
+        _cur_sessions.erase(session.get());
         lck.unlock();
         if (!session->status().ok()) {
             set_error(session->status().error_code(), session->status().error_cstr());
             return;
         }
-        if (_writer->add_file(filename, &meta) != 0) {
-            set_error(EIO, "Fail to add file to writer");
+    }
+
+    void LocalSnapshotCopier::build_chunk_index() {
+        _chunk_index_built = true;
+        _last_snapshot = _storage->open();
+        if (_last_snapshot) {
+            std::vector<std::string> files;
+            _last_snapshot->list_files(&files);
+            for (size_t i = 0; i < files.size(); ++i) {
+                LocalFileMeta meta;
+                if (_last_snapshot->get_file_meta(files[i], &meta) == 0 &&
+                    meta.source() == FILE_SOURCE_LOCAL) {
+                    add_to_chunk_index(_last_snapshot->get_path() + '/' + files[i], meta);
+                }
+            }
+        }
+        // Files kept in the writer by filter_before_copy
+        std::vector<std::string> files;
+        _writer->list_files(&files);
+        for (size_t i = 0; i < files.size(); ++i) {
+            LocalFileMeta meta;
+            if (_writer->get_file_meta(files[i], &meta) == 0) {
+                add_to_chunk_index(_writer->get_path() + '/' + files[i], meta);
+            }
+        }
+    }
+
+    void LocalSnapshotCopier::add_to_chunk_index(const std::string &file_path,
+                                                 const LocalFileMeta &meta) {
+        int64_t offset = 0;
+        for (int i = 0; i < meta.chunks_size(); ++i) {
+            const FileChunk &chunk = meta.chunks(i);
+            ChunkLocation loc;
+            loc.path = file_path;
+            loc.offset = offset;
+            loc.length = chunk.length();
+            _chunk_index.insert(std::make_pair(chunk.hash(), loc));
+            offset += chunk.length();
+        }
+    }
+
+    void LocalSnapshotCopier::copy_file_chunks(const std::string &filename,
+                                               const std::string &file_path,
+                                               const LocalFileMeta &meta) {
+        if (!_chunk_index_built) {
+            build_chunk_index();
+        }
+        mutil::File::Error e;
+        FileAdaptor *file = _fs->open(file_path, O_TRUNC | O_WRONLY | O_CREAT | O_CLOEXEC, NULL, &e);
+        if (!file) {
+            LOG(ERROR) << "Fail to open " << file_path
+                       << ", " << mutil::File::ErrorToString(e);
+            set_error(file_error_to_os_error(e), "Fail to open %s", file_path.c_str());
             return;
         }
-        if (_writer->sync() != 0) {
-            set_error(EIO, "Fail to sync writer");
+        // Fill the chunks found locally and collect the others.
+        std::map<std::string, FileAdaptor *> sources;
+        std::vector<std::pair<int64_t, int64_t> > missing;
+        int64_t offset = 0;
+        int64_t reused_bytes = 0;
+        bool write_failed = false;
+        for (int i = 0; i < meta.chunks_size() && !write_failed; ++i) {
+            const FileChunk &chunk = meta.chunks(i);
+            const int64_t chunk_offset = offset;
+            offset += chunk.length();
+            std::map<std::string, ChunkLocation>::const_iterator
+                    it = _chunk_index.find(chunk.hash());
+            if (it == _chunk_index.end() || it->second.length != chunk.length()) {
+                missing.push_back(std::make_pair(chunk_offset, chunk.length()));
+                continue;
+            }
+            FileAdaptor *&source = sources[it->second.path];
+            if (source == NULL) {
+                source = _fs->open(it->second.path, O_RDONLY | O_CLOEXEC, NULL, &e);
+            }
+            mutil::IOPortal buf;
+            if (source == NULL ||
+                source->read(&buf, it->second.offset, it->second.length) != chunk.length()) {
+                missing.push_back(std::make_pair(chunk_offset, chunk.length()));
+                continue;
+            }
+            if (file->write(buf, chunk_offset) != chunk.length()) {
+                write_failed = true;
+                break;
+            }
+            reused_bytes += chunk.length();
+        }
+        for (std::map<std::string, FileAdaptor *>::iterator
+                     it = sources.begin(); it != sources.end(); ++it) {
+            if (it->second) {
+                it->second->close();
+                delete it->second;
+            }
+        }
+        if (write_failed || !file->sync()) {
+            write_failed = true;
+        }
+        file->close();
+        delete file;
+        if (write_failed) {
+            LOG(WARNING) << "Fail to write into file: " << file_path;
+            set_error(EIO, "%s", berror(EIO));
             return;
         }
+        LOG(INFO) << "Reused " << reused_bytes << " bytes of " << filename
+                  << ", copying " << missing.size() << '/' << meta.chunks_size()
+                  << " chunks from remote, path: " << _writer->get_path();
+
+        // Copy the missing chunks, at most
+        // raft_snapshot_max_concurrent_chunk_copies at the same time.
+        std::deque<scoped_refptr<RemoteFileCopier::Session> > sessions;
+        size_t next = 0;
+        while (ok() && (next < missing.size() || !sessions.empty())) {
+            while (ok() && next < missing.size() &&
+                   sessions.size() < (size_t) FLAGS_raft_snapshot_max_concurrent_chunk_copies) {
+                std::unique_lock<raft_mutex_t> lck(_mutex);
+                if (_cancelled) {
+                    set_error(ECANCELED, "%s", berror(ECANCELED));
+                    break;
+                }
+                scoped_refptr<RemoteFileCopier::Session> session
+                        = _copier.start_to_copy_range_to_file(
+                                filename, file_path, missing[next].first,
+                                missing[next].second, NULL);
+                if (session == NULL) {
+                    set_error(-1, "Fail to copy %s", filename.c_str());
+                    break;
+                }
+                _cur_sessions.insert(session.get());
+                sessions.push_back(session);
+                ++next;
+            }
+            if (sessions.empty()) {
+                break;
+            }
+            scoped_refptr<RemoteFileCopier::Session> session = sessions.front();
+            sessions.pop_front();
+            session->join();
+            std::unique_lock<raft_mutex_t> lck(_mutex);
+            _cur_sessions.erase(session.get());
+            lck.unlock();
+            if (!session->status().ok() && ok()) {
+                set_error(session->status().error_code(), session->status().error_cstr());
+            }
+        }
+        // Stop the remaining sessions on failure
+        for (size_t i = 0; i < sessions.size(); ++i) {
+            sessions[i]->cancel();
+            sessions[i]->join();
+            std::unique_lock<raft_mutex_t> lck(_mutex);
+            _cur_sessions.erase(sessions[i].get());
+        }
     }
 
     void LocalSnapshotCopier::start() {
@@ -1013,8 +1420,9 @@ namespace melon::raft {
             return;
         }
         _cancelled = true;
-        if (_cur_session) {
-            _cur_session->cancel();
+        for (std::set<RemoteFileCopier::Session *>::const_iterator
+                     it = _cur_sessions.begin(); it != _cur_sessions.end(); ++it) {
+            (*it)->cancel();
         }
     }
 
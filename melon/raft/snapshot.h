@@ -21,6 +21,8 @@
 #ifndef MELON_RAFT_RAFT_SNAPSHOT_H_
 #define MELON_RAFT_RAFT_SNAPSHOT_H_
 
+#include <map>
+#include <set>
 #include <string>
 #include <melon/raft/storage.h>
 #include <melon/raft/macros.h>
@@ -31,6 +33,15 @@
 
 namespace melon::raft {
 
+    typedef std::map<std::string, scoped_refptr<SnapshotStreamSource> > SnapshotStreamMap;
+
+    // Split the file at |path| into chunks of |chunk_size| bytes and put their
+    // lengths and content hashes into |file_meta|, which allows followers to
+    // copy only the chunks they don't have.
+    // Returns 0 on success, -1 otherwise.
+    int compute_file_chunks(FileSystemAdaptor *fs, const std::string &path,
+                            size_t chunk_size, LocalFileMeta *file_meta);
+
     class LocalSnapshotMetaTable {
     public:
         LocalSnapshotMetaTable();
@@ -95,6 +106,10 @@ namespace melon::raft {
         // would be removed from the storage.
         virtual int remove_file(const std::string &filename);
 
+        // Add a file produced by |source| when a follower copies the snapshot.
+        virtual int add_stream(const std::string &filename,
+                               SnapshotStreamSource *source);
+
         // List all the existing files in the Snapshot currently
         virtual void list_files(std::vector<std::string> *files);
 
@@ -117,6 +132,7 @@ namespace melon::raft {
         std::string _path;
         LocalSnapshotMetaTable _meta_table;
         scoped_refptr<FileSystemAdaptor> _fs;
+        SnapshotStreamMap _streams;
     };
 
     class LocalSnapshotReader : public SnapshotReader {
@@ -160,6 +176,7 @@ namespace melon::raft {
         int64_t _reader_id;
         scoped_refptr<FileSystemAdaptor> _fs;
         scoped_refptr<SnapshotThrottle> _snapshot_throttle;
+        SnapshotStreamMap _streams;
     };
 
     // Describe the Snapshot on another machine
@@ -217,6 +234,28 @@ namespace melon::raft {
 
         void copy_file(const std::string &filename);
 
+        void copy_whole_file(const std::string &filename,
+                             const std::string &file_path);
+
+        // Fill the chunks of the file found in local files and fetch the others
+        // from remote concurrently.
+        void copy_file_chunks(const std::string &filename,
+                              const std::string &file_path,
+                              const LocalFileMeta &meta);
+
+        // Index the chunks of the files in the last snapshot.
+        void build_chunk_index();
+
+        void add_to_chunk_index(const std::string &file_path,
+                                const LocalFileMeta &meta);
+
+        // Where a chunk with some content hash can be read locally
+        struct ChunkLocation {
+            std::string path;
+            int64_t offset;
+            int64_t length;
+        };
+
         raft_mutex_t _mutex;
         fiber_t _tid;
         bool _cancelled;
@@ -227,9 +266,12 @@ namespace melon::raft {
         LocalSnapshotWriter *_writer;
         LocalSnapshotStorage *_storage;
         SnapshotReader *_reader;
-        RemoteFileCopier::Session *_cur_session;
+        std::set<RemoteFileCopier::Session *> _cur_sessions;
         LocalSnapshot _remote_snapshot;
         RemoteFileCopier _copier;
+        bool _chunk_index_built;
+        SnapshotReader *_last_snapshot;
+        std::map<std::string, ChunkLocation> _chunk_index;
     };
 
     class LocalSnapshotStorage : public SnapshotStorage {
@@ -292,6 +334,8 @@ namespace melon::raft {
         bool _filter_before_copy_remote;
         int64_t _last_snapshot_index;
         std::map<int64_t, int> _ref_map;
+        // Stream sources of the snapshots in memory
+        std::map<int64_t, SnapshotStreamMap> _streams;
         mutil::EndPoint _addr;
         bool _copy_file = true;
         scoped_refptr<FileSystemAdaptor> _fs;
@@ -39,7 +39,11 @@ namespace melon::raft {
                 "Create parent directories of the path in local storage if true");
     DEFINE_int32(raft_sync_policy, 0,
                  "raft sync policy when raft_sync set to true, 0 mean sync immediately, 1 mean sync by "
-                 "writed bytes");
+                 "writed bytes, 2 mean adaptive group commit");
+    DEFINE_int32(raft_sync_target_latency_us, 2000,
+                 "Target latency of syncing appended logs when raft_sync_policy is 2, appends "
+                 "are held for at most the part of this value not spent on syncing");
+    MELON_VALIDATE_GFLAG(raft_sync_target_latency_us, ::melon::NonNegativeInteger);
     DEFINE_bool(raft_sync_meta, false, "sync log meta, snapshot meta and raft meta");
     MELON_VALIDATE_GFLAG(raft_sync_meta, ::melon::PassValidate);
 
@@ -26,6 +26,8 @@
 #include <gflags/gflags.h>
 #include <melon/utility/status.h>
 #include <melon/utility/class_name.h>
+#include <melon/utility/iobuf.h>
+#include <melon/utility/memory/ref_counted.h>
 #include <melon/rpc/extension.h>
 #include <melon/utility/strings/string_piece.h>
 #include <melon/raft/configuration.h>
@@ -41,6 +43,15 @@ namespace melon::raft {
 
     struct LogEntry;
 
+    // Values of FLAGS_raft_sync_policy
+    enum RaftSyncPolicy {
+        RAFT_SYNC_IMMEDIATELY = 0,
+        RAFT_SYNC_BY_BYTES = 1,
+        // Appends are held by LogManager for a while to be synced together,
+        // see FLAGS_raft_sync_target_latency_us
+        RAFT_SYNC_ADAPTIVE = 2,
+    };
+
     struct IOMetric {
     public:
         IOMetric()
@@ -234,6 +245,32 @@ namespace melon::raft {
         }
     };
 
+    // One pass over the content of a streamed snapshot file.
+    class SnapshotStream {
+    public:
+        virtual ~SnapshotStream() {}
+
+        // Append at most |max_count| bytes following the previous call to |out|
+        // and set |*eof| once the whole content has been produced.
+        // Returns 0 on success, the error otherwise.
+        virtual int read(mutil::IOBuf *out, size_t max_count, bool *eof) = 0;
+    };
+
+    // Produces the content of a snapshot file on demand, e.g. by iterating a
+    // consistent view of the state machine, so that the file never has to be
+    // written by the node taking the snapshot.
+    class SnapshotStreamSource : public mutil::RefCountedThreadSafe<SnapshotStreamSource> {
+    public:
+        // Start a new pass over the content, called once each time a follower
+        // copies the file. Returns NULL on failure.
+        virtual SnapshotStream *open() = 0;
+
+    protected:
+        friend class mutil::RefCountedThreadSafe<SnapshotStreamSource>;
+
+        virtual ~SnapshotStreamSource() {}
+    };
+
     class SnapshotWriter : public Snapshot {
     public:
         SnapshotWriter() {}
@@ -261,6 +298,19 @@ namespace melon::raft {
         // Note that whether the file will be removed from the backing storage is
         // implementation-defined.
         virtual int remove_file(const std::string &filename) = 0;
+
+        // Add a file whose content is produced by |source| whenever a follower
+        // copies the snapshot instead of being stored with it. The source lives
+        // in memory only, so the snapshot can't be copied after restarting
+        // until the next one is taken, and on_snapshot_load() of this node
+        // must not rely on the file.
+        // Returns 0 on success, -1 if streaming isn't supported.
+        virtual int add_stream(const std::string &filename,
+                               SnapshotStreamSource *source) {
+            (void) filename;
+            (void) source;
+            return -1;
+        }
     };
 
     class SnapshotReader : public Snapshot {
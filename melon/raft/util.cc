@@ -23,6 +23,9 @@
 #include <melon/utility/macros.h>
 #include <melon/utility/raw_pack.h>                     // mutil::RawPacker
 #include <melon/utility/file_util.h>
+#include <melon/compress/gzip_compress.h>
+#include <melon/compress/snappy_compress.h>
+#include <melon/proto/rpc/options.pb.h>
 #include <melon/raft/raft.h>
 
 namespace melon::var {
@@ -326,6 +329,59 @@ namespace melon::raft {
         return size - left;
     }
 
+    bool is_log_compress_type_supported(int compress_type) {
+        switch (compress_type) {
+            case melon::COMPRESS_TYPE_NONE:
+            case melon::COMPRESS_TYPE_SNAPPY:
+            case melon::COMPRESS_TYPE_GZIP:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    int compress_log_data(int compress_type, const mutil::IOBuf &in,
+                          mutil::IOBuf *out) {
+        bool ok = false;
+        switch (compress_type) {
+            case melon::COMPRESS_TYPE_NONE:
+                out->append(in);
+                ok = true;
+                break;
+            case melon::COMPRESS_TYPE_SNAPPY:
+                ok = melon::compress::SnappyCompress(in, out);
+                break;
+            case melon::COMPRESS_TYPE_GZIP:
+                ok = melon::compress::GzipCompress(in, out, NULL);
+                break;
+            default:
+                LOG(ERROR) << "Unsupported compress_type=" << compress_type;
+                return -1;
+        }
+        return ok ? 0 : -1;
+    }
+
+    int decompress_log_data(int compress_type, const mutil::IOBuf &in,
+                            mutil::IOBuf *out) {
+        bool ok = false;
+        switch (compress_type) {
+            case melon::COMPRESS_TYPE_NONE:
+                out->append(in);
+                ok = true;
+                break;
+            case melon::COMPRESS_TYPE_SNAPPY:
+                ok = melon::compress::SnappyDecompress(in, out);
+                break;
+            case melon::COMPRESS_TYPE_GZIP:
+                ok = melon::compress::GzipDecompress(in, out);
+                break;
+            default:
+                LOG(ERROR) << "Unsupported compress_type=" << compress_type;
+                return -1;
+        }
+        return ok ? 0 : -1;
+    }
+
     void FileSegData::append(const mutil::IOBuf &data, uint64_t offset) {
         uint32_t len = data.size();
         if (0 != _seg_offset && offset == (_seg_offset + _seg_len)) {
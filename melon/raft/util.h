@@ -264,6 +264,20 @@ namespace melon::raft {
 
     ssize_t file_pwrite(const mutil::IOBuf &data, int fd, off_t offset);
 
+    // Compress `in' into `out' with `compress_type', one of the values of
+    // melon::CompressType. Only COMPRESS_TYPE_NONE, COMPRESS_TYPE_SNAPPY and
+    // COMPRESS_TYPE_GZIP are supported for logs.
+    // Returns 0 on success, -1 otherwise.
+    int compress_log_data(int compress_type, const mutil::IOBuf &in,
+                          mutil::IOBuf *out);
+
+    // Reverse of compress_log_data().
+    int decompress_log_data(int compress_type, const mutil::IOBuf &in,
+                            mutil::IOBuf *out);
+
+    // Whether logs can be compressed with `compress_type'.
+    bool is_log_compress_type_supported(int compress_type);
+
 // unsequence file data, reduce the overhead of copy some files have hole.
     class FileSegData {
     public:
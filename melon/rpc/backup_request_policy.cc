@@ -0,0 +1,147 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#include <algorithm>
+#include <melon/utility/time.h>
+#include <melon/rpc/backup_request_policy.h>
+
+namespace melon {
+
+// Interval of re-computing the percentile.
+static const int64_t BACKUP_MS_UPDATE_INTERVAL_US = 100000;
+
+AdaptiveBackupRequestOptions::AdaptiveBackupRequestOptions()
+    : latency_percentile(0.95)
+    , window_size(10)
+    , fallback_backup_request_ms(-1)
+    , min_sample_count(100)
+    , min_backup_request_ms(1)
+    , max_backup_request_ms(-1)
+    , max_backup_ratio(0.05)
+    , max_backup_burst(10) {}
+
+static AdaptiveBackupRequestOptions NormalizeOptions(
+    const AdaptiveBackupRequestOptions* options) {
+    AdaptiveBackupRequestOptions opt;
+    if (options) {
+        opt = *options;
+    }
+    opt.latency_percentile = std::min(std::max(opt.latency_percentile, 0.0), 1.0);
+    opt.window_size = std::max(opt.window_size, 1);
+    opt.max_backup_ratio = std::max(opt.max_backup_ratio, 0.0);
+    opt.max_backup_burst = std::max(opt.max_backup_burst, 1);
+    return opt;
+}
+
+AdaptiveBackupRequestPolicy::AdaptiveBackupRequestPolicy(
+    const AdaptiveBackupRequestOptions* options)
+    : _options(NormalizeOptions(options))
+    , _cached_backup_ms(_options.fallback_backup_request_ms)
+    , _last_update_us(0)
+    , _tokens(_options.max_backup_burst * 1000L)
+    , _latency(_options.window_size)
+    , _nrpc_window(&_nrpc, _options.window_size)
+    , _nbackup_window(&_nbackup, _options.window_size)
+    , _nbackup_won_window(&_nbackup_won, _options.window_size)
+    , _backup_ratio(GetBackupRatio, this)
+    , _win_ratio(GetWinRatio, this) {}
+
+int32_t AdaptiveBackupRequestPolicy::GetBackupRequestMs(const Controller*) const {
+    const int64_t now_us = mutil::cpuwide_time_us();
+    const int64_t last_update_us = _last_update_us.load(mutil::memory_order_relaxed);
+    if (now_us - last_update_us < BACKUP_MS_UPDATE_INTERVAL_US) {
+        return _cached_backup_ms.load(mutil::memory_order_relaxed);
+    }
+    // Only one thread re-computes the delay.
+    int64_t expected = last_update_us;
+    if (!_last_update_us.compare_exchange_strong(
+            expected, now_us, mutil::memory_order_relaxed)) {
+        return _cached_backup_ms.load(mutil::memory_order_relaxed);
+    }
+    int64_t backup_ms = _options.fallback_backup_request_ms;
+    if (_latency.count() >= _options.min_sample_count) {
+        const int64_t latency_us = _latency.latency_percentile(_options.latency_percentile);
+        if (latency_us > 0) {
+            backup_ms = std::max(latency_us / 1000, (int64_t)_options.min_backup_request_ms);
+            if (_options.max_backup_request_ms >= 0) {
+                backup_ms = std::min(backup_ms, (int64_t)_options.max_backup_request_ms);
+            }
+        }
+    }
+    _cached_backup_ms.store(backup_ms, mutil::memory_order_relaxed);
+    return backup_ms;
+}
+
+bool AdaptiveBackupRequestPolicy::DoBackup(const Controller*) const {
+    int64_t tokens = _tokens.load(mutil::memory_order_relaxed);
+    do {
+        if (tokens < 1000) {
+            return false;
+        }
+    } while (!_tokens.compare_exchange_weak(
+                 tokens, tokens - 1000, mutil::memory_order_relaxed));
+    _nbackup << 1;
+    return true;
+}
+
+void AdaptiveBackupRequestPolicy::OnRPCEnd(const Controller* cntl) {
+    _nrpc << 1;
+    if (cntl->responded_by_backup_request()) {
+        _nbackup_won << 1;
+    }
+    if (!cntl->Failed()) {
+        _latency << cntl->latency_us();
+    }
+    // Refill the bucket.
+    const int64_t max_tokens = _options.max_backup_burst * 1000L;
+    const int64_t refill = (int64_t)(_options.max_backup_ratio * 1000);
+    int64_t tokens = _tokens.load(mutil::memory_order_relaxed);
+    while (tokens < max_tokens &&
+           !_tokens.compare_exchange_weak(
+               tokens, std::min(tokens + refill, max_tokens),
+               mutil::memory_order_relaxed)) {}
+}
+
+double AdaptiveBackupRequestPolicy::GetBackupRatio(void* arg) {
+    AdaptiveBackupRequestPolicy* p = static_cast<AdaptiveBackupRequestPolicy*>(arg);
+    const int64_t nrpc = p->_nrpc_window.get_value();
+    return nrpc > 0 ? (double)p->_nbackup_window.get_value() / nrpc : 0;
+}
+
+double AdaptiveBackupRequestPolicy::GetWinRatio(void* arg) {
+    AdaptiveBackupRequestPolicy* p = static_cast<AdaptiveBackupRequestPolicy*>(arg);
+    const int64_t nbackup = p->_nbackup_window.get_value();
+    return nbackup > 0 ? (double)p->_nbackup_won_window.get_value() / nbackup : 0;
+}
+
+int AdaptiveBackupRequestPolicy::Expose(const mutil::StringPiece& prefix) {
+    if (prefix.empty()) {
+        LOG(ERROR) << "Parameter[prefix] is empty";
+        return -1;
+    }
+    if (_latency.expose(prefix) != 0 ||
+        _nbackup.expose_as(prefix, "backup_count") != 0 ||
+        _backup_ratio.expose_as(prefix, "backup_ratio") != 0 ||
+        _win_ratio.expose_as(prefix, "backup_win_ratio") != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+} // namespace melon
@@ -0,0 +1,142 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#pragma once
+
+#include <melon/utility/atomicops.h>
+#include <melon/var/var.h>
+#include <melon/rpc/controller.h>
+
+namespace melon {
+
+// Inherit this class to customize when and whether backup requests are sent.
+// Set to ChannelOptions.backup_request_policy to enable, which overrides
+// ChannelOptions.backup_request_ms. Controller.set_backup_request_ms() still
+// takes precedence over the policy.
+class BackupRequestPolicy {
+public:
+    virtual ~BackupRequestPolicy() = default;
+
+    // Returns the time in milliseconds after which a backup request is
+    // sent if the RPC does not finish. Negative value disables backup
+    // request of the RPC.
+    virtual int32_t GetBackupRequestMs(const Controller* controller) const = 0;
+
+    // Returns true if the backup request should be sent when the time
+    // returned by GetBackupRequestMs() is reached. If false is returned,
+    // the RPC keeps waiting for the original request.
+    virtual bool DoBackup(const Controller* controller) const = 0;
+
+    // Called when the RPC ends, after latency_us() is available.
+    virtual void OnRPCEnd(const Controller* controller) = 0;
+};
+
+struct AdaptiveBackupRequestOptions {
+    // Constructed with default options.
+    AdaptiveBackupRequestOptions();
+
+    // Backup requests are sent after this percentile of recent latencies
+    // of successful RPCs.
+    // Default: 0.95
+    double latency_percentile;
+
+    // Window in seconds of the latencies.
+    // Default: 10
+    int window_size;
+
+    // Backup delay used before `min_sample_count' RPCs have been recorded.
+    // Negative value disables backup requests in that period.
+    // Default: -1
+    int32_t fallback_backup_request_ms;
+
+    // Default: 100
+    int64_t min_sample_count;
+
+    // Bounds of the backup delay. Negative max means unbounded.
+    // Default: 1, -1
+    int32_t min_backup_request_ms;
+    int32_t max_backup_request_ms;
+
+    // Max ratio of backup requests to all RPCs, e.g. 0.05 means that backup
+    // requests add at most 5% extra load to servers. Implemented as a token
+    // bucket refilled by `max_backup_ratio' tokens per RPC.
+    // Default: 0.05
+    double max_backup_ratio;
+
+    // Max number of backup requests that can be sent in a burst, namely
+    // capacity of the token bucket.
+    // Default: 10
+    int max_backup_burst;
+};
+
+// Send backup requests after a live percentile of the latencies observed
+// by the channel instead of a fixed delay, capped by a budget of extra load.
+// The response arriving first is used and the other one is dropped, same
+// as backup requests with fixed delay.
+// One policy is normally shared by all RPCs of a channel and must outlive
+// the channel.
+// Example:
+//   melon::AdaptiveBackupRequestOptions bopt;
+//   bopt.latency_percentile = 0.9;
+//   melon::AdaptiveBackupRequestPolicy policy(&bopt);
+//   policy.Expose("foo_client");
+//   melon::ChannelOptions opt;
+//   opt.backup_request_policy = &policy;
+class AdaptiveBackupRequestPolicy : public BackupRequestPolicy {
+public:
+    // Use default options if `options' is NULL.
+    explicit AdaptiveBackupRequestPolicy(const AdaptiveBackupRequestOptions* options);
+
+    int32_t GetBackupRequestMs(const Controller* controller) const override;
+    bool DoBackup(const Controller* controller) const override;
+    void OnRPCEnd(const Controller* controller) override;
+
+    // Expose latencies, number of backup requests, ratio of backup requests
+    // to RPCs (backup_ratio) and ratio of backup requests responding first
+    // (backup_win_ratio) as vars prefixed with `prefix'.
+    // Returns 0 on success, -1 otherwise.
+    int Expose(const mutil::StringPiece& prefix);
+
+    const AdaptiveBackupRequestOptions& options() const { return _options; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(AdaptiveBackupRequestPolicy);
+
+    static double GetBackupRatio(void* arg);
+    static double GetWinRatio(void* arg);
+
+    AdaptiveBackupRequestOptions _options;
+    // Computing percentiles is expensive, cache the delay for a while.
+    mutable mutil::atomic<int32_t> _cached_backup_ms;
+    mutable mutil::atomic<int64_t> _last_update_us;
+    // Tokens in thousandths.
+    mutable mutil::atomic<int64_t> _tokens;
+
+    melon::var::LatencyRecorder _latency;
+    melon::var::Adder<int64_t> _nrpc;
+    mutable melon::var::Adder<int64_t> _nbackup;
+    melon::var::Adder<int64_t> _nbackup_won;
+    melon::var::Window<melon::var::Adder<int64_t> > _nrpc_window;
+    melon::var::Window<melon::var::Adder<int64_t> > _nbackup_window;
+    melon::var::Window<melon::var::Adder<int64_t> > _nbackup_won_window;
+    melon::var::PassiveStatus<double> _backup_ratio;
+    melon::var::PassiveStatus<double> _win_ratio;
+};
+
+} // namespace melon
@@ -0,0 +1,351 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#include <inttypes.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <melon/fiber/fiber.h>                  // fiber_session_xx
+#include <melon/utility/time.h>
+#include <melon/rpc/details/response_cache.h>
+#include <melon/rpc/caching_channel.h>
+
+namespace melon {
+
+    DECLARE_bool(usercode_in_pthread);
+
+    CachingChannelOptions::CachingChannelOptions()
+            : default_ttl_ms(0), stale_while_revalidate_ms(0), max_cache_bytes(64 * 1024 * 1024L), num_shards(32),
+              ownership(DOESNT_OWN_CHANNEL) {}
+
+    // Fill the cache with the response before running user's done.
+    class CacheFillDone : public google::protobuf::Closure {
+    public:
+        CacheFillDone(CachingChannel *chan, const std::string &key, int64_t ttl_ms,
+                      Controller *cntl, google::protobuf::Message *response,
+                      google::protobuf::Closure *done)
+                : _chan(chan), _key(key), _ttl_ms(ttl_ms), _cntl(cntl), _response(response), _done(done) {}
+
+        void Run() override {
+            std::unique_ptr<CacheFillDone> delete_self(this);
+            _chan->FillCache(_key, _ttl_ms, _cntl, _response);
+            _done->Run();
+        }
+
+    private:
+        CachingChannel *_chan;
+        std::string _key;
+        int64_t _ttl_ms;
+        Controller *_cntl;
+        google::protobuf::Message *_response;
+        google::protobuf::Closure *_done;
+    };
+
+    // A copy of a call sent in background to refresh a stale response.
+    class CacheRefreshCall : public google::protobuf::Closure {
+    public:
+        CacheRefreshCall(CachingChannel *chan, const std::string &key, int64_t ttl_ms)
+                : _chan(chan), _key(key), _ttl_ms(ttl_ms) {}
+
+        void Run() override {
+            std::unique_ptr<CacheRefreshCall> delete_self(this);
+            if (!cntl.Failed()) {
+                _chan->FillCache(_key, _ttl_ms, &cntl, response.get());
+            } else {
+                _chan->_cache->EndRefresh(_key);
+            }
+            // Don't touch _chan after this line, it may be destructed.
+            _chan->_nrefreshing.fetch_sub(1, mutil::memory_order_release);
+        }
+
+        Controller cntl;
+        std::unique_ptr<google::protobuf::Message> request;
+        std::unique_ptr<google::protobuf::Message> response;
+
+    private:
+        CachingChannel *_chan;
+        std::string _key;
+        int64_t _ttl_ms;
+    };
+
+    static bool MakeCacheKey(const google::protobuf::MethodDescriptor *method,
+                             const Controller *cntl,
+                             const google::protobuf::Message *request,
+                             std::string *key) {
+        key->append(method->full_name());
+        key->push_back('\0');
+        if (!cntl->cache_key().empty()) {
+            key->append(cntl->cache_key());
+            return true;
+        }
+        if (!cntl->request_attachment().empty()) {
+            // The attachment is part of the request, don't bother.
+            return false;
+        }
+        if (request == NULL) {
+            return true;
+        }
+        google::protobuf::io::StringOutputStream sos(key);
+        google::protobuf::io::CodedOutputStream cos(&sos);
+        // Map fields must be serialized in the same order to make same keys.
+        cos.SetSerializationDeterministic(true);
+        return request->SerializeToCodedStream(&cos) && !cos.HadError();
+    }
+
+    CachingChannel::CachingChannel()
+            : _sub_channel(NULL), _nrefreshing(0),
+              _cache_bytes(GetCacheBytes, this), _cache_count(GetCacheCount, this) {}
+
+    CachingChannel::~CachingChannel() {
+        while (_nrefreshing.load(mutil::memory_order_acquire) > 0) {
+            fiber_usleep(1000);
+        }
+        if (_options.ownership == OWNS_CHANNEL) {
+            delete _sub_channel;
+        }
+        _sub_channel = NULL;
+    }
+
+    int CachingChannel::Init(ChannelBase *sub_channel, const CachingChannelOptions *options) {
+        if (sub_channel == NULL) {
+            LOG(ERROR) << "Param[sub_channel] is NULL";
+            return -1;
+        }
+        if (_sub_channel != NULL) {
+            LOG(ERROR) << "Already initialized";
+            return -1;
+        }
+        if (options) {
+            _options = *options;
+        }
+        if (_options.max_cache_bytes == 0) {
+            LOG(ERROR) << "max_cache_bytes must be positive";
+            return -1;
+        }
+        _cache.reset(new ResponseCache(_options.max_cache_bytes, _options.num_shards));
+        _sub_channel = sub_channel;
+        return 0;
+    }
+
+    int CachingChannel::Expose(const mutil::StringPiece &prefix) {
+        if (_nhit.expose_as(prefix, "hit") != 0) {
+            return -1;
+        }
+        if (_nstale_hit.expose_as(prefix, "stale_hit") != 0) {
+            return -1;
+        }
+        if (_nmiss.expose_as(prefix, "miss") != 0) {
+            return -1;
+        }
+        if (_cache_bytes.expose_as(prefix, "bytes") != 0) {
+            return -1;
+        }
+        if (_cache_count.expose_as(prefix, "count") != 0) {
+            return -1;
+        }
+        return 0;
+    }
+
+    size_t CachingChannel::GetCacheBytes(void *arg) {
+        const CachingChannel *c = static_cast<const CachingChannel *>(arg);
+        return c->_cache ? c->_cache->size_in_bytes() : 0;
+    }
+
+    size_t CachingChannel::GetCacheCount(void *arg) {
+        const CachingChannel *c = static_cast<const CachingChannel *>(arg);
+        return c->_cache ? c->_cache->size() : 0;
+    }
+
+    void CachingChannel::ClearCache() {
+        if (_cache) {
+            _cache->Clear();
+        }
+    }
+
+    int64_t CachingChannel::GetTTL(const google::protobuf::MethodDescriptor *method) const {
+        if (method == NULL) {
+            return 0;
+        }
+        if (!_options.method_ttl_ms.empty()) {
+            auto it = _options.method_ttl_ms.find(method->full_name());
+            if (it != _options.method_ttl_ms.end()) {
+                return it->second;
+            }
+        }
+        return _options.default_ttl_ms;
+    }
+
+    void CachingChannel::FillCache(const std::string &key, int64_t ttl_ms,
+                                   const Controller *cntl,
+                                   const google::protobuf::Message *response) {
+        if (cntl->Failed()) {
+            return;
+        }
+        if (!cntl->response_attachment().empty()) {
+            // Not cacheable, let the next stale hit refresh again.
+            _cache->EndRefresh(key);
+            return;
+        }
+        std::string value;
+        if (!response->SerializeToString(&value)) {
+            _cache->EndRefresh(key);
+            return;
+        }
+        const int64_t expire_us = mutil::cpuwide_time_us() + ttl_ms * 1000L;
+        _cache->Insert(key, value, expire_us,
+                       expire_us + std::max(_options.stale_while_revalidate_ms, (int64_t)0) * 1000L);
+    }
+
+    void CachingChannel::StartRefresh(const google::protobuf::MethodDescriptor *method,
+                                      const Controller *cntl,
+                                      const google::protobuf::Message *request,
+                                      const google::protobuf::Message *response,
+                                      const std::string &key, int64_t ttl_ms) {
+        CacheRefreshCall *c = new CacheRefreshCall(this, key, ttl_ms);
+        if (request) {
+            c->request.reset(request->New());
+            c->request->CopyFrom(*request);
+        }
+        c->response.reset(response->New());
+        if (cntl->timeout_ms() != UNSET_MAGIC_NUM) {
+            c->cntl.set_timeout_ms(cntl->timeout_ms());
+        }
+        c->cntl.set_log_id(cntl->log_id());
+        _nrefreshing.fetch_add(1, mutil::memory_order_relaxed);
+        _sub_channel->CallMethod(method, &c->cntl, c->request.get(), c->response.get(), c);
+    }
+
+    void *CachingChannel::RunDoneAndDestroy(void *arg) {
+        Controller *c = static_cast<Controller *>(arg);
+        // Move done out from the controller.
+        google::protobuf::Closure *done = c->_done;
+        c->_done = NULL;
+        // Save call_id from the controller which may be deleted after Run().
+        const fiber_session_t cid = c->call_id();
+        done->Run();
+        CHECK_EQ(0, fiber_session_unlock_and_destroy(cid));
+        return NULL;
+    }
+
+    void CachingChannel::EndCallFromCache(Controller *cntl, google::protobuf::Closure *done) {
+        cntl->OnRPCBegin(mutil::gettimeofday_us());
+        const CallId cid = cntl->call_id();
+        const int rc = fiber_session_lock(cid, NULL);
+        if (rc != 0) {
+            CHECK_EQ(EINVAL, rc);
+            if (!cntl->FailedInline()) {
+                cntl->SetFailed(EINVAL, "Fail to lock call_id=%" PRId64, cid.value);
+            }
+            LOG_IF(ERROR, cntl->is_used_by_rpc())
+                << "Controller=" << cntl << " was used by another RPC before. "
+                   "Did you forget to Reset() it before reuse?";
+            if (done) {
+                done->Run();
+            }
+            return;
+        }
+        cntl->set_used_by_rpc();
+        cntl->add_flag(Controller::FLAGS_RESPONSE_FROM_CACHE);
+        cntl->OnRPCEnd(mutil::gettimeofday_us());
+        if (done) {
+            if (!cntl->is_done_allowed_to_run_in_place()) {
+                fiber_t bh;
+                fiber_attr_t attr = (FLAGS_usercode_in_pthread ?
+                                     FIBER_ATTR_PTHREAD : FIBER_ATTR_NORMAL);
+                // Hack: save done in cntl->_done to remove a malloc of args.
+                cntl->_done = done;
+                if (fiber_start_background(&bh, &attr, RunDoneAndDestroy, cntl) == 0) {
+                    return;
+                }
+                cntl->_done = NULL;
+                LOG(FATAL) << "Fail to start fiber";
+            }
+            done->Run();
+        }
+        CHECK_EQ(0, fiber_session_unlock_and_destroy(cid));
+    }
+
+    void CachingChannel::CallMethod(const google::protobuf::MethodDescriptor *method,
+                                    google::protobuf::RpcController *cntl_base,
+                                    const google::protobuf::Message *request,
+                                    google::protobuf::Message *response,
+                                    google::protobuf::Closure *done) {
+        Controller *cntl = static_cast<Controller *>(cntl_base);
+        const int64_t ttl_ms = GetTTL(method);
+        std::string key;
+        if (_cache == NULL || ttl_ms <= 0 || response == NULL ||
+            cntl->has_flag(Controller::FLAGS_BYPASS_CACHE) ||
+            !MakeCacheKey(method, cntl, request, &key)) {
+            return _sub_channel->CallMethod(method, cntl, request, response, done);
+        }
+        if (!cntl->has_flag(Controller::FLAGS_REFRESH_CACHE)) {
+            std::string value;
+            bool should_refresh = false;
+            const ResponseCache::LookupResult rc =
+                    _cache->Lookup(key, mutil::cpuwide_time_us(), &value, &should_refresh);
+            if (rc != ResponseCache::CACHE_MISS) {
+                if (response->ParseFromString(value)) {
+                    if (rc == ResponseCache::CACHE_HIT) {
+                        _nhit << 1;
+                    } else {
+                        _nstale_hit << 1;
+                    }
+                    if (should_refresh) {
+                        StartRefresh(method, cntl, request, response, key, ttl_ms);
+                    }
+                    return EndCallFromCache(cntl, done);
+                }
+                // Corrupted, probably because the response type was changed.
+                response->Clear();
+                _cache->Erase(key);
+            }
+        }
+        _nmiss << 1;
+        if (done == NULL) {
+            _sub_channel->CallMethod(method, cntl, request, response, NULL);
+            FillCache(key, ttl_ms, cntl, response);
+            return;
+        }
+        _sub_channel->CallMethod(method, cntl, request, response,
+                                 new CacheFillDone(this, key, ttl_ms, cntl, response, done));
+    }
+
+    int CachingChannel::Weight() {
+        return _sub_channel ? _sub_channel->Weight() : 0;
+    }
+
+    int CachingChannel::CheckHealth() {
+        return _sub_channel ? _sub_channel->CheckHealth() : -1;
+    }
+
+    void CachingChannel::Describe(std::ostream &os, const DescribeOptions &options) const {
+        os << "CachingChannel[";
+        if (_sub_channel != NULL) {
+            _sub_channel->Describe(os, options);
+            if (_cache) {
+                os << " cached=" << _cache->size()
+                   << " bytes=" << _cache->size_in_bytes();
+            }
+        } else {
+            os << "uninitialized";
+        }
+        os << ']';
+    }
+
+} // namespace melon
@@ -0,0 +1,160 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+#include <melon/utility/atomicops.h>
+#include <melon/var/var.h>
+#include <melon/rpc/channel.h>
+
+namespace melon {
+
+    class ResponseCache;
+
+    struct CachingChannelOptions {
+        // Constructed with default options.
+        CachingChannelOptions();
+
+        // Responses of methods not listed in `method_ttl_ms' are cached for
+        // so many milliseconds. Non-positive value means that these methods
+        // are not cached.
+        // Default: 0
+        int64_t default_ttl_ms;
+
+        // Time-to-live in milliseconds of responses of specific methods,
+        // keyed by full names of methods, e.g. "example.EchoService.Echo".
+        // Non-positive value disables caching of the method.
+        std::map<std::string, int64_t> method_ttl_ms;
+
+        // If positive, an expired response is still returned within so many
+        // milliseconds after its expiration, meanwhile one request is sent in
+        // background to refresh the response.
+        // Default: 0
+        int64_t stale_while_revalidate_ms;
+
+        // Max bytes of all cached keys and responses. Least recently used
+        // responses are evicted when the cache is full.
+        // Default: 64MB
+        size_t max_cache_bytes;
+
+        // Number of shards of the cache, each of them has its own lock.
+        // Default: 32
+        int num_shards;
+
+        // Whether the sub channel is deleted along with the CachingChannel.
+        // Default: DOESNT_OWN_CHANNEL
+        ChannelOwnership ownership;
+    };
+
+    // A channel caching successful responses of read-mostly methods, aka
+    // "cchan". Responses are keyed by the method and the serialized request,
+    // or by Controller::cache_key() when it's set. Failed calls and responses
+    // with attachments are never cached.
+    // Per call, Controller::bypass_cache() skips the cache entirely and
+    // Controller::refresh_cache() forces a request whose response replaces
+    // the cached one. Controller::is_response_from_cache() tells whether the
+    // response was served from the cache.
+    // Unlike Channel, a cchan must outlive asynchronous calls made through it.
+    // Example:
+    //   melon::CachingChannelOptions opt;
+    //   opt.method_ttl_ms["example.ConfigService.Get"] = 5000;
+    //   melon::CachingChannel cchan;
+    //   cchan.Init(&channel, &opt);
+    //   example::ConfigService_Stub stub(&cchan);
+    class CachingChannel : public ChannelBase/*non-copyable*/ {
+    public:
+        CachingChannel();
+
+        // Wait for background refreshes to complete.
+        ~CachingChannel();
+
+        // Cache responses from `sub_channel' which must outlive this channel
+        // unless its ownership is transferred by `options'. If `options' is
+        // NULL, use default options.
+        // Returns 0 on success, -1 otherwise.
+        int Init(ChannelBase *sub_channel, const CachingChannelOptions *options);
+
+        // Expose hit/miss counters and size of the cache as vars prefixed
+        // with `prefix'.
+        // Returns 0 on success, -1 otherwise.
+        int Expose(const mutil::StringPiece &prefix);
+
+        // Remove all cached responses.
+        void ClearCache();
+
+        void CallMethod(const google::protobuf::MethodDescriptor *method,
+                        google::protobuf::RpcController *controller,
+                        const google::protobuf::Message *request,
+                        google::protobuf::Message *response,
+                        google::protobuf::Closure *done) override;
+
+        int Weight() override;
+
+        int CheckHealth() override;
+
+        void Describe(std::ostream &os, const DescribeOptions &options) const override;
+
+        const CachingChannelOptions &options() const { return _options; }
+
+    private:
+        DISALLOW_COPY_AND_ASSIGN(CachingChannel);
+
+        friend class CacheFillDone;
+
+        friend class CacheRefreshCall;
+
+        int64_t GetTTL(const google::protobuf::MethodDescriptor *method) const;
+
+        // Serialize response of `cntl' into the cache if the call succeeded.
+        void FillCache(const std::string &key, int64_t ttl_ms,
+                       const Controller *cntl,
+                       const google::protobuf::Message *response);
+
+        // Send a copy of the call in background to refresh a stale response.
+        void StartRefresh(const google::protobuf::MethodDescriptor *method,
+                          const Controller *cntl,
+                          const google::protobuf::Message *request,
+                          const google::protobuf::Message *response,
+                          const std::string &key, int64_t ttl_ms);
+
+        static void EndCallFromCache(Controller *cntl,
+                                     google::protobuf::Closure *done);
+
+        static void *RunDoneAndDestroy(void *arg);
+
+        static size_t GetCacheBytes(void *arg);
+
+        static size_t GetCacheCount(void *arg);
+
+        ChannelBase *_sub_channel;
+        CachingChannelOptions _options;
+        std::unique_ptr<ResponseCache> _cache;
+        mutil::atomic<int> _nrefreshing;
+
+        melon::var::Adder<int64_t> _nhit;
+        melon::var::Adder<int64_t> _nstale_hit;
+        melon::var::Adder<int64_t> _nmiss;
+        melon::var::PassiveStatus<size_t> _cache_bytes;
+        melon::var::PassiveStatus<size_t> _cache_count;
+    };
+
+} // namespace melon
@@ -20,6 +20,7 @@
 
 
 #include <inttypes.h>
+#include <algorithm>
 #include <google/protobuf/descriptor.h>
 #include <gflags/gflags.h>
 #include <memory>
@@ -36,6 +37,7 @@
 #include <melon/rpc/controller.h>
 #include <melon/rpc/channel.h>
 #include <melon/rpc/details/usercode_backup_pool.h>       // TooManyUserCode
+#include <melon/rpc/details/server_deadline.h>            // GetServerDeadline
 
 namespace melon {
 
@@ -48,6 +50,7 @@ ChannelOptions::ChannelOptions()
     , backup_request_ms(-1)
     , max_retry(3)
     , enable_circuit_breaker(false)
+    , enable_outlier_detection(false)
     , protocol(PROTOCOL_MELON_STD)
     , connection_type(CONNECTION_TYPE_UNKNOWN)
     , succeed_without_server(true)
@@ -55,7 +58,9 @@ ChannelOptions::ChannelOptions()
     , use_rdma(false)
     , auth(nullptr)
     , retry_policy(nullptr)
+    , backup_request_policy(nullptr)
     , ns_filter(nullptr)
+    , subset_options(nullptr)
 {}
 
 ChannelSSLOptions* ChannelOptions::mutable_ssl_options() {
@@ -361,7 +366,8 @@ int Channel::Init(const char* ns_url,
     if (CreateSocketSSLContext(_options, &ns_opt.ssl_ctx) != 0) {
         return -1;
     }
-    if (lb->Init(ns_url, lb_name, _options.ns_filter, &ns_opt) != 0) {
+    if (lb->Init(ns_url, lb_name, _options.ns_filter, &ns_opt,
+                 _options.subset_options, _options.enable_outlier_detection) != 0) {
         LOG(ERROR) << "Fail to initialize LoadBalancerWithNaming";
         return -1;
     }
@@ -462,12 +468,29 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
     if (cntl->timeout_ms() == UNSET_MAGIC_NUM) {
         cntl->set_timeout_ms(_options.timeout_ms);
     }
+    // The RPC is made on behalf of a server-side RPC, don't wait longer
+    // than the upstream caller.
+    const int64_t inherited_deadline_us = cntl->_inheritable.deadline_us >= 0 ?
+        cntl->_inheritable.deadline_us : GetServerDeadline();
+    if (inherited_deadline_us >= 0) {
+        const int64_t left_ms =
+            std::max(inherited_deadline_us - start_send_real_us, (int64_t)0) / 1000;
+        if (cntl->timeout_ms() < 0 || left_ms < cntl->timeout_ms()) {
+            cntl->set_timeout_ms(left_ms);
+        }
+    }
     // Since connection is shared extensively amongst channels and RPC,
     // overriding connect_timeout_ms does not make sense, just use the
     // one in ChannelOptions
     cntl->_connect_timeout_ms = _options.connect_timeout_ms;
     if (cntl->backup_request_ms() == UNSET_MAGIC_NUM) {
-        cntl->set_backup_request_ms(_options.backup_request_ms);
+        if (_options.backup_request_policy) {
+            cntl->_backup_request_policy = _options.backup_request_policy;
+            cntl->set_backup_request_ms(
+                _options.backup_request_policy->GetBackupRequestMs(cntl));
+        } else {
+            cntl->set_backup_request_ms(_options.backup_request_ms);
+        }
     }
     if (cntl->connection_type() == CONNECTION_TYPE_UNKNOWN) {
         cntl->set_connection_type(_options.connection_type);
@@ -502,6 +525,10 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
                         "-usercode_in_pthread is on");
         return cntl->HandleSendFailed();
     }
+    if (inherited_deadline_us >= 0 && start_send_real_us >= inherited_deadline_us) {
+        cntl->SetFailed(ERPCTIMEDOUT, "Deadline of the upstream RPC has passed");
+        return cntl->HandleSendFailed();
+    }
 
     if (cntl->_request_stream != INVALID_STREAM_ID) {
         // Currently we cannot handle retry and backup request correctly
@@ -31,10 +31,15 @@
 #include <melon/rpc/controller.h>                // melon::Controller
 #include <melon/rpc/details/profiler_linker.h>
 #include <melon/rpc/retry_policy.h>
+#include <melon/rpc/backup_request_policy.h>
 #include <melon/naming/naming_service_filter.h>
 
 namespace melon {
 
+    namespace lb {
+        struct SubsetOptions;
+    }  // namespace lb
+
     struct ChannelOptions {
         // Constructed with default options.
         ChannelOptions();
@@ -73,6 +78,13 @@ namespace melon {
         // Default: false
         bool enable_circuit_breaker;
 
+        // Stop sending requests to servers which are much slower or fail much
+        // more than other servers of this channel for a while. Only works for
+        // channels with NamingService. Like circuit breaker, ejection is
+        // GLOBAL. Refer to melon/rpc/outlier_detector.h for details.
+        // Default: false
+        bool enable_outlier_detection;
+
         // Serialization protocol, defined in melon/proto/options.proto
         // NOTE: You can assign name of the protocol to this field as well, for
         // Example: options.protocol = "melon_std";
@@ -118,6 +130,14 @@ namespace melon {
         // Default: NULL
         const RetryPolicy *retry_policy;
 
+        // Decide when and whether to send backup requests, overriding
+        // `backup_request_ms'. The interface is defined in
+        // melon/rpc/backup_request_policy.h
+        // This object is NOT owned by channel and should remain valid when
+        // channel is used.
+        // Default: NULL
+        BackupRequestPolicy *backup_request_policy;
+
         // Filter ServerNodes (i.e. based on `tag' field of `ServerNode')
         // which are generated by NamingService. The interface is defined
         // in melon/naming_service_filter.h
@@ -126,6 +146,15 @@ namespace melon {
         // Default: NULL
         const NamingServiceFilter *ns_filter;
 
+        // Use a deterministic subset of servers from the NamingService rather
+        // than all of them, to bound connections and health checks when
+        // there're thousands of clients and servers. The interface is defined
+        // in melon/lb/subset_load_balancer.h
+        // This object is NOT owned by channel and should remain valid when
+        // channel is being initialized.
+        // Default: NULL (use all servers)
+        const lb::SubsetOptions *subset_options;
+
         // Channels with same connection_group share connections.
         // In other words, set to a different value to stop sharing connections.
         // Case-sensitive, leading and trailing spaces are ignored.
@@ -182,7 +211,14 @@ namespace melon {
         //   wr                           # weighted random
         //   wrr                          # weighted round robin
         //   la                           # locality aware
-        //   c_murmurhash/c_md5           # consistent hashing with murmurhash3/md5
+        //   p2c_ewma                     # power of two choices by peak-EWMA latency
+        //   utilization                  # power of two choices by load reported by
+        //                                # servers, read ServerOptions.report_load
+        //   c_murmurhash/c_md5           # consistent hashing with murmurhash3/md5,
+        //                                # "c_murmurhash:epsilon=0.25" bounds loads
+        //   c_maglev                     # consistent hashing with maglev lookup table
+        //   zone_aware                   # prefer servers in the same zone, e.g.
+        //                                # "zone_aware:zone=us-east-1a lb=la"
         //   "" or NULL                   # treat `naming_service_url' as `server_addr_and_port'
         //                                # Init(xxx, "", options) and Init(xxx, NULL, options)
         //                                # are exactly same with Init(xxx, options)
@@ -236,6 +236,8 @@ namespace melon {
         }
         delete _remote_stream_settings;
         _thrift_method_name.clear();
+        _cache_key.clear();
+        _server_load = ServerLoad();
         _after_rpc_resp_fn = nullptr;
 
         CHECK(_unfinished_call == NULL);
@@ -252,10 +254,12 @@ namespace melon {
         _server = NULL;
         _oncancel_id = INVALID_FIBER_ID;
         _auth_context = NULL;
+        _tenant = NULL;
         _sampled_request = NULL;
         _request_protocol = PROTOCOL_UNKNOWN;
         _max_retry = UNSET_MAGIC_NUM;
         _retry_policy = NULL;
+        _backup_request_policy = NULL;
         _correlation_id = INVALID_FIBER_ID;
         _connection_type = CONNECTION_TYPE_UNKNOWN;
         _timeout_ms = UNSET_MAGIC_NUM;
@@ -618,6 +622,12 @@ namespace melon {
                 SetFailed(rc, "Fail to add timer");
                 goto END_OF_RPC;
             }
+            if (_backup_request_policy && !_backup_request_policy->DoBackup(this)) {
+                // Keep waiting for the original request.
+                _error_code = saved_error;
+                CHECK_EQ(0, fiber_session_unlock(info.id));
+                return;
+            }
             if (!SingleServer()) {
                 if (_accessed == NULL) {
                     _accessed = ExcludedServers::Create(
@@ -862,6 +872,9 @@ namespace melon {
             }
 
             if (_unfinished_call != NULL) {
+                if (_error_code == 0) {
+                    add_flag(FLAGS_RESPONDED_BY_BACKUP);
+                }
                 // When _current_call is successful, mark _unfinished_call as
                 // EBACKUPREQUEST, we can't use 0 because the server possibly
                 // never respond, we can't use ERPCTIMEDOUT because _current_call
@@ -970,6 +983,13 @@ namespace melon {
         }
     }
 
+    void Controller::OnRPCEnd(int64_t end_time_us) {
+        _end_time_us = end_time_us;
+        if (_backup_request_policy) {
+            _backup_request_policy->OnRPCEnd(this);
+        }
+    }
+
     void Controller::RunDoneInBackupThread(void *arg) {
         static_cast<Controller *>(arg)->DoneInBackupThread();
     }
@@ -44,6 +44,7 @@
 #include <melon/rpc/progressive_reader.h>           // ProgressiveReader
 #include <melon/rpc/grpc/grpc.h>
 #include <melon/rpc/kvmap.h>
+#include <melon/rpc/server_load.h>                  // ServerLoad
 #include <melon/utility/time.h>
 
 // EAUTH is defined in MAC
@@ -77,6 +78,11 @@ namespace melon {
     class InputMessageBase;
 
     class ThriftStub;
+
+    class Tenant;
+
+    class BackupRequestPolicy;
+
     namespace policy {
         class OnServerStreamCreated;
 
@@ -130,6 +136,10 @@ namespace melon {
 
         friend class SelectiveChannel;
 
+        friend class CachingChannel;
+
+        friend class TenantScheduler;
+
         friend class ThriftStub;
 
         friend class schan::Sender;
@@ -169,18 +179,29 @@ namespace melon {
         static const uint32_t FLAGS_PB_SINGLE_REPEATED_TO_ARRAY = (1 << 20);
         static const uint32_t FLAGS_MANAGE_HTTP_BODY_ON_ERROR = (1 << 21);
         static const uint32_t FLAGS_WRITE_TO_SOCKET_IN_BACKGROUND = (1 << 22);
+        static const uint32_t FLAGS_BYPASS_CACHE = (1 << 23);
+        static const uint32_t FLAGS_REFRESH_CACHE = (1 << 24);
+        static const uint32_t FLAGS_RESPONSE_FROM_CACHE = (1 << 25);
+        static const uint32_t FLAGS_RESPONDED_BY_BACKUP = (1 << 26);
 
     public:
         struct Inheritable {
-            Inheritable() : log_id(0) {}
+            Inheritable() : log_id(0), deadline_us(-1) {}
 
             void Reset() {
                 log_id = 0;
                 request_id.clear();
+                deadline_us = -1;
             }
 
             uint64_t log_id;
             std::string request_id;
+            // Deadline of the server-side RPC (since the Epoch in microseconds)
+            // that the downstream calls are made for, -1 means no deadline.
+            // Timeouts of calls made with the inherited controller are clamped
+            // to the remaining time so that a request whose caller has given
+            // up is not sent any more.
+            int64_t deadline_us;
         };
 
     public:
@@ -228,6 +249,30 @@ namespace melon {
         // True if a backup request was sent during the RPC.
         bool has_backup_request() const { return has_flag(FLAGS_BACKUP_REQUEST); }
 
+        // True if the backup request responded before the original request.
+        bool responded_by_backup_request() const { return has_flag(FLAGS_RESPONDED_BY_BACKUP); }
+
+        // [CachingChannel] Neither look up nor fill the response cache.
+        void bypass_cache() { add_flag(FLAGS_BYPASS_CACHE); }
+
+        // [CachingChannel] Skip the lookup and always send the request, the
+        // response overwrites the cached one on success.
+        void refresh_cache() { add_flag(FLAGS_REFRESH_CACHE); }
+
+        // [CachingChannel] Set the key to cache the response with instead of
+        // the serialized request. Responses of the same method are shared
+        // between calls with the same key.
+        void set_cache_key(const std::string &key) { _cache_key = key; }
+
+        const std::string &cache_key() const { return _cache_key; }
+
+        // [CachingChannel] True if the response was served from cache.
+        bool is_response_from_cache() const { return has_flag(FLAGS_RESPONSE_FROM_CACHE); }
+
+        // [Client-side] Load reported by the server in the last response,
+        // reported() is false if the server did not set ServerOptions.report_load.
+        const ServerLoad &server_load() const { return _server_load; }
+
         // This function has different meanings in client and server side.
         // In client side it gets latency of the RPC call. While in server side,
         // it gets queue time before server processes the RPC call.
@@ -652,6 +697,8 @@ namespace melon {
 
         // Get deadline of this RPC (since the Epoch in microseconds).
         // -1 means no deadline.
+        // On server side, the deadline is derived from the timeout sent by
+        // the client and is passed to downstream calls via inheritable().
         int64_t deadline_us() const { return _deadline_us; }
 
         using AfterRpcRespFnType = std::function<void(Controller *cntl,
@@ -795,9 +842,7 @@ namespace melon {
             _end_time_us = begin_time_us;
         }
 
-        void OnRPCEnd(int64_t end_time_us) {
-            _end_time_us = end_time_us;
-        }
+        void OnRPCEnd(int64_t end_time_us);
 
         static void RunDoneInBackupThread(void *);
 
@@ -840,6 +885,7 @@ namespace melon {
         const Server *_server;
         fiber_session_t _oncancel_id;
         const AuthContext *_auth_context;        // Authentication result
+        Tenant *_tenant;                         // Admitted by TenantScheduler
         mutil::intrusive_ptr<MongoContext> _mongo_session_data;
         SampledRequest *_sampled_request;
 
@@ -848,6 +894,7 @@ namespace melon {
         // after CallMethod.
         int _max_retry;
         const RetryPolicy *_retry_policy;
+        BackupRequestPolicy *_backup_request_policy;
         // Synchronization object for one RPC call. It remains unchanged even
         // when retry happens. Synchronous RPC will wait on this id.
         CallId _correlation_id;
@@ -933,6 +980,12 @@ namespace melon {
         // Thrift method name, only used when thrift protocol enabled
         std::string _thrift_method_name;
 
+        // Key of the response in CachingChannel, empty means the serialized
+        // request.
+        std::string _cache_key;
+
+        ServerLoad _server_load;
+
         uint32_t _auth_flags;
 
         AfterRpcRespFnType _after_rpc_resp_fn;
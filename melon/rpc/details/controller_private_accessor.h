@@ -111,6 +111,8 @@ public:
         return *this;
     }
 
+    void set_server_load(const ServerLoad& load) { _cntl->_server_load = load; }
+
     // Pass the owership of |settings| to _cntl, while is going to be
     // destroyed in Controller::Reset()
     void set_remote_stream_settings(StreamSettings *settings) {
@@ -140,7 +142,10 @@ public:
 
     // Note: This function can only be called in server side. The deadline of client
     // side is properly set in the RPC sending path.
-    void set_deadline_us(int64_t deadline_us) { _cntl->_deadline_us = deadline_us; }
+    void set_deadline_us(int64_t deadline_us) {
+        _cntl->_deadline_us = deadline_us;
+        _cntl->_inheritable.deadline_us = deadline_us;
+    }
 
     ControllerPrivateAccessor& set_begin_time_us(int64_t begin_time_us) {
         _cntl->_begin_time_us = begin_time_us;
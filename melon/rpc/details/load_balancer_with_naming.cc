@@ -32,10 +32,15 @@ LoadBalancerWithNaming::~LoadBalancerWithNaming() {
 
 int LoadBalancerWithNaming::Init(const char* ns_url, const char* lb_name,
                                  const NamingServiceFilter* filter,
-                                 const GetNamingServiceThreadOptions* options) {
-    if (SharedLoadBalancer::Init(lb_name) != 0) {
+                                 const GetNamingServiceThreadOptions* options,
+                                 const lb::SubsetOptions* subset_options,
+                                 bool enable_outlier_detection) {
+    if (SharedLoadBalancer::Init(lb_name, subset_options) != 0) {
         return -1;
     }
+    if (enable_outlier_detection) {
+        EnableOutlierDetection();
+    }
     if (GetNamingServiceThread(&_nsthread_ptr, ns_url, options) != 0) {
         LOG(ERROR) << "Fail to get NamingServiceThread";
         return -1;
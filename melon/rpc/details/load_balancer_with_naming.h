@@ -36,7 +36,9 @@ public:
 
     int Init(const char* ns_url, const char* lb_name,
              const NamingServiceFilter* filter,
-             const GetNamingServiceThreadOptions* options);
+             const GetNamingServiceThreadOptions* options,
+             const lb::SubsetOptions* subset_options = NULL,
+             bool enable_outlier_detection = false);
     
     void OnAddedServers(const std::vector<ServerId>& servers);
     void OnRemovedServers(const std::vector<ServerId>& servers);
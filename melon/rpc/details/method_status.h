@@ -57,6 +57,10 @@ public:
     // Current max_concurrency of the method.
     int MaxConcurrency() const { return _cl ? _cl->MaxConcurrency() : 0; }
 
+    // Number of requests being processed by the method.
+    int concurrency() const
+    { return _nconcurrency.load(mutil::memory_order_relaxed); }
+
 private:
 friend class Server;
     DISALLOW_COPY_AND_ASSIGN(MethodStatus);
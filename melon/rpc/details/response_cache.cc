@@ -0,0 +1,160 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#include <algorithm>
+#include <melon/utility/scoped_lock.h>
+#include <melon/utility/third_party/murmurhash3/murmurhash3.h>
+#include <melon/rpc/details/response_cache.h>
+
+namespace melon {
+
+    ResponseCache::ResponseCache(size_t max_bytes, int num_shards) {
+        size_t n = 1;
+        while (n < (size_t)std::max(num_shards, 1)) {
+            n <<= 1;
+        }
+        _shard_mask = n - 1;
+        _shard_max_bytes = max_bytes / n;
+        _shards = new Shard[n];
+    }
+
+    ResponseCache::~ResponseCache() {
+        Clear();
+        delete [] _shards;
+    }
+
+    ResponseCache::Shard* ResponseCache::GetShard(const std::string& key) const {
+        // Don't use std::hash here, the low bits are also used by buckets of
+        // the unordered_map inside the shard.
+        uint32_t h = 0;
+        mutil::MurmurHash3_x86_32(key.data(), key.size(), 0x5bd1e995, &h);
+        return &_shards[h & _shard_mask];
+    }
+
+    void ResponseCache::RemoveEntry(Shard* s, Entry* e) {
+        e->RemoveFromList();
+        s->map.erase(e->key);
+        s->nbytes -= e->charge();
+        delete e;
+    }
+
+    ResponseCache::LookupResult ResponseCache::Lookup(
+        const std::string& key, int64_t now_us,
+        std::string* value, bool* should_refresh) {
+        *should_refresh = false;
+        Shard* s = GetShard(key);
+        MELON_SCOPED_LOCK(s->mutex);
+        auto it = s->map.find(key);
+        if (it == s->map.end()) {
+            return CACHE_MISS;
+        }
+        Entry* e = it->second;
+        if (now_us >= e->stale_until_us) {
+            RemoveEntry(s, e);
+            return CACHE_MISS;
+        }
+        // Move to the most recently used position.
+        e->RemoveFromList();
+        s->lru.Append(e);
+        value->assign(e->value);
+        if (now_us < e->expire_us) {
+            return CACHE_HIT;
+        }
+        if (!e->refreshing) {
+            e->refreshing = true;
+            *should_refresh = true;
+        }
+        return CACHE_STALE;
+    }
+
+    void ResponseCache::Insert(const std::string& key, const std::string& value,
+                               int64_t expire_us, int64_t stale_until_us) {
+        Entry* e = new Entry;
+        e->key = key;
+        e->value = value;
+        e->expire_us = expire_us;
+        e->stale_until_us = std::max(expire_us, stale_until_us);
+        e->refreshing = false;
+        const size_t charge = e->charge();
+        Shard* s = GetShard(key);
+        std::unique_lock<mutil::Mutex> mu(s->mutex);
+        auto it = s->map.find(key);
+        if (it != s->map.end()) {
+            RemoveEntry(s, it->second);
+        }
+        if (charge > _shard_max_bytes) {
+            mu.unlock();
+            delete e;
+            return;
+        }
+        while (s->nbytes + charge > _shard_max_bytes && !s->lru.empty()) {
+            RemoveEntry(s, s->lru.head()->value());
+        }
+        s->map[key] = e;
+        s->lru.Append(e);
+        s->nbytes += charge;
+    }
+
+    void ResponseCache::EndRefresh(const std::string& key) {
+        Shard* s = GetShard(key);
+        MELON_SCOPED_LOCK(s->mutex);
+        auto it = s->map.find(key);
+        if (it != s->map.end()) {
+            it->second->refreshing = false;
+        }
+    }
+
+    void ResponseCache::Erase(const std::string& key) {
+        Shard* s = GetShard(key);
+        MELON_SCOPED_LOCK(s->mutex);
+        auto it = s->map.find(key);
+        if (it != s->map.end()) {
+            RemoveEntry(s, it->second);
+        }
+    }
+
+    void ResponseCache::Clear() {
+        for (size_t i = 0; i <= _shard_mask; ++i) {
+            Shard* s = &_shards[i];
+            MELON_SCOPED_LOCK(s->mutex);
+            while (!s->lru.empty()) {
+                RemoveEntry(s, s->lru.head()->value());
+            }
+        }
+    }
+
+    size_t ResponseCache::size() const {
+        size_t n = 0;
+        for (size_t i = 0; i <= _shard_mask; ++i) {
+            MELON_SCOPED_LOCK(_shards[i].mutex);
+            n += _shards[i].map.size();
+        }
+        return n;
+    }
+
+    size_t ResponseCache::size_in_bytes() const {
+        size_t n = 0;
+        for (size_t i = 0; i <= _shard_mask; ++i) {
+            MELON_SCOPED_LOCK(_shards[i].mutex);
+            n += _shards[i].nbytes;
+        }
+        return n;
+    }
+
+} // namespace melon
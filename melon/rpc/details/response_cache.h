@@ -0,0 +1,102 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <melon/utility/macros.h>                       // DISALLOW_COPY_AND_ASSIGN
+#include <melon/utility/synchronization/lock.h>         // mutil::Mutex
+#include <melon/utility/containers/linked_list.h>       // mutil::LinkedList
+
+namespace melon {
+
+    // A sharded LRU cache mapping keys to serialized responses. The total size
+    // of keys and values is bounded by `max_bytes', which is split evenly among
+    // shards so that concurrent lookups on different keys rarely contend.
+    // Used by CachingChannel.
+    class ResponseCache {
+    public:
+        enum LookupResult {
+            CACHE_MISS = 0,
+            CACHE_HIT = 1,    // Entry is fresh.
+            CACHE_STALE = 2,  // Entry expired but is still in its stale window.
+        };
+
+        // `num_shards' is rounded up to the next power of 2.
+        ResponseCache(size_t max_bytes, int num_shards);
+        ~ResponseCache();
+
+        // Find the entry of `key' at time `now_us'. On CACHE_HIT or CACHE_STALE,
+        // the cached value is copied into `value'. On CACHE_STALE, `*should_refresh'
+        // is set to true for exactly one caller until the entry is re-inserted
+        // or the refreshing is given up by EndRefresh(), so that only one
+        // background refresh is issued for a stale entry.
+        LookupResult Lookup(const std::string& key, int64_t now_us,
+                            std::string* value, bool* should_refresh);
+
+        // Insert or overwrite the entry of `key'. The entry is fresh before
+        // `expire_us' and stale (but servable) before `stale_until_us'.
+        // Entries larger than a shard are not cached.
+        void Insert(const std::string& key, const std::string& value,
+                    int64_t expire_us, int64_t stale_until_us);
+
+        // Clear the refreshing mark of `key' set by Lookup(), called when the
+        // background refresh failed.
+        void EndRefresh(const std::string& key);
+
+        void Erase(const std::string& key);
+        void Clear();
+
+        // Number of entries and bytes in the cache.
+        size_t size() const;
+        size_t size_in_bytes() const;
+
+    private:
+        DISALLOW_COPY_AND_ASSIGN(ResponseCache);
+
+        struct Entry : public mutil::LinkNode<Entry> {
+            std::string key;
+            std::string value;
+            int64_t expire_us;
+            int64_t stale_until_us;
+            bool refreshing;
+
+            size_t charge() const { return key.size() + value.size() + sizeof(Entry); }
+        };
+
+        struct Shard {
+            Shard() : nbytes(0) {}
+            mutable mutil::Mutex mutex;
+            std::unordered_map<std::string, Entry*> map;
+            // Most recently used entries are at the tail.
+            mutil::LinkedList<Entry> lru;
+            size_t nbytes;
+        };
+
+        Shard* GetShard(const std::string& key) const;
+
+        // Remove `e' from `s'. Caller must hold s->mutex.
+        static void RemoveEntry(Shard* s, Entry* e);
+
+        size_t _shard_max_bytes;
+        size_t _shard_mask;
+        Shard* _shards;
+    };
+
+} // namespace melon
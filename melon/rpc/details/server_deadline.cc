@@ -0,0 +1,57 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#include <pthread.h>
+#include <turbo/log/logging.h>
+#include <melon/fiber/key.h>
+#include <melon/rpc/details/server_deadline.h>
+
+namespace melon {
+
+static pthread_once_t s_create_deadline_key_once = PTHREAD_ONCE_INIT;
+static fiber_key_t s_deadline_key;
+
+static void CreateDeadlineKey() {
+    CHECK_EQ(0, fiber_key_create(&s_deadline_key, NULL));
+}
+
+// The deadline is stored as the value of the key, NULL means no deadline.
+int64_t GetServerDeadline() {
+    pthread_once(&s_create_deadline_key_once, CreateDeadlineKey);
+    void* data = fiber_getspecific(s_deadline_key);
+    return data ? (int64_t)(intptr_t)data : -1;
+}
+
+ScopedServerDeadline::ScopedServerDeadline(int64_t deadline_us)
+    : _set(false), _saved(NULL) {
+    if (deadline_us <= 0) {
+        return;
+    }
+    pthread_once(&s_create_deadline_key_once, CreateDeadlineKey);
+    _saved = fiber_getspecific(s_deadline_key);
+    _set = (fiber_setspecific(s_deadline_key, (void*)(intptr_t)deadline_us) == 0);
+}
+
+ScopedServerDeadline::~ScopedServerDeadline() {
+    if (_set) {
+        fiber_setspecific(s_deadline_key, _saved);
+    }
+}
+
+} // namespace melon
@@ -0,0 +1,48 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <melon/utility/macros.h>                       // DISALLOW_COPY_AND_ASSIGN
+
+namespace melon {
+
+// Deadline (since the Epoch in microseconds) of the server-side RPC whose
+// user callback is running in the calling fiber or pthread, -1 if there's
+// none. Channels clamp timeouts of RPCs issued by the callback to it, so that
+// deadlines are propagated across hops without passing inheritable() around.
+// Only RPCs issued before the callback returns see the deadline, asynchronous
+// continuations should create their controllers from inheritable().
+int64_t GetServerDeadline();
+
+// Make `deadline_us' the server deadline of the calling fiber or pthread
+// within the scope. Negative deadline is ignored.
+class ScopedServerDeadline {
+public:
+    explicit ScopedServerDeadline(int64_t deadline_us);
+    ~ScopedServerDeadline();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ScopedServerDeadline);
+    bool _set;
+    void* _saved;
+};
+
+} // namespace melon
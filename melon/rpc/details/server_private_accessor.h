@@ -26,6 +26,7 @@
 #include <melon/rpc/details/method_status.h>
 #include <melon/builtin/bad_method_service.h>
 #include <melon/rpc/restful.h>
+#include <melon/rpc/tenant_scheduler.h>
 
 namespace melon {
 
@@ -42,6 +43,10 @@ public:
         _server->_nerror_var << 1;
     }
 
+    void AddExpired() {
+        _server->_nexpired_var << 1;
+    }
+
     // Returns true if the `max_concurrency' limit is not reached.
     bool AddConcurrency(Controller* c) {
         if (_server->options().max_concurrency <= 0) {
@@ -56,6 +61,9 @@ public:
         if (c->has_flag(Controller::FLAGS_ADDED_CONCURRENCY)) {
             mutil::subtle::NoBarrier_AtomicIncrement(&_server->_concurrency, -1);
         }
+        if (c->_tenant) {
+            _server->options().tenant_scheduler->OnResponded(c);
+        }
     }
 
     // Find by MethodDescriptor::full_name
@@ -41,7 +41,11 @@
 #include <melon/lb/randomized_load_balancer.h>
 #include <melon/lb/weighted_randomized_load_balancer.h>
 #include <melon/lb/locality_aware_load_balancer.h>
+#include <melon/lb/p2c_ewma_load_balancer.h>
+#include <melon/lb/utilization_load_balancer.h>
 #include <melon/lb/consistent_hashing_load_balancer.h>
+#include <melon/lb/maglev_load_balancer.h>
+#include <melon/lb/zone_aware_load_balancer.h>
 #include <melon/rpc/policy/hasher.h>
 #include <melon/rpc/policy/dynpart_load_balancer.h>
 
@@ -68,6 +72,7 @@
 #include <melon/rpc/policy/auto_concurrency_limiter.h>
 #include <melon/rpc/policy/constant_concurrency_limiter.h>
 #include <melon/rpc/policy/timeout_concurrency_limiter.h>
+#include <melon/rpc/policy/codel_concurrency_limiter.h>
 
 #include <melon/rpc/input_messenger.h>     // get_or_new_client_side_messenger
 #include <melon/rpc/socket_map.h>          // SocketMapList
@@ -129,14 +134,19 @@ namespace melon {
         melon::lb::RandomizedLoadBalancer randomized_lb;
         melon::lb::WeightedRandomizedLoadBalancer wr_lb;
         melon::lb::LocalityAwareLoadBalancer la_lb;
+        melon::lb::P2CEwmaLoadBalancer p2c_ewma_lb;
+        melon::lb::UtilizationLoadBalancer utilization_lb;
         melon::lb::ConsistentHashingLoadBalancer ch_mh_lb;
         melon::lb::ConsistentHashingLoadBalancer ch_md5_lb;
         melon::lb::ConsistentHashingLoadBalancer ch_ketama_lb;
+        melon::lb::MaglevLoadBalancer ch_maglev_lb;
+        melon::lb::ZoneAwareLoadBalancer zone_aware_lb;
         DynPartLoadBalancer dynpart_lb;
 
         AutoConcurrencyLimiter auto_cl;
         ConstantConcurrencyLimiter constant_cl;
         TimeoutConcurrencyLimiter timeout_cl;
+        CodelConcurrencyLimiter codel_cl;
     };
 
     static pthread_once_t register_extensions_once = PTHREAD_ONCE_INIT;
@@ -357,9 +367,13 @@ namespace melon {
         LoadBalancerExtension()->RegisterOrDie("random", &g_ext->randomized_lb);
         LoadBalancerExtension()->RegisterOrDie("wr", &g_ext->wr_lb);
         LoadBalancerExtension()->RegisterOrDie("la", &g_ext->la_lb);
+        LoadBalancerExtension()->RegisterOrDie("p2c_ewma", &g_ext->p2c_ewma_lb);
+        LoadBalancerExtension()->RegisterOrDie("utilization", &g_ext->utilization_lb);
         LoadBalancerExtension()->RegisterOrDie("c_murmurhash", &g_ext->ch_mh_lb);
         LoadBalancerExtension()->RegisterOrDie("c_md5", &g_ext->ch_md5_lb);
         LoadBalancerExtension()->RegisterOrDie("c_ketama", &g_ext->ch_ketama_lb);
+        LoadBalancerExtension()->RegisterOrDie("c_maglev", &g_ext->ch_maglev_lb);
+        LoadBalancerExtension()->RegisterOrDie("zone_aware", &g_ext->zone_aware_lb);
         LoadBalancerExtension()->RegisterOrDie("_dynpart", &g_ext->dynpart_lb);
 
         // Compress Handlers
@@ -502,6 +516,7 @@ namespace melon {
         ConcurrencyLimiterExtension()->RegisterOrDie("auto", &g_ext->auto_cl);
         ConcurrencyLimiterExtension()->RegisterOrDie("constant", &g_ext->constant_cl);
         ConcurrencyLimiterExtension()->RegisterOrDie("timeout", &g_ext->timeout_cl);
+        ConcurrencyLimiterExtension()->RegisterOrDie("codel", &g_ext->codel_cl);
 
         if (FLAGS_usercode_in_pthread) {
             // Optional. If channel/server are initialized before main(), this
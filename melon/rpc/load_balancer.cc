@@ -22,6 +22,8 @@
 #include <gflags/gflags.h>
 #include <melon/rpc/reloadable_flags.h>
 #include <melon/rpc/load_balancer.h>
+#include <melon/lb/subset_load_balancer.h>
+#include <melon/rpc/outlier_detector.h>
 
 
 namespace melon {
@@ -63,13 +65,17 @@ namespace melon {
 
     SharedLoadBalancer::~SharedLoadBalancer() {
         _st.hide();
+        if (_outlier_detector) {
+            _outlier_detector->Stop();
+        }
         if (_lb) {
             _lb->Destroy();
             _lb = NULL;
         }
     }
 
-    int SharedLoadBalancer::Init(const char *lb_protocol) {
+    int SharedLoadBalancer::Init(const char *lb_protocol,
+                                 const lb::SubsetOptions *subset_options) {
         std::string lb_name;
         mutil::StringPiece lb_params;
         if (!ParseParameters(lb_protocol, &lb_name, &lb_params)) {
@@ -86,12 +92,42 @@ namespace melon {
             LOG(FATAL) << "Fail to new LoadBalancer";
             return -1;
         }
+        if (subset_options) {
+            LoadBalancer *subset_lb =
+                    new(std::nothrow) lb::SubsetLoadBalancer(_lb, *subset_options);
+            if (subset_lb == NULL) {
+                LOG(FATAL) << "Fail to new SubsetLoadBalancer";
+                _lb->Destroy();
+                _lb = NULL;
+                return -1;
+            }
+            _lb = subset_lb;
+        }
         if (FLAGS_show_lb_in_vars && !_exposed) {
             ExposeLB();
         }
         return 0;
     }
 
+    void SharedLoadBalancer::EnableOutlierDetection() {
+        if (!_outlier_detector) {
+            _outlier_detector = std::make_shared<OutlierDetector>();
+            OutlierDetector::StartEvaluating(_outlier_detector);
+        }
+    }
+
+    void SharedLoadBalancer::FeedbackOutlierDetector(const LoadBalancer::CallInfo &info) {
+        _outlier_detector->OnCallEnd(info);
+    }
+
+    void SharedLoadBalancer::AddToOutlierDetector(const std::vector<ServerId> &servers) {
+        _outlier_detector->AddServers(servers);
+    }
+
+    void SharedLoadBalancer::RemoveFromOutlierDetector(const std::vector<ServerId> &servers) {
+        _outlier_detector->RemoveServers(servers);
+    }
+
     void SharedLoadBalancer::Describe(std::ostream &os,
                                       const DescribeOptions &options) {
         if (_lb == NULL) {
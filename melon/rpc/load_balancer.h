@@ -19,6 +19,7 @@
 
 #pragma once
 
+#include <memory>                                      // std::shared_ptr
 #include <melon/var/passive_status.h>
 #include <melon/rpc/describable.h>
 #include <melon/rpc/destroyable.h>
@@ -108,6 +109,12 @@ namespace melon {
         virtual ~LoadBalancer() {}
     };
 
+    namespace lb {
+        struct SubsetOptions;
+    }  // namespace lb
+
+    class OutlierDetector;
+
     DECLARE_bool(show_lb_in_vars);
     DECLARE_int32(default_weight_of_wlb);
 
@@ -118,21 +125,41 @@ namespace melon {
 
         ~SharedLoadBalancer();
 
-        int Init(const char *lb_name);
+        // Feed the LoadBalancer with a subset of servers if `subset_options'
+        // is not NULL, see melon/lb/subset_load_balancer.h for details.
+        int Init(const char *lb_name,
+                 const lb::SubsetOptions *subset_options = NULL);
 
         int SelectServer(const LoadBalancer::SelectIn &in,
                          LoadBalancer::SelectOut *out) {
             if (FLAGS_show_lb_in_vars && !_exposed) {
                 ExposeLB();
             }
-            return _lb->SelectServer(in, out);
+            const int rc = _lb->SelectServer(in, out);
+            if (rc == 0 && _outlier_detector) {
+                out->need_feedback = true;
+            }
+            return rc;
+        }
+
+        void Feedback(const LoadBalancer::CallInfo &info) {
+            if (_outlier_detector) {
+                FeedbackOutlierDetector(info);
+            }
+            _lb->Feedback(info);
         }
 
-        void Feedback(const LoadBalancer::CallInfo &info) { _lb->Feedback(info); }
+        // Eject servers much slower or failing much more than others, see
+        // melon/rpc/outlier_detector.h for details. Must be called before
+        // adding servers.
+        void EnableOutlierDetection();
 
         bool AddServer(const ServerId &server) {
             if (_lb->AddServer(server)) {
                 _weight_sum.fetch_add(1, mutil::memory_order_relaxed);
+                if (_outlier_detector) {
+                    AddToOutlierDetector(std::vector<ServerId>(1, server));
+                }
                 return true;
             }
             return false;
@@ -141,6 +168,9 @@ namespace melon {
         bool RemoveServer(const ServerId &server) {
             if (_lb->RemoveServer(server)) {
                 _weight_sum.fetch_sub(1, mutil::memory_order_relaxed);
+                if (_outlier_detector) {
+                    RemoveFromOutlierDetector(std::vector<ServerId>(1, server));
+                }
                 return true;
             }
             return false;
@@ -151,6 +181,9 @@ namespace melon {
             if (n) {
                 _weight_sum.fetch_add(n, mutil::memory_order_relaxed);
             }
+            if (_outlier_detector) {
+                AddToOutlierDetector(servers);
+            }
             return n;
         }
 
@@ -159,6 +192,9 @@ namespace melon {
             if (n) {
                 _weight_sum.fetch_sub(n, mutil::memory_order_relaxed);
             }
+            if (_outlier_detector) {
+                RemoveFromOutlierDetector(servers);
+            }
             return n;
         }
 
@@ -177,7 +213,14 @@ namespace melon {
 
         void ExposeLB();
 
+        void FeedbackOutlierDetector(const LoadBalancer::CallInfo &info);
+
+        void AddToOutlierDetector(const std::vector<ServerId> &servers);
+
+        void RemoveFromOutlierDetector(const std::vector<ServerId> &servers);
+
         LoadBalancer *_lb;
+        std::shared_ptr<OutlierDetector> _outlier_detector;
         mutil::atomic<int> _weight_sum;
         volatile bool _exposed;
         mutil::Mutex _st_mutex;
@@ -0,0 +1,244 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#include <algorithm>                                   // std::nth_element
+#include <gflags/gflags.h>
+#include <melon/utility/time.h>
+#include <melon/rpc/socket.h>
+#include <melon/rpc/periodic_task.h>
+#include <melon/rpc/reloadable_flags.h>
+#include <melon/rpc/outlier_detector.h>
+
+namespace melon {
+
+    DEFINE_int32(outlier_detection_interval_ms, 1000,
+                 "Interval between two rounds of outlier detection");
+    DEFINE_int32(outlier_detection_min_requests, 20,
+                 "Servers with fewer requests in an interval are not evaluated");
+    DEFINE_int32(outlier_detection_min_servers, 5,
+                 "Skip outlier detection when fewer servers can be evaluated");
+    DEFINE_double(outlier_detection_latency_factor, 3.0,
+                  "A server is an outlier if its latency is larger than the median "
+                  "latency multiplied by this factor, non-positive value disables it");
+    DEFINE_double(outlier_detection_success_rate_ratio, 0.9,
+                  "A server is an outlier if its success rate is less than the median "
+                  "success rate multiplied by this ratio, non-positive value disables it");
+    DEFINE_int32(outlier_detection_base_ejection_ms, 30000,
+                 "Duration of the first ejection of a server, doubled for each "
+                 "consecutive ejection");
+    DEFINE_int32(outlier_detection_max_ejection_ms, 300000,
+                 "Max duration of an ejection");
+    DEFINE_int32(outlier_detection_max_ejection_percent, 10,
+                 "At most so many percent of servers are ejected at the same time");
+    MELON_VALIDATE_GFLAG(outlier_detection_latency_factor, PassValidate);
+    MELON_VALIDATE_GFLAG(outlier_detection_success_rate_ratio, PassValidate);
+    MELON_VALIDATE_GFLAG(outlier_detection_max_ejection_percent, PassValidate);
+
+    class OutlierDetectionTask : public PeriodicTask {
+    public:
+        explicit OutlierDetectionTask(const std::shared_ptr<OutlierDetector> &detector)
+                : _detector(detector) {}
+
+        bool OnTriggeringTask(timespec *next_abstime) override {
+            if (_detector->stopped()) {
+                return false;
+            }
+            _detector->Evaluate();
+            *next_abstime = mutil::milliseconds_from_now(
+                    std::max(FLAGS_outlier_detection_interval_ms, 1));
+            return true;
+        }
+
+        void OnDestroyingTask() override {
+            delete this;
+        }
+
+    private:
+        std::shared_ptr<OutlierDetector> _detector;
+    };
+
+    OutlierDetector::OutlierDetector() : _stopped(false) {}
+
+    OutlierDetector::~OutlierDetector() {}
+
+    void OutlierDetector::StartEvaluating(const std::shared_ptr<OutlierDetector> &detector) {
+        PeriodicTaskManager::StartTaskAt(
+                new OutlierDetectionTask(detector),
+                mutil::milliseconds_from_now(std::max(FLAGS_outlier_detection_interval_ms, 1)));
+    }
+
+    size_t OutlierDetector::AddStats(StatsMap &bg, const StatsMap &fg,
+                                     const std::vector<ServerId> &servers) {
+        for (size_t i = 0; i < servers.size(); ++i) {
+            const SocketId id = servers[i].id;
+            StatsMap::const_iterator it = fg.find(id);
+            if (it != fg.end()) {
+                // Created in the first call.
+                bg[id] = it->second;
+            } else {
+                bg[id] = std::make_shared<Stats>();
+            }
+        }
+        return 1;
+    }
+
+    size_t OutlierDetector::RemoveStats(StatsMap &bg, const std::vector<ServerId> &servers) {
+        for (size_t i = 0; i < servers.size(); ++i) {
+            bg.erase(servers[i].id);
+        }
+        return 1;
+    }
+
+    void OutlierDetector::AddServers(const std::vector<ServerId> &servers) {
+        _db_stats.ModifyWithForeground(AddStats, servers);
+    }
+
+    void OutlierDetector::RemoveServers(const std::vector<ServerId> &servers) {
+        _db_stats.Modify(RemoveStats, servers);
+    }
+
+    void OutlierDetector::OnCallEnd(const LoadBalancer::CallInfo &info) {
+        mutil::DoublyBufferedData<StatsMap>::ScopedPtr s;
+        if (_db_stats.Read(&s) != 0) {
+            return;
+        }
+        StatsMap::const_iterator it = s->find(info.server_id);
+        if (it == s->end()) {
+            return;
+        }
+        Stats *stats = it->second.get();
+        stats->nrequest.fetch_add(1, mutil::memory_order_relaxed);
+        if (info.error_code != 0) {
+            stats->nerror.fetch_add(1, mutil::memory_order_relaxed);
+            return;
+        }
+        const int64_t latency_us = mutil::gettimeofday_us() - info.begin_time_us;
+        const int64_t old_value = stats->ewma_latency_us.load(mutil::memory_order_relaxed);
+        // Racing updates lose some samples, which is fine for an average.
+        stats->ewma_latency_us.store(
+                old_value <= 0 ? latency_us : old_value + (latency_us - old_value) / 16,
+                mutil::memory_order_relaxed);
+    }
+
+    namespace {
+
+        struct Candidate {
+            SocketId id;
+            int64_t latency_us;
+            double success_rate;
+        };
+
+        template<typename T>
+        T Median(std::vector<T> *values) {
+            std::nth_element(values->begin(), values->begin() + values->size() / 2,
+                             values->end());
+            return (*values)[values->size() / 2];
+        }
+
+    }  // namespace
+
+    size_t OutlierDetector::Evaluate() {
+        MELON_SCOPED_LOCK(_evaluate_mutex);
+        mutil::DoublyBufferedData<StatsMap>::ScopedPtr s;
+        if (_db_stats.Read(&s) != 0) {
+            return 0;
+        }
+        const int64_t now_us = mutil::cpuwide_time_us();
+        size_t nejected = 0;
+        std::vector<std::pair<Stats *, Candidate> > candidates;
+        std::vector<int64_t> latencies;
+        std::vector<double> success_rates;
+        for (StatsMap::const_iterator it = s->begin(); it != s->end(); ++it) {
+            Stats *stats = it->second.get();
+            const int64_t nrequest = stats->nrequest.exchange(0, mutil::memory_order_relaxed);
+            const int64_t nerror = stats->nerror.exchange(0, mutil::memory_order_relaxed);
+            if (stats->ejected_until_us > now_us) {
+                ++nejected;
+                continue;
+            }
+            if (nrequest < std::max(FLAGS_outlier_detection_min_requests, 1)) {
+                continue;
+            }
+            Candidate c;
+            c.id = it->first;
+            c.latency_us = stats->ewma_latency_us.load(mutil::memory_order_relaxed);
+            c.success_rate = (double) (nrequest - nerror) / nrequest;
+            candidates.push_back(std::make_pair(stats, c));
+            if (c.latency_us > 0) {
+                latencies.push_back(c.latency_us);
+            }
+            success_rates.push_back(c.success_rate);
+        }
+        if (candidates.empty() ||
+            candidates.size() < (size_t) std::max(FLAGS_outlier_detection_min_servers, 1)) {
+            return 0;
+        }
+        const int64_t median_latency = latencies.empty() ? 0 : Median(&latencies);
+        const double median_success_rate = Median(&success_rates);
+        const int max_ejection_percent = std::max(FLAGS_outlier_detection_max_ejection_percent, 0);
+        size_t max_ejected = s->size() * max_ejection_percent / 100;
+        if (max_ejection_percent > 0) {
+            // Small clusters can eject one server, but never all of them.
+            max_ejected = std::min(std::max<size_t>(max_ejected, 1), s->size() - 1);
+        }
+        // Eject the slowest outliers first.
+        std::sort(candidates.begin(), candidates.end(),
+                  [](const std::pair<Stats *, Candidate> &lhs,
+                     const std::pair<Stats *, Candidate> &rhs) {
+                      return lhs.second.latency_us > rhs.second.latency_us;
+                  });
+        size_t nnew_ejected = 0;
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            Stats *stats = candidates[i].first;
+            const Candidate &c = candidates[i].second;
+            const bool slow = FLAGS_outlier_detection_latency_factor > 0 && median_latency > 0 &&
+                              c.latency_us > median_latency * FLAGS_outlier_detection_latency_factor;
+            const bool failing = FLAGS_outlier_detection_success_rate_ratio > 0 &&
+                                 c.success_rate < median_success_rate *
+                                                  FLAGS_outlier_detection_success_rate_ratio;
+            SocketUniquePtr ptr;
+            if ((slow || failing) && nejected < max_ejected &&
+                Socket::Address(c.id, &ptr) == 0) {
+                ++stats->nejection;
+                int64_t duration_ms = std::max(FLAGS_outlier_detection_base_ejection_ms, 0);
+                for (int n = 1; n < stats->nejection &&
+                                duration_ms < FLAGS_outlier_detection_max_ejection_ms; ++n) {
+                    duration_ms *= 2;
+                }
+                duration_ms = std::min(duration_ms,
+                                       (int64_t) FLAGS_outlier_detection_max_ejection_ms);
+                stats->ejected_until_us = now_us + duration_ms * 1000;
+                // Forget the latency before ejection, otherwise the server is
+                // ejected again right after it's back.
+                stats->ewma_latency_us.store(0, mutil::memory_order_relaxed);
+                ptr->SetEjectedUntil(stats->ejected_until_us);
+                LOG(WARNING) << "Eject " << *ptr << " for " << duration_ms << "ms, latency="
+                             << c.latency_us << "us(median=" << median_latency
+                             << "us) success_rate=" << c.success_rate << "(median="
+                             << median_success_rate << ')';
+                ++nejected;
+                ++nnew_ejected;
+            } else if (!slow && !failing && stats->nejection > 0) {
+                --stats->nejection;
+            }
+        }
+        return nnew_ejected;
+    }
+
+}  // namespace melon
@@ -0,0 +1,100 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#pragma once
+
+#include <memory>                                      // std::shared_ptr
+#include <unordered_map>                               // std::unordered_map
+#include <vector>                                      // std::vector
+#include <melon/utility/atomicops.h>
+#include <melon/utility/containers/doubly_buffered_data.h>
+#include <melon/utility/synchronization/lock.h>        // mutil::Mutex
+#include <melon/rpc/load_balancer.h>
+
+namespace melon {
+
+    // Eject servers which are much slower or fail much more than others of
+    // the same LoadBalancer, a.k.a. "outlier detection" in envoy.
+    // Every -outlier_detection_interval_ms, servers with enough requests in
+    // the interval are compared against the medians of them, a server is an
+    // outlier when:
+    //   its EWMA latency > median * -outlier_detection_latency_factor, or
+    //   its success rate < median * -outlier_detection_success_rate_ratio
+    // Outliers are ejected, namely Socket::IsAvailable() returns false, for
+    // -outlier_detection_base_ejection_ms * 2^(n-1) where n is the number of
+    // consecutive ejections, which is decreased by one in each interval that
+    // the server is not ejected. At most -outlier_detection_max_ejection_percent
+    // of servers (but at least one unless it's 0, and never all of them) are
+    // ejected at the same time.
+    // Like CircuitBreaker, ejection is global: all channels stop sending
+    // requests to the ejected server, but its connections are kept.
+    class OutlierDetector {
+    public:
+        OutlierDetector();
+
+        ~OutlierDetector();
+
+        // Run Evaluate() periodically until Stop() is called.
+        static void StartEvaluating(const std::shared_ptr<OutlierDetector> &detector);
+
+        void Stop() { _stopped.store(true, mutil::memory_order_relaxed); }
+
+        bool stopped() const { return _stopped.load(mutil::memory_order_relaxed); }
+
+        void AddServers(const std::vector<ServerId> &servers);
+
+        void RemoveServers(const std::vector<ServerId> &servers);
+
+        // Called when each call to a server ends.
+        void OnCallEnd(const LoadBalancer::CallInfo &info);
+
+        // Find outliers and eject them. Returns number of servers ejected in
+        // this round.
+        size_t Evaluate();
+
+    private:
+        DISALLOW_COPY_AND_ASSIGN(OutlierDetector);
+
+        struct Stats {
+            Stats() : nrequest(0), nerror(0), ewma_latency_us(0),
+                      nejection(0), ejected_until_us(0) {}
+
+            // Reset at each Evaluate().
+            mutil::atomic<int64_t> nrequest;
+            mutil::atomic<int64_t> nerror;
+            // Latency of successful calls.
+            mutil::atomic<int64_t> ewma_latency_us;
+            // Accessed in Evaluate() only.
+            int nejection;
+            int64_t ejected_until_us;
+        };
+        // Shared by both instances of _db_stats.
+        typedef std::unordered_map<SocketId, std::shared_ptr<Stats> > StatsMap;
+
+        static size_t AddStats(StatsMap &bg, const StatsMap &fg,
+                               const std::vector<ServerId> &servers);
+
+        static size_t RemoveStats(StatsMap &bg, const std::vector<ServerId> &servers);
+
+        mutil::DoublyBufferedData<StatsMap> _db_stats;
+        mutil::Mutex _evaluate_mutex;
+        mutil::atomic<bool> _stopped;
+    };
+
+}  // namespace melon
@@ -25,8 +25,10 @@
 #include <melon/utility/time.h>
 #include <melon/utility/macros.h>
 #include <melon/rpc/details/controller_private_accessor.h>
+#include <melon/rpc/details/server_deadline.h>
 #include <melon/rpc/parallel_channel.h>
 #include <cinttypes>
+#include <algorithm>
 
 
 namespace melon {
@@ -683,6 +685,18 @@ void ParallelChannel::CallMethod(
     if (cntl->timeout_ms() == UNSET_MAGIC_NUM) {
         cntl->set_timeout_ms(_options.timeout_ms);
     }
+    {
+        const int64_t inherited_deadline_us = cntl->_inheritable.deadline_us >= 0 ?
+            cntl->_inheritable.deadline_us : GetServerDeadline();
+        if (inherited_deadline_us >= 0) {
+            // Don't wait longer than the upstream caller.
+            const int64_t left_ms = std::max(
+                inherited_deadline_us - cntl->_begin_time_us, (int64_t)0) / 1000;
+            if (cntl->timeout_ms() < 0 || left_ms < cntl->timeout_ms()) {
+                cntl->set_timeout_ms(left_ms);
+            }
+        }
+    }
     if (cntl->timeout_ms() >= 0) {
         cntl->_deadline_us = cntl->timeout_ms() * 1000L + cntl->_begin_time_us;
         // Setup timer for RPC timetout
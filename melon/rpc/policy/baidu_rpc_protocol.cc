@@ -324,6 +324,142 @@ void EndRunningCallMethodInPool(
     return EndRunningUserCodeInPool(CallMethodInBackupThread, args);
 };
 
+// Parse and run the request accepted by Server::AcceptRequest().
+static void ProcessAcceptedBRPCRequest(MostCommonMessage* msg_raw,
+                                       Controller* cntl_raw,
+                                       const RpcMeta& meta,
+                                       const Server::MethodProperty* mp) {
+    DestroyingPtr<MostCommonMessage> msg(msg_raw);
+    std::unique_ptr<Controller> cntl(cntl_raw);
+    std::unique_ptr<google::protobuf::Message> req;
+    std::unique_ptr<google::protobuf::Message> res;
+    const Server* server = static_cast<const Server*>(msg->arg());
+    Span* span = ControllerPrivateAccessor(cntl.get()).span();
+    google::protobuf::Service* svc = mp->service;
+    const google::protobuf::MethodDescriptor* method = mp->method;
+    MethodStatus* method_status = NULL;
+    do {
+        // Take the concurrency slots after the tenant is admitted so that
+        // queued requests do not hold them while waiting.
+        ServerPrivateAccessor server_accessor(server);
+        if (!server_accessor.AddConcurrency(cntl.get())) {
+            server_accessor.AddError();
+            cntl->SetFailed(
+                ELIMIT, "Reached server's max_concurrency=%d",
+                server->options().max_concurrency);
+            break;
+        }
+
+        if (FLAGS_usercode_in_pthread && TooManyUserCode()) {
+            server_accessor.AddError();
+            cntl->SetFailed(ELIMIT, "Too many user code to run when"
+                            " -usercode_in_pthread is on");
+            break;
+        }
+
+        method_status = mp->status;
+        if (method_status) {
+            int rejected_cc = 0;
+            if (!method_status->OnRequested(&rejected_cc, cntl.get())) {
+                cntl->SetFailed(ELIMIT, "Rejected by %s's ConcurrencyLimiter, concurrency=%d",
+                                method->full_name().c_str(), rejected_cc);
+                break;
+            }
+        }
+
+        if (span) {
+            span->ResetServerSpanName(method->full_name());
+        }
+        const int req_size = static_cast<int>(msg->payload.size());
+        mutil::IOBuf req_buf;
+        mutil::IOBuf* req_buf_ptr = &msg->payload;
+        if (meta.has_attachment_size()) {
+            if (req_size < meta.attachment_size()) {
+                cntl->SetFailed(EREQUEST,
+                    "attachment_size=%d is larger than request_size=%d",
+                     meta.attachment_size(), req_size);
+                break;
+            }
+            int body_without_attachment_size = req_size - meta.attachment_size();
+            msg->payload.cutn(&req_buf, body_without_attachment_size);
+            req_buf_ptr = &req_buf;
+            cntl->request_attachment().swap(msg->payload);
+        }
+
+        CompressType req_cmp_type = (CompressType)meta.compress_type();
+        req.reset(svc->GetRequestPrototype(method).New());
+        if (!ParseFromCompressedData(*req_buf_ptr, req.get(), req_cmp_type)) {
+            cntl->SetFailed(EREQUEST, "Fail to parse request message, "
+                            "CompressType=%s, request_size=%d", 
+                            CompressTypeToCStr(req_cmp_type), req_size);
+            break;
+        }
+        
+        res.reset(svc->GetResponsePrototype(method).New());
+        // `socket' will be held until response has been sent
+        google::protobuf::Closure* done = ::melon::NewCallback<
+            int64_t, Controller*, const google::protobuf::Message*,
+            const google::protobuf::Message*, const Server*,
+            MethodStatus*, int64_t>(
+                &SendBRPCResponse, meta.correlation_id(), cntl.get(), 
+                req.get(), res.get(), server,
+                method_status, msg->received_us());
+
+        // optional, just release resource ASAP
+        msg.reset();
+        req_buf.clear();
+
+        if (span) {
+            span->set_start_callback_us(mutil::cpuwide_time_us());
+            span->AsParent();
+        }
+        if (!FLAGS_usercode_in_pthread) {
+            return svc->CallMethod(method, cntl.release(), 
+                                   req.release(), res.release(), done);
+        }
+        if (BeginRunningUserCode()) {
+            svc->CallMethod(method, cntl.release(), 
+                            req.release(), res.release(), done);
+            return EndRunningUserCodeInPlace();
+        } else {
+            return EndRunningCallMethodInPool(
+                svc, method, cntl.release(),
+                req.release(), res.release(), done);
+        }
+    } while (false);
+
+    // `cntl', `req' and `res' will be deleted inside `SendBRPCResponse'
+    // `socket' will be held until response has been sent
+    SendBRPCResponse(meta.correlation_id(), cntl.release(),
+                     req.release(), res.release(), server,
+                     method_status, msg->received_us());
+}
+
+// Continue the request queued by Server::AcceptRequest(), `cntl' is failed
+// if the request was rejected.
+static void ResumeBRPCRequest(Controller* cntl_raw, void* arg) {
+    DestroyingPtr<MostCommonMessage> msg(static_cast<MostCommonMessage*>(arg));
+    std::unique_ptr<Controller> cntl(cntl_raw);
+    const Server* server = static_cast<const Server*>(msg->arg());
+    RpcMeta meta;
+    // Parsed successfully before the request was queued.
+    ParsePbFromIOBuf(&meta, msg->meta);
+    const google::protobuf::MethodDescriptor* method = cntl->method();
+    const Server::MethodProperty* mp =
+        ServerPrivateAccessor(server).FindMethodPropertyByFullName(
+            method->service()->full_name(), method->name());
+    if (server->thread_local_options().thread_local_data_factory) {
+        fiber_assign_data((void*)&server->thread_local_options());
+    }
+    if (cntl->Failed()) {
+        ServerPrivateAccessor(server).AddError();
+        return SendBRPCResponse(meta.correlation_id(), cntl.release(),
+                                NULL, NULL, server, NULL,
+                                msg->received_us());
+    }
+    ProcessAcceptedBRPCRequest(msg.release(), cntl.release(), meta, mp);
+}
+
 void ProcessBRPCRequest(InputMessageBase* msg_base) {
     const int64_t start_parse_us = mutil::cpuwide_time_us();
     DestroyingPtr<MostCommonMessage> msg(static_cast<MostCommonMessage*>(msg_base));
@@ -414,7 +550,6 @@ void ProcessBRPCRequest(InputMessageBase* msg_base) {
         span->set_request_size(msg->payload.size() + msg->meta.size() + 12);
     }
 
-    MethodStatus* method_status = NULL;
     do {
         if (!server->IsRunning()) {
             cntl->SetFailed(ELOGOFF, "Server is stopping");
@@ -426,19 +561,7 @@ void ProcessBRPCRequest(InputMessageBase* msg_base) {
                             mutil::endpoint2str(socket->remote_side()).c_str());
             break;
         }
-        
-        if (!server_accessor.AddConcurrency(cntl.get())) {
-            cntl->SetFailed(
-                ELIMIT, "Reached server's max_concurrency=%d",
-                server->options().max_concurrency);
-            break;
-        }
 
-        if (FLAGS_usercode_in_pthread && TooManyUserCode()) {
-            cntl->SetFailed(ELIMIT, "Too many user code to run when"
-                            " -usercode_in_pthread is on");
-            break;
-        }
 
         // NOTE(gejun): jprotobuf sends service names without packages. So the
         // name should be changed to full when it's not.
@@ -469,92 +592,32 @@ void ProcessBRPCRequest(InputMessageBase* msg_base) {
             mp->service->CallMethod(mp->method, cntl.get(), &breq, &bres, NULL);
             break;
         }
-        // Switch to service-specific error.
-        non_service_error.release();
-        method_status = mp->status;
-        if (method_status) {
-            int rejected_cc = 0;
-            if (!method_status->OnRequested(&rejected_cc, cntl.get())) {
-                cntl->SetFailed(ELIMIT, "Rejected by %s's ConcurrencyLimiter, concurrency=%d",
-                                mp->method->full_name().c_str(), rejected_cc);
-                break;
+        accessor.set_method(mp->method);
+
+        // Admit the tenant before taking the concurrency slots, which is
+        // done in ProcessAcceptedBRPCRequest().
+        bool queued = false;
+        if (!server->AcceptRequest(cntl.get(), ResumeBRPCRequest,
+                                   msg.get(), &queued)) {
+            if (queued) {
+                // Owned by TenantScheduler until ResumeBRPCRequest().
+                non_service_error.release();
+                msg.release();
+                cntl.release();
+                return;
             }
-        }
-        google::protobuf::Service* svc = mp->service;
-        const google::protobuf::MethodDescriptor* method = mp->method;
-        accessor.set_method(method);
-
-
-        if (!server->AcceptRequest(cntl.get())) {
             break;
         }
-
-        if (span) {
-            span->ResetServerSpanName(method->full_name());
-        }
-        const int req_size = static_cast<int>(msg->payload.size());
-        mutil::IOBuf req_buf;
-        mutil::IOBuf* req_buf_ptr = &msg->payload;
-        if (meta.has_attachment_size()) {
-            if (req_size < meta.attachment_size()) {
-                cntl->SetFailed(EREQUEST,
-                    "attachment_size=%d is larger than request_size=%d",
-                     meta.attachment_size(), req_size);
-                break;
-            }
-            int body_without_attachment_size = req_size - meta.attachment_size();
-            msg->payload.cutn(&req_buf, body_without_attachment_size);
-            req_buf_ptr = &req_buf;
-            cntl->request_attachment().swap(msg->payload);
-        }
-
-        CompressType req_cmp_type = (CompressType)meta.compress_type();
-        req.reset(svc->GetRequestPrototype(method).New());
-        if (!ParseFromCompressedData(*req_buf_ptr, req.get(), req_cmp_type)) {
-            cntl->SetFailed(EREQUEST, "Fail to parse request message, "
-                            "CompressType=%s, request_size=%d", 
-                            CompressTypeToCStr(req_cmp_type), req_size);
-            break;
-        }
-        
-        res.reset(svc->GetResponsePrototype(method).New());
-        // `socket' will be held until response has been sent
-        google::protobuf::Closure* done = ::melon::NewCallback<
-            int64_t, Controller*, const google::protobuf::Message*,
-            const google::protobuf::Message*, const Server*,
-            MethodStatus*, int64_t>(
-                &SendBRPCResponse, meta.correlation_id(), cntl.get(), 
-                req.get(), res.get(), server,
-                method_status, msg->received_us());
-
-        // optional, just release resource ASAP
-        msg.reset();
-        req_buf.clear();
-
-        if (span) {
-            span->set_start_callback_us(mutil::cpuwide_time_us());
-            span->AsParent();
-        }
-        if (!FLAGS_usercode_in_pthread) {
-            return svc->CallMethod(method, cntl.release(), 
-                                   req.release(), res.release(), done);
-        }
-        if (BeginRunningUserCode()) {
-            svc->CallMethod(method, cntl.release(), 
-                            req.release(), res.release(), done);
-            return EndRunningUserCodeInPlace();
-        } else {
-            return EndRunningCallMethodInPool(
-                svc, method, cntl.release(),
-                req.release(), res.release(), done);
-        }
+        // Switch to service-specific error.
+        non_service_error.release();
+        return ProcessAcceptedBRPCRequest(msg.release(), cntl.release(), meta, mp);
     } while (false);
     
     // `cntl', `req' and `res' will be deleted inside `SendBRPCResponse'
     // `socket' will be held until response has been sent
     SendBRPCResponse(meta.correlation_id(), cntl.release(), 
                     req.release(), res.release(), server,
-                    method_status, msg->received_us());
+                    NULL, msg->received_us());
 }
 
 bool VerifyBRPCRequest(const InputMessageBase* msg_base) {
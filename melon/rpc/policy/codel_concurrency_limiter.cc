@@ -0,0 +1,105 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+
+#include <gflags/gflags.h>
+#include <melon/utility/time.h>
+#include <melon/rpc/controller.h>
+#include <melon/rpc/policy/codel_concurrency_limiter.h>
+
+namespace melon {
+namespace policy {
+
+DEFINE_int32(codel_cl_target_delay_ms, 5,
+             "The method is considered overloaded when the minimum queueing "
+             "delay of requests during an interval exceeds this value.");
+DEFINE_int32(codel_cl_interval_ms, 100,
+             "Interval to check whether the method is overloaded.");
+DEFINE_int32(codel_cl_max_concurrency, 0,
+             "Reject requests when concurrency exceeds this value, "
+             "non-positive means unlimited.");
+
+static const int64_t NO_DELAY_SAMPLED = INT64_MAX;
+
+CodelConcurrencyLimiter::CodelConcurrencyLimiter()
+    : _interval_end_us(0)
+    , _min_delay_us(NO_DELAY_SAMPLED)
+    , _overloaded(false) {
+}
+
+CodelConcurrencyLimiter*
+CodelConcurrencyLimiter::New(const AdaptiveMaxConcurrency&) const {
+    return new (std::nothrow) CodelConcurrencyLimiter;
+}
+
+bool CodelConcurrencyLimiter::OnQueueDelay(int64_t queue_delay_us, int64_t now_us) {
+    const int64_t target_us = FLAGS_codel_cl_target_delay_ms * 1000L;
+    int64_t interval_end_us = _interval_end_us.load(mutil::memory_order_relaxed);
+    if (now_us >= interval_end_us &&
+        _interval_end_us.compare_exchange_strong(
+            interval_end_us, now_us + FLAGS_codel_cl_interval_ms * 1000L,
+            mutil::memory_order_relaxed)) {
+        // Requests never waited less than the target during the interval,
+        // the queue is not draining. An interval without requests (the
+        // first one included) leaves the minimum unset, which means not
+        // overloaded.
+        const int64_t min_delay_us =
+            _min_delay_us.exchange(NO_DELAY_SAMPLED, mutil::memory_order_relaxed);
+        _overloaded.store(min_delay_us != NO_DELAY_SAMPLED && min_delay_us > target_us,
+                          mutil::memory_order_relaxed);
+    }
+    int64_t min_delay_us = _min_delay_us.load(mutil::memory_order_relaxed);
+    while (queue_delay_us < min_delay_us &&
+           !_min_delay_us.compare_exchange_weak(min_delay_us, queue_delay_us,
+                                                mutil::memory_order_relaxed)) {}
+    // Shed requests which have been waiting for long while overloaded, the
+    // newer ones get served first.
+    return _overloaded.load(mutil::memory_order_relaxed) &&
+           queue_delay_us > 2 * target_us;
+}
+
+bool CodelConcurrencyLimiter::OnRequested(int current_concurrency, Controller* cntl) {
+    if (FLAGS_codel_cl_max_concurrency > 0 &&
+        current_concurrency > FLAGS_codel_cl_max_concurrency) {
+        return false;
+    }
+    if (cntl == NULL) {
+        return true;
+    }
+    const int64_t now_us = mutil::cpuwide_time_us();
+    // Server-side latency_us() is the time spent before processing.
+    const int64_t queue_delay_us = cntl->latency_us();
+    if (cntl->timeout_ms() != UNSET_MAGIC_NUM && cntl->timeout_ms() > 0 &&
+        queue_delay_us >= cntl->timeout_ms() * 1000L) {
+        // The client has given up, don't waste time on it.
+        OnQueueDelay(queue_delay_us, now_us);
+        return false;
+    }
+    return !OnQueueDelay(queue_delay_us, now_us);
+}
+
+void CodelConcurrencyLimiter::OnResponded(int error_code, int64_t latency_us) {
+}
+
+int CodelConcurrencyLimiter::MaxConcurrency() {
+    return FLAGS_codel_cl_max_concurrency;
+}
+
+}  // namespace policy
+}  // namespace melon
@@ -0,0 +1,67 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#pragma once
+
+#include <melon/utility/atomicops.h>
+#include <melon/rpc/concurrency_limiter.h>
+
+namespace melon {
+namespace policy {
+
+// Admission control driven by queueing delay rather than concurrency, in
+// the spirit of CoDel (Controlled Delay).
+// The queueing delay of a request is the time between it was cut from the
+// socket and it reaches the limiter, before the request is deserialized.
+// If the minimum delay observed during an interval stays above the target,
+// the method is considered overloaded. While overloaded, requests which
+// waited longer than twice the target are rejected so that fresh requests
+// are served first (adaptive LIFO), instead of working on requests whose
+// callers are likely to have given up already.
+// Independent of overload, requests whose propagated timeout has already
+// elapsed are always rejected.
+// Enable it with:
+//   options.method_max_concurrency = "codel";
+class CodelConcurrencyLimiter : public ConcurrencyLimiter {
+public:
+    CodelConcurrencyLimiter();
+
+    bool OnRequested(int current_concurrency, Controller* cntl) override;
+
+    void OnResponded(int error_code, int64_t latency_us) override;
+
+    int MaxConcurrency() override;
+
+    CodelConcurrencyLimiter* New(const AdaptiveMaxConcurrency&) const override;
+
+    bool overloaded() const {
+        return _overloaded.load(mutil::memory_order_relaxed);
+    }
+
+private:
+    // Returns true if `queue_delay_us' should be rejected.
+    bool OnQueueDelay(int64_t queue_delay_us, int64_t now_us);
+
+    MELON_CACHELINE_ALIGNMENT mutil::atomic<int64_t> _interval_end_us;
+    mutil::atomic<int64_t> _min_delay_us;
+    mutil::atomic<bool> _overloaded;
+};
+
+}  // namespace policy
+}  // namespace melon
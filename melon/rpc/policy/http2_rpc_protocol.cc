@@ -1665,6 +1665,14 @@ namespace melon {
             if (is_grpc) {
                 _grpc_status = ErrorCodeToGrpcStatus(c->ErrorCode());
                 PercentEncode(c->ErrorText(), &_grpc_message);
+                // Load of the server is known after the response is done,
+                // send it in trailers.
+                const std::string *server_load = (_http_response ?
+                        _http_response->GetHeader(get_common_strings()->SERVER_LOAD) : NULL);
+                if (server_load) {
+                    _server_load = *server_load;
+                    _http_response->RemoveHeader(get_common_strings()->SERVER_LOAD);
+                }
             }
         }
 
@@ -1761,6 +1769,11 @@ namespace melon {
                     HPacker::Header msg_header("grpc-message", _grpc_message);
                     hpacker.Encode(&appender, msg_header, options);
                 }
+                if (!_server_load.empty()) {
+                    HPacker::Header load_header(get_common_strings()->SERVER_LOAD,
+                                                _server_load);
+                    hpacker.Encode(&appender, load_header, options);
+                }
                 appender.move_to(trailer_frag);
             }
 
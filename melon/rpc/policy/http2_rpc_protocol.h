@@ -225,6 +225,7 @@ private:
     bool _is_grpc;
     GrpcStatus _grpc_status;
     std::string _grpc_message;
+    std::string _server_load;
     HPacker::Header _list[0];
 };
 
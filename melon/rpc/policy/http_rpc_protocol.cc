@@ -46,6 +46,7 @@
 #include <melon/compress/gzip_compress.h>
 #include <melon/rpc/policy/http2_rpc_protocol.h>
 #include <melon/rpc/details/usercode_backup_pool.h>
+#include <melon/rpc/details/server_deadline.h>
 #include <melon/rpc/grpc/grpc.h>
 #include <melon/fiber/key.h>
 #include <cinttypes>
@@ -132,7 +133,7 @@ namespace melon {
                   METHOD_POST("POST"), TE("te"), TRAILERS("trailers"), GRPC_ENCODING("grpc-encoding"),
                   GRPC_ACCEPT_ENCODING("grpc-accept-encoding"), GRPC_ACCEPT_ENCODING_VALUE("identity,gzip"),
                   GRPC_STATUS("grpc-status"), GRPC_MESSAGE("grpc-message"), GRPC_TIMEOUT("grpc-timeout"),
-                  DEFAULT_PATH("/") {}
+                  SERVER_LOAD("x-melon-server-load"), DEFAULT_PATH("/") {}
 
         static CommonStrings *common = NULL;
         static pthread_once_t g_common_strings_once = PTHREAD_ONCE_INIT;
@@ -299,6 +300,15 @@ namespace melon {
             const bool is_grpc = (is_http2 && is_grpc_ct);
             bool grpc_compressed = false;  // only valid when is_grpc is true.
 
+            // Carried in trailers of gRPC.
+            const std::string *server_load = res_header->GetHeader(common->SERVER_LOAD);
+            if (server_load) {
+                ServerLoad load;
+                if (ServerLoadFromString(*server_load, &load)) {
+                    accessor.set_server_load(load);
+                }
+            }
+
             do {
                 if (!is_http2) {
                     // If header has "Connection: close", close the connection.
@@ -714,6 +724,12 @@ namespace melon {
 
             void set_h2_stream_id(int id) { _h2_stream_id = id; }
 
+            // Give up the controller without sending the response.
+            void release_controller() {
+                _cntl.release();
+                _method_status = NULL;
+            }
+
         private:
             std::unique_ptr<Controller, LogErrorTextAndDelete> _cntl;
             std::unique_ptr<google::protobuf::Message> _req;
@@ -846,6 +862,15 @@ namespace melon {
                 res_header->set_status_code(HTTP_STATUS_OK);
             }
 
+            if (cntl->server() != NULL && cntl->server()->options().report_load) {
+                ServerLoad load;
+                GetServerLoad(cntl->server(), _method_status, &load);
+                std::string load_str;
+                ServerLoadToString(load, &load_str);
+                // Moved into trailers by H2UnsentResponse for gRPC.
+                res_header->SetHeader(common->SERVER_LOAD, load_str);
+            }
+
             bool grpc_compressed = false;
             if (cntl->Failed()) {
                 if (!cntl->does_manage_http_body_on_error()) {
@@ -1282,6 +1307,216 @@ namespace melon {
                 ::google::protobuf::Message *response,
                 ::google::protobuf::Closure *done);
 
+        // Parse and run the request accepted by Server::AcceptRequest(). The
+        // response is sent when `resp_sender' is destructed or run as done.
+        static void ProcessAcceptedHttpRequest(HttpResponseSender *sender,
+                                               DestroyingPtr<HttpContext> *msg_guard,
+                                               Controller *cntl,
+                                               const Server::MethodProperty *sp,
+                                               int64_t start_parse_us) {
+            HttpResponseSender &resp_sender = *sender;
+            DestroyingPtr<HttpContext> &imsg_guard = *msg_guard;
+            const HttpContext *msg = imsg_guard.get();
+            const Server *server = cntl->server();
+            ControllerPrivateAccessor accessor(cntl);
+            ServerPrivateAccessor server_accessor(server);
+            Span *span = accessor.span();
+            HttpHeader &req_header = cntl->http_request();
+            mutil::IOBuf &req_body = imsg_guard->body();
+            const bool is_http2 = req_header.is_http2();
+            google::protobuf::Service *svc = sp->service;
+            const google::protobuf::MethodDescriptor *method = sp->method;
+            // Take the concurrency slots after the tenant is admitted so that
+            // queued requests do not hold them while waiting.
+            // NOTE: accesses to builtin services are not counted as part of
+            // concurrency, therefore are not limited by ServerOptions.max_concurrency.
+            if (!sp->is_builtin_service && !sp->params.is_tabbed) {
+                if (!server_accessor.AddConcurrency(cntl)) {
+                    server_accessor.AddError();
+                    cntl->SetFailed(ELIMIT, "Reached server's max_concurrency=%d",
+                                    server->options().max_concurrency);
+                    return;
+                }
+                if (FLAGS_usercode_in_pthread && TooManyUserCode()) {
+                    server_accessor.AddError();
+                    cntl->SetFailed(ELIMIT, "Too many user code to run when"
+                                            " -usercode_in_pthread is on");
+                    return;
+                }
+            }
+            MethodStatus *method_status = sp->status;
+            resp_sender.set_method_status(method_status);
+            if (method_status) {
+                int rejected_cc = 0;
+                if (!method_status->OnRequested(&rejected_cc)) {
+                    cntl->SetFailed(ELIMIT, "Rejected by %s's ConcurrencyLimiter, concurrency=%d",
+                                    method->full_name().c_str(), rejected_cc);
+                    return;
+                }
+            }
+
+            google::protobuf::Message *req = svc->GetRequestPrototype(method).New();
+            resp_sender.own_request(req);
+            google::protobuf::Message *res = svc->GetResponsePrototype(method).New();
+            resp_sender.own_response(res);
+
+            if (__builtin_expect(!req || !res, 0)) {
+                PLOG(FATAL) << "Fail to new req or res";
+                cntl->SetFailed("Fail to new req or res");
+                return;
+            }
+            if (sp->params.allow_http_body_to_pb &&
+                method->input_type()->field_count() > 0) {
+                // A protobuf service. No matter if Content-type is set to
+                // applcation/json or body is empty, we have to treat body as a json
+                // and try to convert it to pb, which guarantees that a protobuf
+                // service is always accessed with valid requests.
+                if (req_body.empty()) {
+                    // Treat empty body specially since parsing it results in error
+                    if (!req->IsInitialized()) {
+                        cntl->SetFailed(EREQUEST, "%s needs to be created from a"
+                                                  " non-empty json, it has required fields.",
+                                        req->GetDescriptor()->full_name().c_str());
+                        return;
+                    } // else all fields of the request are optional.
+                } else {
+                    bool is_grpc_ct = false;
+                    const HttpContentType content_type =
+                            ParseContentType(req_header.content_type(), &is_grpc_ct);
+                    const std::string *encoding = NULL;
+                    if (is_http2 && is_grpc_ct) {
+                        bool grpc_compressed = false;
+                        if (!RemoveGrpcPrefix(&req_body, &grpc_compressed)) {
+                            cntl->SetFailed(EREQUEST, "Invalid gRPC request");
+                            return;
+                        }
+                        if (grpc_compressed) {
+                            encoding = req_header.GetHeader(common->GRPC_ENCODING);
+                            if (encoding == NULL) {
+                                cntl->SetFailed(
+                                        EREQUEST, "Fail to find header `grpc-encoding'"
+                                                  " in compressed gRPC request");
+                                return;
+                            }
+                        }
+                        int64_t timeout_value_us =
+                                ConvertGrpcTimeoutToUS(req_header.GetHeader(common->GRPC_TIMEOUT));
+                        if (timeout_value_us >= 0) {
+                            accessor.set_deadline_us(
+                                    msg->base_real_us() + msg->received_us()
+                                    + timeout_value_us);
+                            if (mutil::gettimeofday_us() >= cntl->deadline_us()) {
+                                server_accessor.AddExpired();
+                                cntl->SetFailed(ERPCTIMEDOUT, "Deadline of the request"
+                                                " has passed before it's processed");
+                                return;
+                            }
+                        }
+                    } else { // http or h2 but not grpc
+                        encoding = req_header.GetHeader(common->CONTENT_ENCODING);
+                    }
+                    if (encoding != NULL && *encoding == common->GZIP) {
+                        TRACEPRINTF("Decompressing request=%lu",
+                                    (unsigned long) req_body.size());
+                        mutil::IOBuf uncompressed;
+                        if (!compress::GzipDecompress(req_body, &uncompressed)) {
+                            cntl->SetFailed(EREQUEST, "Fail to un-gzip request body");
+                            return;
+                        }
+                        req_body.swap(uncompressed);
+                    }
+                    if (content_type == HTTP_CONTENT_PROTO) {
+                        if (!ParsePbFromIOBuf(req, req_body)) {
+                            cntl->SetFailed(EREQUEST, "Fail to parse http body as %s",
+                                            req->GetDescriptor()->full_name().c_str());
+                            return;
+                        }
+                    } else if (content_type == HTTP_CONTENT_PROTO_TEXT) {
+                        if (!ParsePbTextFromIOBuf(req, req_body)) {
+                            cntl->SetFailed(EREQUEST, "Fail to parse http proto-text body as %s",
+                                            req->GetDescriptor()->full_name().c_str());
+                            return;
+                        }
+                    } else {
+                        mutil::IOBufAsZeroCopyInputStream wrapper(req_body);
+                        std::string err;
+                        json2pb::Json2PbOptions options;
+                        options.base64_to_bytes = sp->params.pb_bytes_to_base64;
+                        options.array_to_single_repeated = sp->params.pb_single_repeated_to_array;
+                        cntl->set_pb_bytes_to_base64(sp->params.pb_bytes_to_base64);
+                        cntl->set_pb_single_repeated_to_array(sp->params.pb_single_repeated_to_array);
+                        if (!json2pb::JsonToProtoMessage(&wrapper, req, options, &err)) {
+                            cntl->SetFailed(EREQUEST, "Fail to parse http body as %s, %s",
+                                            req->GetDescriptor()->full_name().c_str(), err.c_str());
+                            return;
+                        }
+                    }
+                }
+                SampledRequest *sample = AskToBeSampled();
+                if (sample && !is_http2) {
+                    sample->meta.set_compress_type(COMPRESS_TYPE_NONE);
+                    sample->meta.set_protocol_type(PROTOCOL_HTTP);
+                    sample->meta.set_attachment_size(req_body.size());
+
+                    mutil::EndPoint ep;
+                    MakeRawHttpRequest(&sample->request, &req_header, ep, &req_body);
+                    sample->submit(start_parse_us);
+                }
+            } else {
+                if (imsg_guard->read_body_progressively()) {
+                    accessor.set_readable_progressive_attachment(imsg_guard.get());
+                } else {
+                    // A http server, just keep content as it is.
+                    cntl->request_attachment().swap(req_body);
+                }
+            }
+
+            google::protobuf::Closure *done = new HttpResponseSenderAsDone(&resp_sender);
+            imsg_guard.reset();  // optional, just release resource ASAP
+
+            if (span) {
+                span->set_start_callback_us(mutil::cpuwide_time_us());
+                span->AsParent();
+            }
+            // Downstream RPCs issued by the callback inherit the deadline.
+            ScopedServerDeadline deadline_guard(cntl->deadline_us());
+            if (!FLAGS_usercode_in_pthread) {
+                return svc->CallMethod(method, cntl, req, res, done);
+            }
+            if (BeginRunningUserCode()) {
+                svc->CallMethod(method, cntl, req, res, done);
+                return EndRunningUserCodeInPlace();
+            } else {
+                return EndRunningCallMethodInPool(svc, method, cntl, req, res, done);
+            }
+        }
+
+        // Continue the request queued by Server::AcceptRequest(), `cntl' is
+        // failed if the request was rejected.
+        static void ResumeHttpRequest(Controller *cntl, void *arg) {
+            DestroyingPtr<HttpContext> imsg_guard(static_cast<HttpContext *>(arg));
+            const Server *server = cntl->server();
+            HttpResponseSender resp_sender(cntl);
+            resp_sender.set_received_us(imsg_guard->received_us());
+            if (cntl->http_request().is_http2()) {
+                H2StreamContext *h2_sctx = static_cast<H2StreamContext *>(imsg_guard.get());
+                resp_sender.set_h2_stream_id(h2_sctx->stream_id());
+            }
+            // Found successfully before the request was queued.
+            std::string unresolved_path;
+            const Server::MethodProperty *sp = FindMethodPropertyByURI(
+                    cntl->http_request().uri().path(), server, &unresolved_path);
+            if (server->thread_local_options().thread_local_data_factory) {
+                fiber_assign_data((void *) &server->thread_local_options());
+            }
+            if (cntl->Failed()) {
+                ServerPrivateAccessor(server).AddError();
+                return;
+            }
+            ProcessAcceptedHttpRequest(&resp_sender, &imsg_guard, cntl, sp,
+                                       mutil::cpuwide_time_us());
+        }
+
         void ProcessHttpRequest(InputMessageBase *msg) {
             const int64_t start_parse_us = mutil::cpuwide_time_us();
             DestroyingPtr<HttpContext> imsg_guard(static_cast<HttpContext *>(msg));
@@ -1426,41 +1661,29 @@ namespace melon {
                 sp->service->CallMethod(sp->method, cntl, &breq, &bres, NULL);
                 return;
             }
-            // Switch to service-specific error.
-            non_service_error.release();
-            MethodStatus *method_status = sp->status;
-            resp_sender.set_method_status(method_status);
-            if (method_status) {
-                int rejected_cc = 0;
-                if (!method_status->OnRequested(&rejected_cc)) {
-                    cntl->SetFailed(ELIMIT, "Rejected by %s's ConcurrencyLimiter, concurrency=%d",
-                                    sp->method->full_name().c_str(), rejected_cc);
-                    return;
-                }
-            }
-
             if (span) {
                 span->ResetServerSpanName(sp->method->full_name());
             }
-            // NOTE: accesses to builtin services are not counted as part of
-            // concurrency, therefore are not limited by ServerOptions.max_concurrency.
+            // Set before AcceptRequest() which may look at the method.
+            accessor.set_method(sp->method);
+            // Builtin services are not scheduled by tenants either.
             if (!sp->is_builtin_service && !sp->params.is_tabbed) {
                 if (socket->is_overcrowded()) {
                     cntl->SetFailed(EOVERCROWDED, "Connection to %s is overcrowded",
                                     mutil::endpoint2str(socket->remote_side()).c_str());
                     return;
                 }
-                if (!server_accessor.AddConcurrency(cntl)) {
-                    cntl->SetFailed(ELIMIT, "Reached server's max_concurrency=%d",
-                                    server->options().max_concurrency);
-                    return;
-                }
-                if (FLAGS_usercode_in_pthread && TooManyUserCode()) {
-                    cntl->SetFailed(ELIMIT, "Too many user code to run when"
-                                            " -usercode_in_pthread is on");
-                    return;
-                }
-                if (!server->AcceptRequest(cntl)) {
+                // Admit the tenant before taking the concurrency slots, which
+                // is done in ProcessAcceptedHttpRequest().
+                bool queued = false;
+                if (!server->AcceptRequest(cntl, ResumeHttpRequest,
+                                           imsg_guard.get(), &queued)) {
+                    if (queued) {
+                        // Owned by TenantScheduler until ResumeHttpRequest().
+                        non_service_error.release();
+                        resp_sender.release_controller();
+                        imsg_guard.release();
+                    }
                     return;
                 }
             } else if (security_mode) {
@@ -1469,135 +1692,10 @@ namespace melon {
                                        " internal network", server->options().internal_port);
                 return;
             }
+            // Switch to service-specific error.
+            non_service_error.release();
 
-            google::protobuf::Service *svc = sp->service;
-            const google::protobuf::MethodDescriptor *method = sp->method;
-            accessor.set_method(method);
-            google::protobuf::Message *req = svc->GetRequestPrototype(method).New();
-            resp_sender.own_request(req);
-            google::protobuf::Message *res = svc->GetResponsePrototype(method).New();
-            resp_sender.own_response(res);
-
-            if (__builtin_expect(!req || !res, 0)) {
-                PLOG(FATAL) << "Fail to new req or res";
-                cntl->SetFailed("Fail to new req or res");
-                return;
-            }
-            if (sp->params.allow_http_body_to_pb &&
-                method->input_type()->field_count() > 0) {
-                // A protobuf service. No matter if Content-type is set to
-                // applcation/json or body is empty, we have to treat body as a json
-                // and try to convert it to pb, which guarantees that a protobuf
-                // service is always accessed with valid requests.
-                if (req_body.empty()) {
-                    // Treat empty body specially since parsing it results in error
-                    if (!req->IsInitialized()) {
-                        cntl->SetFailed(EREQUEST, "%s needs to be created from a"
-                                                  " non-empty json, it has required fields.",
-                                        req->GetDescriptor()->full_name().c_str());
-                        return;
-                    } // else all fields of the request are optional.
-                } else {
-                    bool is_grpc_ct = false;
-                    const HttpContentType content_type =
-                            ParseContentType(req_header.content_type(), &is_grpc_ct);
-                    const std::string *encoding = NULL;
-                    if (is_http2 && is_grpc_ct) {
-                        bool grpc_compressed = false;
-                        if (!RemoveGrpcPrefix(&req_body, &grpc_compressed)) {
-                            cntl->SetFailed(EREQUEST, "Invalid gRPC request");
-                            return;
-                        }
-                        if (grpc_compressed) {
-                            encoding = req_header.GetHeader(common->GRPC_ENCODING);
-                            if (encoding == NULL) {
-                                cntl->SetFailed(
-                                        EREQUEST, "Fail to find header `grpc-encoding'"
-                                                  " in compressed gRPC request");
-                                return;
-                            }
-                        }
-                        int64_t timeout_value_us =
-                                ConvertGrpcTimeoutToUS(req_header.GetHeader(common->GRPC_TIMEOUT));
-                        if (timeout_value_us >= 0) {
-                            accessor.set_deadline_us(
-                                    mutil::gettimeofday_us() + timeout_value_us);
-                        }
-                    } else { // http or h2 but not grpc
-                        encoding = req_header.GetHeader(common->CONTENT_ENCODING);
-                    }
-                    if (encoding != NULL && *encoding == common->GZIP) {
-                        TRACEPRINTF("Decompressing request=%lu",
-                                    (unsigned long) req_body.size());
-                        mutil::IOBuf uncompressed;
-                        if (!compress::GzipDecompress(req_body, &uncompressed)) {
-                            cntl->SetFailed(EREQUEST, "Fail to un-gzip request body");
-                            return;
-                        }
-                        req_body.swap(uncompressed);
-                    }
-                    if (content_type == HTTP_CONTENT_PROTO) {
-                        if (!ParsePbFromIOBuf(req, req_body)) {
-                            cntl->SetFailed(EREQUEST, "Fail to parse http body as %s",
-                                            req->GetDescriptor()->full_name().c_str());
-                            return;
-                        }
-                    } else if (content_type == HTTP_CONTENT_PROTO_TEXT) {
-                        if (!ParsePbTextFromIOBuf(req, req_body)) {
-                            cntl->SetFailed(EREQUEST, "Fail to parse http proto-text body as %s",
-                                            req->GetDescriptor()->full_name().c_str());
-                            return;
-                        }
-                    } else {
-                        mutil::IOBufAsZeroCopyInputStream wrapper(req_body);
-                        std::string err;
-                        json2pb::Json2PbOptions options;
-                        options.base64_to_bytes = sp->params.pb_bytes_to_base64;
-                        options.array_to_single_repeated = sp->params.pb_single_repeated_to_array;
-                        cntl->set_pb_bytes_to_base64(sp->params.pb_bytes_to_base64);
-                        cntl->set_pb_single_repeated_to_array(sp->params.pb_single_repeated_to_array);
-                        if (!json2pb::JsonToProtoMessage(&wrapper, req, options, &err)) {
-                            cntl->SetFailed(EREQUEST, "Fail to parse http body as %s, %s",
-                                            req->GetDescriptor()->full_name().c_str(), err.c_str());
-                            return;
-                        }
-                    }
-                }
-                SampledRequest *sample = AskToBeSampled();
-                if (sample && !is_http2) {
-                    sample->meta.set_compress_type(COMPRESS_TYPE_NONE);
-                    sample->meta.set_protocol_type(PROTOCOL_HTTP);
-                    sample->meta.set_attachment_size(req_body.size());
-
-                    mutil::EndPoint ep;
-                    MakeRawHttpRequest(&sample->request, &req_header, ep, &req_body);
-                    sample->submit(start_parse_us);
-                }
-            } else {
-                if (imsg_guard->read_body_progressively()) {
-                    accessor.set_readable_progressive_attachment(imsg_guard.get());
-                } else {
-                    // A http server, just keep content as it is.
-                    cntl->request_attachment().swap(req_body);
-                }
-            }
-
-            google::protobuf::Closure *done = new HttpResponseSenderAsDone(&resp_sender);
-            imsg_guard.reset();  // optional, just release resource ASAP
-
-            if (span) {
-                span->set_start_callback_us(mutil::cpuwide_time_us());
-                span->AsParent();
-            }
-            if (!FLAGS_usercode_in_pthread) {
-                return svc->CallMethod(method, cntl, req, res, done);
-            }
-            if (BeginRunningUserCode()) {
-                svc->CallMethod(method, cntl, req, res, done);
-                return EndRunningUserCodeInPlace();
-            } else {
-                return EndRunningCallMethodInPool(svc, method, cntl, req, res, done);
-            }
+            ProcessAcceptedHttpRequest(&resp_sender, &imsg_guard, cntl, sp, start_parse_us);
         }
 
         bool ParseHttpServerAddress(mutil::EndPoint *point, const char *server_addr_and_port) {
@@ -75,6 +75,7 @@ struct CommonStrings {
     std::string GRPC_STATUS;
     std::string GRPC_MESSAGE;
     std::string GRPC_TIMEOUT;
+    std::string SERVER_LOAD;
 
     std::string DEFAULT_PATH;
 
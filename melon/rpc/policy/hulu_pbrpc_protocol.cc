@@ -328,6 +328,134 @@ namespace melon {
                 ::google::protobuf::Message *response,
                 ::google::protobuf::Closure *done);
 
+        // Parse and run the request accepted by Server::AcceptRequest().
+        static void ProcessAcceptedHuluRequest(MostCommonMessage *msg_raw,
+                                               HuluController *cntl_raw,
+                                               const HuluRpcRequestMeta &meta,
+                                               const Server::MethodProperty *sp) {
+            DestroyingPtr<MostCommonMessage> msg(msg_raw);
+            std::unique_ptr<HuluController> cntl(cntl_raw);
+            std::unique_ptr<google::protobuf::Message> req;
+            std::unique_ptr<google::protobuf::Message> res;
+            const Server *server = static_cast<const Server *>(msg->arg());
+            Span *span = ControllerPrivateAccessor(cntl.get()).span();
+            const int64_t correlation_id = meta.correlation_id();
+            const CompressType req_cmp_type = cntl->request_compress_type();
+            google::protobuf::Service *svc = sp->service;
+            const google::protobuf::MethodDescriptor *method = sp->method;
+            MethodStatus *method_status = NULL;
+            do {
+                // Take the concurrency slots after the tenant is admitted so
+                // that queued requests do not hold them while waiting.
+                ServerPrivateAccessor server_accessor(server);
+                if (!server_accessor.AddConcurrency(cntl.get())) {
+                    server_accessor.AddError();
+                    cntl->SetFailed(ELIMIT, "Reached server's max_concurrency=%d",
+                                    server->options().max_concurrency);
+                    break;
+                }
+                if (FLAGS_usercode_in_pthread && TooManyUserCode()) {
+                    server_accessor.AddError();
+                    cntl->SetFailed(ELIMIT, "Too many user code to run when"
+                                            " -usercode_in_pthread is on");
+                    break;
+                }
+
+                method_status = sp->status;
+                if (method_status) {
+                    int rejected_cc = 0;
+                    if (!method_status->OnRequested(&rejected_cc)) {
+                        cntl->SetFailed(ELIMIT, "Rejected by %s's ConcurrencyLimiter, concurrency=%d",
+                                        method->full_name().c_str(), rejected_cc);
+                        break;
+                    }
+                }
+
+                if (span) {
+                    span->ResetServerSpanName(method->full_name());
+                }
+                const int reqsize = msg->payload.length();
+                mutil::IOBuf req_buf;
+                mutil::IOBuf *req_buf_ptr = &msg->payload;
+                if (meta.has_user_message_size()) {
+                    msg->payload.cutn(&req_buf, meta.user_message_size());
+                    req_buf_ptr = &req_buf;
+                    cntl->request_attachment().swap(msg->payload);
+                }
+
+                req.reset(svc->GetRequestPrototype(method).New());
+                if (!ParseFromCompressedData(*req_buf_ptr, req.get(), req_cmp_type)) {
+                    cntl->SetFailed(EREQUEST, "Fail to parse request message, "
+                                              "CompressType=%s, request_size=%d",
+                                    CompressTypeToCStr(req_cmp_type), reqsize);
+                    break;
+                }
+
+                res.reset(svc->GetResponsePrototype(method).New());
+                // `socket' will be held until response has been sent
+                google::protobuf::Closure *done = ::melon::NewCallback<
+                        int64_t, HuluController *, const google::protobuf::Message *,
+                        const google::protobuf::Message *, const Server *,
+                        MethodStatus *, int64_t>(
+                        &SendHuluResponse, correlation_id, cntl.get(),
+                        req.get(), res.get(), server,
+                        method_status, msg->received_us());
+
+                // optional, just release resource ASAP
+                msg.reset();
+                req_buf.clear();
+
+                if (span) {
+                    span->set_start_callback_us(mutil::cpuwide_time_us());
+                    span->AsParent();
+                }
+                if (!FLAGS_usercode_in_pthread) {
+                    return svc->CallMethod(method, cntl.release(),
+                                           req.release(), res.release(), done);
+                }
+                if (BeginRunningUserCode()) {
+                    svc->CallMethod(method, cntl.release(),
+                                    req.release(), res.release(), done);
+                    return EndRunningUserCodeInPlace();
+                } else {
+                    return EndRunningCallMethodInPool(
+                            svc, method, cntl.release(),
+                            req.release(), res.release(), done);
+                }
+            } while (false);
+
+            // `cntl', `req' and `res' will be deleted inside `SendHuluResponse'
+            // `socket' will be held until response has been sent
+            SendHuluResponse(correlation_id, cntl.release(),
+                             req.release(), res.release(), server,
+                             method_status, msg->received_us());
+        }
+
+        // Continue the request queued by Server::AcceptRequest(), `cntl' is
+        // failed if the request was rejected.
+        static void ResumeHuluRequest(Controller *cntl_raw, void *arg) {
+            DestroyingPtr<MostCommonMessage> msg(static_cast<MostCommonMessage *>(arg));
+            std::unique_ptr<HuluController> cntl(static_cast<HuluController *>(cntl_raw));
+            const Server *server = static_cast<const Server *>(msg->arg());
+            HuluRpcRequestMeta meta;
+            // Parsed successfully before the request was queued.
+            ParsePbFromIOBuf(&meta, msg->meta);
+            const google::protobuf::MethodDescriptor *method = cntl->method();
+            const Server::MethodProperty *sp =
+                    ServerPrivateAccessor(server).FindMethodPropertyByFullName(
+                            method->service()->full_name(), method->name());
+            if (server->thread_local_options().thread_local_data_factory) {
+                fiber_assign_data((void *) &server->thread_local_options());
+            }
+            if (cntl->Failed()) {
+                ServerPrivateAccessor(server).AddError();
+                return SendHuluResponse(meta.correlation_id(), cntl.release(),
+                                        NULL, NULL, server, NULL,
+                                        msg->received_us());
+            }
+            ProcessAcceptedHuluRequest(msg.release(), cntl.release(), meta, sp);
+        }
+
         void ProcessHuluRequest(InputMessageBase *msg_base) {
             const int64_t start_parse_us = mutil::cpuwide_time_us();
             DestroyingPtr<MostCommonMessage> msg(static_cast<MostCommonMessage *>(msg_base));
@@ -415,7 +543,6 @@ namespace melon {
                 span->set_request_size(msg->payload.size() + msg->meta.size() + 12);
             }
 
-            MethodStatus *method_status = NULL;
             do {
                 if (!server->IsRunning()) {
                     cntl->SetFailed(ELOGOFF, "Server is stopping");
@@ -428,17 +555,6 @@ namespace melon {
                     break;
                 }
 
-                if (!server_accessor.AddConcurrency(cntl.get())) {
-                    cntl->SetFailed(ELIMIT, "Reached server's max_concurrency=%d",
-                                    server->options().max_concurrency);
-                    break;
-                }
-                if (FLAGS_usercode_in_pthread && TooManyUserCode()) {
-                    cntl->SetFailed(ELIMIT, "Too many user code to run when"
-                                            " -usercode_in_pthread is on");
-                    break;
-                }
-
                 const Server::MethodProperty *sp =
                         server_accessor.FindMethodPropertyByNameAndIndex(
                                 meta.service_name(), meta.method_index());
@@ -454,84 +570,33 @@ namespace melon {
                     sp->service->CallMethod(sp->method, cntl.get(), &breq, &bres, NULL);
                     break;
                 }
-                // Switch to service-specific error.
-                non_service_error.release();
-                method_status = sp->status;
-                if (method_status) {
-                    int rejected_cc = 0;
-                    if (!method_status->OnRequested(&rejected_cc)) {
-                        cntl->SetFailed(ELIMIT, "Rejected by %s's ConcurrencyLimiter, concurrency=%d",
-                                        sp->method->full_name().c_str(), rejected_cc);
-                        break;
+                accessor.set_method(sp->method);
+
+                // Admit the tenant before taking the concurrency slots, which
+                // is done in ProcessAcceptedHuluRequest().
+                bool queued = false;
+                if (!server->AcceptRequest(cntl.get(), ResumeHuluRequest,
+                                           msg.get(), &queued)) {
+                    if (queued) {
+                        // Owned by TenantScheduler until ResumeHuluRequest().
+                        non_service_error.release();
+                        msg.release();
+                        cntl.release();
+                        return;
                     }
-                }
-
-                google::protobuf::Service *svc = sp->service;
-                const google::protobuf::MethodDescriptor *method = sp->method;
-                accessor.set_method(method);
-
-                if (!server->AcceptRequest(cntl.get())) {
                     break;
                 }
-
-                if (span) {
-                    span->ResetServerSpanName(method->full_name());
-                }
-                const int reqsize = msg->payload.length();
-                mutil::IOBuf req_buf;
-                mutil::IOBuf *req_buf_ptr = &msg->payload;
-                if (meta.has_user_message_size()) {
-                    msg->payload.cutn(&req_buf, meta.user_message_size());
-                    req_buf_ptr = &req_buf;
-                    cntl->request_attachment().swap(msg->payload);
-                }
-
-                req.reset(svc->GetRequestPrototype(method).New());
-                if (!ParseFromCompressedData(*req_buf_ptr, req.get(), req_cmp_type)) {
-                    cntl->SetFailed(EREQUEST, "Fail to parse request message, "
-                                              "CompressType=%s, request_size=%d",
-                                    CompressTypeToCStr(req_cmp_type), reqsize);
-                    break;
-                }
-
-                res.reset(svc->GetResponsePrototype(method).New());
-                // `socket' will be held until response has been sent
-                google::protobuf::Closure *done = ::melon::NewCallback<
-                        int64_t, HuluController *, const google::protobuf::Message *,
-                        const google::protobuf::Message *, const Server *,
-                        MethodStatus *, int64_t>(
-                        &SendHuluResponse, correlation_id, cntl.get(),
-                        req.get(), res.get(), server,
-                        method_status, msg->received_us());
-
-                // optional, just release resource ASAP
-                msg.reset();
-                req_buf.clear();
-
-                if (span) {
-                    span->set_start_callback_us(mutil::cpuwide_time_us());
-                    span->AsParent();
-                }
-                if (!FLAGS_usercode_in_pthread) {
-                    return svc->CallMethod(method, cntl.release(),
-                                           req.release(), res.release(), done);
-                }
-                if (BeginRunningUserCode()) {
-                    svc->CallMethod(method, cntl.release(),
-                                    req.release(), res.release(), done);
-                    return EndRunningUserCodeInPlace();
-                } else {
-                    return EndRunningCallMethodInPool(
-                            svc, method, cntl.release(),
-                            req.release(), res.release(), done);
-                }
+                // Switch to service-specific error.
+                non_service_error.release();
+                return ProcessAcceptedHuluRequest(msg.release(), cntl.release(),
+                                                  meta, sp);
             } while (false);
 
             // `cntl', `req' and `res' will be deleted inside `SendHuluResponse'
             // `socket' will be held until response has been sent
             SendHuluResponse(correlation_id, cntl.release(),
                              req.release(), res.release(), server,
-                             method_status, msg->received_us());
+                             NULL, msg->received_us());
         }
 
         bool VerifyHuluRequest(const InputMessageBase *msg_base) {
@@ -41,6 +41,7 @@
 #include <melon/rpc/details/usercode_backup_pool.h>
 #include <melon/rpc/details/controller_private_accessor.h>
 #include <melon/rpc/details/server_private_accessor.h>
+#include <melon/rpc/details/server_deadline.h>
 #include <melon/fiber/key.h>
 #include <cinttypes>
 
@@ -52,7 +53,8 @@ namespace melon {
                     ", otherwise puts service.name (required by jprotobuf).");
 
         DEFINE_bool(melon_std_protocol_deliver_timeout_ms, false,
-                    "If this flag is true, melon_std puts timeout_ms in requests.");
+                    "If this flag is true, melon_std puts timeout_ms in requests, "
+                    "which is the deadline of the request on server side.");
 
         // Notes:
         // 1. 12-byte header [MRPC][body_size][meta_size]
@@ -206,6 +208,14 @@ namespace melon {
                 // always new the string no matter if it's empty or not.
                 response_meta->set_error_text(cntl->ErrorText());
             }
+            if (server != NULL && server->options().report_load) {
+                ServerLoad load;
+                GetServerLoad(server, method_status, &load);
+                ServerLoadReport *report = response_meta->mutable_load_report();
+                report->set_cpu_utilization(load.cpu_utilization);
+                report->set_concurrency(load.concurrency);
+                report->set_max_concurrency(load.max_concurrency);
+            }
             meta.set_correlation_id(correlation_id);
             meta.set_compress_type(cntl->response_compress_type());
             if (attached_size > 0) {
@@ -301,6 +311,8 @@ namespace melon {
 
         static void CallMethodInBackupThread(void *void_args) {
             CallMethodInBackupThreadArgs *args = (CallMethodInBackupThreadArgs *) void_args;
+            ScopedServerDeadline deadline_guard(
+                    static_cast<Controller *>(args->controller)->deadline_us());
             args->service->CallMethod(args->method, args->controller, args->request,
                                       args->response, args->done);
             delete args;
@@ -324,6 +336,144 @@ namespace melon {
             return EndRunningUserCodeInPool(CallMethodInBackupThread, args);
         };
 
+        // Parse and run the request accepted by Server::AcceptRequest().
+        static void ProcessAcceptedMStdRequest(MostCommonMessage *msg_raw,
+                                               Controller *cntl_raw,
+                                               const RpcMeta &meta,
+                                               const Server::MethodProperty *mp) {
+            DestroyingPtr<MostCommonMessage> msg(msg_raw);
+            std::unique_ptr<Controller> cntl(cntl_raw);
+            std::unique_ptr<google::protobuf::Message> req;
+            std::unique_ptr<google::protobuf::Message> res;
+            const Server *server = static_cast<const Server *>(msg->arg());
+            Span *span = ControllerPrivateAccessor(cntl.get()).span();
+            google::protobuf::Service *svc = mp->service;
+            const google::protobuf::MethodDescriptor *method = mp->method;
+            MethodStatus *method_status = NULL;
+            do {
+                // Take the concurrency slots after the tenant is admitted so
+                // that queued requests do not hold them while waiting.
+                ServerPrivateAccessor server_accessor(server);
+                if (!server_accessor.AddConcurrency(cntl.get())) {
+                    server_accessor.AddError();
+                    cntl->SetFailed(
+                            ELIMIT, "Reached server's max_concurrency=%d",
+                            server->options().max_concurrency);
+                    break;
+                }
+
+                if (FLAGS_usercode_in_pthread && TooManyUserCode()) {
+                    server_accessor.AddError();
+                    cntl->SetFailed(ELIMIT, "Too many user code to run when"
+                                            " -usercode_in_pthread is on");
+                    break;
+                }
+
+                method_status = mp->status;
+                if (method_status) {
+                    int rejected_cc = 0;
+                    if (!method_status->OnRequested(&rejected_cc, cntl.get())) {
+                        cntl->SetFailed(ELIMIT, "Rejected by %s's ConcurrencyLimiter, concurrency=%d",
+                                        method->full_name().c_str(), rejected_cc);
+                        break;
+                    }
+                }
+
+                if (span) {
+                    span->ResetServerSpanName(method->full_name());
+                }
+                const int req_size = static_cast<int>(msg->payload.size());
+                mutil::IOBuf req_buf;
+                mutil::IOBuf *req_buf_ptr = &msg->payload;
+                if (meta.has_attachment_size()) {
+                    if (req_size < meta.attachment_size()) {
+                        cntl->SetFailed(EREQUEST,
+                                        "attachment_size=%d is larger than request_size=%d",
+                                        meta.attachment_size(), req_size);
+                        break;
+                    }
+                    int body_without_attachment_size = req_size - meta.attachment_size();
+                    msg->payload.cutn(&req_buf, body_without_attachment_size);
+                    req_buf_ptr = &req_buf;
+                    cntl->request_attachment().swap(msg->payload);
+                }
+
+                CompressType req_cmp_type = (CompressType) meta.compress_type();
+                req.reset(svc->GetRequestPrototype(method).New());
+                if (!ParseFromCompressedData(*req_buf_ptr, req.get(), req_cmp_type)) {
+                    cntl->SetFailed(EREQUEST, "Fail to parse request message, "
+                                              "CompressType=%s, request_size=%d",
+                                    CompressTypeToCStr(req_cmp_type), req_size);
+                    break;
+                }
+
+                res.reset(svc->GetResponsePrototype(method).New());
+                // `socket' will be held until response has been sent
+                google::protobuf::Closure *done = ::melon::NewCallback<
+                        int64_t, Controller *, const google::protobuf::Message *,
+                        const google::protobuf::Message *, const Server *,
+                        MethodStatus *, int64_t>(
+                        &SendRpcResponse, meta.correlation_id(), cntl.get(),
+                        req.get(), res.get(), server,
+                        method_status, msg->received_us());
+
+                // optional, just release resource ASAP
+                msg.reset();
+                req_buf.clear();
+
+                if (span) {
+                    span->set_start_callback_us(mutil::cpuwide_time_us());
+                    span->AsParent();
+                }
+                // Downstream RPCs issued by the callback inherit the deadline.
+                ScopedServerDeadline deadline_guard(cntl->deadline_us());
+                if (!FLAGS_usercode_in_pthread) {
+                    return svc->CallMethod(method, cntl.release(),
+                                           req.release(), res.release(), done);
+                }
+                if (BeginRunningUserCode()) {
+                    svc->CallMethod(method, cntl.release(),
+                                    req.release(), res.release(), done);
+                    return EndRunningUserCodeInPlace();
+                } else {
+                    return MStdEndRunningCallMethodInPool(
+                            svc, method, cntl.release(),
+                            req.release(), res.release(), done);
+                }
+            } while (false);
+
+            // `cntl', `req' and `res' will be deleted inside `SendRpcResponse'
+            // `socket' will be held until response has been sent
+            SendRpcResponse(meta.correlation_id(), cntl.release(),
+                            req.release(), res.release(), server,
+                            method_status, msg->received_us());
+        }
+
+        // Continue the request queued by Server::AcceptRequest(), `cntl' is
+        // failed if the request was rejected.
+        static void ResumeMStdRequest(Controller *cntl_raw, void *arg) {
+            DestroyingPtr<MostCommonMessage> msg(static_cast<MostCommonMessage *>(arg));
+            std::unique_ptr<Controller> cntl(cntl_raw);
+            const Server *server = static_cast<const Server *>(msg->arg());
+            RpcMeta meta;
+            // Parsed successfully before the request was queued.
+            ParsePbFromIOBuf(&meta, msg->meta);
+            const google::protobuf::MethodDescriptor *method = cntl->method();
+            const Server::MethodProperty *mp =
+                    ServerPrivateAccessor(server).FindMethodPropertyByFullName(
+                            method->service()->full_name(), method->name());
+            if (server->thread_local_options().thread_local_data_factory) {
+                fiber_assign_data((void *) &server->thread_local_options());
+            }
+            if (cntl->Failed()) {
+                ServerPrivateAccessor(server).AddError();
+                return SendRpcResponse(meta.correlation_id(), cntl.release(),
+                                       NULL, NULL, server, NULL,
+                                       msg->received_us());
+            }
+            ProcessAcceptedMStdRequest(msg.release(), cntl.release(), meta, mp);
+        }
+
         void ProcessMStdRequest(InputMessageBase *msg_base) {
             const int64_t start_parse_us = mutil::cpuwide_time_us();
             DestroyingPtr<MostCommonMessage> msg(static_cast<MostCommonMessage *>(msg_base));
@@ -373,6 +523,10 @@ namespace melon {
             }
             if (request_meta.has_timeout_ms()) {
                 cntl->set_timeout_ms(request_meta.timeout_ms());
+                // The time spent on the wire is unknown, count from the
+                // moment that the request was read.
+                accessor.set_deadline_us(msg->base_real_us() + msg->received_us()
+                                         + request_meta.timeout_ms() * 1000L);
             }
             cntl->set_request_compress_type((CompressType) meta.compress_type());
             accessor.set_server(server)
@@ -414,7 +568,6 @@ namespace melon {
                 span->set_request_size(msg->payload.size() + msg->meta.size() + 12);
             }
 
-            MethodStatus *method_status = NULL;
             do {
                 if (!server->IsRunning()) {
                     cntl->SetFailed(ELOGOFF, "Server is stopping");
@@ -427,16 +580,13 @@ namespace melon {
                     break;
                 }
 
-                if (!server_accessor.AddConcurrency(cntl.get())) {
-                    cntl->SetFailed(
-                            ELIMIT, "Reached server's max_concurrency=%d",
-                            server->options().max_concurrency);
-                    break;
-                }
-
-                if (FLAGS_usercode_in_pthread && TooManyUserCode()) {
-                    cntl->SetFailed(ELIMIT, "Too many user code to run when"
-                                            " -usercode_in_pthread is on");
+                // The client has given up the request, don't waste time on
+                // parsing and running it.
+                if (cntl->deadline_us() >= 0 &&
+                    mutil::gettimeofday_us() >= cntl->deadline_us()) {
+                    server_accessor.AddExpired();
+                    cntl->SetFailed(ERPCTIMEDOUT, "Deadline of the request has"
+                                    " passed before it's processed");
                     break;
                 }
 
@@ -469,92 +619,33 @@ namespace melon {
                     mp->service->CallMethod(mp->method, cntl.get(), &breq, &bres, NULL);
                     break;
                 }
-                // Switch to service-specific error.
-                non_service_error.release();
-                method_status = mp->status;
-                if (method_status) {
-                    int rejected_cc = 0;
-                    if (!method_status->OnRequested(&rejected_cc, cntl.get())) {
-                        cntl->SetFailed(ELIMIT, "Rejected by %s's ConcurrencyLimiter, concurrency=%d",
-                                        mp->method->full_name().c_str(), rejected_cc);
-                        break;
+                accessor.set_method(mp->method);
+
+                // Admit the tenant before taking the concurrency slots, which
+                // is done in ProcessAcceptedMStdRequest().
+                bool queued = false;
+                if (!server->AcceptRequest(cntl.get(), ResumeMStdRequest,
+                                           msg.get(), &queued)) {
+                    if (queued) {
+                        // Owned by TenantScheduler until ResumeMStdRequest().
+                        non_service_error.release();
+                        msg.release();
+                        cntl.release();
+                        return;
                     }
-                }
-                google::protobuf::Service *svc = mp->service;
-                const google::protobuf::MethodDescriptor *method = mp->method;
-                accessor.set_method(method);
-
-
-                if (!server->AcceptRequest(cntl.get())) {
                     break;
                 }
-
-                if (span) {
-                    span->ResetServerSpanName(method->full_name());
-                }
-                const int req_size = static_cast<int>(msg->payload.size());
-                mutil::IOBuf req_buf;
-                mutil::IOBuf *req_buf_ptr = &msg->payload;
-                if (meta.has_attachment_size()) {
-                    if (req_size < meta.attachment_size()) {
-                        cntl->SetFailed(EREQUEST,
-                                        "attachment_size=%d is larger than request_size=%d",
-                                        meta.attachment_size(), req_size);
-                        break;
-                    }
-                    int body_without_attachment_size = req_size - meta.attachment_size();
-                    msg->payload.cutn(&req_buf, body_without_attachment_size);
-                    req_buf_ptr = &req_buf;
-                    cntl->request_attachment().swap(msg->payload);
-                }
-
-                CompressType req_cmp_type = (CompressType) meta.compress_type();
-                req.reset(svc->GetRequestPrototype(method).New());
-                if (!ParseFromCompressedData(*req_buf_ptr, req.get(), req_cmp_type)) {
-                    cntl->SetFailed(EREQUEST, "Fail to parse request message, "
-                                              "CompressType=%s, request_size=%d",
-                                    CompressTypeToCStr(req_cmp_type), req_size);
-                    break;
-                }
-
-                res.reset(svc->GetResponsePrototype(method).New());
-                // `socket' will be held until response has been sent
-                google::protobuf::Closure *done = ::melon::NewCallback<
-                        int64_t, Controller *, const google::protobuf::Message *,
-                        const google::protobuf::Message *, const Server *,
-                        MethodStatus *, int64_t>(
-                        &SendRpcResponse, meta.correlation_id(), cntl.get(),
-                        req.get(), res.get(), server,
-                        method_status, msg->received_us());
-
-                // optional, just release resource ASAP
-                msg.reset();
-                req_buf.clear();
-
-                if (span) {
-                    span->set_start_callback_us(mutil::cpuwide_time_us());
-                    span->AsParent();
-                }
-                if (!FLAGS_usercode_in_pthread) {
-                    return svc->CallMethod(method, cntl.release(),
-                                           req.release(), res.release(), done);
-                }
-                if (BeginRunningUserCode()) {
-                    svc->CallMethod(method, cntl.release(),
-                                    req.release(), res.release(), done);
-                    return EndRunningUserCodeInPlace();
-                } else {
-                    return MStdEndRunningCallMethodInPool(
-                            svc, method, cntl.release(),
-                            req.release(), res.release(), done);
-                }
+                // Switch to service-specific error.
+                non_service_error.release();
+                return ProcessAcceptedMStdRequest(msg.release(), cntl.release(),
+                                                  meta, mp);
             } while (false);
 
             // `cntl', `req' and `res' will be deleted inside `SendRpcResponse'
             // `socket' will be held until response has been sent
             SendRpcResponse(meta.correlation_id(), cntl.release(),
                             req.release(), res.release(), server,
-                            method_status, msg->received_us());
+                            NULL, msg->received_us());
         }
 
         bool VerifyMStdRequest(const InputMessageBase *msg_base) {
@@ -626,6 +717,14 @@ namespace melon {
                 span->set_start_parse_us(start_parse_us);
             }
             const RpcResponseMeta &response_meta = meta.response();
+            if (response_meta.has_load_report()) {
+                const ServerLoadReport &report = response_meta.load_report();
+                ServerLoad load;
+                load.cpu_utilization = report.cpu_utilization();
+                load.concurrency = report.concurrency();
+                load.max_concurrency = report.max_concurrency();
+                accessor.set_server_load(load);
+            }
             const int saved_error = cntl->ErrorCode();
             do {
                 if (response_meta.error_code() != 0) {
@@ -70,6 +70,7 @@
 #include <melon/naming/naming_service.h>
 #include <melon/rpc/simple_data_pool.h>
 #include <melon/rpc/server.h>
+#include <melon/rpc/tenant_scheduler.h>
 #include <melon/rpc/trackme.h>
 #include <melon/rpc/restful.h>
 #include <melon/rpc/rtmp/rtmp.h>
@@ -123,11 +124,12 @@ namespace melon {
 
     ServerOptions::ServerOptions()
             : idle_timeout_sec(-1), mongo_service_adaptor(NULL), auth(NULL), server_owns_auth(false), interceptor(NULL),
-              server_owns_interceptor(false), num_threads(8), max_concurrency(0), session_local_data_factory(NULL),
+              server_owns_interceptor(false), num_threads(8), max_concurrency(0), tenant_scheduler(NULL),
+              session_local_data_factory(NULL),
               reserved_session_local_data(0), thread_local_data_factory(NULL), reserved_thread_local_data(0),
               fiber_init_fn(NULL), fiber_init_args(NULL), fiber_init_count(0), internal_port(-1),
               has_builtin_services(true), force_ssl(false), use_rdma(false), http_master_service(NULL),
-              health_reporter(NULL), rtmp_service(NULL), redis_service(NULL), fiber_tag(FIBER_TAG_DEFAULT) {
+              health_reporter(NULL), rtmp_service(NULL), redis_service(NULL), fiber_tag(FIBER_TAG_DEFAULT), report_load(false) {
         if (s_ncore > 0) {
             num_threads = s_ncore + 1;
         }
@@ -272,6 +274,12 @@ namespace melon {
 
         server->_nerror_var.expose_as(prefix, "error");
 
+        server->_nexpired_var.expose_as(prefix, "expired");
+
+        if (server->options().tenant_scheduler) {
+            server->options().tenant_scheduler->Expose(prefix);
+        }
+
         server->_eps_var.expose_as(prefix, "eps");
 
         server->_concurrency_var.expose_as(prefix, "concurrency");
@@ -408,6 +416,9 @@ namespace melon {
 
         delete _options.redis_service;
         _options.redis_service = NULL;
+
+        delete _options.tenant_scheduler;
+        _options.tenant_scheduler = NULL;
     }
 
     int Server::AddBuiltinServices() {
@@ -2142,19 +2153,28 @@ namespace melon {
         return MaxConcurrencyOf(service->GetDescriptor()->full_name(), method_name);
     }
 
-    bool Server::AcceptRequest(Controller *cntl) const {
+    bool Server::AcceptRequest(Controller *cntl,
+                               void (*resume)(Controller *, void *),
+                               void *resume_arg, bool *queued) const {
+        if (queued) {
+            *queued = false;
+        }
         const Interceptor *interceptor = _options.interceptor;
-        if (!interceptor) {
-            return true;
+        if (interceptor) {
+            int error_code = 0;
+            std::string error_text;
+            if (cntl &&
+                !interceptor->Accept(cntl, error_code, error_text)) {
+                cntl->SetFailed(error_code,
+                                "Reject by Interceptor: %s",
+                                error_text.c_str());
+                return false;
+            }
         }
 
-        int error_code = 0;
-        std::string error_text;
-        if (cntl &&
-            !interceptor->Accept(cntl, error_code, error_text)) {
-            cntl->SetFailed(error_code,
-                            "Reject by Interceptor: %s",
-                            error_text.c_str());
+        // Admitted requests are released in ServerPrivateAccessor::RemoveConcurrency().
+        if (_options.tenant_scheduler && cntl &&
+            !_options.tenant_scheduler->OnRequested(cntl, resume, resume_arg, queued)) {
             return false;
         }
 
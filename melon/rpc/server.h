@@ -57,6 +57,8 @@ namespace melon {
 
     class RedisService;
 
+    class TenantScheduler;
+
     struct SocketSSLContext;
 
     struct ServerOptions {
@@ -121,6 +123,15 @@ namespace melon {
         // Default: 0 (unlimited)
         int max_concurrency;
 
+        // If this option is set, requests are classified into tenants which
+        // share capacity of the server by weights, so that a noisy tenant
+        // can't starve others. Read tenant_scheduler.h for details.
+        // Checked before max_concurrency and method-level max concurrencies,
+        // so that requests waiting in the queue do not hold their slots.
+        // Owned by Server and deleted in server's destructor.
+        // Default: NULL (disabled)
+        TenantScheduler *tenant_scheduler;
+
         // Default value of method-level max concurrencies,
         // Overridable by Server.MaxConcurrencyOf().
         AdaptiveMaxConcurrency method_max_concurrency;
@@ -261,6 +272,13 @@ namespace melon {
         // Default: FIBER_TAG_DEFAULT
         fiber_tag_t fiber_tag;
 
+        // Report load of the server, namely utilization of fiber workers and
+        // concurrency, in responses of melon_std and http/h2 (trailers of
+        // gRPC), so that clients using the "utilization" load balancer spread
+        // requests by real load of servers rather than latencies.
+        // Default: false
+        bool report_load;
+
     private:
         // SSLOptions is large and not often used, allocate it on heap to
         // prevent ServerOptions from being bloated in most cases.
@@ -583,8 +601,13 @@ namespace melon {
             return mutil::subtle::NoBarrier_Load(&_concurrency);
         };
 
-        // Returns true if accept request, reject request otherwise.
-        bool AcceptRequest(Controller *cntl) const;
+        // Returns true if accept request. Otherwise the request is rejected
+        // with `cntl' set failed, or it's queued by tenant_scheduler with
+        // `*queued' set to true and `resume(cntl, resume_arg)' will be called
+        // in another fiber, see TenantScheduler::OnRequested().
+        bool AcceptRequest(Controller *cntl,
+                           void (*resume)(Controller *, void *) = NULL,
+                           void *resume_arg = NULL, bool *queued = NULL) const;
 
         bool has_progressive_read_method() const {
             return this->_has_progressive_read_method;
@@ -754,6 +777,8 @@ namespace melon {
 
         // mutable is required for `ServerPrivateAccessor' to change this var
         mutable melon::var::Adder<int64_t> _nerror_var;
+        // Requests rejected because their deadlines passed before processing.
+        mutable melon::var::Adder<int64_t> _nexpired_var;
         mutable melon::var::PerSecond<melon::var::Adder<int64_t> > _eps_var;
         MELON_CACHELINE_ALIGNMENT mutable int32_t _concurrency;
         melon::var::PassiveStatus<int32_t> _concurrency_var;
@@ -0,0 +1,127 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#include <algorithm>
+#include <stdlib.h>                                     // strtod
+#include <melon/utility/time.h>
+#include <melon/utility/atomicops.h>
+#include <melon/utility/string_printf.h>
+#include <melon/utility/string_splitter.h>
+#include <melon/utility/strings/string_number_conversions.h>
+#include <melon/fiber/fiber.h>                          // fiber_getconcurrency
+#include <melon/var/variable.h>
+#include <melon/rpc/server.h>
+#include <melon/rpc/details/method_status.h>
+#include <melon/rpc/server_load.h>
+
+namespace melon {
+
+    // fiber_worker_usage is already averaged over the last second, sampling
+    // it more frequently is useless.
+    static const int64_t CPU_SAMPLE_INTERVAL_US = 100000;
+
+    static mutil::atomic<int64_t> s_last_cpu_sample_us(0);
+    // In parts per million to be stored in an atomic integer.
+    static mutil::atomic<int64_t> s_cpu_utilization_ppm(0);
+
+    static double GetFiberWorkerUtilization() {
+        const int64_t now_us = mutil::cpuwide_time_us();
+        int64_t last_us = s_last_cpu_sample_us.load(mutil::memory_order_relaxed);
+        // Only one thread samples in each interval.
+        if (now_us - last_us >= CPU_SAMPLE_INTERVAL_US &&
+            s_last_cpu_sample_us.compare_exchange_strong(
+                    last_us, now_us, mutil::memory_order_relaxed)) {
+            const std::string usage =
+                    melon::var::Variable::describe_exposed("fiber_worker_usage");
+            const int nworkers = fiber_getconcurrency();
+            double utilization = 0;
+            if (!usage.empty() && nworkers > 0) {
+                utilization = strtod(usage.c_str(), NULL) / nworkers;
+            }
+            utilization = std::min(std::max(utilization, 0.0), 1.0);
+            s_cpu_utilization_ppm.store((int64_t) (utilization * 1000000),
+                                        mutil::memory_order_relaxed);
+        }
+        return s_cpu_utilization_ppm.load(mutil::memory_order_relaxed) / 1000000.0;
+    }
+
+    double ServerLoad::utilization() const {
+        double u = std::max(cpu_utilization, 0.0);
+        if (max_concurrency > 0) {
+            u = std::max(u, (double) concurrency / max_concurrency);
+        }
+        return std::min(u, 1.0);
+    }
+
+    void GetServerLoad(const Server *server, const MethodStatus *method_status,
+                       ServerLoad *load) {
+        load->cpu_utilization = GetFiberWorkerUtilization();
+        load->concurrency = 0;
+        load->max_concurrency = 0;
+        if (server) {
+            load->concurrency = server->Concurrency();
+            load->max_concurrency = server->options().max_concurrency;
+        }
+        if (method_status) {
+            const int max_cc = method_status->MaxConcurrency();
+            const int cc = method_status->concurrency();
+            // Report the one closer to its limit.
+            if (max_cc > 0 &&
+                (load->max_concurrency <= 0 ||
+                 (int64_t) cc * load->max_concurrency >
+                 (int64_t) load->concurrency * max_cc)) {
+                load->concurrency = cc;
+                load->max_concurrency = max_cc;
+            }
+        }
+    }
+
+    void ServerLoadToString(const ServerLoad &load, std::string *out) {
+        mutil::string_printf(out, "cpu=%.3f,concurrency=%d,max_concurrency=%d",
+                             load.cpu_utilization, load.concurrency,
+                             load.max_concurrency);
+    }
+
+    bool ServerLoadFromString(const mutil::StringPiece &str, ServerLoad *load) {
+        ServerLoad tmp;
+        for (mutil::KeyValuePairsSplitter sp(str.begin(), str.end(), ',', '=');
+             sp; ++sp) {
+            if (sp.key() == "cpu") {
+                if (!mutil::StringToDouble(sp.value().as_string(), &tmp.cpu_utilization)) {
+                    return false;
+                }
+            } else if (sp.key() == "concurrency") {
+                if (!mutil::StringToInt(sp.value(), &tmp.concurrency)) {
+                    return false;
+                }
+            } else if (sp.key() == "max_concurrency") {
+                if (!mutil::StringToInt(sp.value(), &tmp.max_concurrency)) {
+                    return false;
+                }
+            }
+            // Ignore unknown fields which may be added in future.
+        }
+        if (!tmp.reported()) {
+            return false;
+        }
+        *load = tmp;
+        return true;
+    }
+
+} // namespace melon
@@ -0,0 +1,63 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#pragma once
+
+#include <string>
+#include <melon/utility/strings/string_piece.h>
+
+namespace melon {
+
+    class Server;
+    class MethodStatus;
+
+    // Load of a server piggybacked on responses when ServerOptions.report_load
+    // is true. Unlike latencies measured by clients, it reflects how busy the
+    // server really is, so that servers on heterogeneous hardware can be
+    // loaded evenly by LoadBalancers, e.g. the "utilization" one.
+    struct ServerLoad {
+        ServerLoad() : cpu_utilization(-1), concurrency(0), max_concurrency(0) {}
+
+        // False if the server did not report its load.
+        bool reported() const { return cpu_utilization >= 0; }
+
+        // The busier one of cpu and concurrency in [0, 1].
+        double utilization() const;
+
+        // Ratio of busy fiber workers in [0, 1], negative means unreported.
+        double cpu_utilization;
+        // Requests being processed by the server, or by the method when its
+        // max_concurrency is closer to be reached than the server's.
+        int concurrency;
+        // max_concurrency paired with `concurrency', 0 means unlimited.
+        int max_concurrency;
+    };
+
+    // Get load of `server' processing a request to `method_status' which
+    // may be NULL. Cheap enough to be called for each response.
+    void GetServerLoad(const Server *server, const MethodStatus *method_status,
+                       ServerLoad *load);
+
+    // Convert to/from the value of http header "x-melon-server-load", e.g.
+    // "cpu=0.53,concurrency=12,max_concurrency=100".
+    void ServerLoadToString(const ServerLoad &load, std::string *out);
+
+    bool ServerLoadFromString(const mutil::StringPiece &str, ServerLoad *load);
+
+} // namespace melon
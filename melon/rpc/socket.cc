@@ -430,6 +430,7 @@ namespace melon {
               _ssl_state(SSL_UNKNOWN), _ssl_session(NULL), _rdma_ep(NULL), _rdma_state(RDMA_OFF),
               _connection_type_for_progressive_read(CONNECTION_TYPE_UNKNOWN), _controller_released_socket(false),
               _overcrowded(false), _fail_me_at_server_stop(false), _logoff_flag(false),
+              _ejected_until_us(0),
               _additional_ref_status(REF_USING), _error_code(0), _pipeline_q(NULL), _last_writetime_us(0),
               _unwritten_bytes(0), _epollout_butex(NULL), _write_head(NULL), _stream_set(NULL),
               _total_streams_unconsumed_size(0), _ninflight_app_health_check(0), _http_request_method(HTTP_METHOD_GET) {
@@ -676,6 +677,7 @@ namespace melon {
         // May be non-zero for RTMP connections.
         m->_fail_me_at_server_stop = false;
         m->_logoff_flag.store(false, mutil::memory_order_relaxed);
+        m->_ejected_until_us.store(0, mutil::memory_order_relaxed);
         m->_additional_ref_status.store(REF_USING, mutil::memory_order_relaxed);
         m->_error_code = 0;
         m->_error_text.clear();
@@ -2249,6 +2251,7 @@ namespace melon {
            << "\nauth_id=" << ptr->_auth_id.value
            << "\nauth_context=" << ptr->_auth_context
            << "\nlogoff_flag=" << ptr->_logoff_flag.load(mutil::memory_order_relaxed)
+           << "\nejected=" << ptr->IsEjected()
            << "\n_additional_ref_status="
            << ptr->_additional_ref_status.load(mutil::memory_order_relaxed)
            << "\ntotal_streams_buffer_size="
@@ -471,6 +471,15 @@ namespace melon {
         // fd. Once set, this flag can only be cleared inside `WaitAndReset'.
         void SetLogOff();
 
+        // Make `IsAvailable' return false until `until_us' (in
+        // mutil::cpuwide_time_us) without closing the inner fd, used by
+        // OutlierDetector to stop sending requests to a slow server.
+        void SetEjectedUntil(int64_t until_us) {
+            _ejected_until_us.store(until_us, mutil::memory_order_relaxed);
+        }
+
+        bool IsEjected() const;
+
         // Check Whether the socket is available for user requests.
         bool IsAvailable() const;
 
@@ -938,6 +947,9 @@ namespace melon {
         // Set by SetLogOff
         mutil::atomic<bool> _logoff_flag;
 
+        // Set by SetEjectedUntil
+        mutil::atomic<int64_t> _ejected_until_us;
+
         // Status flag used to mark that
         enum AdditionalRefStatus {
             REF_USING,        // additional reference has been increased
@@ -250,9 +250,15 @@ inline void Socket::SetLogOff() {
     }
 }
 
+inline bool Socket::IsEjected() const {
+    const int64_t until_us = _ejected_until_us.load(mutil::memory_order_relaxed);
+    return until_us != 0 && mutil::cpuwide_time_us() < until_us;
+}
+
 inline bool Socket::IsAvailable() const {
     return !_logoff_flag.load(mutil::memory_order_relaxed) &&
-        (_ninflight_app_health_check.load(mutil::memory_order_relaxed) == 0);
+        (_ninflight_app_health_check.load(mutil::memory_order_relaxed) == 0) &&
+        !IsEjected();
 }
 
 static const uint32_t EOF_FLAG = (1 << 31);
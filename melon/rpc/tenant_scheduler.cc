@@ -0,0 +1,359 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#include <algorithm>
+#include <melon/fiber/fiber.h>
+#include <melon/fiber/unstable.h>                    // fiber_timer_add
+#include <melon/utility/time.h>
+#include <melon/proto/rpc/errno.pb.h>
+#include <melon/rpc/authenticator.h>
+#include <melon/rpc/details/usercode_backup_pool.h>  // FLAGS_usercode_in_pthread
+#include <melon/rpc/tenant_scheduler.h>
+
+namespace melon {
+
+    // A queued request. Referenced by the queue and by the queueing timer,
+    // whoever removes it from the queue resumes the request.
+    struct TenantWaiter {
+        TenantWaiter() : scheduler(NULL), tenant(NULL), cntl(NULL), resume(NULL),
+                         arg(NULL), timer(0), queued(true), nref(2) {}
+
+        void Dereference() {
+            if (nref.fetch_sub(1, mutil::memory_order_acq_rel) == 1) {
+                delete this;
+            }
+        }
+
+        TenantScheduler *scheduler;
+        Tenant *tenant;
+        Controller *cntl;
+        TenantResumeFn resume;
+        void *arg;
+        fiber_timer_t timer;
+        // Protected by TenantScheduler::_mutex.
+        bool queued;
+        mutil::atomic<int> nref;
+    };
+
+    class Tenant {
+    public:
+        Tenant(const std::string &name2, int weight2)
+                : name(name2), weight(weight2), concurrency(0), deficit(0), nqueued(0),
+                  _concurrency_var(GetConcurrency, this), _nqueued_var(GetQueued, this) {}
+
+        void Expose(const std::string &scheduler_prefix) {
+            const std::string prefix = scheduler_prefix + "_tenant_" +
+                                       (name.empty() ? std::string("default") : name);
+            _concurrency_var.expose_as(prefix, "concurrency");
+            _nqueued_var.expose_as(prefix, "queued");
+            nadmitted.expose_as(prefix, "admitted");
+            nrejected.expose_as(prefix, "rejected");
+        }
+
+        const std::string name;
+        const int weight;
+        // Following fields are protected by TenantScheduler::_mutex.
+        int concurrency;
+        int64_t deficit;
+        std::deque<TenantWaiter *> waiters;
+        // Copy of waiters.size() readable without the lock.
+        int nqueued;
+
+        melon::var::Adder<int64_t> nadmitted;
+        melon::var::Adder<int64_t> nrejected;
+
+    private:
+        static int GetConcurrency(void *arg) {
+            return static_cast<Tenant *>(arg)->concurrency;
+        }
+
+        static int GetQueued(void *arg) {
+            return static_cast<Tenant *>(arg)->nqueued;
+        }
+
+        melon::var::PassiveStatus<int> _concurrency_var;
+        melon::var::PassiveStatus<int> _nqueued_var;
+    };
+
+    TenantSchedulerOptions::TenantSchedulerOptions()
+            : max_concurrency(0), default_weight(1), key_type(TENANT_BY_METHOD), classifier(NULL),
+              max_queue_size(0), max_queue_time_ms(100), max_tenants(1024) {}
+
+    TenantScheduler::TenantScheduler()
+            : _total_weight(0), _concurrency(0), _nqueued(0) {}
+
+    TenantScheduler::~TenantScheduler() {
+        for (auto &kv: _tenants) {
+            delete kv.second;
+        }
+        _tenants.clear();
+    }
+
+    int TenantScheduler::Init(const TenantSchedulerOptions &options) {
+        if (options.max_concurrency <= 0) {
+            LOG(ERROR) << "max_concurrency=" << options.max_concurrency << " must be positive";
+            return -1;
+        }
+        if (options.default_weight <= 0) {
+            LOG(ERROR) << "default_weight=" << options.default_weight << " must be positive";
+            return -1;
+        }
+        for (auto &kv: options.weights) {
+            if (kv.second <= 0) {
+                LOG(ERROR) << "Weight of tenant `" << kv.first << "' must be positive";
+                return -1;
+            }
+        }
+        if (options.classifier == NULL && options.key_type == TENANT_BY_HEADER &&
+            options.key_name.empty()) {
+            LOG(ERROR) << "key_name must be set when key_type is TENANT_BY_HEADER";
+            return -1;
+        }
+        _options = options;
+        return 0;
+    }
+
+    std::string TenantScheduler::Classify(Controller *cntl) const {
+        if (_options.classifier) {
+            return _options.classifier->Classify(cntl);
+        }
+        switch (_options.key_type) {
+            case TENANT_BY_METHOD:
+                return cntl->method() ? cntl->method()->full_name() : std::string();
+            case TENANT_BY_HEADER: {
+                if (cntl->has_http_request()) {
+                    const std::string *value = cntl->http_request().GetHeader(_options.key_name);
+                    if (value) {
+                        return *value;
+                    }
+                }
+                if (cntl->has_request_user_fields()) {
+                    const std::string *value = cntl->request_user_fields()->seek(_options.key_name);
+                    if (value) {
+                        return *value;
+                    }
+                }
+                return std::string();
+            }
+            case TENANT_BY_AUTH_USER:
+                return cntl->auth_context() ? cntl->auth_context()->user() : std::string();
+        }
+        return std::string();
+    }
+
+    Tenant *TenantScheduler::FindOrCreateTenant(const std::string &name) {
+        auto it = _tenants.find(name);
+        if (it != _tenants.end()) {
+            return it->second;
+        }
+        if (!name.empty() && (int) _tenants.size() >= _options.max_tenants) {
+            return FindOrCreateTenant(std::string());
+        }
+        auto wit = _options.weights.find(name);
+        const int weight = (wit != _options.weights.end() ? wit->second : _options.default_weight);
+        Tenant *t = new Tenant(name, weight);
+        _tenants[name] = t;
+        _total_weight += weight;
+        if (!_var_prefix.empty()) {
+            t->Expose(_var_prefix);
+        }
+        return t;
+    }
+
+    int TenantScheduler::ShareOf(const Tenant *t) const {
+        return std::max((int64_t) 1, (int64_t) _options.max_concurrency * t->weight / _total_weight);
+    }
+
+    void TenantScheduler::Admit(Tenant *t) {
+        ++t->concurrency;
+        ++_concurrency;
+    }
+
+    void TenantScheduler::RemoveWaiter(Tenant *t, TenantWaiter *w) {
+        auto it = std::find(t->waiters.begin(), t->waiters.end(), w);
+        if (it == t->waiters.end()) {
+            return;
+        }
+        t->waiters.erase(it);
+        t->nqueued = t->waiters.size();
+        --_nqueued;
+        if (t->waiters.empty()) {
+            t->deficit = 0;
+            _backlogged.erase(std::find(_backlogged.begin(), _backlogged.end(), t));
+        }
+    }
+
+    void TenantScheduler::Dispatch(std::vector<TenantWaiter *> *admitted) {
+        while (_concurrency < _options.max_concurrency && !_backlogged.empty()) {
+            Tenant *t = _backlogged.front();
+            if (t->deficit <= 0) {
+                // A new round of the tenant.
+                t->deficit += t->weight;
+            }
+            TenantWaiter *w = t->waiters.front();
+            t->waiters.pop_front();
+            t->nqueued = t->waiters.size();
+            --_nqueued;
+            --t->deficit;
+            Admit(t);
+            w->queued = false;
+            w->cntl->_tenant = t;
+            admitted->push_back(w);
+            if (t->waiters.empty()) {
+                t->deficit = 0;
+                _backlogged.pop_front();
+            } else if (t->deficit <= 0) {
+                _backlogged.pop_front();
+                _backlogged.push_back(t);
+            }
+        }
+    }
+
+    bool TenantScheduler::OnRequested(Controller *cntl, TenantResumeFn resume,
+                                      void *arg, bool *queued) {
+        if (queued) {
+            *queued = false;
+        }
+        const std::string name = Classify(cntl);
+        std::unique_lock<fiber::Mutex> mu(_mutex);
+        Tenant *t = FindOrCreateTenant(name);
+        if (_concurrency < _options.max_concurrency &&
+            (_nqueued == 0 || t->concurrency < ShareOf(t))) {
+            Admit(t);
+            mu.unlock();
+            cntl->_tenant = t;
+            t->nadmitted << 1;
+            return true;
+        }
+        if (resume == NULL || queued == NULL ||
+            (int) t->waiters.size() >= _options.max_queue_size) {
+            const int share = ShareOf(t);
+            mu.unlock();
+            t->nrejected << 1;
+            cntl->SetFailed(ELIMIT, "Reached max_concurrency=%d of TenantScheduler,"
+                                    " share of tenant `%s' is %d",
+                            _options.max_concurrency, t->name.c_str(), share);
+            return false;
+        }
+        int64_t due_us = mutil::gettimeofday_us() + _options.max_queue_time_ms * 1000L;
+        if (cntl->deadline_us() >= 0 && cntl->deadline_us() < due_us) {
+            due_us = cntl->deadline_us();
+        }
+        TenantWaiter *w = new TenantWaiter;
+        w->scheduler = this;
+        w->tenant = t;
+        w->cntl = cntl;
+        w->resume = resume;
+        w->arg = arg;
+        if (fiber_timer_add(&w->timer, mutil::microseconds_to_timespec(due_us),
+                            OnQueueTimeout, w) != 0) {
+            mu.unlock();
+            delete w;
+            t->nrejected << 1;
+            cntl->SetFailed(ELIMIT, "Fail to add timer of TenantScheduler,"
+                                    " tenant=`%s'", t->name.c_str());
+            return false;
+        }
+        if (t->waiters.empty()) {
+            _backlogged.push_back(t);
+        }
+        t->waiters.push_back(w);
+        t->nqueued = t->waiters.size();
+        ++_nqueued;
+        *queued = true;
+        return false;
+    }
+
+    void TenantScheduler::OnQueueTimeout(void *arg) {
+        TenantWaiter *w = static_cast<TenantWaiter *>(arg);
+        TenantScheduler *ts = w->scheduler;
+        std::unique_lock<fiber::Mutex> mu(ts->_mutex);
+        if (!w->queued) {
+            // Admitted just now.
+            mu.unlock();
+            return w->Dereference();
+        }
+        ts->RemoveWaiter(w->tenant, w);
+        w->queued = false;
+        mu.unlock();
+        w->tenant->nrejected << 1;
+        w->cntl->SetFailed(ELIMIT, "Queued in TenantScheduler for too long,"
+                                   " tenant=`%s'", w->tenant->name.c_str());
+        StartResume(w);
+        w->Dereference();
+    }
+
+    void *TenantScheduler::RunResume(void *arg) {
+        TenantWaiter *w = static_cast<TenantWaiter *>(arg);
+        w->resume(w->cntl, w->arg);
+        w->Dereference();
+        return NULL;
+    }
+
+    void TenantScheduler::StartResume(TenantWaiter *w) {
+        fiber_t th;
+        const fiber_attr_t attr = (FLAGS_usercode_in_pthread ?
+                                   FIBER_ATTR_PTHREAD : FIBER_ATTR_NORMAL);
+        if (fiber_start_background(&th, &attr, RunResume, w) != 0) {
+            RunResume(w);
+        }
+    }
+
+    void TenantScheduler::OnResponded(const Controller *cntl) {
+        Tenant *t = cntl->_tenant;
+        if (t == NULL) {
+            return;
+        }
+        std::vector<TenantWaiter *> admitted;
+        std::unique_lock<fiber::Mutex> mu(_mutex);
+        --t->concurrency;
+        --_concurrency;
+        Dispatch(&admitted);
+        mu.unlock();
+        for (size_t i = 0; i < admitted.size(); ++i) {
+            TenantWaiter *w = admitted[i];
+            w->tenant->nadmitted << 1;
+            if (fiber_timer_del(w->timer) == 0) {
+                // The timer won't run.
+                w->Dereference();
+            }
+            StartResume(w);
+        }
+    }
+
+    int TenantScheduler::Expose(const mutil::StringPiece &prefix) {
+        if (prefix.empty()) {
+            LOG(ERROR) << "Parameter[prefix] is empty";
+            return -1;
+        }
+        std::unique_lock<fiber::Mutex> mu(_mutex);
+        _var_prefix = prefix.as_string();
+        for (auto &kv: _tenants) {
+            kv.second->Expose(_var_prefix);
+        }
+        return 0;
+    }
+
+    int TenantScheduler::GetShare(const std::string &tenant) {
+        std::unique_lock<fiber::Mutex> mu(_mutex);
+        auto it = _tenants.find(tenant);
+        return it != _tenants.end() ? ShareOf(it->second) : -1;
+    }
+
+} // namespace melon
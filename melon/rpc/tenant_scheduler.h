@@ -0,0 +1,188 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#pragma once
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <melon/utility/macros.h>
+#include <melon/fiber/mutex.h>
+#include <melon/var/var.h>
+#include <melon/rpc/controller.h>
+
+namespace melon {
+
+    struct TenantWaiter;
+
+    // Called in a new fiber when a request queued by TenantScheduler is
+    // admitted, or rejected with `cntl' set failed.
+    typedef void (*TenantResumeFn)(Controller *cntl, void *arg);
+
+    // Put a request into a tenant. Requests of the same tenant share the
+    // capacity assigned to the tenant by TenantScheduler.
+    class TenantClassifier {
+    public:
+        virtual ~TenantClassifier() {}
+
+        // Returns name of the tenant that the request belongs to. `cntl' has
+        // the method, auth_context(), http headers or user fields of the
+        // request. Empty name means the default tenant.
+        virtual std::string Classify(const Controller *cntl) const = 0;
+    };
+
+    // How TenantScheduler classifies requests when no classifier is set.
+    enum TenantKeyType {
+        TENANT_BY_METHOD = 0,      // full name of the method.
+        TENANT_BY_HEADER = 1,      // http header or melon_std user field `key_name'.
+        TENANT_BY_AUTH_USER = 2,   // AuthContext::user() set by Authenticator.
+    };
+
+    struct TenantSchedulerOptions {
+        // Constructed with default options.
+        TenantSchedulerOptions();
+
+        // Max number of requests being processed by all tenants together.
+        // Must be positive.
+        // Default: 0
+        int max_concurrency;
+
+        // Weights of tenants. Tenants not listed here use `default_weight'.
+        std::map<std::string, int> weights;
+
+        // Default: 1
+        int default_weight;
+
+        // Default: TENANT_BY_METHOD
+        TenantKeyType key_type;
+
+        // Name of the header or user field when key_type is TENANT_BY_HEADER.
+        std::string key_name;
+
+        // If set, requests are classified by it and `key_type' is ignored.
+        // NOT owned by the scheduler and must be valid when server is running.
+        // Default: NULL
+        const TenantClassifier *classifier;
+
+        // Max number of requests of a tenant waiting for capacity. Requests
+        // are rejected with ELIMIT immediately when they can't be admitted
+        // and the queue of the tenant is full.
+        // Default: 0 (no queueing)
+        int max_queue_size;
+
+        // Max time that a request waits in the queue, also bounded by the
+        // deadline of the request.
+        // Default: 100
+        int64_t max_queue_time_ms;
+
+        // Requests of new tenants beyond this number are put into the
+        // default tenant to bound the memory and the number of vars.
+        // Default: 1024
+        int max_tenants;
+    };
+
+    // Share server capacity between tenants in proportion to their weights.
+    //
+    // `max_concurrency' is split into guaranteed shares by weights of known
+    // tenants. A request is admitted immediately if the scheduler is not full
+    // and either its tenant is within its share or no request is waiting, so
+    // that idle capacity is lent to busy tenants. Otherwise the request is
+    // queued (when max_queue_size is positive) and queued requests are
+    // admitted in deficit-round-robin order with quantums proportional to
+    // weights of tenants, as slots are released. A noisy tenant therefore
+    // can't hold capacity guaranteed to others for longer than its running
+    // requests take.
+    //
+    // Queued requests don't block the fibers processing them, which may be
+    // the fibers reading from the connections. The processing returns after
+    // the request is queued and is resumed in a new fiber by the releasing
+    // request or by the queueing timer.
+    //
+    // Set ServerOptions.tenant_scheduler to enable. Per-tenant vars named
+    // <server>_tenant_<name>_{concurrency,queued,admitted,rejected} are
+    // exposed when the server starts.
+    class TenantScheduler {
+    public:
+        TenantScheduler();
+
+        ~TenantScheduler();
+
+        // Returns 0 on success, -1 otherwise.
+        int Init(const TenantSchedulerOptions &options);
+
+        // Called before the request is processed. Returns true if the request
+        // is admitted. Otherwise the request is rejected with `cntl' set
+        // failed, or it's queued with `*queued' set to true. A queued request
+        // is owned by the scheduler until `resume(cntl, arg)' is called, which
+        // may happen before this function returns, so don't touch `cntl'
+        // after that. Requests are never queued if `resume' is NULL.
+        bool OnRequested(Controller *cntl, TenantResumeFn resume = NULL,
+                         void *arg = NULL, bool *queued = NULL);
+
+        // Called when an admitted request is done.
+        void OnResponded(const Controller *cntl);
+
+        // Expose vars of tenants with `prefix', including ones created later.
+        // Returns 0 on success, -1 otherwise.
+        int Expose(const mutil::StringPiece &prefix);
+
+        const TenantSchedulerOptions &options() const { return _options; }
+
+        // Guaranteed concurrency of `tenant', for debugging.
+        // Returns -1 if no request of the tenant has been seen.
+        int GetShare(const std::string &tenant);
+
+    private:
+        DISALLOW_COPY_AND_ASSIGN(TenantScheduler);
+
+        std::string Classify(Controller *cntl) const;
+
+        // Following methods must be called with _mutex held.
+        Tenant *FindOrCreateTenant(const std::string &name);
+
+        int ShareOf(const Tenant *t) const;
+
+        void Admit(Tenant *t);
+
+        void RemoveWaiter(Tenant *t, TenantWaiter *w);
+
+        // Admit queued requests while there's capacity. Admitted waiters
+        // are put into `admitted' and should be resumed without the lock.
+        void Dispatch(std::vector<TenantWaiter *> *admitted);
+
+        // Run `resume' of `w' in a new fiber.
+        static void StartResume(TenantWaiter *w);
+
+        static void *RunResume(void *arg);
+
+        static void OnQueueTimeout(void *arg);
+
+        TenantSchedulerOptions _options;
+        fiber::Mutex _mutex;
+        std::map<std::string, Tenant *> _tenants;
+        // Tenants having queued requests, in round-robin order.
+        std::deque<Tenant *> _backlogged;
+        int64_t _total_weight;
+        int _concurrency;
+        int _nqueued;
+        std::string _var_prefix;
+    };
+
+} // namespace melon
@@ -0,0 +1,399 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#ifndef MUTIL_EPOCH_BUFFERED_DATA_H
+#define MUTIL_EPOCH_BUFFERED_DATA_H
+
+#include <deque>
+#include <vector>                                       // std::vector
+#include <pthread.h>
+#include <melon/utility/scoped_lock.h>
+#include <melon/utility/thread_local.h>
+#include <turbo/log/logging.h>
+#include <melon/utility/macros.h>
+#include <melon/utility/errno.h>
+#include <melon/utility/atomicops.h>
+
+namespace mutil {
+
+// An alternative to DoublyBufferedData with the same Read()/Modify() API,
+// based on epoch-based reclamation.
+//
+// Read(): Publish the global epoch in a thread-local slot, then load the
+// pointer to current instance. No locks, no loops, namely wait-free.
+//
+// Modify(): Copy current instance, modify the copy, publish it with an
+// atomic store and bump the global epoch. The replaced instance is retired
+// with the new epoch and deleted by later Modify() when every thread is
+// either not reading or reading in a newer epoch. Modify() never waits for
+// readers, while DoublyBufferedData::Modify() waits for every reading
+// thread to release its thread-local mutex, which stalls with many threads
+// and frequent modifications.
+//
+// The price is that each Modify() copies the whole instance and retired
+// instances live until no reader may see them, so this is suitable for
+// data which is moderately sized and updated often, e.g. servers of load
+// balancers under frequent naming updates.
+//
+// Differences from DoublyBufferedData:
+//  - fn in Modify() is called once with a copy of current instance rather
+//    than twice with both instances. Functions written for
+//    DoublyBufferedData work as well since the copy equals to the
+//    foreground instance.
+//  - Thread-local user data is not supported.
+//  - Like DoublyBufferedData<T, Void, false>, fiber must not be suspended
+//    while reading, otherwise the reading may end in another pthread.
+//    Suspending does not deadlock, but the ending thread's slot is wrong.
+template <typename T>
+class EpochBufferedData {
+    struct Slot;
+    typedef int SlotTLSId;
+public:
+    class ScopedPtr {
+    friend class EpochBufferedData;
+    public:
+        ScopedPtr() : _data(NULL), _slot(NULL) {}
+        ~ScopedPtr() {
+            if (_slot) {
+                EndRead(_slot);
+            }
+        }
+        const T* get() const { return _data; }
+        const T& operator*() const { return *_data; }
+        const T* operator->() const { return _data; }
+
+    private:
+        DISALLOW_COPY_AND_ASSIGN(ScopedPtr);
+        const T* _data;
+        Slot* _slot;
+    };
+
+    EpochBufferedData();
+    ~EpochBufferedData();
+
+    // Put current instance into ptr. The instance will not be deleted until
+    // ptr is destructed.
+    // This function is not blocked by Read() and Modify() in other threads.
+    // Returns 0 on success, -1 otherwise.
+    int Read(ScopedPtr* ptr);
+
+    // Modify a copy of current instance with fn(T&, args...) and publish it
+    // if fn returns non-zero. Modify() from different threads are exclusive
+    // from each other. Returns what fn returns.
+    template <typename Fn, typename... Args>
+    size_t Modify(Fn& fn, const Args&... args);
+
+    // fn(T& copy, const T& current, args...) is called once.
+    template <typename Fn, typename... Args>
+    size_t ModifyWithForeground(Fn& fn, const Args&... args);
+
+    // Number of replaced instances not deleted yet.
+    size_t retired_count() const;
+
+private:
+    struct MELON_CACHELINE_ALIGNMENT Slot {
+        Slot() : control(NULL), epoch(0), nesting(0) {}
+        ~Slot() {
+            if (control != NULL) {
+                control->RemoveSlot(this);
+            }
+        }
+        EpochBufferedData* control;
+        // Epoch when the outermost Read() began, 0 means not reading.
+        mutil::atomic<uint64_t> epoch;
+        // Only accessed by the owner thread.
+        int nesting;
+    };
+
+    struct Retired {
+        const T* data;
+        // The instance is not visible to readers in this epoch or later.
+        uint64_t epoch;
+    };
+
+    template <typename Fn>
+    size_t ModifyImpl(Fn& fn);
+
+    static void EndRead(Slot* s) {
+        if (--s->nesting == 0) {
+            s->epoch.store(0, mutil::memory_order_release);
+        }
+    }
+
+    Slot* AddSlot(Slot* s);
+    void RemoveSlot(Slot* s);
+    // Delete retired instances invisible to all readers.
+    // Caller must hold _modify_mutex.
+    void Reclaim();
+
+    static SlotTLSId key_create();
+    static void key_delete(SlotTLSId id);
+    static Slot* get_or_create_tls_slot(SlotTLSId id);
+    static void destroy_tls_slots();
+
+    mutil::atomic<const T*> _data;
+    mutil::atomic<uint64_t> _epoch;
+
+    // Sorted by epoch.
+    std::deque<Retired> _retired;
+
+    // Key to access thread-local slots.
+    SlotTLSId _slot_key;
+
+    // Slots of threads ever read this instance.
+    std::vector<Slot*> _slots;
+
+    // Sequence access to _slots.
+    mutable pthread_mutex_t _slots_mutex;
+
+    // Sequence modifications and access to _retired.
+    mutable pthread_mutex_t _modify_mutex;
+
+    // Thread-local slots are indexed by ids of instances instead of
+    // pthread_key_t which is limited by PTHREAD_KEYS_MAX.
+    static pthread_mutex_t _s_mutex;
+    static SlotTLSId _s_id;
+    static std::deque<SlotTLSId>* _s_free_ids;
+    static __thread std::vector<Slot*>* _s_tls_slots;
+};
+
+template <typename T>
+pthread_mutex_t EpochBufferedData<T>::_s_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+template <typename T>
+typename EpochBufferedData<T>::SlotTLSId EpochBufferedData<T>::_s_id = 0;
+
+template <typename T>
+std::deque<typename EpochBufferedData<T>::SlotTLSId>*
+        EpochBufferedData<T>::_s_free_ids = NULL;
+
+template <typename T>
+__thread std::vector<typename EpochBufferedData<T>::Slot*>*
+        EpochBufferedData<T>::_s_tls_slots = NULL;
+
+template <typename T>
+typename EpochBufferedData<T>::SlotTLSId EpochBufferedData<T>::key_create() {
+    MELON_SCOPED_LOCK(_s_mutex);
+    if (_s_free_ids != NULL && !_s_free_ids->empty()) {
+        const SlotTLSId id = _s_free_ids->back();
+        _s_free_ids->pop_back();
+        return id;
+    }
+    return _s_id++;
+}
+
+template <typename T>
+void EpochBufferedData<T>::key_delete(SlotTLSId id) {
+    MELON_SCOPED_LOCK(_s_mutex);
+    if (_s_free_ids == NULL) {
+        _s_free_ids = new std::deque<SlotTLSId>;
+    }
+    _s_free_ids->push_back(id);
+}
+
+template <typename T>
+typename EpochBufferedData<T>::Slot*
+EpochBufferedData<T>::get_or_create_tls_slot(SlotTLSId id) {
+    if (MELON_UNLIKELY(_s_tls_slots == NULL)) {
+        _s_tls_slots = new (std::nothrow) std::vector<Slot*>;
+        if (MELON_UNLIKELY(_s_tls_slots == NULL)) {
+            LOG(FATAL) << "Fail to create vector, " << berror();
+            return NULL;
+        }
+        mutil::thread_atexit(destroy_tls_slots);
+    }
+    if ((size_t)id >= _s_tls_slots->size()) {
+        // The 32ul avoid pointless small resizes.
+        _s_tls_slots->resize(std::max((size_t)id + 1, 32ul), NULL);
+    }
+    Slot*& s = (*_s_tls_slots)[id];
+    if (s == NULL) {
+        s = new (std::nothrow) Slot;
+    }
+    return s;
+}
+
+template <typename T>
+void EpochBufferedData<T>::destroy_tls_slots() {
+    if (!_s_tls_slots) {
+        return;
+    }
+    for (size_t i = 0; i < _s_tls_slots->size(); ++i) {
+        delete (*_s_tls_slots)[i];
+    }
+    delete _s_tls_slots;
+    _s_tls_slots = NULL;
+}
+
+// Called when thread reads this instance for the first time.
+template <typename T>
+typename EpochBufferedData<T>::Slot* EpochBufferedData<T>::AddSlot(Slot* s) {
+    if (NULL == s) {
+        return NULL;
+    }
+    if (s->control == this) {
+        return s;
+    }
+    if (s->control != NULL) {
+        LOG(FATAL) << "Get slot from tls but control != this";
+        return NULL;
+    }
+    try {
+        s->control = this;
+        MELON_SCOPED_LOCK(_slots_mutex);
+        _slots.push_back(s);
+    } catch (std::exception& e) {
+        return NULL;
+    }
+    return s;
+}
+
+// Called when thread quits.
+template <typename T>
+void EpochBufferedData<T>::RemoveSlot(Slot* s) {
+    MELON_SCOPED_LOCK(_slots_mutex);
+    for (size_t i = 0; i < _slots.size(); ++i) {
+        if (_slots[i] == s) {
+            _slots[i] = _slots.back();
+            _slots.pop_back();
+            return;
+        }
+    }
+}
+
+template <typename T>
+EpochBufferedData<T>::EpochBufferedData()
+    : _data(new T())
+    , _epoch(1)
+    , _slot_key(key_create()) {
+    _slots.reserve(64);
+    pthread_mutex_init(&_slots_mutex, NULL);
+    pthread_mutex_init(&_modify_mutex, NULL);
+}
+
+template <typename T>
+EpochBufferedData<T>::~EpochBufferedData() {
+    // User is responsible for synchronizations between Read()/Modify() and
+    // this function.
+    {
+        MELON_SCOPED_LOCK(_slots_mutex);
+        for (size_t i = 0; i < _slots.size(); ++i) {
+            _slots[i]->control = NULL;  // hack: disable removal.
+        }
+        _slots.clear();
+    }
+    key_delete(_slot_key);
+    _slot_key = -1;
+    for (size_t i = 0; i < _retired.size(); ++i) {
+        delete _retired[i].data;
+    }
+    _retired.clear();
+    delete _data.load(mutil::memory_order_relaxed);
+    pthread_mutex_destroy(&_modify_mutex);
+    pthread_mutex_destroy(&_slots_mutex);
+}
+
+template <typename T>
+int EpochBufferedData<T>::Read(ScopedPtr* ptr) {
+    Slot* s = AddSlot(get_or_create_tls_slot(_slot_key));
+    if (MELON_UNLIKELY(s == NULL)) {
+        return -1;
+    }
+    if (s->nesting++ == 0) {
+        // The seq_cst store and the seq_cst load below pair with the ones
+        // in ModifyImpl() and Reclaim(): either Reclaim() sees this epoch,
+        // or this thread sees the instance published before Reclaim().
+        s->epoch.store(_epoch.load(mutil::memory_order_acquire),
+                       mutil::memory_order_seq_cst);
+    }
+    ptr->_data = _data.load(mutil::memory_order_seq_cst);
+    ptr->_slot = s;
+    return 0;
+}
+
+template <typename T>
+template <typename Fn>
+size_t EpochBufferedData<T>::ModifyImpl(Fn& fn) {
+    MELON_SCOPED_LOCK(_modify_mutex);
+    const T* old_data = _data.load(mutil::memory_order_relaxed);
+    T* new_data = new (std::nothrow) T(*old_data);
+    if (new_data == NULL) {
+        return 0;
+    }
+    const size_t ret = fn(*new_data, *old_data);
+    if (!ret) {
+        delete new_data;
+        return 0;
+    }
+    _data.store(new_data, mutil::memory_order_seq_cst);
+    // Readers beginning in the new epoch see new_data.
+    Retired r = { old_data, _epoch.fetch_add(1, mutil::memory_order_seq_cst) + 1 };
+    _retired.push_back(r);
+    Reclaim();
+    return ret;
+}
+
+template <typename T>
+void EpochBufferedData<T>::Reclaim() {
+    if (_retired.empty()) {
+        return;
+    }
+    uint64_t min_epoch = (uint64_t)-1;
+    {
+        MELON_SCOPED_LOCK(_slots_mutex);
+        for (size_t i = 0; i < _slots.size(); ++i) {
+            const uint64_t e = _slots[i]->epoch.load(mutil::memory_order_seq_cst);
+            if (e != 0 && e < min_epoch) {
+                min_epoch = e;
+            }
+        }
+    }
+    while (!_retired.empty() && _retired.front().epoch <= min_epoch) {
+        delete _retired.front().data;
+        _retired.pop_front();
+    }
+}
+
+template <typename T>
+size_t EpochBufferedData<T>::retired_count() const {
+    MELON_SCOPED_LOCK(_modify_mutex);
+    return _retired.size();
+}
+
+template <typename T>
+template <typename Fn, typename... Args>
+size_t EpochBufferedData<T>::Modify(Fn& fn, const Args&... args) {
+    auto c = [&fn, &args...](T& bg, const T&) -> size_t {
+        return fn(bg, args...);
+    };
+    return ModifyImpl(c);
+}
+
+template <typename T>
+template <typename Fn, typename... Args>
+size_t EpochBufferedData<T>::ModifyWithForeground(Fn& fn, const Args&... args) {
+    auto c = [&fn, &args...](T& bg, const T& fg) -> size_t {
+        return fn(bg, fg, args...);
+    };
+    return ModifyImpl(c);
+}
+
+}  // namespace mutil
+
+#endif  // MUTIL_EPOCH_BUFFERED_DATA_H
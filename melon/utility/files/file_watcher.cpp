@@ -23,13 +23,189 @@
 #include <sys/stat.h>
 #include <melon/utility/build_config.h>              // OS_MACOSX
 #include <melon/utility/files/file_watcher.h>
+#if defined(OS_LINUX)
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <map>
+#include <vector>
+#include <turbo/log/logging.h>
+#include <melon/utility/errno.h>
+#include <melon/utility/files/file_path.h>
+#include <melon/utility/memory/singleton_on_pthread_once.h>
+#endif
 
 namespace mutil {
 
 static const FileWatcher::Timestamp NON_EXIST_TS =
     static_cast<FileWatcher::Timestamp>(-1);
 
-FileWatcher::FileWatcher() : _last_ts(NON_EXIST_TS) {
+#if defined(OS_LINUX)
+// Watch directories of files rather than the files, otherwise files
+// replaced by rename(2), which is how most tools update files atomically,
+// are not tracked anymore. Modifications in the middle of writing are not
+// notified to avoid reading partial files.
+static const uint32_t INOTIFY_MASK = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+// Owns the inotify fd shared by all FileWatchers in the process.
+class InotifyDispatcher {
+public:
+    InotifyDispatcher() : _fd(-1) {
+        pthread_mutex_init(&_mutex, NULL);
+        _fd = inotify_init1(IN_CLOEXEC);
+        if (_fd < 0) {
+            PLOG(WARNING) << "Fail to create inotify fd";
+            return;
+        }
+        pthread_t tid;
+        const int rc = pthread_create(&tid, NULL, RunThis, this);
+        if (rc != 0) {
+            LOG(WARNING) << "Fail to create thread: " << berror(rc);
+            close(_fd);
+            _fd = -1;
+            return;
+        }
+        pthread_detach(tid);
+    }
+
+    // Returns the watch descriptor, -1 on error.
+    int Add(const std::string& path, FileWatcher* watcher,
+            void (*on_change)(void*), void* arg) {
+        if (_fd < 0) {
+            return -1;
+        }
+        const FilePath file_path(path);
+        Entry e = { file_path.BaseName().value(), watcher, on_change, arg };
+        pthread_mutex_lock(&_mutex);
+        // Directories are watched with the same mask, so that watchers of
+        // files in one directory share the descriptor.
+        const int wd = inotify_add_watch(
+            _fd, file_path.DirName().value().c_str(), INOTIFY_MASK);
+        if (wd >= 0) {
+            _entries[wd].push_back(e);
+        }
+        pthread_mutex_unlock(&_mutex);
+        if (wd < 0) {
+            PLOG(WARNING) << "Fail to watch directory of " << path;
+        }
+        return wd;
+    }
+
+    void Remove(int wd, FileWatcher* watcher) {
+        pthread_mutex_lock(&_mutex);
+        std::map<int, std::vector<Entry> >::iterator it = _entries.find(wd);
+        if (it != _entries.end()) {
+            std::vector<Entry>& v = it->second;
+            for (size_t i = 0; i < v.size(); ++i) {
+                if (v[i].watcher == watcher) {
+                    v[i] = v.back();
+                    v.pop_back();
+                    break;
+                }
+            }
+            if (v.empty()) {
+                inotify_rm_watch(_fd, wd);
+                _entries.erase(it);
+            }
+        }
+        pthread_mutex_unlock(&_mutex);
+    }
+
+private:
+    struct Entry {
+        std::string name;
+        FileWatcher* watcher;
+        void (*on_change)(void*);
+        void* arg;
+    };
+
+    static void* RunThis(void* arg) {
+        static_cast<InotifyDispatcher*>(arg)->Run();
+        return NULL;
+    }
+
+    void Run() {
+        char buf[16384]
+            __attribute__((aligned(__alignof__(struct inotify_event))));
+        for (;;) {
+            const ssize_t nr = read(_fd, buf, sizeof(buf));
+            if (nr < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                PLOG(ERROR) << "Fail to read inotify fd";
+                return;
+            }
+            for (char* p = buf; p < buf + nr;) {
+                const struct inotify_event* ev =
+                    reinterpret_cast<const struct inotify_event*>(p);
+                p += sizeof(struct inotify_event) + ev->len;
+                // Callbacks run inside the lock so that they're not running
+                // after Remove() returns.
+                pthread_mutex_lock(&_mutex);
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    // Events are lost, notify everyone.
+                    for (std::map<int, std::vector<Entry> >::iterator
+                             it = _entries.begin(); it != _entries.end(); ++it) {
+                        Notify(it->second, NULL);
+                    }
+                } else {
+                    std::map<int, std::vector<Entry> >::iterator
+                        it = _entries.find(ev->wd);
+                    if (it != _entries.end()) {
+                        // Empty name means the directory itself changed.
+                        Notify(it->second, ev->len ? ev->name : NULL);
+                    }
+                }
+                pthread_mutex_unlock(&_mutex);
+            }
+        }
+    }
+
+    static void Notify(const std::vector<Entry>& v, const char* name) {
+        for (size_t i = 0; i < v.size(); ++i) {
+            if (name == NULL || v[i].name == name) {
+                v[i].on_change(v[i].arg);
+            }
+        }
+    }
+
+    int _fd;
+    pthread_mutex_t _mutex;
+    std::map<int, std::vector<Entry> > _entries;
+};
+#endif  // OS_LINUX
+
+FileWatcher::FileWatcher() : _last_ts(NON_EXIST_TS), _wd(-1) {
+}
+
+FileWatcher::~FileWatcher() {
+    unwatch();
+}
+
+int FileWatcher::watch(void (*on_change)(void*), void* arg) {
+    if (_file_path.empty() || on_change == NULL || _wd >= 0) {
+        return -1;
+    }
+#if defined(OS_LINUX)
+    _wd = get_leaky_singleton<InotifyDispatcher>()->Add(
+        _file_path, this, on_change, arg);
+    return _wd >= 0 ? 0 : -1;
+#else
+    (void)arg;
+    return -1;
+#endif
+}
+
+void FileWatcher::unwatch() {
+#if defined(OS_LINUX)
+    if (_wd >= 0) {
+        get_leaky_singleton<InotifyDispatcher>()->Remove(_wd, this);
+        _wd = -1;
+    }
+#endif
 }
 
 int FileWatcher::init(const char* file_path) {
@@ -36,6 +36,9 @@
 //       // the file is created or updated 
 //       ......
 //   }
+//
+// Instead of calling check_and_consume() periodically, users may wait for
+// notifications from watch() which is based on inotify(7) on linux.
 
 namespace mutil {
 class FileWatcher {
@@ -50,6 +53,7 @@ public:
     typedef int64_t Timestamp;
     
     FileWatcher();
+    ~FileWatcher();
 
     // Watch file at `file_path', must be called before calling other methods.
     // Returns 0 on success, -1 otherwise.
@@ -76,11 +80,28 @@ public:
     // Get path of watched file
     const char* filepath() const { return _file_path.c_str(); }
 
+    // Call `on_change(arg)' when the watched file may be created, written,
+    // renamed or deleted. Call check_and_consume() to know the change, the
+    // callback may be called spuriously.
+    // All watchers share one inotify fd of the process, whose events are
+    // dispatched by a background thread which runs the callback, so the
+    // callback should be quick and not call methods of this watcher.
+    // Returns 0 on success, -1 when notifications are unavailable (e.g. not
+    // on linux, or the directory of the file does not exist), in which case
+    // users should poll check_and_consume().
+    int watch(void (*on_change)(void*), void* arg);
+
+    // Stop the notifications set by watch(). The callback is not running
+    // and never called after this method returns. Called in dtor.
+    void unwatch();
+
 private:
     Change check(Timestamp* new_timestamp) const;
 
     std::string _file_path;
     Timestamp _last_ts;    
+    // inotify watch descriptor of the directory of _file_path.
+    int _wd;
 };
 }  // namespace mutil
 
@@ -99,3 +99,27 @@ TEST(BallotTest, joint_consensus_different_conf) {
     bl.grant(peer4);
     ASSERT_TRUE(bl.granted());
 }
+
+TEST(BallotTest, learner) {
+    melon::raft::PeerId peer1("127.0.0.1:1");
+    melon::raft::PeerId peer2("127.0.0.1:2");
+    melon::raft::PeerId peer3("127.0.0.1:3:0:2");
+    melon::raft::PeerId peer4("127.0.0.1:4:0:2");
+    ASSERT_TRUE(peer3.is_learner());
+    melon::raft::Configuration conf;
+    conf.add_peer(peer1);
+    conf.add_peer(peer2);
+    conf.add_peer(peer3);
+    conf.add_peer(peer4);
+    melon::raft::Ballot bl;
+    ASSERT_EQ(0, bl.init(conf, NULL));
+    // Learners don't count toward the quorum.
+    ASSERT_EQ(2, bl._quorum);
+    bl.grant(peer3);
+    bl.grant(peer4);
+    ASSERT_EQ(2, bl._quorum);
+    bl.grant(peer1);
+    ASSERT_FALSE(bl.granted());
+    bl.grant(peer2);
+    ASSERT_TRUE(bl.granted());
+}
@@ -115,6 +115,51 @@ TEST_F(CliTest, add_and_remove_peer) {
     ASSERT_TRUE(st.ok()) << st;
 }
 
+TEST_F(CliTest, add_promote_and_remove_learner) {
+    RaftNode node1;
+    ASSERT_EQ(0, node1.start(9500, true));
+    usleep(1000 * 1000);
+    mutil::Status st;
+    melon::raft::Configuration conf;
+    melon::raft::PeerId peer1 = node1.peer_id();
+    conf.add_peer(peer1);
+    melon::raft::PeerId peer2("127.0.0.1:9501");
+    RaftNode node2;
+    ASSERT_EQ(0, node2.start(peer2.addr.port, false));
+    st = melon::raft::cli::add_learner("test", conf, peer2,
+                                       melon::raft::cli::CliOptions());
+    ASSERT_TRUE(st.ok()) << st;
+    std::vector<melon::raft::PeerId> peers;
+    ASSERT_TRUE(node1._node->list_peers(&peers).ok());
+    ASSERT_EQ(2u, peers.size());
+    melon::raft::Configuration current(peers);
+    ASSERT_TRUE(current.is_learner(peer2));
+    ASSERT_EQ(1u, current.voter_count());
+    // Leadership is never transferred to a learner.
+    ASSERT_NE(0, node1._node->transfer_leadership_to(peer2));
+
+    st = melon::raft::cli::promote_learner("test", conf, peer2,
+                                           melon::raft::cli::CliOptions());
+    ASSERT_TRUE(st.ok()) << st;
+    ASSERT_TRUE(node1._node->list_peers(&peers).ok());
+    current = peers;
+    ASSERT_TRUE(current.is_voter(peer2));
+    ASSERT_EQ(2u, current.voter_count());
+
+    melon::raft::PeerId peer3("127.0.0.1:9502");
+    RaftNode node3;
+    ASSERT_EQ(0, node3.start(peer3.addr.port, false));
+    conf.add_peer(peer2);
+    st = melon::raft::cli::add_learner("test", conf, peer3,
+                                       melon::raft::cli::CliOptions());
+    ASSERT_TRUE(st.ok()) << st;
+    st = melon::raft::cli::remove_learner("test", conf, peer3,
+                                          melon::raft::cli::CliOptions());
+    ASSERT_TRUE(st.ok()) << st;
+    ASSERT_TRUE(node1._node->list_peers(&peers).ok());
+    ASSERT_EQ(2u, peers.size());
+}
+
 TEST_F(CliTest, set_peer) {
     RaftNode node1;
     ASSERT_EQ(0, node1.start(9500, false));
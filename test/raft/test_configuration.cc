@@ -50,7 +50,11 @@ TEST_F(TestUsageSuits, PeerId) {
     LOG(INFO) << "id:" << id1;
     ASSERT_TRUE(id1.is_witness());
 
-    ASSERT_EQ(-1, id1.parse("1.1.1.1:1000:0:2"));
+    ASSERT_EQ(0, id1.parse("1.1.1.1:1000:0:2"));
+    ASSERT_TRUE(id1.is_learner());
+    ASSERT_FALSE(id1.is_witness());
+
+    ASSERT_EQ(-1, id1.parse("1.1.1.1:1000:0:3"));
 
     ASSERT_EQ(0, id1.parse("1.1.1.1:1000"));
     LOG(INFO) << "id:" << id1.to_string();
@@ -100,6 +104,40 @@ TEST_F(TestUsageSuits, Configuration) {
     ASSERT_EQ(peer_vector.size(), 3);
 }
 
+TEST_F(TestUsageSuits, ConfigurationLearner) {
+    melon::raft::Configuration conf;
+    ASSERT_EQ(0, conf.parse_from("1.1.1.1:1000:0,1.1.1.1:1001:0,1.1.1.1:1002:0:2"));
+    ASSERT_EQ(3u, conf.size());
+    ASSERT_EQ(2u, conf.voter_count());
+    ASSERT_TRUE(conf.is_learner(melon::raft::PeerId("1.1.1.1:1002:0")));
+    ASSERT_FALSE(conf.is_voter(melon::raft::PeerId("1.1.1.1:1002:0")));
+    ASSERT_TRUE(conf.is_voter(melon::raft::PeerId("1.1.1.1:1000:0")));
+    ASSERT_FALSE(conf.is_voter(melon::raft::PeerId("1.1.1.1:2000:0")));
+    std::vector<melon::raft::PeerId> voters;
+    conf.list_voters(&voters);
+    ASSERT_EQ(2u, voters.size());
+
+    // Promoting the learner is a change of the configuration.
+    melon::raft::Configuration promoted = conf;
+    promoted.remove_peer(melon::raft::PeerId("1.1.1.1:1002:0"));
+    promoted.add_peer(melon::raft::PeerId("1.1.1.1:1002:0:0"));
+    ASSERT_FALSE(promoted.equals(conf));
+    ASSERT_EQ(3u, promoted.voter_count());
+    melon::raft::Configuration adding;
+    melon::raft::Configuration removing;
+    promoted.diffs(conf, &adding, &removing);
+    ASSERT_TRUE(adding.empty());
+    ASSERT_TRUE(removing.empty());
+
+    melon::raft::ConfigurationEntry entry;
+    entry.conf = promoted;
+    entry.old_conf = conf;
+    ASSERT_TRUE(entry.is_voter(melon::raft::PeerId("1.1.1.1:1002:0")));
+    entry.conf = conf;
+    entry.old_conf.reset();
+    ASSERT_FALSE(entry.is_voter(melon::raft::PeerId("1.1.1.1:1002:0")));
+}
+
 TEST_F(TestUsageSuits, ConfigurationManager) {
     melon::raft::ConfigurationManager conf_manager;
 
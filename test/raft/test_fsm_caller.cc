@@ -286,3 +286,104 @@ TEST_F(FSMCallerTest, snapshot) {
     ASSERT_EQ(1, load_snapshot_done._start_times);
 }
 
+
+class PartitionedStateMachine : public melon::raft::StateMachine {
+public:
+    PartitionedStateMachine() : _napplied(0), _inflight(0), _max_inflight(0) {
+        for (size_t i = 0; i < ARRAY_SIZE(_next_seq); ++i) {
+            _next_seq[i] = 0;
+        }
+    }
+    // data is "${key}:${seq}" or "barrier"
+    bool get_apply_key(const mutil::IOBuf& data, uint64_t* key) {
+        const std::string s = data.to_string();
+        if (s == "barrier") {
+            return false;
+        }
+        *key = strtoull(s.c_str(), NULL, 10);
+        return true;
+    }
+    void on_apply(melon::raft::Iterator& iter) {
+        const int n = _inflight.fetch_add(1) + 1;
+        int max = _max_inflight.load();
+        while (n > max && !_max_inflight.compare_exchange_weak(max, n)) {}
+        for (; iter.valid(); iter.next()) {
+            const std::string s = iter.data().to_string();
+            if (s == "barrier") {
+                // All the tasks before the barrier are applied
+                EXPECT_EQ(iter.index() - 1, _napplied.load());
+            } else {
+                uint64_t key = 0;
+                uint64_t seq = 0;
+                ASSERT_EQ(2, sscanf(s.c_str(), "%" PRIu64 ":%" PRIu64, &key, &seq));
+                EXPECT_EQ(_next_seq[key]++, seq);
+                fiber_usleep(10);
+            }
+            _napplied.fetch_add(1);
+        }
+        _inflight.fetch_sub(1);
+    }
+    uint64_t _next_seq[8];
+    mutil::atomic<int64_t> _napplied;
+    mutil::atomic<int> _inflight;
+    mutil::atomic<int> _max_inflight;
+};
+
+TEST_F(FSMCallerTest, partitioned_apply) {
+    system("rm -rf ./data");
+    scoped_ptr<melon::raft::ConfigurationManager> cm(
+                                new melon::raft::ConfigurationManager);
+    scoped_ptr<melon::raft::SegmentLogStorage> storage(
+                                new melon::raft::SegmentLogStorage("./data"));
+    scoped_ptr<melon::raft::LogManager> lm(new melon::raft::LogManager());
+    melon::raft::LogManagerOptions log_opt;
+    log_opt.log_storage = storage.get();
+    log_opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(log_opt));
+
+    melon::raft::ClosureQueue cq(false);
+    PartitionedStateMachine fsm;
+    melon::raft::FSMCallerOptions opt;
+    opt.log_manager = lm.get();
+    opt.after_shutdown = NULL;
+    opt.fsm = &fsm;
+    opt.closure_queue = &cq;
+    opt.apply_concurrency = 4;
+    melon::raft::FSMCaller caller;
+    ASSERT_EQ(0, caller.init(opt));
+
+    const size_t N = 1000;
+    uint64_t seqs[8] = {0};
+    std::vector<melon::raft::LogEntry*> entries;
+    for (size_t i = 0; i < N; ++i) {
+        melon::raft::LogEntry* entry = new melon::raft::LogEntry;
+        entry->AddRef();
+        entry->type = melon::raft::ENTRY_TYPE_DATA;
+        std::string buf;
+        if (i % 100 == 99) {
+            buf = "barrier";
+        } else {
+            const uint64_t key = i % 8;
+            mutil::string_printf(&buf, "%" PRIu64 ":%" PRIu64, key, seqs[key]++);
+        }
+        entry->data.append(buf);
+        entry->id.index = i + 1;
+        entry->id.term = 1;
+        entries.push_back(entry);
+    }
+    SyncClosure c;
+    lm->append_entries(&entries, &c);
+    c.join();
+    ASSERT_TRUE(c.status().ok()) << c.status();
+    ASSERT_EQ(0, caller.on_committed(N));
+    while (caller.last_applied_index() < (int64_t)N) {
+        fiber_usleep(1000);
+    }
+    ASSERT_EQ(0, caller.shutdown());
+    caller.join();
+    ASSERT_EQ((int64_t)N, fsm._napplied.load());
+    for (size_t i = 0; i < 8; ++i) {
+        ASSERT_EQ(seqs[i], fsm._next_seq[i]);
+    }
+    ASSERT_GT(fsm._max_inflight.load(), 1);
+}
@@ -1087,6 +1087,53 @@ TEST_F(LogStorageTest, reboot_with_checksum_type_changed) {
     delete storage;
 }
 
+TEST_F(LogStorageTest, reboot_with_compress_type_changed) {
+    system("rm -rf ./data");
+    const int32_t saved_compress_type = melon::raft::FLAGS_raft_log_compress_type;
+    melon::raft::ConfigurationManager* configuration_manager = new melon::raft::ConfigurationManager;
+    // Entries of each round are written with a different compress type,
+    // odd entries are too short to be compressed.
+    const int compress_types[] = { 0, 1, 2 };
+    for (size_t round = 0; round < ARRAY_SIZE(compress_types); ++round) {
+        melon::raft::FLAGS_raft_log_compress_type = compress_types[round];
+        melon::raft::SegmentLogStorage* storage = new melon::raft::SegmentLogStorage("./data");
+        ASSERT_EQ(0, storage->init(configuration_manager));
+        for (int i = round * 10; i < (int)(round + 1) * 10; i++) {
+            melon::raft::LogEntry* entry = new melon::raft::LogEntry();
+            entry->type = melon::raft::ENTRY_TYPE_DATA;
+            entry->id.term = 1;
+            entry->id.index = i + 1;
+            const std::string data(i % 2 ? 16 : 4096, 'a' + i % 26);
+            entry->data.append(data);
+            ASSERT_EQ(0, storage->append_entry(entry));
+            entry->Release();
+        }
+        delete storage;
+    }
+    melon::raft::FLAGS_raft_log_compress_type = saved_compress_type;
+
+    melon::raft::SegmentLogStorage* storage = new melon::raft::SegmentLogStorage("./data");
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    ASSERT_EQ(30, storage->last_log_index());
+    for (int index = 1; index <= 30; ++index) {
+        melon::raft::LogEntry* entry = storage->get_entry(index);
+        ASSERT_TRUE(entry != NULL);
+        ASSERT_EQ(entry->id.term, 1);
+        ASSERT_EQ(entry->type, melon::raft::ENTRY_TYPE_DATA);
+        ASSERT_EQ(entry->id.index, index);
+        const int i = index - 1;
+        ASSERT_EQ(std::string(i % 2 ? 16 : 4096, 'a' + i % 26),
+                  entry->data.to_string());
+        entry->Release();
+    }
+    // Only the 5 large entries of the first round take their raw size.
+    ASSERT_TRUE(storage->_open_segment != NULL);
+    ASSERT_LT(storage->_open_segment->bytes(), 6 * 4096);
+
+    delete storage;
+    delete configuration_manager;
+}
+
 TEST_F(LogStorageTest, joint_configuration) {
     system("rm -rf ./data");
     melon::raft::ConfigurationManager cm;
@@ -1282,3 +1329,266 @@ TEST_F(LogStorageTest, append_close_load_append_with_io_metric) {
     delete storage;
     delete configuration_manager;
 }
+
+static void append_hello_entries(melon::raft::LogStorage* storage,
+                                 int64_t first_index, int64_t last_index,
+                                 int64_t term = 1) {
+    for (int64_t index = first_index; index <= last_index; index += 5) {
+        std::vector<melon::raft::LogEntry*> entries;
+        for (int64_t i = index; i < index + 5 && i <= last_index; ++i) {
+            melon::raft::LogEntry* entry = new melon::raft::LogEntry();
+            entry->type = melon::raft::ENTRY_TYPE_DATA;
+            entry->id.term = term;
+            entry->id.index = i;
+            char data_buf[128];
+            snprintf(data_buf, sizeof(data_buf), "hello, world: %" PRId64, i);
+            entry->data.append(data_buf);
+            entries.push_back(entry);
+        }
+        ASSERT_EQ((int)entries.size(), storage->append_entries(entries, NULL));
+        for (size_t j = 0; j < entries.size(); j++) {
+            entries[j]->Release();
+        }
+    }
+}
+
+static void check_hello_entries(melon::raft::LogStorage* storage,
+                                int64_t first_index, int64_t last_index) {
+    ASSERT_EQ(first_index, storage->first_log_index());
+    ASSERT_EQ(last_index, storage->last_log_index());
+    for (int64_t index = first_index; index <= last_index; ++index) {
+        melon::raft::LogEntry* entry = storage->get_entry(index);
+        ASSERT_TRUE(entry != NULL) << "index=" << index;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello, world: %" PRId64, index);
+        ASSERT_EQ(data_buf, entry->data.to_string());
+        entry->Release();
+    }
+}
+
+static int count_files(const char* path, const char* prefix) {
+    int n = 0;
+    mutil::DirReaderPosix dir_reader(path);
+    while (dir_reader.Next()) {
+        if (strncmp(dir_reader.name(), prefix, strlen(prefix)) == 0) {
+            ++n;
+        }
+    }
+    return n;
+}
+
+TEST_F(LogStorageTest, direct_io_append_load_and_recycle) {
+    ::system("rm -rf data");
+    const int32_t saved_max_segment_size = melon::raft::FLAGS_raft_max_segment_size;
+    melon::raft::FLAGS_raft_max_segment_size = 64 * 1024;
+    melon::raft::FLAGS_raft_segment_direct_io = true;
+    melon::raft::ConfigurationManager* configuration_manager = new melon::raft::ConfigurationManager;
+    melon::raft::SegmentLogStorage* storage = new melon::raft::SegmentLogStorage("./data");
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    append_hello_entries(storage, 1, 10000);
+    check_hello_entries(storage, 1, 10000);
+    ASSERT_GT(storage->segments().size(), 2u);
+    // The open segment is preallocated
+    ASSERT_GE(file_size(("./data/" + storage->_open_segment->file_name()).c_str()),
+              64 * 1024);
+    delete storage;
+
+    storage = new melon::raft::SegmentLogStorage("./data");
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    check_hello_entries(storage, 1, 10000);
+
+    // Removed segments are kept for reuse
+    ASSERT_EQ(0, storage->truncate_prefix(5000));
+    ASSERT_EQ(melon::raft::FLAGS_raft_segment_recycle_num,
+              count_files("./data", "log_recycled_"));
+    int64_t next_index = 10001;
+    while (count_files("./data", "log_recycled_") ==
+           melon::raft::FLAGS_raft_segment_recycle_num) {
+        append_hello_entries(storage, next_index, next_index);
+        ++next_index;
+    }
+    // The reused file has nothing but zeros after the new entries and their
+    // padding, so that old entries can't be loaded even if a write is torn.
+    {
+        const std::string reused_path = "./data/" + storage->_open_segment->file_name();
+        const int64_t size = file_size(reused_path.c_str());
+        const int64_t end = storage->_open_segment->_wbuf_offset;
+        ASSERT_EQ(0, end % 4096);
+        ASSERT_GT(size, end);
+        std::string content(size - end, 'x');
+        int fd = ::open(reused_path.c_str(), O_RDONLY);
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ((ssize_t)content.size(), ::pread(fd, &content[0], content.size(), end));
+        ::close(fd);
+        ASSERT_EQ(std::string(content.size(), '\0'), content);
+    }
+    append_hello_entries(storage, next_index, 20000);
+    ASSERT_LT(count_files("./data", "log_recycled_"),
+              melon::raft::FLAGS_raft_segment_recycle_num);
+    const int64_t first_index = storage->first_log_index();
+    check_hello_entries(storage, first_index, 20000);
+
+    // Rewrite the tail in the middle of a block
+    ASSERT_EQ(0, storage->truncate_suffix(19990));
+    append_hello_entries(storage, 19991, 20000);
+    check_hello_entries(storage, first_index, 20000);
+    delete storage;
+
+    storage = new melon::raft::SegmentLogStorage("./data");
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    check_hello_entries(storage, first_index, 20000);
+    std::string open_path = "./data/" + storage->_open_segment->file_name();
+    const int64_t last_offset = storage->_open_segment->_offset_and_term.back().first;
+    delete storage;
+
+    // A partially written entry followed by zeros is dropped on loading
+    int fd = ::open(open_path.c_str(), O_RDWR);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(4, ::pwrite(fd, "\0\0\0\0", 4, last_offset + 24));
+    ::close(fd);
+    storage = new melon::raft::SegmentLogStorage("./data");
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    check_hello_entries(storage, first_index, 19999);
+    append_hello_entries(storage, 20000, 20010);
+    check_hello_entries(storage, first_index, 20010);
+    delete storage;
+
+    // Segments written with direct io can be read without it
+    melon::raft::FLAGS_raft_segment_direct_io = false;
+    storage = new melon::raft::SegmentLogStorage("./data");
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    check_hello_entries(storage, first_index, 20010);
+    append_hello_entries(storage, 20011, 20020);
+    check_hello_entries(storage, first_index, 20020);
+    ASSERT_EQ(0, count_files("./data", "log_recycled_"));
+    delete storage;
+
+    delete configuration_manager;
+    melon::raft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+
+static std::string read_file_prefix(const std::string& path, int64_t len) {
+    std::string content(len, '\0');
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return std::string();
+    }
+    const ssize_t n = ::pread(fd, &content[0], len, 0);
+    ::close(fd);
+    content.resize(n < 0 ? 0 : n);
+    return content;
+}
+
+TEST_F(LogStorageTest, direct_io_never_rewrites_synced_blocks) {
+    ::system("rm -rf data");
+    melon::raft::FLAGS_raft_segment_direct_io = true;
+    melon::raft::ConfigurationManager* configuration_manager = new melon::raft::ConfigurationManager;
+    melon::raft::SegmentLogStorage* storage = new melon::raft::SegmentLogStorage("./data");
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    const std::string path = "./data/" + storage->_open_segment->file_name();
+
+    // Each batch starts from a new block and the blocks written by the
+    // previous batches stay the same
+    append_hello_entries(storage, 1, 3);
+    for (int64_t index = 4; index < 100; index += 3) {
+        const int64_t synced = storage->_open_segment->_wbuf_offset;
+        const std::string before = read_file_prefix(path, synced);
+        ASSERT_EQ(synced, (int64_t)before.size());
+        append_hello_entries(storage, index, index + 2);
+        const int64_t offset =
+                storage->_open_segment->_offset_and_term[index - 1].first;
+        ASSERT_EQ(synced, offset);
+        ASSERT_EQ(0, offset % 4096);
+        ASSERT_EQ(before, read_file_prefix(path, synced));
+    }
+    check_hello_entries(storage, 1, 99);
+    const int64_t lost_offset = storage->_open_segment->_offset_and_term[96].first;
+    delete storage;
+
+    // The first block of the last write is lost. Entries behind it are
+    // dropped on loading instead of being taken as the following indexes.
+    char zero_block[4096] = {0};
+    int fd = ::open(path.c_str(), O_RDWR);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(4096, ::pwrite(fd, zero_block, sizeof(zero_block), lost_offset));
+    ::close(fd);
+    storage = new melon::raft::SegmentLogStorage("./data");
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    ASSERT_EQ(96, storage->last_log_index());
+    check_hello_entries(storage, 1, 96);
+    append_hello_entries(storage, 97, 101);
+    check_hello_entries(storage, 1, 101);
+    delete storage;
+
+    // Reload after a truncation in the middle of a block
+    storage = new melon::raft::SegmentLogStorage("./data");
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    ASSERT_EQ(0, storage->truncate_suffix(50));
+    append_hello_entries(storage, 51, 60);
+    delete storage;
+    storage = new melon::raft::SegmentLogStorage("./data");
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    ASSERT_EQ(60, storage->last_log_index());
+    check_hello_entries(storage, 1, 60);
+    delete storage;
+
+    delete configuration_manager;
+    melon::raft::FLAGS_raft_segment_direct_io = false;
+}
+
+// Not a correctness test, prints percentiles of the latency of appending
+// batches of entries with fsync, through page cache and with direct io.
+TEST_F(LogStorageTest, append_latency_perf) {
+    const bool saved_sync = melon::raft::FLAGS_raft_sync;
+    const int32_t saved_max_segment_size = melon::raft::FLAGS_raft_max_segment_size;
+    melon::raft::FLAGS_raft_sync = true;
+    melon::raft::FLAGS_raft_max_segment_size = 1024 * 1024;
+    const int kBatchCount = 2000;
+    const int kBatchSize = 8;
+    const std::string data(512, 'x');
+    for (int direct_io = 0; direct_io < 2; ++direct_io) {
+        ::system("rm -rf data");
+        melon::raft::FLAGS_raft_segment_direct_io = direct_io;
+        melon::raft::ConfigurationManager configuration_manager;
+        melon::raft::SegmentLogStorage* storage = new melon::raft::SegmentLogStorage("./data");
+        ASSERT_EQ(0, storage->init(&configuration_manager));
+        std::vector<int64_t> latencies;
+        latencies.reserve(kBatchCount);
+        int64_t index = 1;
+        for (int i = 0; i < kBatchCount; ++i) {
+            std::vector<melon::raft::LogEntry*> entries;
+            for (int j = 0; j < kBatchSize; ++j) {
+                melon::raft::LogEntry* entry = new melon::raft::LogEntry();
+                entry->type = melon::raft::ENTRY_TYPE_DATA;
+                entry->id.term = 1;
+                entry->id.index = index++;
+                entry->data.append(data);
+                entries.push_back(entry);
+            }
+            mutil::Timer timer;
+            timer.start();
+            ASSERT_EQ(kBatchSize, storage->append_entries(entries, NULL));
+            timer.stop();
+            latencies.push_back(timer.u_elapsed());
+            for (size_t j = 0; j < entries.size(); ++j) {
+                entries[j]->Release();
+            }
+            if (i % 200 == 199) {
+                // Recycle segments like a snapshot does
+                ASSERT_EQ(0, storage->truncate_prefix(index - 1000));
+            }
+        }
+        delete storage;
+        std::sort(latencies.begin(), latencies.end());
+        printf("direct_io=%d append %d x %d bytes: p50=%" PRId64 "us p99=%" PRId64
+               "us p999=%" PRId64 "us max=%" PRId64 "us\n",
+               direct_io, kBatchSize, (int)data.size(),
+               latencies[latencies.size() / 2],
+               latencies[latencies.size() * 99 / 100],
+               latencies[latencies.size() * 999 / 1000],
+               latencies.back());
+    }
+    melon::raft::FLAGS_raft_segment_direct_io = false;
+    melon::raft::FLAGS_raft_sync = saved_sync;
+    melon::raft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
@@ -11,6 +11,8 @@
 #include "melon/raft/log_manager.h"
 #include "melon/raft/configuration.h"
 #include "melon/raft/log.h"
+#include "melon/raft/config.h"
+#include "melon/raft/log_cache.h"
 
 class LogManagerTest : public testing::Test {
 protected:
@@ -679,3 +681,119 @@ TEST_F(LogManagerTest, set_snapshot_and_get_log_term) {
     ASSERT_EQ(1L, lm->get_term(N - 1));
     LOG(INFO) << "Last_index=" << lm->last_log_index();
 }
+
+class CountClosure : public melon::raft::LogManager::StableClosure {
+public:
+    CountClosure(fiber::CountdownEvent* event, int64_t* expected_next_log_index)
+        : _event(event), _expected_next_log_index(expected_next_log_index) {}
+    void Run() {
+        EXPECT_TRUE(status().ok()) << status();
+        EXPECT_EQ((*_expected_next_log_index)++, _first_log_index);
+        _event->signal();
+        delete this;
+    }
+private:
+    fiber::CountdownEvent* _event;
+    int64_t* _expected_next_log_index;
+};
+
+TEST_F(LogManagerTest, adaptive_group_commit) {
+    system("rm -rf ./data");
+    const int32_t saved_policy = melon::raft::FLAGS_raft_sync_policy;
+    melon::raft::FLAGS_raft_sync_policy = melon::raft::RAFT_SYNC_ADAPTIVE;
+    scoped_ptr<melon::raft::ConfigurationManager> cm(
+                                new melon::raft::ConfigurationManager);
+    scoped_ptr<melon::raft::SegmentLogStorage> storage(
+                                new melon::raft::SegmentLogStorage("./data"));
+    scoped_ptr<melon::raft::LogManager> lm(new melon::raft::LogManager());
+    melon::raft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+    const int N = 2000;
+    fiber::CountdownEvent event(N);
+    int64_t expected_next_log_index = 1;
+    for (int i = 0; i < N; ++i) {
+        melon::raft::LogEntry* entry = new melon::raft::LogEntry;
+        entry->AddRef();
+        entry->type = melon::raft::ENTRY_TYPE_DATA;
+        entry->data.append("hello");
+        entry->id = melon::raft::LogId(i + 1, 1);
+        std::vector<melon::raft::LogEntry*> entries;
+        entries.push_back(entry);
+        lm->append_entries(&entries, new CountClosure(&event, &expected_next_log_index));
+        if (i % 100 == 0) {
+            // Idle for a while to shrink the hold time
+            fiber_usleep(5000);
+        }
+    }
+    event.wait();
+    ASSERT_EQ(N + 1, expected_next_log_index);
+    ASSERT_EQ(melon::raft::LogId(N, 1), lm->last_log_id(true));
+    ASSERT_EQ(N, storage->last_log_index());
+    ASSERT_LE(lm->_group_commit_hold_us, melon::raft::FLAGS_raft_sync_target_latency_us);
+    LOG(INFO) << "hold_us=" << lm->_group_commit_hold_us
+              << " sync_latency_us=" << lm->_sync_latency_us;
+    melon::raft::FLAGS_raft_sync_policy = saved_policy;
+}
+
+TEST_F(LogManagerTest, log_cache_evicts_logs_on_disk) {
+    system("rm -rf ./data");
+    const int64_t saved_max_bytes = melon::raft::FLAGS_raft_log_cache_max_bytes;
+    const int64_t max_bytes = 64 * 1024;
+    melon::raft::FLAGS_raft_log_cache_max_bytes = max_bytes;
+    melon::raft::LogCache* cache = melon::raft::LogCache::GetInstance();
+    scoped_ptr<melon::raft::ConfigurationManager> cm(
+                                new melon::raft::ConfigurationManager);
+    scoped_ptr<melon::raft::SegmentLogStorage> storage(
+                                new melon::raft::SegmentLogStorage("./data"));
+    scoped_ptr<melon::raft::LogManager> lm(new melon::raft::LogManager());
+    melon::raft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+    const int N = 1000;
+    const std::string data(1024, 'a');
+    fiber::CountdownEvent event(N);
+    int64_t expected_next_log_index = 1;
+    for (int i = 0; i < N; ++i) {
+        melon::raft::LogEntry* entry = new melon::raft::LogEntry;
+        entry->AddRef();
+        entry->type = melon::raft::ENTRY_TYPE_DATA;
+        entry->data.append(data);
+        entry->id = melon::raft::LogId(i + 1, 1);
+        std::vector<melon::raft::LogEntry*> entries;
+        entries.push_back(entry);
+        lm->append_entries(&entries, new CountClosure(&event, &expected_next_log_index));
+    }
+    event.wait();
+    // Nothing is applied, so only the cache could release logs on disk
+    while (lm->last_log_id(true) != melon::raft::LogId(N, 1)
+            || cache->cached_bytes() > max_bytes) {
+        cache->evict_if_needed();
+        usleep(1000);
+    }
+    ASSERT_GT(lm->_cached_bytes, 0);
+    ASSERT_LE(lm->_cached_bytes, max_bytes);
+    ASSERT_FALSE(lm->_logs_in_memory.empty());
+    ASSERT_GT(lm->_logs_in_memory.front()->id.index, 1);
+    ASSERT_EQ(N, lm->_logs_in_memory.back()->id.index);
+    const int64_t nmiss = cache->_nmiss.get_value();
+    const int64_t nhit = cache->_nhit.get_value();
+    // Evicted logs are read from storage
+    melon::raft::LogEntry* entry = lm->get_entry(1);
+    ASSERT_TRUE(entry);
+    ASSERT_EQ(data, entry->data.to_string());
+    entry->Release();
+    ASSERT_EQ(nmiss + 1, cache->_nmiss.get_value());
+    entry = lm->get_entry(N);
+    ASSERT_TRUE(entry);
+    ASSERT_EQ(data, entry->data.to_string());
+    entry->Release();
+    ASSERT_EQ(nhit + 1, cache->_nhit.get_value());
+    const int64_t total_bytes = cache->cached_bytes();
+    const int64_t cached_bytes = lm->_cached_bytes;
+    lm.reset();
+    ASSERT_EQ(total_bytes - cached_bytes, cache->cached_bytes());
+    melon::raft::FLAGS_raft_log_cache_max_bytes = saved_max_bytes;
+}
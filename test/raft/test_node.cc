@@ -11,6 +11,7 @@
 #include <melon/utility/files/file_path.h>
 #include <melon/utility/file_util.h>
 #include <melon/utility/fast_rand.h>
+#include <melon/utility/time.h>
 #include <melon/rpc/closure_guard.h>
 #include <melon/fiber/fiber.h>
 #include <melon/fiber/countdown_event.h>
@@ -3563,6 +3564,266 @@ TEST_P(NodeTest, readonly) {
     cluster.stop_all();
 }
 
+class ReadIndexClosure : public melon::raft::Closure {
+public:
+    ReadIndexClosure(melon::raft::Node* node, int64_t min_index,
+                     fiber::CountdownEvent* cond)
+        : _node(node), _min_index(min_index), _cond(cond) {}
+
+    void Run() {
+        EXPECT_TRUE(status().ok()) << status();
+        if (status().ok()) {
+            // Everything committed before read_index() must be visible.
+            EXPECT_GE(_node->_impl->_fsm_caller->last_applied_index(), _min_index);
+        }
+        _cond->signal();
+        delete this;
+    }
+
+private:
+    melon::raft::Node* _node;
+    int64_t _min_index;
+    fiber::CountdownEvent* _cond;
+};
+
+static void apply_logs(melon::raft::Node* leader, int n) {
+    fiber::CountdownEvent cond(n);
+    for (int i = 0; i < n; i++) {
+        mutil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        melon::raft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+}
+
+TEST_P(NodeTest, read_index) {
+    std::vector<melon::raft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        melon::raft::PeerId peer;
+        peer.addr.ip = mutil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+    cluster.wait_leader();
+    melon::raft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+
+    apply_logs(leader, 10);
+    const int64_t committed = leader->_impl->_ballot_box->last_committed_index();
+
+    // Concurrent reads on the leader are confirmed in batches.
+    {
+        const int N = 100;
+        fiber::CountdownEvent cond(N);
+        for (int i = 0; i < N; i++) {
+            leader->read_index(new ReadIndexClosure(leader, committed, &cond));
+        }
+        cond.wait();
+    }
+
+    // Followers forward to the leader and wait for their own state machine.
+    std::vector<melon::raft::Node*> followers;
+    cluster.followers(&followers);
+    ASSERT_EQ(2, followers.size());
+    {
+        fiber::CountdownEvent cond(2 * 10);
+        for (int i = 0; i < 10; i++) {
+            for (size_t j = 0; j < followers.size(); j++) {
+                followers[j]->read_index(
+                        new ReadIndexClosure(followers[j], committed, &cond));
+            }
+        }
+        cond.wait();
+    }
+
+    // The leader can't confirm its leadership without a quorum.
+    cluster.stop(followers[0]->node_id().peer_id.addr);
+    cluster.stop(followers[1]->node_id().peer_id.addr);
+    {
+        fiber::CountdownEvent cond(1);
+        leader->read_index(NEW_APPLYCLOSURE(&cond, EPERM));
+        cond.wait();
+    }
+
+    cluster.stop_all();
+}
+
+TEST_P(NodeTest, read_index_vs_apply_benchmark) {
+    std::vector<melon::raft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        melon::raft::PeerId peer;
+        peer.addr.ip = mutil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+    cluster.wait_leader();
+    melon::raft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    apply_logs(leader, 1);
+
+    const int N = 10000;
+    const int64_t committed = leader->_impl->_ballot_box->last_committed_index();
+    mutil::Timer tm;
+    tm.start();
+    {
+        fiber::CountdownEvent cond(N);
+        for (int i = 0; i < N; i++) {
+            leader->read_index(new ReadIndexClosure(leader, committed, &cond));
+        }
+        cond.wait();
+    }
+    tm.stop();
+    const int64_t read_index_us = std::max(tm.u_elapsed(), (int64_t)1);
+
+    // Reads through the log, every read is replicated and applied.
+    tm.start();
+    apply_logs(leader, N);
+    tm.stop();
+    const int64_t apply_us = std::max(tm.u_elapsed(), (int64_t)1);
+
+    LOG(WARNING) << "read_index: " << N * 1000000L / read_index_us << " reads/s"
+                 << ", apply: " << N * 1000000L / apply_us << " reads/s";
+
+    cluster.stop_all();
+}
+
+TEST_P(NodeTest, coalesced_heartbeat_and_quiesce) {
+    melon::raft::FLAGS_raft_enable_coalesced_heartbeat = true;
+    melon::raft::FLAGS_raft_quiesce_idle_groups = true;
+    std::vector<melon::raft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        melon::raft::PeerId peer;
+        peer.addr.ip = mutil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+
+    Cluster cluster("unittest", peers, 1000);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+    cluster.wait_leader();
+    melon::raft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    const int64_t saved_term = leader->_impl->_current_term;
+    apply_logs(leader, 10);
+
+    // Followers get quiesced after a few idle heartbeats and the leader
+    // survives several election timeouts without per-group heartbeats.
+    std::vector<melon::raft::Node*> followers;
+    cluster.followers(&followers);
+    ASSERT_EQ(2, followers.size());
+    for (int i = 0; i < 50; ++i) {
+        if (followers[0]->_impl->_quiesced && followers[1]->_impl->_quiesced) {
+            break;
+        }
+        usleep(100 * 1000);
+    }
+    ASSERT_TRUE(followers[0]->_impl->_quiesced);
+    ASSERT_TRUE(followers[1]->_impl->_quiesced);
+    // Only the leader in the current term keeps the followers quiesced.
+    const melon::raft::PeerId leader_id = leader->node_id().peer_id;
+    ASSERT_TRUE(followers[0]->_impl->handle_quiesced_heartbeat(leader_id, saved_term));
+    ASSERT_FALSE(followers[0]->_impl->handle_quiesced_heartbeat(leader_id, saved_term - 1));
+    ASSERT_FALSE(followers[0]->_impl->handle_quiesced_heartbeat(
+            followers[1]->node_id().peer_id, saved_term));
+    usleep(3000 * 1000);
+    cluster.wait_leader();
+    ASSERT_EQ(leader, cluster.leader());
+    ASSERT_EQ(saved_term, leader->_impl->_current_term);
+
+    // Replicating wakes the group up.
+    apply_logs(leader, 10);
+    ASSERT_FALSE(followers[0]->_impl->_quiesced && followers[1]->_impl->_quiesced);
+    cluster.ensure_same();
+
+    // A new leader is elected after the leader is stopped.
+    const mutil::EndPoint leader_addr = leader->node_id().peer_id.addr;
+    cluster.stop(leader_addr);
+    cluster.wait_leader();
+    ASSERT_TRUE(cluster.leader() != NULL);
+    ASSERT_NE(leader_addr, cluster.leader()->node_id().peer_id.addr);
+
+    cluster.stop_all();
+    melon::raft::FLAGS_raft_enable_coalesced_heartbeat = false;
+    melon::raft::FLAGS_raft_quiesce_idle_groups = false;
+}
+
+static int64_t get_exposed_int64(const std::string& name) {
+    std::ostringstream os;
+    if (melon::var::Variable::describe_exposed(name, os) != 0) {
+        return -1;
+    }
+    return strtoll(os.str().c_str(), NULL, 10);
+}
+
+TEST_P(NodeTest, compressed_replication) {
+    const int32_t saved_compress_type = melon::raft::FLAGS_raft_replication_compress_type;
+    melon::raft::FLAGS_raft_replication_compress_type = 1;  // snappy
+    std::vector<melon::raft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        melon::raft::PeerId peer;
+        peer.addr.ip = mutil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+    cluster.wait_leader();
+    melon::raft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    // Entries are compressed after the followers report that they can
+    // decompress them, which is done by the first responses.
+    apply_logs(leader, 1);
+    const int64_t saved_raw_bytes = get_exposed_int64("raft_send_entries_raw_bytes");
+    const int64_t saved_compressed_bytes =
+        get_exposed_int64("raft_send_entries_compressed_bytes");
+
+    fiber::CountdownEvent cond(10);
+    for (int i = 0; i < 10; i++) {
+        mutil::IOBuf data;
+        data.append(std::string(64 * 1024, 'a' + i));
+        melon::raft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+    cluster.ensure_same();
+
+    const int64_t raw_bytes =
+        get_exposed_int64("raft_send_entries_raw_bytes") - saved_raw_bytes;
+    const int64_t compressed_bytes =
+        get_exposed_int64("raft_send_entries_compressed_bytes") - saved_compressed_bytes;
+    ASSERT_GE(raw_bytes, 2 * 10 * 64 * 1024);
+    ASSERT_LT(compressed_bytes, raw_bytes / 10);
+
+    cluster.stop_all();
+    melon::raft::FLAGS_raft_replication_compress_type = saved_compress_type;
+}
+
 INSTANTIATE_TEST_CASE_P(NodeTestWithoutPipelineReplication,
                         NodeTest,
                         ::testing::Values("NoReplcation"));
@@ -0,0 +1,269 @@
+// Copyright (c) 2016 Baidu.com, Inc. All Rights Reserved
+
+
+#include <gtest/gtest.h>
+#include <melon/utility/time.h>
+#include <melon/utility/string_printf.h>
+#include <melon/fiber/fiber.h>
+#include <melon/raft/shared_log.h>
+#include <melon/raft/configuration_manager.h>
+#include <melon/raft/config.h>
+
+namespace melon::raft {
+extern void global_init_once_or_die();
+};
+
+class SharedLogTest : public testing::Test {
+protected:
+    void SetUp() {
+        system("rm -rf data");
+        melon::raft::global_init_once_or_die();
+        melon::raft::FLAGS_raft_sync = false;
+    }
+    void TearDown() {
+        melon::raft::FLAGS_raft_sync = true;
+    }
+};
+
+static melon::raft::LogEntry* new_entry(int64_t index, int64_t term,
+                                        const std::string& data) {
+    melon::raft::LogEntry* entry = new melon::raft::LogEntry();
+    entry->AddRef();
+    entry->type = melon::raft::ENTRY_TYPE_DATA;
+    entry->id = melon::raft::LogId(index, term);
+    entry->data.append(data);
+    return entry;
+}
+
+static int append(melon::raft::LogStorage* storage, int64_t first, int n,
+                  int64_t term, const std::string& data) {
+    std::vector<melon::raft::LogEntry*> entries;
+    for (int i = 0; i < n; ++i) {
+        entries.push_back(new_entry(first + i, term, data));
+    }
+    const int rc = storage->append_entries(entries, NULL);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        entries[i]->Release();
+    }
+    return rc;
+}
+
+static std::string get_data(melon::raft::LogStorage* storage, int64_t index) {
+    melon::raft::LogEntry* entry = storage->get_entry(index);
+    if (entry == NULL) {
+        return "";
+    }
+    std::string data = entry->data.to_string();
+    entry->Release();
+    return data;
+}
+
+static void wait_gc_done(melon::raft::SharedWal* wal) {
+    while (wal->_gc_running.load()) {
+        usleep(1000);
+    }
+}
+
+TEST_F(SharedLogTest, uri) {
+    melon::raft::ConfigurationManager cm;
+    ASSERT_FALSE(melon::raft::LogStorage::create("shared://data/wal"));
+    ASSERT_FALSE(melon::raft::LogStorage::create("shared://data/wal?group="));
+    melon::raft::LogStorage* storage =
+            melon::raft::LogStorage::create("shared://data/wal?group=g1");
+    ASSERT_TRUE(storage);
+    ASSERT_EQ(0, storage->init(&cm));
+    // A group can't be opened twice
+    melon::raft::LogStorage* storage2 =
+            melon::raft::LogStorage::create("shared://data/wal?group=g1");
+    ASSERT_TRUE(storage2);
+    ASSERT_NE(0, storage2->init(&cm));
+    delete storage2;
+    delete storage;
+}
+
+TEST_F(SharedLogTest, entry_operation) {
+    melon::raft::ConfigurationManager cm;
+    melon::raft::LogStorage* s1 =
+            melon::raft::LogStorage::create("shared://data/wal?group=g1");
+    melon::raft::LogStorage* s2 =
+            melon::raft::LogStorage::create("shared://data/wal?group=g2");
+    ASSERT_EQ(0, s1->init(&cm));
+    ASSERT_EQ(0, s2->init(&cm));
+    ASSERT_EQ(10, append(s1, 1, 10, 1, "g1"));
+    ASSERT_EQ(5, append(s2, 1, 5, 2, "g2"));
+    ASSERT_EQ(1, s1->first_log_index());
+    ASSERT_EQ(10, s1->last_log_index());
+    ASSERT_EQ(5, s2->last_log_index());
+    ASSERT_EQ("g1", get_data(s1, 10));
+    ASSERT_EQ("g2", get_data(s2, 5));
+    ASSERT_EQ(1, s1->get_term(3));
+    ASSERT_EQ(2, s2->get_term(3));
+    ASSERT_EQ(0, s2->get_term(6));
+    ASSERT_TRUE(s2->get_entry(6) == NULL);
+
+    ASSERT_EQ(0, s1->truncate_prefix(4));
+    ASSERT_EQ(4, s1->first_log_index());
+    ASSERT_EQ(0, s1->get_term(3));
+    ASSERT_EQ(0, s1->truncate_suffix(8));
+    ASSERT_EQ(8, s1->last_log_index());
+    ASSERT_EQ(3, append(s1, 9, 3, 3, "g1_new"));
+    ASSERT_EQ(11, s1->last_log_index());
+    ASSERT_EQ("g1_new", get_data(s1, 9));
+    ASSERT_EQ("g1", get_data(s1, 8));
+
+    ASSERT_EQ(0, s2->reset(100));
+    ASSERT_EQ(100, s2->first_log_index());
+    ASSERT_EQ(99, s2->last_log_index());
+    ASSERT_EQ(1, append(s2, 100, 1, 4, "g2_new"));
+
+    melon::raft::LogEntry* conf = new melon::raft::LogEntry();
+    conf->AddRef();
+    conf->type = melon::raft::ENTRY_TYPE_CONFIGURATION;
+    conf->id = melon::raft::LogId(12, 3);
+    conf->peers = new std::vector<melon::raft::PeerId>;
+    conf->peers->push_back(melon::raft::PeerId("127.0.0.1:8000"));
+    ASSERT_EQ(0, s1->append_entry(conf));
+    conf->Release();
+    delete s1;
+    delete s2;
+
+    // Rebuilt from the segments
+    melon::raft::ConfigurationManager cm2;
+    s1 = melon::raft::LogStorage::create("shared://data/wal?group=g1");
+    s2 = melon::raft::LogStorage::create("shared://data/wal?group=g2");
+    ASSERT_EQ(0, s1->init(&cm2));
+    ASSERT_EQ(0, s2->init(&cm2));
+    ASSERT_EQ(4, s1->first_log_index());
+    ASSERT_EQ(12, s1->last_log_index());
+    ASSERT_EQ("g1", get_data(s1, 8));
+    ASSERT_EQ("g1_new", get_data(s1, 11));
+    ASSERT_EQ(melon::raft::LogId(12, 3), cm2.last_configuration().id);
+    melon::raft::LogEntry* entry = s1->get_entry(12);
+    ASSERT_TRUE(entry);
+    ASSERT_EQ(melon::raft::ENTRY_TYPE_CONFIGURATION, entry->type);
+    ASSERT_EQ(1u, entry->peers->size());
+    entry->Release();
+    ASSERT_EQ(100, s2->first_log_index());
+    ASSERT_EQ(100, s2->last_log_index());
+    ASSERT_EQ("g2_new", get_data(s2, 100));
+
+    // Dropped groups are empty when they are created again
+    delete s2;
+    ASSERT_TRUE(melon::raft::LogStorage::destroy("shared://data/wal?group=g2").ok());
+    s2 = melon::raft::LogStorage::create("shared://data/wal?group=g2");
+    ASSERT_EQ(0, s2->init(&cm2));
+    ASSERT_EQ(1, s2->first_log_index());
+    ASSERT_EQ(0, s2->last_log_index());
+    delete s2;
+    delete s1;
+}
+
+TEST_F(SharedLogTest, gc_segments) {
+    const int32_t saved_segment_size = melon::raft::FLAGS_raft_shared_wal_segment_size;
+    const int32_t saved_max_segments = melon::raft::FLAGS_raft_shared_wal_max_segments;
+    melon::raft::FLAGS_raft_shared_wal_segment_size = 16 * 1024;
+    melon::raft::FLAGS_raft_shared_wal_max_segments = 4;
+    melon::raft::ConfigurationManager cm;
+    melon::raft::SharedLogStorage* busy = new melon::raft::SharedLogStorage("data/wal", "busy");
+    melon::raft::SharedLogStorage* idle = new melon::raft::SharedLogStorage("data/wal", "idle");
+    ASSERT_EQ(0, busy->init(&cm));
+    ASSERT_EQ(0, idle->init(&cm));
+    // |idle| pins the first segment with a few logs
+    ASSERT_EQ(3, append(idle, 1, 3, 1, "idle"));
+    const std::string data(512, 'a');
+    for (int64_t i = 1; i <= 1000; ++i) {
+        ASSERT_EQ(1, append(busy, i, 1, 1, data));
+        if (i % 10 == 0) {
+            // Discard logs like taking snapshots
+            ASSERT_EQ(0, busy->truncate_prefix(i - 5));
+        }
+    }
+    melon::raft::SharedWal* wal = busy->wal();
+    wait_gc_done(wal);
+    melon::raft::SharedWal::Stats stats = wal->stats();
+    LOG(INFO) << "nsegment=" << stats.nsegment << " bytes=" << stats.bytes;
+    ASSERT_LE(stats.nsegment, melon::raft::FLAGS_raft_shared_wal_max_segments + 1);
+    ASSERT_EQ("idle", get_data(idle, 1));
+    ASSERT_EQ("idle", get_data(idle, 3));
+    delete busy;
+    delete idle;
+
+    melon::raft::ConfigurationManager cm2;
+    busy = new melon::raft::SharedLogStorage("data/wal", "busy");
+    idle = new melon::raft::SharedLogStorage("data/wal", "idle");
+    ASSERT_EQ(0, busy->init(&cm2));
+    ASSERT_EQ(0, idle->init(&cm2));
+    ASSERT_EQ(995, busy->first_log_index());
+    ASSERT_EQ(1000, busy->last_log_index());
+    ASSERT_EQ(data, get_data(busy, 995));
+    ASSERT_EQ(1, idle->first_log_index());
+    ASSERT_EQ(3, idle->last_log_index());
+    ASSERT_EQ("idle", get_data(idle, 2));
+    delete busy;
+    delete idle;
+    melon::raft::FLAGS_raft_shared_wal_segment_size = saved_segment_size;
+    melon::raft::FLAGS_raft_shared_wal_max_segments = saved_max_segments;
+}
+
+struct AppendArg {
+    melon::raft::LogStorage* storage;
+    int nappend;
+    int entry_size;
+};
+
+static void* append_thread(void* arg) {
+    AppendArg* a = (AppendArg*)arg;
+    const std::string data(a->entry_size, 'x');
+    for (int i = 0; i < a->nappend; ++i) {
+        EXPECT_EQ(1, append(a->storage, i + 1, 1, 1, data));
+    }
+    return NULL;
+}
+
+// Many groups appending concurrently, the number of fsync and the write
+// amplification are compared with one fsync per append which is what
+// SegmentLogStorage does.
+TEST_F(SharedLogTest, group_commit_benchmark) {
+    melon::raft::FLAGS_raft_sync = true;
+    const int ngroup = 1000;
+    const int nappend = 20;
+    const int entry_size = 256;
+    melon::raft::ConfigurationManager cm;
+    std::vector<melon::raft::LogStorage*> storages;
+    std::vector<AppendArg> args(ngroup);
+    for (int i = 0; i < ngroup; ++i) {
+        melon::raft::LogStorage* storage = melon::raft::LogStorage::create(
+                mutil::string_printf("shared://data/wal?group=%d", i));
+        ASSERT_EQ(0, storage->init(&cm));
+        storages.push_back(storage);
+        args[i].storage = storage;
+        args[i].nappend = nappend;
+        args[i].entry_size = entry_size;
+    }
+    melon::raft::SharedWal* wal = ((melon::raft::SharedLogStorage*)storages[0])->wal();
+    const melon::raft::SharedWal::Stats before = wal->stats();
+    std::vector<fiber_t> tids(ngroup);
+    mutil::Timer timer;
+    timer.start();
+    for (int i = 0; i < ngroup; ++i) {
+        ASSERT_EQ(0, fiber_start_background(&tids[i], NULL, append_thread, &args[i]));
+    }
+    for (int i = 0; i < ngroup; ++i) {
+        fiber_join(tids[i], NULL);
+    }
+    timer.stop();
+    const melon::raft::SharedWal::Stats after = wal->stats();
+    const int64_t nappend_total = (int64_t)ngroup * nappend;
+    const int64_t nsync = after.nsync - before.nsync;
+    const int64_t payload = nappend_total * entry_size;
+    LOG(INFO) << "groups=" << ngroup << " appends=" << nappend_total
+              << " fsync=" << nsync
+              << " appends_per_fsync=" << (double)nappend_total / std::max<int64_t>(nsync, 1)
+              << " write_amplification=" << (double)(after.bytes - before.bytes) / payload
+              << " qps=" << nappend_total * 1000000L / std::max<int64_t>(timer.u_elapsed(), 1);
+    ASSERT_LE(nsync, nappend_total);
+    for (int i = 0; i < ngroup; ++i) {
+        ASSERT_EQ(nappend, storages[i]->last_log_index());
+        delete storages[i];
+    }
+}
@@ -13,6 +13,7 @@
 #include "melon/raft/util.h"
 #include "melon/proto/raft/local_file_meta.pb.h"
 #include "melon/raft/snapshot_throttle.h"
+#include "melon/raft/config.h"
 #include "memory_file_system_adaptor.h"
 
 namespace logging {
@@ -1053,3 +1054,148 @@ TEST_F(SnapshotTest, dynamically_change_throttle_threshold) {
     FOR_EACH_FILE_SYSTEM_ADAPTOR_END;
     google::SetCommandLineOption("raft_minimal_throttle_threshold_mb", "0");
 }
+
+static void write_file(const std::string& path, const std::string& data) {
+    ASSERT_EQ((int)data.size(),
+              mutil::WriteFile(mutil::FilePath(path), data.data(), data.size()));
+}
+
+static std::string read_file(const std::string& path) {
+    std::string data;
+    EXPECT_TRUE(mutil::ReadFileToString(mutil::FilePath(path), &data));
+    return data;
+}
+
+TEST_F(SnapshotTest, copy_chunks) {
+    ::system("rm -rf data data2");
+    google::SetCommandLineOption("raft_snapshot_chunk_size", "4096");
+    melon::Server server;
+    ASSERT_EQ(0, melon::raft::add_service(&server, "0.0.0.0:6006"));
+    ASSERT_EQ(0, server.Start(6006, NULL));
+
+    std::string content;
+    for (int i = 0; i < 8 * 4096 + 100; ++i) {
+        content.push_back('a' + i / 4096);
+    }
+    melon::raft::SnapshotMeta meta;
+    meta.set_last_included_index(1000);
+    meta.set_last_included_term(2);
+    melon::raft::LocalSnapshotStorage* storage1 = new melon::raft::LocalSnapshotStorage("./data");
+    ASSERT_EQ(0, storage1->init());
+    storage1->set_server_addr(mutil::EndPoint(mutil::my_ip(), 6006));
+    melon::raft::SnapshotWriter* writer1 = storage1->create();
+    ASSERT_TRUE(writer1 != NULL);
+    ASSERT_EQ(0, writer1->save_meta(meta));
+    write_file(writer1->get_path() + "/file", content);
+    ASSERT_EQ(0, writer1->add_file("file"));
+    melon::raft::LocalFileMeta file_meta;
+    ASSERT_EQ(0, writer1->get_file_meta("file", &file_meta));
+    ASSERT_EQ(9, file_meta.chunks_size());
+    ASSERT_EQ(100, file_meta.chunks(8).length());
+    ASSERT_EQ(0, storage1->close(writer1));
+
+    // The follower has the first 3 chunks in its last snapshot.
+    melon::raft::LocalSnapshotStorage* storage2 = new melon::raft::LocalSnapshotStorage("./data2");
+    ASSERT_EQ(0, storage2->init());
+    meta.set_last_included_index(500);
+    melon::raft::SnapshotWriter* writer2 = storage2->create();
+    ASSERT_TRUE(writer2 != NULL);
+    ASSERT_EQ(0, writer2->save_meta(meta));
+    write_file(writer2->get_path() + "/old_file",
+               content.substr(0, 3 * 4096) + std::string(100, 'z'));
+    ASSERT_EQ(0, writer2->add_file("old_file"));
+    ASSERT_EQ(0, storage2->close(writer2));
+
+    // Chunks found locally are not fetched from the leader, which is told by
+    // overwriting the first chunk at the leader.
+    std::string changed = content;
+    changed.replace(0, 4096, std::string(4096, 'x'));
+    write_file("./data/snapshot_00000000000000001000/file", changed);
+
+    melon::raft::SnapshotReader* reader1 = storage1->open();
+    ASSERT_TRUE(reader1 != NULL);
+    const std::string uri = reader1->generate_uri_for_copy();
+    melon::raft::SnapshotReader* reader2 = storage2->copy_from(uri);
+    ASSERT_TRUE(reader2 != NULL);
+    ASSERT_EQ(content, read_file(reader2->get_path() + "/file"));
+    ASSERT_EQ(0, reader2->get_file_meta("file", &file_meta));
+    ASSERT_EQ(9, file_meta.chunks_size());
+    ASSERT_EQ(0, storage1->close(reader1));
+    ASSERT_EQ(0, storage2->close(reader2));
+    delete storage2;
+    delete storage1;
+    google::SetCommandLineOption("raft_snapshot_chunk_size", "0");
+}
+
+class StringStream : public melon::raft::SnapshotStream {
+public:
+    explicit StringStream(const std::string& data) : _data(data), _pos(0) {}
+    int read(mutil::IOBuf* out, size_t max_count, bool* eof) {
+        // Produce small pieces to exercise the buffering of the reader
+        const size_t n = std::min(std::min(max_count, (size_t)1000), _data.size() - _pos);
+        out->append(_data.data() + _pos, n);
+        _pos += n;
+        *eof = (_pos == _data.size());
+        return 0;
+    }
+private:
+    std::string _data;
+    size_t _pos;
+};
+
+class StringStreamSource : public melon::raft::SnapshotStreamSource {
+public:
+    explicit StringStreamSource(const std::string& data) : _data(data), nopen(0) {}
+    melon::raft::SnapshotStream* open() {
+        ++nopen;
+        return new StringStream(_data);
+    }
+    std::string _data;
+    int nopen;
+};
+
+TEST_F(SnapshotTest, copy_stream) {
+    ::system("rm -rf data data2");
+    melon::Server server;
+    ASSERT_EQ(0, melon::raft::add_service(&server, "0.0.0.0:6006"));
+    ASSERT_EQ(0, server.Start(6006, NULL));
+
+    std::string content;
+    for (int i = 0; i < 300 * 1024; ++i) {
+        content.push_back('a' + i % 26);
+    }
+    scoped_refptr<StringStreamSource> source(new StringStreamSource(content));
+    melon::raft::SnapshotMeta meta;
+    meta.set_last_included_index(1000);
+    meta.set_last_included_term(2);
+    melon::raft::LocalSnapshotStorage* storage1 = new melon::raft::LocalSnapshotStorage("./data");
+    ASSERT_EQ(0, storage1->init());
+    storage1->set_server_addr(mutil::EndPoint(mutil::my_ip(), 6006));
+    melon::raft::SnapshotWriter* writer1 = storage1->create();
+    ASSERT_TRUE(writer1 != NULL);
+    ASSERT_EQ(0, writer1->save_meta(meta));
+    ASSERT_EQ(0, writer1->add_stream("stream", source.get()));
+    ASSERT_EQ(0, storage1->close(writer1));
+    // Nothing is written at the leader.
+    ASSERT_FALSE(mutil::PathExists(
+            mutil::FilePath("./data/snapshot_00000000000000001000/stream")));
+
+    for (int i = 0; i < 2; ++i) {
+        ::system("rm -rf data2");
+        melon::raft::LocalSnapshotStorage* storage2 =
+            new melon::raft::LocalSnapshotStorage("./data2");
+        ASSERT_EQ(0, storage2->init());
+        melon::raft::SnapshotReader* reader1 = storage1->open();
+        ASSERT_TRUE(reader1 != NULL);
+        melon::raft::SnapshotReader* reader2 =
+            storage2->copy_from(reader1->generate_uri_for_copy());
+        ASSERT_TRUE(reader2 != NULL);
+        ASSERT_EQ(content, read_file(reader2->get_path() + "/stream"));
+        ASSERT_EQ(0, storage1->close(reader1));
+        ASSERT_EQ(0, storage2->close(reader2));
+        delete storage2;
+    }
+    // Every copy reads a new pass of the stream.
+    ASSERT_EQ(2, source->nopen);
+    delete storage1;
+}
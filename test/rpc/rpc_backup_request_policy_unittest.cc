@@ -0,0 +1,93 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#include <gtest/gtest.h>
+#include <melon/utility/time.h>
+#include <melon/rpc/controller.h>
+#include <melon/rpc/backup_request_policy.h>
+
+namespace {
+
+void EndRPC(melon::AdaptiveBackupRequestPolicy* policy, int64_t latency_us,
+            bool by_backup = false) {
+    melon::Controller cntl;
+    cntl._begin_time_us = 1000;
+    cntl._end_time_us = 1000 + latency_us;
+    if (by_backup) {
+        cntl.add_flag(melon::Controller::FLAGS_RESPONDED_BY_BACKUP);
+    }
+    policy->OnRPCEnd(&cntl);
+}
+
+TEST(BackupRequestPolicyTest, fallback_before_enough_samples) {
+    melon::AdaptiveBackupRequestOptions opt;
+    opt.fallback_backup_request_ms = 30;
+    opt.min_sample_count = 10;
+    melon::AdaptiveBackupRequestPolicy policy(&opt);
+    ASSERT_EQ(30, policy.GetBackupRequestMs(NULL));
+    for (int i = 0; i < 5; ++i) {
+        EndRPC(&policy, 5000);
+    }
+    policy._last_update_us.store(0);
+    ASSERT_EQ(30, policy.GetBackupRequestMs(NULL));
+}
+
+TEST(BackupRequestPolicyTest, delay_follows_percentile) {
+    melon::AdaptiveBackupRequestOptions opt;
+    opt.latency_percentile = 0.9;
+    opt.min_sample_count = 100;
+    opt.max_backup_request_ms = 50;
+    melon::AdaptiveBackupRequestPolicy policy(&opt);
+    for (int i = 0; i < 1000; ++i) {
+        EndRPC(&policy, (i % 10 == 9) ? 100000 : 20000);
+    }
+    // Wait for the sampler to take the latencies into the window.
+    usleep(1500000);
+    policy._last_update_us.store(0);
+    const int32_t backup_ms = policy.GetBackupRequestMs(NULL);
+    ASSERT_GE(backup_ms, 20);
+    ASSERT_LE(backup_ms, 50);
+    // The delay is cached.
+    for (int i = 0; i < 1000; ++i) {
+        EndRPC(&policy, 1000);
+    }
+    ASSERT_EQ(backup_ms, policy.GetBackupRequestMs(NULL));
+}
+
+TEST(BackupRequestPolicyTest, backups_are_budgeted) {
+    melon::AdaptiveBackupRequestOptions opt;
+    opt.max_backup_ratio = 0.25;
+    opt.max_backup_burst = 2;
+    melon::AdaptiveBackupRequestPolicy policy(&opt);
+    ASSERT_TRUE(policy.DoBackup(NULL));
+    ASSERT_TRUE(policy.DoBackup(NULL));
+    ASSERT_FALSE(policy.DoBackup(NULL));
+    for (int i = 0; i < 3; ++i) {
+        EndRPC(&policy, 1000);
+        ASSERT_FALSE(policy.DoBackup(NULL));
+    }
+    EndRPC(&policy, 1000, true);
+    ASSERT_TRUE(policy.DoBackup(NULL));
+    ASSERT_FALSE(policy.DoBackup(NULL));
+    ASSERT_EQ(3, policy._nbackup.get_value());
+    ASSERT_EQ(1, policy._nbackup_won.get_value());
+    ASSERT_EQ(4, policy._nrpc.get_value());
+}
+
+} // namespace
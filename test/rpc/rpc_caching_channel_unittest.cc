@@ -0,0 +1,315 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#include <atomic>
+#include <gtest/gtest.h>
+#include <melon/fiber/fiber.h>
+#include <melon/utility/time.h>
+#include <melon/rpc/controller.h>
+#include <melon/rpc/caching_channel.h>
+#include <melon/rpc/details/response_cache.h>
+#include "echo.pb.h"
+
+namespace {
+
+// Echo the request back with a sequence number so that cached responses
+// can be told apart from fresh ones.
+class CountingChannel : public melon::ChannelBase {
+public:
+    CountingChannel() : ncall(0), fail(false), attach(false) {}
+
+    void CallMethod(const google::protobuf::MethodDescriptor*,
+                    google::protobuf::RpcController* cntl_base,
+                    const google::protobuf::Message* request,
+                    google::protobuf::Message* response,
+                    google::protobuf::Closure* done) override {
+        melon::Controller* cntl = static_cast<melon::Controller*>(cntl_base);
+        const int n = ncall.fetch_add(1) + 1;
+        if (fail) {
+            cntl->SetFailed(melon::EINTERNAL, "failed on purpose");
+        } else {
+            static_cast<test::EchoResponse*>(response)->set_message(
+                static_cast<const test::EchoRequest*>(request)->message()
+                + "#" + std::to_string(n));
+            if (attach) {
+                cntl->response_attachment().append("attachment");
+            }
+        }
+        if (done) {
+            done->Run();
+        }
+    }
+
+    int CheckHealth() override { return 0; }
+    void Describe(std::ostream& os, const melon::DescribeOptions&) const override {
+        os << "CountingChannel";
+    }
+
+    std::atomic<int> ncall;
+    bool fail;
+    bool attach;
+};
+
+class CachingChannelTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        _method = test::EchoService::descriptor()->FindMethodByName("Echo");
+    }
+
+    std::string Echo(melon::ChannelBase* chan, const std::string& msg,
+                     melon::Controller* cntl) {
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message(msg);
+        chan->CallMethod(_method, cntl, &req, &res, NULL);
+        return cntl->Failed() ? "" : res.message();
+    }
+
+    const google::protobuf::MethodDescriptor* _method;
+};
+
+TEST_F(CachingChannelTest, lru_bounded_by_bytes) {
+    melon::ResponseCache cache(4096, 1);
+    const int64_t now = mutil::cpuwide_time_us();
+    const std::string v(200, 'x');
+    for (int i = 0; i < 100; ++i) {
+        cache.Insert("key" + std::to_string(i), v, now + 1000000, now + 1000000);
+        ASSERT_LE(cache.size_in_bytes(), 4096u);
+    }
+    ASSERT_GT(cache.size(), 0u);
+    std::string out;
+    bool should_refresh = false;
+    ASSERT_EQ(melon::ResponseCache::CACHE_HIT,
+              cache.Lookup("key99", now, &out, &should_refresh));
+    ASSERT_EQ(v, out);
+    ASSERT_EQ(melon::ResponseCache::CACHE_MISS,
+              cache.Lookup("key0", now, &out, &should_refresh));
+    // Too large to be cached.
+    cache.Insert("huge", std::string(8192, 'y'), now + 1000000, now + 1000000);
+    ASSERT_EQ(melon::ResponseCache::CACHE_MISS,
+              cache.Lookup("huge", now, &out, &should_refresh));
+    cache.Clear();
+    ASSERT_EQ(0u, cache.size());
+    ASSERT_EQ(0u, cache.size_in_bytes());
+}
+
+TEST_F(CachingChannelTest, stale_entry_refreshed_once) {
+    melon::ResponseCache cache(1 << 20, 4);
+    const int64_t now = mutil::cpuwide_time_us();
+    cache.Insert("k", "v", now + 10, now + 1000);
+    std::string out;
+    bool should_refresh = false;
+    ASSERT_EQ(melon::ResponseCache::CACHE_HIT,
+              cache.Lookup("k", now, &out, &should_refresh));
+    ASSERT_FALSE(should_refresh);
+    ASSERT_EQ(melon::ResponseCache::CACHE_STALE,
+              cache.Lookup("k", now + 20, &out, &should_refresh));
+    ASSERT_TRUE(should_refresh);
+    ASSERT_EQ(melon::ResponseCache::CACHE_STALE,
+              cache.Lookup("k", now + 20, &out, &should_refresh));
+    ASSERT_FALSE(should_refresh);
+    cache.EndRefresh("k");
+    ASSERT_EQ(melon::ResponseCache::CACHE_STALE,
+              cache.Lookup("k", now + 20, &out, &should_refresh));
+    ASSERT_TRUE(should_refresh);
+    ASSERT_EQ(melon::ResponseCache::CACHE_MISS,
+              cache.Lookup("k", now + 1000, &out, &should_refresh));
+}
+
+TEST_F(CachingChannelTest, hit_and_miss) {
+    CountingChannel sub;
+    melon::CachingChannelOptions opt;
+    opt.method_ttl_ms[_method->full_name()] = 10000;
+    melon::CachingChannel cchan;
+    ASSERT_EQ(0, cchan.Init(&sub, &opt));
+    {
+        melon::Controller cntl;
+        ASSERT_EQ("a#1", Echo(&cchan, "a", &cntl));
+        ASSERT_FALSE(cntl.is_response_from_cache());
+    }
+    {
+        melon::Controller cntl;
+        ASSERT_EQ("a#1", Echo(&cchan, "a", &cntl));
+        ASSERT_TRUE(cntl.is_response_from_cache());
+        // Joining a call served from cache should not block.
+        melon::Join(cntl.call_id());
+    }
+    {
+        melon::Controller cntl;
+        ASSERT_EQ("b#2", Echo(&cchan, "b", &cntl));
+    }
+    ASSERT_EQ(2, sub.ncall.load());
+    ASSERT_EQ(1, cchan._nhit.get_value());
+    ASSERT_EQ(2, cchan._nmiss.get_value());
+}
+
+TEST_F(CachingChannelTest, bypass_refresh_and_key) {
+    CountingChannel sub;
+    melon::CachingChannelOptions opt;
+    opt.default_ttl_ms = 10000;
+    melon::CachingChannel cchan;
+    ASSERT_EQ(0, cchan.Init(&sub, &opt));
+    {
+        melon::Controller cntl;
+        ASSERT_EQ("a#1", Echo(&cchan, "a", &cntl));
+    }
+    {
+        melon::Controller cntl;
+        cntl.bypass_cache();
+        ASSERT_EQ("a#2", Echo(&cchan, "a", &cntl));
+    }
+    {
+        melon::Controller cntl;
+        ASSERT_EQ("a#1", Echo(&cchan, "a", &cntl));
+    }
+    {
+        melon::Controller cntl;
+        cntl.refresh_cache();
+        ASSERT_EQ("a#3", Echo(&cchan, "a", &cntl));
+    }
+    {
+        melon::Controller cntl;
+        ASSERT_EQ("a#3", Echo(&cchan, "a", &cntl));
+    }
+    // Different requests sharing a user-defined key share the response.
+    {
+        melon::Controller cntl;
+        cntl.set_cache_key("shared");
+        ASSERT_EQ("x#4", Echo(&cchan, "x", &cntl));
+    }
+    {
+        melon::Controller cntl;
+        cntl.set_cache_key("shared");
+        ASSERT_EQ("x#4", Echo(&cchan, "y", &cntl));
+    }
+    ASSERT_EQ(4, sub.ncall.load());
+}
+
+TEST_F(CachingChannelTest, failed_call_is_not_cached) {
+    CountingChannel sub;
+    melon::CachingChannelOptions opt;
+    opt.default_ttl_ms = 10000;
+    melon::CachingChannel cchan;
+    ASSERT_EQ(0, cchan.Init(&sub, &opt));
+    sub.fail = true;
+    {
+        melon::Controller cntl;
+        ASSERT_EQ("", Echo(&cchan, "a", &cntl));
+        ASSERT_TRUE(cntl.Failed());
+    }
+    sub.fail = false;
+    {
+        melon::Controller cntl;
+        ASSERT_EQ("a#2", Echo(&cchan, "a", &cntl));
+        ASSERT_FALSE(cntl.is_response_from_cache());
+    }
+}
+
+TEST_F(CachingChannelTest, stale_while_revalidate) {
+    CountingChannel sub;
+    melon::CachingChannelOptions opt;
+    opt.default_ttl_ms = 10;
+    opt.stale_while_revalidate_ms = 60000;
+    melon::CachingChannel cchan;
+    ASSERT_EQ(0, cchan.Init(&sub, &opt));
+    {
+        melon::Controller cntl;
+        ASSERT_EQ("a#1", Echo(&cchan, "a", &cntl));
+    }
+    fiber_usleep(20 * 1000);
+    {
+        // The stale response is returned and refreshed in background.
+        melon::Controller cntl;
+        ASSERT_EQ("a#1", Echo(&cchan, "a", &cntl));
+        ASSERT_TRUE(cntl.is_response_from_cache());
+    }
+    ASSERT_EQ(2, sub.ncall.load());
+    ASSERT_EQ(1, cchan._nstale_hit.get_value());
+    {
+        melon::Controller cntl;
+        ASSERT_EQ("a#2", Echo(&cchan, "a", &cntl));
+        ASSERT_TRUE(cntl.is_response_from_cache());
+    }
+}
+
+TEST_F(CachingChannelTest, refresh_with_attachment) {
+    CountingChannel sub;
+    melon::CachingChannelOptions opt;
+    opt.default_ttl_ms = 10;
+    opt.stale_while_revalidate_ms = 60000;
+    melon::CachingChannel cchan;
+    ASSERT_EQ(0, cchan.Init(&sub, &opt));
+    {
+        melon::Controller cntl;
+        ASSERT_EQ("a#1", Echo(&cchan, "a", &cntl));
+    }
+    fiber_usleep(20 * 1000);
+    sub.attach = true;
+    for (int i = 0; i < 2; ++i) {
+        // Responses with attachments can't replace the stale one, but every
+        // stale hit still triggers a refresh.
+        melon::Controller cntl;
+        ASSERT_EQ("a#1", Echo(&cchan, "a", &cntl));
+        ASSERT_TRUE(cntl.is_response_from_cache());
+        ASSERT_EQ(2 + i, sub.ncall.load());
+    }
+    sub.attach = false;
+    {
+        melon::Controller cntl;
+        ASSERT_EQ("a#1", Echo(&cchan, "a", &cntl));
+    }
+    ASSERT_EQ(4, sub.ncall.load());
+    {
+        melon::Controller cntl;
+        ASSERT_EQ("a#4", Echo(&cchan, "a", &cntl));
+        ASSERT_TRUE(cntl.is_response_from_cache());
+    }
+}
+
+struct AsyncDone : public google::protobuf::Closure {
+    void Run() override { ran = true; }
+    bool ran = false;
+};
+
+TEST_F(CachingChannelTest, async_call) {
+    CountingChannel sub;
+    melon::CachingChannelOptions opt;
+    opt.default_ttl_ms = 10000;
+    melon::CachingChannel cchan;
+    ASSERT_EQ(0, cchan.Init(&sub, &opt));
+    for (int i = 0; i < 2; ++i) {
+        melon::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message("a");
+        AsyncDone done;
+        const melon::CallId cid = cntl.call_id();
+        cchan.CallMethod(_method, &cntl, &req, &res, &done);
+        if (i == 1) {
+            // CountingChannel runs done in-place and leaves the call_id
+            // alone, only calls served from cache can be joined here.
+            melon::Join(cid);
+        }
+        ASSERT_TRUE(done.ran);
+        ASSERT_EQ("a#1", res.message());
+        ASSERT_EQ(i == 1, cntl.is_response_from_cache());
+    }
+}
+
+} // namespace
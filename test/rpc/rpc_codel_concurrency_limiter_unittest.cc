@@ -0,0 +1,116 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+
+#include <melon/rpc/policy/codel_concurrency_limiter.h>
+#include <melon/rpc/details/controller_private_accessor.h>
+#include <melon/utility/time.h>
+#include <melon/fiber/fiber.h>
+#include <gtest/gtest.h>
+
+namespace melon {
+namespace policy {
+DECLARE_int32(codel_cl_target_delay_ms);
+DECLARE_int32(codel_cl_interval_ms);
+DECLARE_int32(codel_cl_max_concurrency);
+}  // namespace policy
+}  // namespace melon
+
+class CodelConcurrencyLimiterTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        melon::policy::FLAGS_codel_cl_target_delay_ms = 5;
+        melon::policy::FLAGS_codel_cl_interval_ms = 10;
+        melon::policy::FLAGS_codel_cl_max_concurrency = 0;
+    }
+
+    // Pretend that the request has been queued for `delay_us'.
+    static void SetQueueDelay(melon::Controller* cntl, int64_t delay_us) {
+        melon::ControllerPrivateAccessor(cntl).set_begin_time_us(
+            mutil::cpuwide_time_us() - delay_us);
+    }
+};
+
+TEST_F(CodelConcurrencyLimiterTest, short_queue_is_never_overloaded) {
+    melon::policy::CodelConcurrencyLimiter limiter;
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 10; ++j) {
+            melon::Controller cntl;
+            // Some requests wait long, but the queue drains regularly.
+            SetQueueDelay(&cntl, j == 0 ? 100 : 50 * 1000);
+            ASSERT_TRUE(limiter.OnRequested(1, &cntl));
+        }
+        fiber_usleep(12 * 1000);
+    }
+    ASSERT_FALSE(limiter.overloaded());
+}
+
+TEST_F(CodelConcurrencyLimiterTest, standing_queue_sheds_old_requests) {
+    melon::policy::CodelConcurrencyLimiter limiter;
+    {
+        melon::Controller cntl;
+        SetQueueDelay(&cntl, 20 * 1000);
+        ASSERT_TRUE(limiter.OnRequested(1, &cntl));
+    }
+    fiber_usleep(12 * 1000);
+    for (int i = 0; i < 5; ++i) {
+        melon::Controller cntl;
+        SetQueueDelay(&cntl, 20 * 1000);
+        limiter.OnRequested(1, &cntl);
+    }
+    fiber_usleep(12 * 1000);
+    {
+        // The interval ends and the limiter enters overloaded state.
+        melon::Controller cntl;
+        SetQueueDelay(&cntl, 20 * 1000);
+        ASSERT_FALSE(limiter.OnRequested(1, &cntl));
+        ASSERT_TRUE(limiter.overloaded());
+    }
+    {
+        // Fresh requests are still served.
+        melon::Controller cntl;
+        SetQueueDelay(&cntl, 1000);
+        ASSERT_TRUE(limiter.OnRequested(1, &cntl));
+    }
+    fiber_usleep(12 * 1000);
+    {
+        // The queue drained in last interval.
+        melon::Controller cntl;
+        SetQueueDelay(&cntl, 20 * 1000);
+        ASSERT_TRUE(limiter.OnRequested(1, &cntl));
+        ASSERT_FALSE(limiter.overloaded());
+    }
+}
+
+TEST_F(CodelConcurrencyLimiterTest, reject_expired_requests) {
+    melon::policy::CodelConcurrencyLimiter limiter;
+    melon::Controller cntl;
+    cntl.set_timeout_ms(10);
+    SetQueueDelay(&cntl, 11 * 1000);
+    ASSERT_FALSE(limiter.OnRequested(1, &cntl));
+    SetQueueDelay(&cntl, 1000);
+    ASSERT_TRUE(limiter.OnRequested(1, &cntl));
+}
+
+TEST_F(CodelConcurrencyLimiterTest, max_concurrency) {
+    melon::policy::FLAGS_codel_cl_max_concurrency = 2;
+    melon::policy::CodelConcurrencyLimiter limiter;
+    ASSERT_TRUE(limiter.OnRequested(2, NULL));
+    ASSERT_FALSE(limiter.OnRequested(3, NULL));
+}
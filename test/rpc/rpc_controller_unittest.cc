@@ -32,6 +32,15 @@
 #include <melon/rpc/channel.h>
 #include <melon/rpc/controller.h>
 #include <melon/utility/config.h>
+#include <melon/rpc/details/controller_private_accessor.h>
+#include <melon/rpc/details/server_deadline.h>
+#include "echo.pb.h"
+
+namespace melon {
+namespace policy {
+DECLARE_bool(melon_std_protocol_deliver_timeout_ms);
+}
+}
 
 class ControllerTest : public ::testing::Test{
 protected:
@@ -140,3 +149,140 @@ TEST_F(ControllerTest, SessionKV) {
     logging::SetLogSink(oldSink);
 }
 #endif
+
+TEST_F(ControllerTest, inherit_deadline) {
+    melon::Channel channel;
+    melon::ChannelOptions opt;
+    opt.timeout_ms = 1000;
+    opt.max_retry = 0;
+    ASSERT_EQ(0, channel.Init("127.0.0.1:1", &opt));
+    test::EchoService_Stub stub(&channel);
+    test::EchoRequest req;
+    test::EchoResponse res;
+    req.set_message("hello");
+
+    melon::Controller server_cntl;
+    ASSERT_EQ(-1, server_cntl.inheritable().deadline_us);
+    melon::ControllerPrivateAccessor(&server_cntl).set_deadline_us(
+        mutil::gettimeofday_us() + 50000);
+    ASSERT_EQ(server_cntl.deadline_us(), server_cntl.inheritable().deadline_us);
+    {
+        // Timeout is clamped to the remaining time of the upstream RPC.
+        melon::Controller cntl(server_cntl.inheritable());
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_TRUE(cntl.Failed());
+        ASSERT_LE(cntl.timeout_ms(), 50);
+    }
+
+    melon::ControllerPrivateAccessor(&server_cntl).set_deadline_us(
+        mutil::gettimeofday_us() - 1000);
+    {
+        // The upstream RPC has expired, nothing is sent.
+        melon::Controller cntl(server_cntl.inheritable());
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_EQ(melon::ERPCTIMEDOUT, cntl.ErrorCode());
+    }
+}
+
+TEST_F(ControllerTest, server_deadline_in_scope) {
+    melon::Channel channel;
+    melon::ChannelOptions opt;
+    opt.timeout_ms = 1000;
+    opt.max_retry = 0;
+    ASSERT_EQ(0, channel.Init("127.0.0.1:1", &opt));
+    test::EchoService_Stub stub(&channel);
+    test::EchoRequest req;
+    test::EchoResponse res;
+    req.set_message("hello");
+
+    ASSERT_EQ(-1, melon::GetServerDeadline());
+    {
+        // As if the RPC is issued inside a server callback.
+        const int64_t deadline_us = mutil::gettimeofday_us() + 50000;
+        melon::ScopedServerDeadline deadline_guard(deadline_us);
+        ASSERT_EQ(deadline_us, melon::GetServerDeadline());
+        {
+            melon::ScopedServerDeadline nested_guard(-1);
+            ASSERT_EQ(deadline_us, melon::GetServerDeadline());
+        }
+        melon::Controller cntl;
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_TRUE(cntl.Failed());
+        ASSERT_LE(cntl.timeout_ms(), 50);
+    }
+    ASSERT_EQ(-1, melon::GetServerDeadline());
+    {
+        melon::Controller cntl;
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_EQ(1000, cntl.timeout_ms());
+    }
+}
+
+// Records the deadline of the request and the timeout of a downstream call
+// issued inside the callback.
+class DeadlineEchoService : public test::EchoService {
+public:
+    DeadlineEchoService() : remaining_us(-1), child_timeout_ms(-1) {}
+
+    void Echo(google::protobuf::RpcController* cntl_base,
+              const test::EchoRequest* req,
+              test::EchoResponse* res,
+              google::protobuf::Closure* done) override {
+        melon::ClosureGuard done_guard(done);
+        melon::Controller* cntl = static_cast<melon::Controller*>(cntl_base);
+        remaining_us = cntl->deadline_us() - mutil::gettimeofday_us();
+        melon::Channel channel;
+        melon::ChannelOptions opt;
+        opt.timeout_ms = 10000;
+        opt.max_retry = 0;
+        ASSERT_EQ(0, channel.Init("127.0.0.1:1", &opt));
+        test::EchoService_Stub stub(&channel);
+        melon::Controller child_cntl;
+        test::EchoResponse child_res;
+        stub.Echo(&child_cntl, req, &child_res, NULL);
+        child_timeout_ms = child_cntl.timeout_ms();
+        res->set_message(req->message());
+    }
+
+    int64_t remaining_us;
+    int64_t child_timeout_ms;
+};
+
+TEST_F(ControllerTest, deadline_round_trip) {
+    DeadlineEchoService svc;
+    melon::Server server;
+    ASSERT_EQ(0, server.AddService(&svc, melon::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start("127.0.0.1:0", NULL));
+    const bool saved_deliver = melon::policy::FLAGS_melon_std_protocol_deliver_timeout_ms;
+    melon::policy::FLAGS_melon_std_protocol_deliver_timeout_ms = true;
+    const char* const protocols[] = { "melon_std", "h2:grpc" };
+    for (size_t i = 0; i < ARRAY_SIZE(protocols); ++i) {
+        melon::Channel channel;
+        melon::ChannelOptions opt;
+        opt.protocol = protocols[i];
+        opt.timeout_ms = 2000;
+        opt.max_retry = 0;
+        ASSERT_EQ(0, channel.Init(server.listen_address(), &opt));
+        test::EchoService_Stub stub(&channel);
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message("hello");
+        svc.remaining_us = -1;
+        svc.child_timeout_ms = -1;
+        melon::Controller cntl;
+        stub.Echo(&cntl, &req, &res, NULL);
+        // The deadline counts from the moment the request was read, which
+        // leaves almost all the timeout to the callback.
+        ASSERT_FALSE(cntl.Failed()) << protocols[i] << ": " << cntl.ErrorText();
+        ASSERT_EQ("hello", res.message());
+        ASSERT_GT(svc.remaining_us, 1000 * 1000L) << protocols[i];
+        ASSERT_LE(svc.remaining_us, 2000 * 1000L) << protocols[i];
+        // The child call gets the remaining budget rather than its own
+        // timeout of the channel.
+        ASSERT_GT(svc.child_timeout_ms, 1000) << protocols[i];
+        ASSERT_LE(svc.child_timeout_ms, 2000) << protocols[i];
+    }
+    melon::policy::FLAGS_melon_std_protocol_deliver_timeout_ms = saved_deliver;
+    server.Stop(0);
+    server.Join();
+}
@@ -23,16 +23,19 @@
 // Date: Sun Jul 13 15:04:18 CST 2014
 
 #include <sys/types.h>
+#include <deque>
 #include <map>
 #include <gtest/gtest.h>
 #include <melon/fiber/fiber.h>
 #include <melon/utility/gperftools_profiler.h>
 #include <melon/utility/containers/doubly_buffered_data.h>
+#include <melon/utility/containers/epoch_buffered_data.h>
 #include <melon/rpc/describable.h>
 #include <melon/rpc/socket.h>
 #include <melon/rpc/socket_map.h>
 #include <melon/rpc/global.h>
 #include <melon/rpc/details/load_balancer_with_naming.h>
+#include <melon/rpc/details/controller_private_accessor.h>
 #include <melon/utility/strings/string_number_conversions.h>
 #include <melon/lb/weighted_round_robin_load_balancer.h>
 #include <melon/lb/round_robin_load_balancer.h>
@@ -40,10 +43,16 @@
 #include <melon/lb/randomized_load_balancer.h>
 #include <melon/lb/locality_aware_load_balancer.h>
 #include <melon/lb/consistent_hashing_load_balancer.h>
+#include <melon/lb/p2c_ewma_load_balancer.h>
+#include <melon/lb/utilization_load_balancer.h>
+#include <melon/lb/maglev_load_balancer.h>
+#include <melon/lb/subset_load_balancer.h>
+#include <melon/lb/zone_aware_load_balancer.h>
 #include <melon/rpc/policy/hasher.h>
 #include "echo.pb.h"
 #include <melon/rpc/channel.h>
 #include <melon/rpc/server.h>
+#include <melon/rpc/controller.h>
 
 namespace melon {
 DECLARE_int32(health_check_interval);
@@ -121,6 +130,46 @@ TEST_F(LoadBalancerTest, doubly_buffered_data) {
     test_doubly_buffered_data<mutil::DoublyBufferedData<Foo, mutil::Void, true>>();
 }
 
+bool SetFromForeground(Foo& bg, const Foo& fg, int n) {
+    bg.x = fg.x * n;
+    return true;
+}
+
+bool DoNothing(Foo&) {
+    return false;
+}
+
+TEST_F(LoadBalancerTest, epoch_buffered_data) {
+    test_doubly_buffered_data<mutil::EpochBufferedData<Foo>>();
+
+    mutil::EpochBufferedData<Foo> d;
+    ASSERT_EQ(1u, d.Modify(AddN, 1));
+    ASSERT_EQ(0u, d.Modify(DoNothing));
+    {
+        mutil::EpochBufferedData<Foo>::ScopedPtr ptr;
+        ASSERT_EQ(0, d.Read(&ptr));
+        ASSERT_EQ(1, ptr->x);
+        // Modify() is not blocked by the reading, replaced instances are
+        // kept until the reading ends.
+        ASSERT_EQ(1u, d.Modify(AddN, 2));
+        ASSERT_EQ(1u, d.ModifyWithForeground(SetFromForeground, 10));
+        ASSERT_EQ(1, ptr->x);
+        ASSERT_EQ(2u, d.retired_count());
+        {
+            // Nested reading sees the latest instance.
+            mutil::EpochBufferedData<Foo>::ScopedPtr ptr2;
+            ASSERT_EQ(0, d.Read(&ptr2));
+            ASSERT_EQ(30, ptr2->x);
+        }
+        ASSERT_EQ(1, ptr->x);
+    }
+    ASSERT_EQ(1u, d.Modify(AddN, 3));
+    ASSERT_EQ(0u, d.retired_count());
+    mutil::EpochBufferedData<Foo>::ScopedPtr ptr;
+    ASSERT_EQ(0, d.Read(&ptr));
+    ASSERT_EQ(33, ptr->x);
+}
+
 bool exitFlag = false;
 
 template <typename DBD>
@@ -224,7 +273,8 @@ void* read_dbd(void* void_arg) {
 }
 
 template<typename DBD>
-void PerfTest(int thread_num, bool modify_during_reading) {
+void PerfTest(int thread_num, bool modify_during_reading,
+              int modify_interval_us = 1000) {
     g_started = false;
     g_stopped = false;
     DBD dbd;
@@ -255,12 +305,19 @@ void PerfTest(int thread_num, bool modify_during_reading) {
     snprintf(prof_name, sizeof(prof_name), "doubly_buffered_data_%d.prof", ++g_prof_name_counter);
     ProfilerStart(prof_name);
     int64_t run_ms = 5 * 1000;
+    int64_t nmodify = 0;
+    int64_t modify_ns = 0;
     if (modify_during_reading) {
         int64_t start = mutil::gettimeofday_ms();
         int i = 1;
         while (mutil::gettimeofday_ms() - start < run_ms) {
+            mutil::Timer mt;
+            mt.start();
             ASSERT_TRUE(dbd.Modify(AddMapN, i++));
-            usleep(1000);
+            mt.stop();
+            modify_ns += mt.n_elapsed();
+            ++nmodify;
+            usleep(modify_interval_us);
         }
     } else {
         usleep(run_ms * 1000);
@@ -279,7 +336,9 @@ void PerfTest(int thread_num, bool modify_during_reading) {
               << " modify_during_reading=" << modify_during_reading
               << " count=" << count
               << " average_time=" << wait_time / (double)count
-              << " qps=" << (double)count / wait_time * (1000 * 1000 * 1000);
+              << " qps=" << (double)count / wait_time * (1000 * 1000 * 1000)
+              << " nmodify=" << nmodify
+              << " average_modify_time=" << modify_ns / (double)std::max(nmodify, (int64_t)1);
 }
 
 TEST_F(LoadBalancerTest, dbd_performance) {
@@ -308,6 +367,18 @@ TEST_F(LoadBalancerTest, dbd_performance) {
     PerfTest<mutil::DoublyBufferedData<PerfMap, mutil::Void, true>>(thread_num, true);
 }
 
+// Compare with DoublyBufferedData, including modifications at a high rate.
+TEST_F(LoadBalancerTest, ebd_performance) {
+    const int thread_nums[] = { 1, 8, 64 };
+    for (size_t i = 0; i < ARRAY_SIZE(thread_nums); ++i) {
+        const int thread_num = thread_nums[i];
+        PerfTest<mutil::EpochBufferedData<PerfMap>>(thread_num, false);
+        PerfTest<mutil::EpochBufferedData<PerfMap>>(thread_num, true);
+        PerfTest<mutil::DoublyBufferedData<PerfMap>>(thread_num, true, 10);
+        PerfTest<mutil::EpochBufferedData<PerfMap>>(thread_num, true, 10);
+    }
+}
+
 
 typedef melon::lb::LocalityAwareLoadBalancer LALB;
 
@@ -1284,4 +1355,563 @@ TEST_F(LoadBalancerTest, la_selection_too_long) {
     ASSERT_EQ(EHOSTDOWN, lb.SelectServer(in, &out));
 }
 
+static void CreateDummyServers(size_t n, std::vector<melon::ServerId>* ids) {
+    for (size_t i = 0; i < n; ++i) {
+        char addr[32];
+        snprintf(addr, sizeof(addr), "10.%d.%d.%d:8080",
+                 (int)(i >> 16) & 0xFF, (int)(i >> 8) & 0xFF, (int)i & 0xFF);
+        mutil::EndPoint dummy;
+        ASSERT_EQ(0, str2endpoint(addr, &dummy));
+        melon::ServerId id(8888);
+        melon::SocketOptions options;
+        options.remote_side = dummy;
+        ASSERT_EQ(0, melon::Socket::Create(options, &id.id));
+        ids->push_back(id);
+    }
+}
+
+TEST_F(LoadBalancerTest, p2c_ewma_prefers_faster_servers) {
+    melon::lb::P2CEwmaLoadBalancer lb;
+    std::vector<melon::ServerId> ids;
+    CreateDummyServers(4, &ids);
+    ASSERT_EQ(ids.size(), lb.AddServersInBatch(ids));
+    // The first server is 50 times slower than others.
+    const melon::SocketId slow_id = ids[0].id;
+    melon::Controller cntl;
+    melon::SocketUniquePtr ptr;
+    melon::LoadBalancer::SelectIn in = { 0, false, false, 0u, NULL };
+    melon::LoadBalancer::SelectOut out(&ptr);
+    int nslow = 0;
+    const int N = 10000;
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, lb.SelectServer(in, &out));
+        ASSERT_TRUE(out.need_feedback);
+        const melon::SocketId id = ptr->id();
+        if (id == slow_id) {
+            ++nslow;
+        }
+        const int64_t latency_us = (id == slow_id ? 50000 : 1000);
+        melon::LoadBalancer::CallInfo info = {
+            mutil::gettimeofday_us() - latency_us, id, 0, &cntl };
+        lb.Feedback(info);
+    }
+    LOG(INFO) << "slow server is selected " << nslow << " times of " << N;
+    ASSERT_LT(nslow, N / 20);
+
+    // Failing servers are not preferred even if they fail fast.
+    std::vector<melon::ServerId> removed(ids.begin(), ids.begin() + 1);
+    ASSERT_EQ(1u, lb.RemoveServersInBatch(removed));
+    cntl.set_timeout_ms(100);
+    const melon::SocketId bad_id = ids[1].id;
+    int nbad = 0;
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, lb.SelectServer(in, &out));
+        const melon::SocketId id = ptr->id();
+        nbad += (id == bad_id);
+        melon::LoadBalancer::CallInfo info = {
+            mutil::gettimeofday_us() - (id == bad_id ? 10 : 1000), id,
+            (id == bad_id ? ECONNREFUSED : 0), &cntl };
+        lb.Feedback(info);
+    }
+    ASSERT_LT(nbad, N / 20);
+
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(0, melon::Socket::SetFailed(ids[i].id));
+    }
+}
+
+TEST_F(LoadBalancerTest, utilization_spreads_by_capacity) {
+    melon::ServerLoad load;
+    load.cpu_utilization = 0.5;
+    load.concurrency = 30;
+    load.max_concurrency = 40;
+    std::string load_str;
+    melon::ServerLoadToString(load, &load_str);
+    melon::ServerLoad parsed;
+    ASSERT_TRUE(melon::ServerLoadFromString(load_str, &parsed));
+    ASSERT_EQ(30, parsed.concurrency);
+    ASSERT_EQ(40, parsed.max_concurrency);
+    ASSERT_DOUBLE_EQ(0.75, parsed.utilization());
+    ASSERT_FALSE(melon::ServerLoadFromString("concurrency=1", &parsed));
+
+    melon::lb::UtilizationLoadBalancer lb;
+    std::vector<melon::ServerId> ids;
+    CreateDummyServers(4, &ids);
+    ASSERT_EQ(ids.size(), lb.AddServersInBatch(ids));
+    // The last two servers have 4 times cores of the first two. Servers
+    // report utilization by their shares of recent requests.
+    const double capacity[] = { 1, 1, 4, 4 };
+    std::map<melon::SocketId, size_t> index_of;
+    for (size_t i = 0; i < ids.size(); ++i) {
+        index_of[ids[i].id] = i;
+    }
+    std::deque<size_t> window;
+    int nrecent[4] = { 0, 0, 0, 0 };
+    int nselected[4] = { 0, 0, 0, 0 };
+    melon::Controller cntl;
+    melon::SocketUniquePtr ptr;
+    melon::LoadBalancer::SelectIn in = { 0, false, false, 0u, NULL };
+    melon::LoadBalancer::SelectOut out(&ptr);
+    const int N = 20000;
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, lb.SelectServer(in, &out));
+        ASSERT_TRUE(out.need_feedback);
+        const size_t index = index_of[ptr->id()];
+        window.push_back(index);
+        ++nrecent[index];
+        if (window.size() > 200) {
+            --nrecent[window.front()];
+            window.pop_front();
+        }
+        if (i >= N / 2) {
+            ++nselected[index];
+        }
+        melon::ServerLoad report;
+        report.cpu_utilization = std::min(
+            1.0, nrecent[index] / (double)window.size() / (capacity[index] / 10) * 0.5);
+        melon::ControllerPrivateAccessor(&cntl).set_server_load(report);
+        melon::LoadBalancer::CallInfo info = {
+            mutil::gettimeofday_us() - 1000, ptr->id(), 0, &cntl };
+        lb.Feedback(info);
+    }
+    const double ratio = (double)(nselected[2] + nselected[3]) /
+                         (nselected[0] + nselected[1]);
+    LOG(INFO) << "selected=" << nselected[0] << ',' << nselected[1] << ','
+              << nselected[2] << ',' << nselected[3] << " ratio=" << ratio;
+    ASSERT_GT(ratio, 3.0);
+    ASSERT_LT(ratio, 5.0);
+
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(0, melon::Socket::SetFailed(ids[i].id));
+    }
+}
+
+// Compare costs of selection and feedback of p2c_ewma and la.
+TEST_F(LoadBalancerTest, p2c_ewma_vs_la_performance) {
+    std::vector<melon::ServerId> ids;
+    CreateDummyServers(5000, &ids);
+    melon::Controller cntl;
+    for (int round = 0; round < 2; ++round) {
+        melon::LoadBalancer* lb = NULL;
+        if (round == 0) {
+            lb = new LALB;
+        } else {
+            lb = new melon::lb::P2CEwmaLoadBalancer;
+        }
+        ASSERT_EQ(ids.size(), lb->AddServersInBatch(ids));
+        melon::SocketUniquePtr ptr;
+        melon::LoadBalancer::SelectIn in = { 0, false, false, 0u, NULL };
+        melon::LoadBalancer::SelectOut out(&ptr);
+        const int N = 200000;
+        mutil::Timer tm;
+        tm.start();
+        for (int i = 0; i < N; ++i) {
+            in.begin_time_us = mutil::gettimeofday_us();
+            ASSERT_EQ(0, lb->SelectServer(in, &out));
+            melon::LoadBalancer::CallInfo info = {
+                in.begin_time_us - 1000 - (int64_t)(ptr->id() % 10) * 100,
+                ptr->id(), 0, &cntl };
+            lb->Feedback(info);
+        }
+        tm.stop();
+        std::cout << mutil::class_name_str(*lb) << " with " << ids.size()
+                  << " servers: " << tm.n_elapsed() / N << "ns per select+feedback"
+                  << std::endl;
+        delete lb;
+    }
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(0, melon::Socket::SetFailed(ids[i].id));
+    }
+}
+
+TEST_F(LoadBalancerTest, consistent_hashing_with_bounded_loads) {
+    std::vector<melon::ServerId> ids;
+    CreateDummyServers(10, &ids);
+    melon::lb::ConsistentHashingLoadBalancer prototype(
+        melon::lb::CONS_HASH_LB_MURMUR3);
+    ASSERT_TRUE(prototype.New("epsilon=0") == NULL);
+    melon::LoadBalancer* lb = prototype.New("epsilon=0.25");
+    ASSERT_TRUE(lb != NULL);
+    ASSERT_EQ(ids.size(), lb->AddServersInBatch(ids));
+
+    melon::SocketUniquePtr ptr;
+    melon::LoadBalancer::SelectIn in = { 0, false, true, 12345u, NULL };
+    melon::LoadBalancer::SelectOut out(&ptr);
+    ASSERT_EQ(0, lb->SelectServer(in, &out));
+    ASSERT_TRUE(out.need_feedback);
+    const melon::SocketId home = ptr->id();
+    melon::Controller cntl;
+    melon::LoadBalancer::CallInfo info = { 0, home, 0, &cntl };
+    lb->Feedback(info);
+
+    // All requests share the same key, they spill over to other servers
+    // instead of piling up on the home server.
+    const int N = 1000;
+    std::map<melon::SocketId, int> inflight;
+    std::vector<melon::SocketId> selected;
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ++inflight[ptr->id()];
+        selected.push_back(ptr->id());
+    }
+    const int max_inflight = (int)ceil(1.25 * N / ids.size());
+    ASSERT_GE(inflight.size(), (size_t)N / max_inflight);
+    for (std::map<melon::SocketId, int>::iterator
+             it = inflight.begin(); it != inflight.end(); ++it) {
+        ASSERT_LE(it->second, max_inflight);
+    }
+    ASSERT_EQ(max_inflight, inflight[home]);
+
+    for (size_t i = 0; i < selected.size(); ++i) {
+        info.server_id = selected[i];
+        lb->Feedback(info);
+    }
+    ASSERT_EQ(0, static_cast<melon::lb::ConsistentHashingLoadBalancer*>(
+                  lb)->_total_inflight.load());
+    ASSERT_EQ(0, lb->SelectServer(in, &out));
+    ASSERT_EQ(home, ptr->id());
+    info.server_id = home;
+    lb->Feedback(info);
+
+    // Removed servers are never selected.
+    ASSERT_TRUE(lb->RemoveServer(ids[0]));
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ASSERT_NE(ids[0].id, ptr->id());
+    }
+    lb->Destroy();
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(0, melon::Socket::SetFailed(ids[i].id));
+    }
+}
+
+static void MaglevSelectAll(melon::LoadBalancer* lb, size_t n,
+                            std::vector<melon::SocketId>* selected) {
+    melon::SocketUniquePtr ptr;
+    melon::LoadBalancer::SelectIn in = { 0, false, true, 0u, NULL };
+    melon::LoadBalancer::SelectOut out(&ptr);
+    selected->clear();
+    for (size_t i = 0; i < n; ++i) {
+        in.request_code = melon::policy::MurmurHash32(&i, sizeof(i));
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        selected->push_back(ptr->id());
+    }
+}
+
+TEST_F(LoadBalancerTest, maglev_minimal_disruption) {
+    std::vector<melon::ServerId> ids;
+    CreateDummyServers(100, &ids);
+    melon::lb::MaglevLoadBalancer lb;
+    ASSERT_EQ(ids.size(), lb.AddServersInBatch(ids));
+    const size_t N = 100000;
+    std::vector<melon::SocketId> before;
+    MaglevSelectAll(&lb, N, &before);
+
+    const melon::ServerId removed = ids[17];
+    ASSERT_TRUE(lb.RemoveServer(removed));
+    ASSERT_FALSE(lb.RemoveServer(removed));
+    std::vector<melon::SocketId> after;
+    MaglevSelectAll(&lb, N, &after);
+    size_t nmoved = 0;
+    for (size_t i = 0; i < N; ++i) {
+        ASSERT_NE(removed.id, after[i]);
+        if (before[i] != removed.id && before[i] != after[i]) {
+            ++nmoved;
+        }
+    }
+    std::cout << "moved " << nmoved << " of " << N
+              << " requests not on the removed server" << std::endl;
+    ASSERT_LT(nmoved, N / 50);
+
+    // Same servers, same table.
+    ASSERT_TRUE(lb.AddServer(removed));
+    ASSERT_FALSE(lb.AddServer(removed));
+    MaglevSelectAll(&lb, N, &after);
+    ASSERT_TRUE(before == after);
+
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(0, melon::Socket::SetFailed(ids[i].id));
+    }
+    // Failed servers are skipped.
+    melon::SocketUniquePtr ptr;
+    melon::LoadBalancer::SelectIn in = { 0, false, true, 0u, NULL };
+    melon::LoadBalancer::SelectOut out(&ptr);
+    ASSERT_EQ(EHOSTDOWN, lb.SelectServer(in, &out));
+    in.has_request_code = false;
+    ASSERT_EQ(EINVAL, lb.SelectServer(in, &out));
+}
+
+TEST_F(LoadBalancerTest, maglev_tries_every_server) {
+    std::vector<melon::ServerId> ids;
+    CreateDummyServers(10, &ids);
+    melon::lb::MaglevLoadBalancer lb;
+    ASSERT_EQ(ids.size(), lb.AddServersInBatch(ids));
+    // Slots of the failed servers interleave, the only available server is
+    // found no matter where the walk starts.
+    for (size_t i = 1; i < ids.size(); ++i) {
+        ASSERT_EQ(0, melon::Socket::SetFailed(ids[i].id));
+    }
+    std::vector<melon::SocketId> selected;
+    MaglevSelectAll(&lb, 10000, &selected);
+    for (size_t i = 0; i < selected.size(); ++i) {
+        ASSERT_EQ(ids[0].id, selected[i]);
+    }
+    // The last server is taken even if it's excluded.
+    melon::ExcludedServers* excluded = melon::ExcludedServers::Create(1);
+    excluded->Add(ids[0].id);
+    melon::SocketUniquePtr ptr;
+    melon::LoadBalancer::SelectIn in = { 0, false, true, 0u, excluded };
+    melon::LoadBalancer::SelectOut out(&ptr);
+    for (uint32_t code = 0; code < 1000; ++code) {
+        in.request_code = melon::policy::MurmurHash32(&code, sizeof(code));
+        ASSERT_EQ(0, lb.SelectServer(in, &out));
+        ASSERT_EQ(ids[0].id, ptr->id());
+    }
+    ASSERT_EQ(0, melon::Socket::SetFailed(ids[0].id));
+    ASSERT_EQ(EHOSTDOWN, lb.SelectServer(in, &out));
+    melon::ExcludedServers::Destroy(excluded);
+}
+
+TEST_F(LoadBalancerTest, maglev_weight) {
+    std::vector<melon::ServerId> ids;
+    CreateDummyServers(10, &ids);
+    ids[0].tag = "4";
+    ids[1].tag = "invalid";
+    melon::lb::MaglevLoadBalancer lb;
+    ASSERT_EQ(ids.size() - 1, lb.AddServersInBatch(ids));
+    const size_t N = 200000;
+    std::vector<melon::SocketId> selected;
+    MaglevSelectAll(&lb, N, &selected);
+    std::map<melon::SocketId, size_t> counts;
+    for (size_t i = 0; i < N; ++i) {
+        ++counts[selected[i]];
+    }
+    ASSERT_EQ(0u, counts.count(ids[1].id));
+    const double ratio = (double)counts[ids[0].id] / counts[ids[2].id];
+    std::cout << "ratio of weight 4 to weight 1: " << ratio << std::endl;
+    ASSERT_GT(ratio, 3.5);
+    ASSERT_LT(ratio, 4.5);
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(0, melon::Socket::SetFailed(ids[i].id));
+    }
+}
+
+TEST_F(LoadBalancerTest, maglev_performance) {
+    std::vector<melon::ServerId> ids;
+    CreateDummyServers(10000, &ids);
+    melon::lb::MaglevLoadBalancer prototype;
+    ASSERT_TRUE(prototype.New("table_size=1000000") == NULL);
+    for (int round = 0; round < 2; ++round) {
+        melon::LoadBalancer* lb = NULL;
+        if (round == 0) {
+            lb = new melon::lb::ConsistentHashingLoadBalancer(
+                melon::lb::CONS_HASH_LB_MURMUR3);
+        } else {
+            lb = prototype.New("table_size=1000003");
+            ASSERT_TRUE(lb != NULL);
+        }
+        mutil::Timer tm;
+        tm.start();
+        ASSERT_EQ(ids.size(), lb->AddServersInBatch(ids));
+        tm.stop();
+        const int64_t build_us = tm.u_elapsed();
+        tm.start();
+        ASSERT_TRUE(lb->RemoveServer(ids[0]));
+        ASSERT_TRUE(lb->AddServer(ids[0]));
+        tm.stop();
+        const int64_t rebuild_us = tm.u_elapsed() / 2;
+
+        melon::SocketUniquePtr ptr;
+        melon::LoadBalancer::SelectIn in = { 0, false, true, 0u, NULL };
+        melon::LoadBalancer::SelectOut out(&ptr);
+        const int N = 1000000;
+        tm.start();
+        for (int i = 0; i < N; ++i) {
+            in.request_code = (uint32_t)i * 2654435761u;
+            ASSERT_EQ(0, lb->SelectServer(in, &out));
+        }
+        tm.stop();
+        std::cout << mutil::class_name_str(*lb) << " with " << ids.size()
+                  << " servers: build=" << build_us << "us"
+                  << " rebuild=" << rebuild_us << "us"
+                  << " select=" << tm.n_elapsed() / N << "ns" << std::endl;
+        lb->Destroy();
+    }
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(0, melon::Socket::SetFailed(ids[i].id));
+    }
+}
+
+static melon::lb::SubsetLoadBalancer* NewSubsetLB(
+    uint64_t client_id, size_t min_subset_size) {
+    melon::lb::SubsetOptions options;
+    options.client_id = client_id;
+    options.min_subset_size = min_subset_size;
+    options.resize_interval_ms = 0;
+    melon::lb::RoundRobinLoadBalancer rr;
+    return new melon::lb::SubsetLoadBalancer(rr.New(""), options);
+}
+
+TEST_F(LoadBalancerTest, subset_is_deterministic_and_balanced) {
+    std::vector<melon::ServerId> ids;
+    CreateDummyServers(500, &ids);
+    const size_t NCLIENT = 200;
+    const size_t SUBSET_SIZE = 10;
+    std::map<melon::SocketId, size_t> nclients;
+    for (size_t i = 0; i < NCLIENT; ++i) {
+        const uint64_t client_id = i;
+        melon::lb::SubsetLoadBalancer* lb = NewSubsetLB(client_id, SUBSET_SIZE);
+        ASSERT_EQ(ids.size(), lb->AddServersInBatch(ids));
+        ASSERT_EQ(SUBSET_SIZE, lb->subset_size());
+        for (size_t j = 0; j < lb->_subset.size(); ++j) {
+            ++nclients[lb->_subset[j].id];
+        }
+        // Same client, same subset, no matter how servers are added.
+        melon::lb::SubsetLoadBalancer* lb2 = NewSubsetLB(client_id, SUBSET_SIZE);
+        for (size_t j = ids.size(); j > 0; --j) {
+            ASSERT_TRUE(lb2->AddServer(ids[j - 1]));
+        }
+        ASSERT_TRUE(lb->_subset == lb2->_subset);
+        lb->Destroy();
+        lb2->Destroy();
+    }
+    // 4 clients per server on average, each server is used by every 50
+    // consecutive clients once.
+    const size_t avg = NCLIENT * SUBSET_SIZE / ids.size();
+    ASSERT_EQ(ids.size(), nclients.size());
+    for (std::map<melon::SocketId, size_t>::iterator
+             it = nclients.begin(); it != nclients.end(); ++it) {
+        ASSERT_GE(it->second, avg - 1);
+        ASSERT_LE(it->second, avg + 1);
+    }
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(0, melon::Socket::SetFailed(ids[i].id));
+    }
+}
+
+TEST_F(LoadBalancerTest, subset_follows_server_changes) {
+    std::vector<melon::ServerId> ids;
+    CreateDummyServers(100, &ids);
+    melon::lb::SubsetLoadBalancer* lb = NewSubsetLB(7, 10);
+    ASSERT_EQ(ids.size(), lb->AddServersInBatch(ids));
+    const std::vector<melon::ServerId> before = lb->_subset;
+    // A removed server is replaced.
+    ASSERT_TRUE(lb->RemoveServer(before[3]));
+    ASSERT_EQ(before.size(), lb->_subset.size());
+    ASSERT_FALSE(std::binary_search(lb->_subset.begin(), lb->_subset.end(),
+                                    before[3]));
+    // Adding it back restores the subset.
+    ASSERT_TRUE(lb->AddServer(before[3]));
+    ASSERT_TRUE(before == lb->_subset);
+    ASSERT_FALSE(lb->AddServer(before[3]));
+    lb->Destroy();
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(0, melon::Socket::SetFailed(ids[i].id));
+    }
+}
+
+TEST_F(LoadBalancerTest, subset_resizes_with_load) {
+    std::vector<melon::ServerId> ids;
+    CreateDummyServers(100, &ids);
+    melon::lb::SubsetLoadBalancer* lb = NewSubsetLB(7, 4);
+    ASSERT_EQ(ids.size(), lb->AddServersInBatch(ids));
+    ASSERT_EQ(4u, lb->subset_size());
+    melon::SocketUniquePtr ptr;
+    melon::LoadBalancer::SelectIn in = { 0, false, false, 0u, NULL };
+    melon::LoadBalancer::SelectOut out(&ptr);
+    std::vector<melon::SocketId> selected;
+    for (int i = 0; i < 200; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ASSERT_TRUE(out.need_feedback);
+        selected.push_back(ptr->id());
+    }
+    const size_t grown_size = lb->subset_size();
+    ASSERT_GT(grown_size, 4u);
+    melon::Controller cntl;
+    for (size_t i = 0; i < selected.size(); ++i) {
+        melon::LoadBalancer::CallInfo info = { 0, selected[i], 0, &cntl };
+        lb->Feedback(info);
+    }
+    for (int i = 0; i < 200; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        melon::LoadBalancer::CallInfo info = { 0, ptr->id(), 0, &cntl };
+        lb->Feedback(info);
+    }
+    ASSERT_EQ(4u, lb->subset_size());
+    lb->Destroy();
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(0, melon::Socket::SetFailed(ids[i].id));
+    }
+}
+
+TEST_F(LoadBalancerTest, zone_aware_spills_over_unhealthy_zone) {
+    std::vector<melon::ServerId> ids;
+    CreateDummyServers(18, &ids);
+    const char* const zones[] = { "a", "b", "c" };
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ids[i].tag = std::string("zone=") + zones[i % 3] + " 10";
+    }
+    melon::lb::ZoneAwareLoadBalancer prototype;
+    ASSERT_TRUE(prototype.New("lb=zone_aware") == NULL);
+    ASSERT_TRUE(prototype.New("lb=not_exist") == NULL);
+    melon::lb::ZoneAwareLoadBalancer* lb =
+        static_cast<melon::lb::ZoneAwareLoadBalancer*>(
+            prototype.New("zone=a lb=wrr latency_factor=0 probe_permille=0"));
+    ASSERT_TRUE(lb != NULL);
+    // The zone is removed from tags fed to wrr.
+    melon::ServerId inner;
+    ASSERT_TRUE(lb->ToInnerServer(ids[0], &inner));
+    ASSERT_EQ("10", inner.tag);
+    ASSERT_FALSE(lb->ToInnerServer(ids[1], &inner));
+    ASSERT_EQ(ids.size(), lb->AddServersInBatch(ids));
+
+    melon::SocketUniquePtr ptr;
+    melon::LoadBalancer::SelectIn in = { 0, false, false, 0u, NULL };
+    melon::LoadBalancer::SelectOut out(&ptr);
+    std::map<melon::SocketId, size_t> zone_of;
+    for (size_t i = 0; i < ids.size(); ++i) {
+        zone_of[ids[i].id] = i % 3;
+    }
+    const int N = 10000;
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ASSERT_TRUE(out.need_feedback);
+        ASSERT_EQ(0u, zone_of[ptr->id()]);
+    }
+    ASSERT_EQ(0, lb->spill_permille());
+
+    // Half of servers in the local zone are down.
+    for (size_t i = 0; i < 3; ++i) {
+        ASSERT_EQ(0, melon::Socket::SetFailed(ids[i * 3].id));
+    }
+    lb->_last_update_us.store(0);
+    size_t nzone[3] = { 0, 0, 0 };
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ++nzone[zone_of[ptr->id()]];
+    }
+    ASSERT_EQ(500, lb->spill_permille());
+    std::cout << "local=" << nzone[0] << " b=" << nzone[1]
+              << " c=" << nzone[2] << std::endl;
+    ASSERT_NEAR(N / 2, nzone[0], N / 20);
+    ASSERT_NEAR(nzone[1], nzone[2], N / 20);
+
+    // All local servers are down.
+    for (size_t i = 3; i < 6; ++i) {
+        ASSERT_EQ(0, melon::Socket::SetFailed(ids[i * 3].id));
+    }
+    lb->_last_update_us.store(0);
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ASSERT_NE(0u, zone_of[ptr->id()]);
+    }
+    ASSERT_EQ(1000, lb->spill_permille());
+    ASSERT_FALSE(melon::var::Variable::describe_exposed(
+                     "zone_aware_lb_cross_zone_percent").empty());
+    lb->Destroy();
+    for (size_t i = 0; i < ids.size(); ++i) {
+        melon::Socket::SetFailed(ids[i].id);
+    }
+}
+
 } //namespace
@@ -19,11 +19,15 @@
 
 
 #include <stdio.h>
+#include <utime.h>
+#include <sys/stat.h>
 #include <gtest/gtest.h>
 #include <vector>
 #include <melon/utility/string_printf.h>
 #include <melon/utility/strings/string_split.h>
 #include "melon/utility/files/temp_file.h"
+#include <melon/utility/files/scoped_temp_dir.h>
+#include <melon/utility/files/file_enumerator.h>
 #include <melon/fiber/fiber.h>
 #include <melon/rpc/http/http_status_code.h>
 #include <melon/naming/consul_naming_service.h>
@@ -33,12 +37,16 @@
 #include <melon/naming/remote_file_naming_service.h>
 #include <melon/naming/discovery_naming_service.h>
 #include <melon/naming/nacos_naming_service.h>
+#include <melon/naming/naming_service_thread.h>
+#include <melon/rpc/socket.h>
 #include "echo.pb.h"
 #include <melon/rpc/server.h>
 
 
 namespace melon {
 DECLARE_int32(health_check_interval);
+DECLARE_string(naming_service_cache_dir);
+DECLARE_int32(naming_service_cache_max_age_s);
 
 namespace naming {
 
@@ -826,4 +834,236 @@ TEST(NamingServiceTest, nacos) {
     }
 }
 
+// Keep the actions to feed deltas from the test.
+class ManualNamingService : public melon::NamingService {
+public:
+    explicit ManualNamingService(bool returns_quickly)
+        : actions(NULL), fail(false), done(false)
+        , _returns_quickly(returns_quickly) {}
+
+    int RunNamingService(const char*,
+                         melon::NamingServiceActions* actions_in) override {
+        actions = actions_in;
+        if (!initial.empty() || fail) {
+            actions->ResetServers(initial);
+        }
+        done = true;
+        return fail ? EHOSTDOWN : 0;
+    }
+    bool RunNamingServiceReturnsQuickly() override { return _returns_quickly; }
+    void Describe(std::ostream& os, const melon::DescribeOptions&) const override {
+        os << "manual";
+    }
+    melon::NamingService* New() const override {
+        return new ManualNamingService(_returns_quickly);
+    }
+    void Destroy() override { delete this; }
+
+    melon::NamingServiceActions* actions;
+    std::vector<melon::ServerNode> initial;
+    bool fail;
+    mutil::atomic<bool> done;
+
+private:
+    bool _returns_quickly;
+};
+
+class AddressWatcher : public melon::NamingServiceWatcher {
+public:
+    AddressWatcher() : nnotified(0) {}
+
+    void OnAddedServers(const std::vector<melon::ServerId>& servers) override {
+        for (size_t i = 0; i < servers.size(); ++i) {
+            melon::SocketUniquePtr ptr;
+            ASSERT_EQ(0, melon::Socket::Address(servers[i].id, &ptr));
+            ASSERT_TRUE(addresses.insert(mutil::endpoint2str(
+                            ptr->remote_side()).c_str()).second);
+            ids[servers[i].id] = ptr->remote_side();
+        }
+        nnotified.fetch_add(1, mutil::memory_order_release);
+    }
+    void OnRemovedServers(const std::vector<melon::ServerId>& servers) override {
+        for (size_t i = 0; i < servers.size(); ++i) {
+            ASSERT_EQ(1u, addresses.erase(mutil::endpoint2str(
+                              ids[servers[i].id]).c_str()));
+        }
+        nnotified.fetch_add(1, mutil::memory_order_release);
+    }
+
+    std::set<std::string> addresses;
+    mutil::atomic<int> nnotified;
+    std::map<melon::SocketId, mutil::EndPoint> ids;
+};
+
+static std::vector<melon::ServerNode> MakeNodes(
+    const std::vector<std::string>& addrs) {
+    std::vector<melon::ServerNode> nodes;
+    for (size_t i = 0; i < addrs.size(); ++i) {
+        melon::ServerNode node;
+        EXPECT_EQ(0, mutil::str2endpoint(addrs[i].c_str(), &node.addr));
+        nodes.push_back(node);
+    }
+    return nodes;
+}
+
+TEST(NamingServiceTest, incremental_updates) {
+    ManualNamingService* ns = new ManualNamingService(true);
+    ns->initial = MakeNodes({"127.0.0.1:9001", "127.0.0.1:9002", "127.0.0.1:9003"});
+    mutil::intrusive_ptr<melon::NamingServiceThread> nsthr(
+        new melon::NamingServiceThread);
+    ASSERT_EQ(0, nsthr->Start(ns, "manual", "incremental_updates", NULL));
+    AddressWatcher watcher;
+    ASSERT_EQ(0, nsthr->AddWatcher(&watcher));
+    ASSERT_EQ(3u, watcher.addresses.size());
+
+    // Existing servers are ignored.
+    ns->actions->AddServers(MakeNodes({"127.0.0.1:9004", "127.0.0.1:9001",
+                                       "127.0.0.1:9004"}));
+    ASSERT_EQ(4u, watcher.addresses.size());
+    ASSERT_EQ(1u, watcher.addresses.count("127.0.0.1:9004"));
+
+    // Missing servers are ignored.
+    ns->actions->RemoveServers(MakeNodes({"127.0.0.1:9005", "127.0.0.1:9002"}));
+    const std::set<std::string> expected{
+        "127.0.0.1:9001", "127.0.0.1:9003", "127.0.0.1:9004"};
+    ASSERT_EQ(expected, watcher.addresses);
+
+    // Full lists still work and are diffed against deltas.
+    ns->actions->ResetServers(MakeNodes({"127.0.0.1:9004", "127.0.0.1:9006"}));
+    const std::set<std::string> expected2{"127.0.0.1:9004", "127.0.0.1:9006"};
+    ASSERT_EQ(expected2, watcher.addresses);
+    ASSERT_EQ(0, nsthr->RemoveWatcher(&watcher));
+}
+
+TEST(NamingServiceTest, cached_servers) {
+    mutil::ScopedTempDir dir;
+    ASSERT_TRUE(dir.CreateUniqueTempDir());
+    const std::string saved_dir = melon::FLAGS_naming_service_cache_dir;
+    melon::FLAGS_naming_service_cache_dir = dir.path().value();
+    const char* const service_name = "cached/servers?x=1";
+    {
+        ManualNamingService* ns = new ManualNamingService(false);
+        ns->initial = MakeNodes({"127.0.0.1:9001", "127.0.0.1:9002"});
+        mutil::intrusive_ptr<melon::NamingServiceThread> nsthr(
+            new melon::NamingServiceThread);
+        ASSERT_EQ(0, nsthr->Start(ns, "manual", service_name, NULL));
+        ns->actions->AddServers(MakeNodes({"127.0.0.1:9003"}));
+    }
+    {
+        // The registry is down, servers saved above are used.
+        ManualNamingService* ns = new ManualNamingService(false);
+        ns->fail = true;
+        mutil::intrusive_ptr<melon::NamingServiceThread> nsthr(
+            new melon::NamingServiceThread);
+        ASSERT_EQ(0, nsthr->Start(ns, "manual", service_name, NULL));
+        while (!ns->done) {
+            fiber_usleep(1000);
+        }
+        AddressWatcher watcher;
+        ASSERT_EQ(0, nsthr->AddWatcher(&watcher));
+        const std::set<std::string> expected{
+            "127.0.0.1:9001", "127.0.0.1:9002", "127.0.0.1:9003"};
+        ASSERT_EQ(expected, watcher.addresses);
+        ASSERT_EQ(0, nsthr->RemoveWatcher(&watcher));
+    }
+    {
+        // Lists from the naming service override the cached one.
+        ManualNamingService* ns = new ManualNamingService(false);
+        ns->initial = MakeNodes({"127.0.0.1:9004"});
+        mutil::intrusive_ptr<melon::NamingServiceThread> nsthr(
+            new melon::NamingServiceThread);
+        ASSERT_EQ(0, nsthr->Start(ns, "manual", service_name, NULL));
+        while (!ns->done) {
+            fiber_usleep(1000);
+        }
+        AddressWatcher watcher;
+        ASSERT_EQ(0, nsthr->AddWatcher(&watcher));
+        const std::set<std::string> expected{"127.0.0.1:9004"};
+        ASSERT_EQ(expected, watcher.addresses);
+        ASSERT_EQ(0, nsthr->RemoveWatcher(&watcher));
+    }
+    melon::FLAGS_naming_service_cache_dir = saved_dir;
+}
+
+TEST(NamingServiceTest, cached_servers_refreshed) {
+    mutil::ScopedTempDir dir;
+    ASSERT_TRUE(dir.CreateUniqueTempDir());
+    const std::string saved_dir = melon::FLAGS_naming_service_cache_dir;
+    melon::FLAGS_naming_service_cache_dir = dir.path().value();
+    const char* const service_name = "cached/refreshed";
+    melon::GetNamingServiceThreadOptions opt;
+    opt.channel_signature.data[0] = 1;
+    {
+        // Channels with different signatures don't share the file.
+        ManualNamingService* ns = new ManualNamingService(false);
+        ns->initial = MakeNodes({"127.0.0.1:9001"});
+        mutil::intrusive_ptr<melon::NamingServiceThread> nsthr(
+            new melon::NamingServiceThread);
+        ASSERT_EQ(0, nsthr->Start(ns, "manual", service_name, NULL));
+        ManualNamingService* ns2 = new ManualNamingService(false);
+        ns2->initial = MakeNodes({"127.0.0.1:9002"});
+        mutil::intrusive_ptr<melon::NamingServiceThread> nsthr2(
+            new melon::NamingServiceThread);
+        ASSERT_EQ(0, nsthr2->Start(ns2, "manual", service_name, &opt));
+    }
+    std::vector<mutil::FilePath> files;
+    mutil::FileEnumerator e(dir.path(), false, mutil::FileEnumerator::FILES);
+    for (mutil::FilePath p = e.Next(); !p.empty(); p = e.Next()) {
+        files.push_back(p);
+        // Pretend that the registry has not changed for a while, the
+        // cache is still loaded but ages until it's refreshed.
+        const time_t old = time(NULL) - melon::FLAGS_naming_service_cache_max_age_s * 3 / 4;
+        struct utimbuf times = { old, old };
+        ASSERT_EQ(0, utime(p.value().c_str(), &times));
+    }
+    ASSERT_EQ(2u, files.size());
+    {
+        // The cached list confirmed by the registry refreshes the cache.
+        ManualNamingService* ns = new ManualNamingService(false);
+        ns->initial = MakeNodes({"127.0.0.1:9001"});
+        mutil::intrusive_ptr<melon::NamingServiceThread> nsthr(
+            new melon::NamingServiceThread);
+        ASSERT_EQ(0, nsthr->Start(ns, "manual", service_name, NULL));
+        while (!ns->done) {
+            fiber_usleep(1000);
+        }
+    }
+    size_t nfresh = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        struct stat st;
+        ASSERT_EQ(0, stat(files[i].value().c_str(), &st));
+        if (time(NULL) - st.st_mtime < melon::FLAGS_naming_service_cache_max_age_s / 2) {
+            ++nfresh;
+        }
+    }
+    ASSERT_EQ(1u, nfresh);
+    melon::FLAGS_naming_service_cache_dir = saved_dir;
+}
+
+TEST(NamingServiceTest, file_reloaded_on_change) {
+    mutil::TempFile tmp_file;
+    ASSERT_EQ(0, tmp_file.save("127.0.0.1:9001\n127.0.0.1:9002\n"));
+    const std::string url = std::string("file://") + tmp_file.fname();
+    mutil::intrusive_ptr<melon::NamingServiceThread> nsthr;
+    ASSERT_EQ(0, melon::GetNamingServiceThread(&nsthr, url.c_str(), NULL));
+    AddressWatcher watcher;
+    ASSERT_EQ(0, nsthr->AddWatcher(&watcher));
+    ASSERT_EQ(2u, watcher.addresses.size());
+    ASSERT_EQ(1, watcher.nnotified.load());
+
+    ASSERT_EQ(0, tmp_file.save("127.0.0.1:9001\n127.0.0.1:9003\n"
+                               "127.0.0.1:9004\n"));
+    // Reloaded by notifications rather than the fallback polling which
+    // runs every second. 9002 is removed and 9003/9004 are added.
+    const int64_t start_us = mutil::gettimeofday_us();
+    while (watcher.nnotified.load(mutil::memory_order_acquire) != 3 &&
+           mutil::gettimeofday_us() - start_us < 800000L) {
+        fiber_usleep(1000);
+    }
+    const std::set<std::string> expected{
+        "127.0.0.1:9001", "127.0.0.1:9003", "127.0.0.1:9004"};
+    ASSERT_EQ(expected, watcher.addresses);
+    ASSERT_EQ(0, nsthr->RemoveWatcher(&watcher));
+}
+
 } //namespace
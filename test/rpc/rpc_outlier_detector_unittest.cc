@@ -0,0 +1,154 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#include <vector>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include <melon/utility/time.h>
+#include <melon/rpc/socket.h>
+#include <melon/rpc/controller.h>
+#include <melon/rpc/outlier_detector.h>
+
+namespace melon {
+DECLARE_int32(outlier_detection_base_ejection_ms);
+} // namespace melon
+
+namespace {
+
+class OutlierDetectorTest : public ::testing::Test {
+protected:
+    // At least -outlier_detection_min_servers.
+    virtual size_t NumServers() const { return 10; }
+
+    void SetUp() override {
+        for (size_t i = 0; i < NumServers(); ++i) {
+            char addr[32];
+            snprintf(addr, sizeof(addr), "192.168.3.%d:8080", (int)i);
+            mutil::EndPoint dummy;
+            ASSERT_EQ(0, str2endpoint(addr, &dummy));
+            melon::ServerId id(8888);
+            melon::SocketOptions options;
+            options.remote_side = dummy;
+            ASSERT_EQ(0, melon::Socket::Create(options, &id.id));
+            _ids.push_back(id);
+        }
+        _detector.AddServers(_ids);
+    }
+
+    void TearDown() override {
+        for (size_t i = 0; i < _ids.size(); ++i) {
+            melon::Socket::SetFailed(_ids[i].id);
+        }
+    }
+
+    // Feed `n' calls to each server, the i-th server takes latencies[i]
+    // microseconds and fails when i is in `failing'.
+    void Feed(const std::vector<int64_t>& latencies, size_t failing, int n) {
+        for (int k = 0; k < n; ++k) {
+            for (size_t i = 0; i < _ids.size(); ++i) {
+                const melon::LoadBalancer::CallInfo info = {
+                    mutil::gettimeofday_us() - latencies[i], _ids[i].id,
+                    (i == failing ? melon::EINTERNAL : 0), &_cntl };
+                _detector.OnCallEnd(info);
+            }
+        }
+    }
+
+    bool IsAvailable(size_t i) {
+        melon::SocketUniquePtr ptr;
+        return melon::Socket::Address(_ids[i].id, &ptr) == 0 && ptr->IsAvailable();
+    }
+
+    std::vector<melon::ServerId> _ids;
+    melon::OutlierDetector _detector;
+    melon::Controller _cntl;
+};
+
+TEST_F(OutlierDetectorTest, eject_slow_server) {
+    std::vector<int64_t> latencies(_ids.size(), 1000);
+    latencies[3] = 20000;
+    Feed(latencies, (size_t)-1, 50);
+    ASSERT_EQ(1u, _detector.Evaluate());
+    for (size_t i = 0; i < _ids.size(); ++i) {
+        ASSERT_EQ(i != 3, IsAvailable(i)) << i;
+    }
+    // Too few requests in this interval.
+    Feed(latencies, (size_t)-1, 1);
+    ASSERT_EQ(0u, _detector.Evaluate());
+}
+
+TEST_F(OutlierDetectorTest, eject_failing_server_with_cap) {
+    std::vector<int64_t> latencies(_ids.size(), 1000);
+    latencies[5] = 50000;
+    // Both server 5 and 7 are outliers, only 10% of 10 servers are ejected,
+    // the slower one first.
+    Feed(latencies, 7, 50);
+    ASSERT_EQ(1u, _detector.Evaluate());
+    ASSERT_FALSE(IsAvailable(5));
+    ASSERT_TRUE(IsAvailable(7));
+}
+
+TEST_F(OutlierDetectorTest, exponential_ejection) {
+    std::vector<int64_t> latencies(_ids.size(), 1000);
+    latencies[0] = 20000;
+    const int64_t base_us = melon::FLAGS_outlier_detection_base_ejection_ms * 1000L;
+    int64_t expected_us = base_us;
+    for (int round = 0; round < 3; ++round) {
+        // The server is back.
+        for (size_t i = 0; i < _ids.size(); ++i) {
+            melon::SocketUniquePtr ptr;
+            ASSERT_EQ(0, melon::Socket::Address(_ids[i].id, &ptr));
+            ptr->SetEjectedUntil(0);
+        }
+        {
+            mutil::DoublyBufferedData<melon::OutlierDetector::StatsMap>::ScopedPtr s;
+            ASSERT_EQ(0, _detector._db_stats.Read(&s));
+            s->find(_ids[0].id)->second->ejected_until_us = 0;
+        }
+
+        Feed(latencies, (size_t)-1, 50);
+        const int64_t now_us = mutil::cpuwide_time_us();
+        ASSERT_EQ(1u, _detector.Evaluate());
+        melon::SocketUniquePtr ptr;
+        ASSERT_EQ(0, melon::Socket::Address(_ids[0].id, &ptr));
+        const int64_t duration_us = ptr->_ejected_until_us.load() - now_us;
+        ASSERT_GE(duration_us, expected_us);
+        ASSERT_LT(duration_us, expected_us + 1000000);
+        expected_us *= 2;
+    }
+}
+
+class SmallClusterOutlierDetectorTest : public OutlierDetectorTest {
+protected:
+    size_t NumServers() const override { return 5; }
+};
+
+TEST_F(SmallClusterOutlierDetectorTest, eject_one_server) {
+    std::vector<int64_t> latencies(_ids.size(), 1000);
+    latencies[1] = 20000;
+    latencies[2] = 30000;
+    // 10% of 5 servers rounds down to 0, one server is still ejectable.
+    Feed(latencies, (size_t)-1, 50);
+    ASSERT_EQ(1u, _detector.Evaluate());
+    for (size_t i = 0; i < _ids.size(); ++i) {
+        ASSERT_EQ(i != 2, IsAvailable(i)) << i;
+    }
+}
+
+} // namespace
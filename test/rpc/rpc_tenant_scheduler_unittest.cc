@@ -0,0 +1,304 @@
+//
+// Copyright (C) 2024 EA group inc.
+// Author: Jeff.li lijippy@163.com
+// All rights reserved.
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include <melon/fiber/fiber.h>
+#include <melon/fiber/countdown_event.h>
+#include <melon/utility/time.h>
+#include <melon/utility/synchronization/lock.h>
+#include <melon/utility/scoped_lock.h>
+#include <melon/rpc/controller.h>
+#include <melon/rpc/channel.h>
+#include <melon/rpc/server.h>
+#include <melon/rpc/tenant_scheduler.h>
+#include "echo.pb.h"
+
+namespace {
+
+class TenantSchedulerTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        _opt.key_type = melon::TENANT_BY_HEADER;
+        _opt.key_name = "tenant";
+    }
+
+    static void SetTenant(melon::Controller* cntl, const std::string& tenant) {
+        (*cntl->request_user_fields())["tenant"] = tenant;
+    }
+
+    melon::TenantSchedulerOptions _opt;
+};
+
+TEST_F(TenantSchedulerTest, invalid_options) {
+    melon::TenantScheduler ts;
+    ASSERT_EQ(-1, ts.Init(melon::TenantSchedulerOptions()));
+    melon::TenantSchedulerOptions opt;
+    opt.max_concurrency = 10;
+    opt.key_type = melon::TENANT_BY_HEADER;
+    ASSERT_EQ(-1, ts.Init(opt));
+    opt.key_name = "tenant";
+    opt.weights["a"] = 0;
+    ASSERT_EQ(-1, ts.Init(opt));
+    opt.weights["a"] = 1;
+    ASSERT_EQ(0, ts.Init(opt));
+}
+
+TEST_F(TenantSchedulerTest, share_by_weight) {
+    _opt.max_concurrency = 10;
+    _opt.weights["a"] = 3;
+    melon::TenantScheduler ts;
+    ASSERT_EQ(0, ts.Init(_opt));
+    // Unknown tenants are not created.
+    ASSERT_EQ(-1, ts.GetShare("a"));
+    melon::Controller c1, c2;
+    SetTenant(&c1, "a");
+    ASSERT_TRUE(ts.OnRequested(&c1));
+    ASSERT_EQ(10, ts.GetShare("a"));
+    ASSERT_EQ(-1, ts.GetShare("b"));
+    SetTenant(&c2, "b");
+    ASSERT_TRUE(ts.OnRequested(&c2));
+    ASSERT_EQ(2, ts.GetShare("b"));
+    ASSERT_EQ(7, ts.GetShare("a"));
+    ts.OnResponded(&c1);
+    ts.OnResponded(&c2);
+}
+
+TEST_F(TenantSchedulerTest, reject_without_queue) {
+    _opt.max_concurrency = 2;
+    melon::TenantScheduler ts;
+    ASSERT_EQ(0, ts.Init(_opt));
+    melon::Controller c1, c2, c3;
+    SetTenant(&c1, "a");
+    SetTenant(&c2, "a");
+    SetTenant(&c3, "b");
+    // Idle capacity is lent to tenant a.
+    ASSERT_TRUE(ts.OnRequested(&c1));
+    ASSERT_TRUE(ts.OnRequested(&c2));
+    ASSERT_FALSE(ts.OnRequested(&c3));
+    ASSERT_EQ(melon::ELIMIT, c3.ErrorCode());
+    ts.OnResponded(&c1);
+    melon::Controller c4;
+    SetTenant(&c4, "b");
+    ASSERT_TRUE(ts.OnRequested(&c4));
+    ts.OnResponded(&c2);
+    ts.OnResponded(&c4);
+    // Rejected requests are not counted.
+    ts.OnResponded(&c3);
+    ASSERT_EQ(0, ts._concurrency);
+}
+
+struct ResumeArg {
+    melon::TenantScheduler* ts;
+    mutil::Mutex* mutex;
+    std::vector<std::string>* order;
+    fiber::CountdownEvent* event;
+};
+
+void OnResume(melon::Controller* cntl, void* void_arg) {
+    ResumeArg* arg = static_cast<ResumeArg*>(void_arg);
+    if (!cntl->Failed()) {
+        {
+            MELON_SCOPED_LOCK(*arg->mutex);
+            arg->order->push_back((*cntl->request_user_fields())["tenant"]);
+        }
+        fiber_usleep(1000);
+        arg->ts->OnResponded(cntl);
+    }
+    arg->event->signal();
+}
+
+TEST_F(TenantSchedulerTest, queued_requests_are_round_robin) {
+    _opt.max_concurrency = 1;
+    _opt.max_queue_size = 10;
+    _opt.max_queue_time_ms = 5000;
+    melon::TenantScheduler ts;
+    ASSERT_EQ(0, ts.Init(_opt));
+    melon::Controller holder;
+    SetTenant(&holder, "a");
+    ASSERT_TRUE(ts.OnRequested(&holder));
+
+    mutil::Mutex mutex;
+    std::vector<std::string> order;
+    fiber::CountdownEvent event(4);
+    ResumeArg arg = { &ts, &mutex, &order, &event };
+    const char* tenants[] = { "a", "a", "a", "b" };
+    melon::Controller cntls[4];
+    for (int i = 0; i < 4; ++i) {
+        SetTenant(&cntls[i], tenants[i]);
+        bool queued = false;
+        // Queued without blocking the caller.
+        ASSERT_FALSE(ts.OnRequested(&cntls[i], OnResume, &arg, &queued));
+        ASSERT_TRUE(queued);
+    }
+    ASSERT_EQ(4, ts._nqueued);
+    // Requests are never queued without a resume callback.
+    melon::Controller rejected;
+    SetTenant(&rejected, "b");
+    ASSERT_FALSE(ts.OnRequested(&rejected));
+    ASSERT_EQ(melon::ELIMIT, rejected.ErrorCode());
+
+    ts.OnResponded(&holder);
+    ASSERT_EQ(0, event.wait());
+    const std::vector<std::string> expected = { "a", "b", "a", "a" };
+    ASSERT_EQ(expected, order);
+    ASSERT_EQ(0, ts._concurrency);
+    ASSERT_EQ(0, ts._nqueued);
+}
+
+TEST_F(TenantSchedulerTest, queue_timeout) {
+    _opt.max_concurrency = 1;
+    _opt.max_queue_size = 1;
+    _opt.max_queue_time_ms = 20;
+    melon::TenantScheduler ts;
+    ASSERT_EQ(0, ts.Init(_opt));
+    melon::Controller holder;
+    SetTenant(&holder, "a");
+    ASSERT_TRUE(ts.OnRequested(&holder));
+
+    mutil::Mutex mutex;
+    std::vector<std::string> order;
+    fiber::CountdownEvent event(1);
+    ResumeArg arg = { &ts, &mutex, &order, &event };
+    melon::Controller cntl;
+    SetTenant(&cntl, "b");
+    const int64_t start_us = mutil::gettimeofday_us();
+    bool queued = false;
+    ASSERT_FALSE(ts.OnRequested(&cntl, OnResume, &arg, &queued));
+    ASSERT_TRUE(queued);
+    ASSERT_EQ(0, event.wait());
+    ASSERT_GE(mutil::gettimeofday_us() - start_us, 15000);
+    ASSERT_EQ(melon::ELIMIT, cntl.ErrorCode());
+    ASSERT_TRUE(order.empty());
+    ASSERT_EQ(0, ts._nqueued);
+    ts.OnResponded(&holder);
+    ASSERT_EQ(0, ts._concurrency);
+}
+
+// Blocks requests with message "block" until Unblock() is called.
+class BlockingEchoService : public test::EchoService {
+public:
+    BlockingEchoService() : nblocked(0), _unblocked(false) {}
+
+    void Echo(google::protobuf::RpcController*,
+              const test::EchoRequest* req,
+              test::EchoResponse* res,
+              google::protobuf::Closure* done) override {
+        melon::ClosureGuard done_guard(done);
+        if (req->message() == "block") {
+            nblocked.fetch_add(1);
+            while (!_unblocked.load()) {
+                fiber_usleep(1000);
+            }
+        }
+        res->set_message(req->message());
+    }
+
+    void Unblock() { _unblocked.store(true); }
+
+    mutil::atomic<int> nblocked;
+
+private:
+    mutil::atomic<bool> _unblocked;
+};
+
+// A request queued by the tenant scheduler does not hold the server's
+// concurrency, and is resumed by the protocol once it's admitted.
+static void TestQueueAndResume(const char* protocol) {
+    BlockingEchoService svc;
+    melon::Server server;
+    ASSERT_EQ(0, server.AddService(&svc, melon::SERVER_DOESNT_OWN_SERVICE));
+    melon::TenantSchedulerOptions ts_opt;
+    ts_opt.max_concurrency = 1;
+    ts_opt.max_queue_size = 1;
+    ts_opt.max_queue_time_ms = 5000;
+    melon::TenantScheduler* ts = new melon::TenantScheduler;
+    ASSERT_EQ(0, ts->Init(ts_opt));
+    melon::ServerOptions opt;
+    opt.max_concurrency = 1;
+    opt.tenant_scheduler = ts;
+    ASSERT_EQ(0, server.Start("127.0.0.1:0", &opt));
+
+    melon::Channel channel;
+    melon::ChannelOptions chan_opt;
+    chan_opt.protocol = protocol;
+    chan_opt.timeout_ms = 5000;
+    chan_opt.max_retry = 0;
+    ASSERT_EQ(0, channel.Init(server.listen_address(), &chan_opt));
+    test::EchoService_Stub stub(&channel);
+
+    test::EchoRequest req1;
+    test::EchoResponse res1;
+    melon::Controller cntl1;
+    req1.set_message("block");
+    stub.Echo(&cntl1, &req1, &res1, melon::DoNothing());
+    while (svc.nblocked.load() == 0) {
+        fiber_usleep(1000);
+    }
+
+    test::EchoRequest req2;
+    test::EchoResponse res2;
+    melon::Controller cntl2;
+    req2.set_message("hello");
+    stub.Echo(&cntl2, &req2, &res2, melon::DoNothing());
+    for (;;) {
+        {
+            std::unique_lock<fiber::Mutex> mu(ts->_mutex);
+            if (ts->_nqueued == 1) {
+                break;
+            }
+        }
+        ASSERT_FALSE(cntl2.Failed()) << protocol << ": " << cntl2.ErrorText();
+        fiber_usleep(1000);
+    }
+    // Only the running request is counted.
+    ASSERT_EQ(1, server.Concurrency()) << protocol;
+
+    svc.Unblock();
+    melon::Join(cntl1.call_id());
+    melon::Join(cntl2.call_id());
+    ASSERT_FALSE(cntl1.Failed()) << protocol << ": " << cntl1.ErrorText();
+    ASSERT_EQ("block", res1.message());
+    ASSERT_FALSE(cntl2.Failed()) << protocol << ": " << cntl2.ErrorText();
+    ASSERT_EQ("hello", res2.message());
+    ASSERT_EQ(0, server.Concurrency()) << protocol;
+    ASSERT_EQ(0, ts->_concurrency);
+    ASSERT_EQ(0, ts->_nqueued);
+    server.Stop(0);
+    server.Join();
+}
+
+TEST_F(TenantSchedulerTest, queue_and_resume_melon_std) {
+    TestQueueAndResume("melon_std");
+}
+
+TEST_F(TenantSchedulerTest, queue_and_resume_baidu_std) {
+    TestQueueAndResume("baidu_std");
+}
+
+TEST_F(TenantSchedulerTest, queue_and_resume_hulu_pbrpc) {
+    TestQueueAndResume("hulu_pbrpc");
+}
+
+TEST_F(TenantSchedulerTest, queue_and_resume_http) {
+    TestQueueAndResume("http");
+}
+
+} // namespace
@@ -19,6 +19,7 @@
 
 
 #include <gtest/gtest.h>
+#include <melon/utility/atomicops.h>
 #include <melon/utility/files/file_watcher.h>
 #include <turbo/log/logging.h>
 
@@ -78,4 +79,49 @@ TEST_F(FileWatcherTest, random_op) {
     ASSERT_EQ(0, system("rm -f dummy_file"));
 }
 
+static void on_change(void* arg) {
+    static_cast<mutil::atomic<int>*>(arg)->fetch_add(1);
+}
+
+TEST_F(FileWatcherTest, watch) {
+    ASSERT_EQ(0, system("rm -f dummy_file dummy_file2 dummy_file.tmp"));
+    mutil::FileWatcher fw;
+    ASSERT_EQ(0, fw.init("dummy_file"));
+    mutil::atomic<int> nchange(0);
+    ASSERT_EQ(0, fw.watch(on_change, &nchange));
+    ASSERT_EQ(-1, fw.watch(on_change, &nchange));
+    mutil::FileWatcher fw2;
+    ASSERT_EQ(0, fw2.init("dummy_file2"));
+    mutil::atomic<int> nchange2(0);
+    ASSERT_EQ(0, fw2.watch(on_change, &nchange2));
+
+    ASSERT_EQ(0, system("echo 1 > dummy_file"));
+    for (int i = 0; i < 100 && nchange.load() == 0; ++i) {
+        usleep(10000);
+    }
+    ASSERT_GT(nchange.load(), 0);
+    ASSERT_EQ(mutil::FileWatcher::CREATED, fw.check_and_consume());
+
+    // Files replaced by rename are still watched.
+    const int before_rename = nchange.load();
+    ASSERT_EQ(0, system("echo 2 > dummy_file.tmp && mv dummy_file.tmp dummy_file"));
+    for (int i = 0; i < 100 && nchange.load() == before_rename; ++i) {
+        usleep(10000);
+    }
+    ASSERT_GT(nchange.load(), before_rename);
+    // Changes of other files in the same directory are not notified.
+    ASSERT_EQ(0, nchange2.load());
+
+    fw.unwatch();
+    const int before_unwatch = nchange.load();
+    ASSERT_EQ(0, system("echo 3 > dummy_file"));
+    ASSERT_EQ(0, system("echo 3 > dummy_file2"));
+    for (int i = 0; i < 100 && nchange2.load() == 0; ++i) {
+        usleep(10000);
+    }
+    ASSERT_GT(nchange2.load(), 0);
+    ASSERT_EQ(before_unwatch, nchange.load());
+    ASSERT_EQ(0, system("rm -f dummy_file dummy_file2"));
+}
+
 }  // namespace